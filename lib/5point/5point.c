@@ -29,6 +29,7 @@
 #include "poly3.h"
 #include "matrix.h"
 #include "qsort.h"
+#include "ransac.h"
 #include "svd.h"
 #include "triangulate.h"
 #include "vector.h"
@@ -544,35 +545,6 @@ void generate_Ematrix_hypotheses(int n, v2_t *rt_pts, v2_t *left_pts,
 #endif
 }
 
-void choose(int n, int k, int *arr)
-{
-    int i;
-    
-    if (k > n) {
-        fprintf(stderr, "[choose] Error: k > n\n");
-        return;
-    }
-
-    for (i = 0; i < k; i++) {
-        while (1) {
-            int idx = rand() % n;
-            int j, redo = 0;
-
-            for (j = 0; j < i; j++) {
-                if (idx == arr[j]) {
-                    redo = 1;
-                    break;
-                }
-            }
-
-            if (!redo) {
-                arr[i] = idx;
-                break;
-            }
-        }
-    }
-}
-
 int evaluate_Ematrix(int n, v2_t *r_pts, v2_t *l_pts, double thresh_norm,
                      double *F, int *best_inlier, double *score)
 {
@@ -614,23 +586,117 @@ int evaluate_Ematrix(int n, v2_t *r_pts, v2_t *l_pts, double thresh_norm,
     return num_inliers;
 }
 
+/* Correspondences handed to the RANSAC callbacks */
+typedef struct {
+    v2_t *r_pts, *l_pts;             /* Image coordinates */
+    v2_t *r_pts_norm, *l_pts_norm;   /* Normalized coordinates */
+    double *r_soa, *l_soa;           /* Image coordinates as 3 x n */
+    int n;
+    double *K1_inv, *K2_inv;
+} pose_ransac_data_t;
+
+/* Convert an essential matrix to an F-matrix in image coordinates */
+static void pose_Ematrix_to_Fmatrix(const double *E, 
+                                    double *K1_inv, double *K2_inv, 
+                                    double *F)
+{
+    double E2[9], tmp[9];
+
+    memcpy(E2, E, 9 * sizeof(double));
+    E2[0] = -E2[0];
+    E2[1] = -E2[1];
+    E2[3] = -E2[3];
+    E2[4] = -E2[4];
+    E2[8] = -E2[8];
+
+    matrix_transpose_product(3, 3, 3, 3, K2_inv, E2, tmp);
+    matrix_product(3, 3, 3, 3, tmp, K1_inv, F);
+}
+
+/* Models are an essential matrix followed by its F-matrix */
+static int pose_ransac_fit(const int *sample, double *models, void *data)
+{
+    pose_ransac_data_t *d = (pose_ransac_data_t *) data;
+    v2_t r_pts_inner[5], l_pts_inner[5];
+    double E[90];
+    int num_hyp, num_ident = 0;
+    int i;
+
+    for (i = 0; i < 5; i++) {
+        r_pts_inner[i] = d->r_pts_norm[sample[i]];
+        l_pts_inner[i] = d->l_pts_norm[sample[i]];
+
+        /* Check for degeneracy */
+        if (Vx(r_pts_inner[i]) == Vx(l_pts_inner[i]) &&
+            Vy(r_pts_inner[i]) == Vy(l_pts_inner[i]))
+            num_ident++;
+    }
+        
+    if (num_ident >= 3)
+        return 0;  /* choose another 5 */
+        
+    generate_Ematrix_hypotheses(5, r_pts_inner, l_pts_inner, &num_hyp, E);
+
+    for (i = 0; i < num_hyp; i++) {
+        memcpy(models + 18 * i, E + 9 * i, 9 * sizeof(double));
+        pose_Ematrix_to_Fmatrix(E + 9 * i, d->K1_inv, d->K2_inv, 
+                                models + 18 * i + 9);
+    }
+
+    return num_hyp;
+}
+
+static double pose_ransac_residual(const double *model, int idx, void *data)
+{
+    pose_ransac_data_t *d = (pose_ransac_data_t *) data;
+    v3_t r = v3_new(Vx(d->r_pts[idx]), Vy(d->r_pts[idx]), 1.0);
+    v3_t l = v3_new(Vx(d->l_pts[idx]), Vy(d->l_pts[idx]), 1.0);
+
+    return fmatrix_compute_residual((double *) model + 9, l, r);
+}
+
+static void pose_ransac_residuals(const double *models, int num_models,
+                                  double *resid, void *data)
+{
+    pose_ransac_data_t *d = (pose_ransac_data_t *) data;
+    double Fs[90];
+    int i;
+
+    /* Gather the F-matrices so they can be scored in one pass */
+    for (i = 0; i < num_models; i++)
+        memcpy(Fs + 9 * i, models + 18 * i + 9, 9 * sizeof(double));
+
+    fmatrix_compute_residuals_multi(num_models, Fs, d->n, 
+                                    d->l_soa, d->r_soa, resid);
+}
+
 int compute_pose_ransac(int n, v2_t *r_pts, v2_t *l_pts, 
                         double *K1, double *K2, 
                         double ransac_threshold, int ransac_rounds, 
                         double *R_out, double *t_out)
 {
     v2_t *r_pts_norm, *l_pts_norm;
-    int i, round;
+    int i;
     double thresh_norm;
     double K1_inv[9], K2_inv[9];
     int max_inliers = 0;
-    double min_score = DBL_MAX;
-    double E_best[9];
-    v2_t r_best, l_best;
+    double model_best[18];
+    double *E_best = model_best;
+
+    pose_ransac_data_t data;
+    ransac_params_t params;
+
+    if (n < 5) {
+        fprintf(stderr, "[compute_pose_ransac] n must be >= 5\n");
+        return 0;
+    }
 
     r_pts_norm = malloc(sizeof(v2_t) * n);
     l_pts_norm = malloc(sizeof(v2_t) * n);
 
+    data.r_soa = malloc(sizeof(double) * 3 * n);
+    data.l_soa = malloc(sizeof(double) * 3 * n);
+
     matrix_invert(3, K1, K1_inv);
     matrix_invert(3, K2, K2_inv);
 
@@ -645,88 +711,39 @@ int compute_pose_ransac(int n, v2_t *r_pts, v2_t *l_pts,
 
         r_pts_norm[i] = v2_new(-r_norm[0], -r_norm[1]);
         l_pts_norm[i] = v2_new(-l_norm[0], -l_norm[1]);
-    }
 
-    thresh_norm = ransac_threshold * ransac_threshold;
+        data.r_soa[i] = r[0];
+        data.r_soa[n + i] = r[1];
+        data.r_soa[2 * n + i] = 1.0;
 
-    for (round = 0; round < ransac_rounds; round++) {
-        /* Pick 5 random points */
-        v2_t r_pts_inner[5], l_pts_inner[5];
-        int indices[5];
-        int num_hyp;
-        double E[90];
-        int inliers_hyp[10];
-        int first_hyp = -1, first_hyp_idx = -1, second_hyp = -1;
-        int best = 0;
-        int num_ident = 0;
-        int inliers = 0;
-
-        choose(n, 5, indices);
-
-        for (i = 0; i < 5; i++) {
-            r_pts_inner[i] = r_pts_norm[indices[i]];
-            l_pts_inner[i] = l_pts_norm[indices[i]];
+        data.l_soa[i] = l[0];
+        data.l_soa[n + i] = l[1];
+        data.l_soa[2 * n + i] = 1.0;
+    }
 
-            /* Check for degeneracy */
-            if (Vx(r_pts_inner[i]) == Vx(l_pts_inner[i]) &&
-                Vy(r_pts_inner[i]) == Vy(l_pts_inner[i]))
-                num_ident++;
-        }
-        
-        if (num_ident >= 3)
-            continue;  /* choose another 5 */
-        
-        generate_Ematrix_hypotheses(5, r_pts_inner, l_pts_inner, &num_hyp, E);
-        
-        for (i = 0; i < num_hyp; i++) {
-            int best_inlier;
-            double score = 0.0;
-
-            double E2[9], tmp[9], F[9];
-            memcpy(E2, E + 9 * i, 9 * sizeof(double));
-            E2[0] = -E2[0];
-            E2[1] = -E2[1];
-            E2[3] = -E2[3];
-            E2[4] = -E2[4];
-            E2[8] = -E2[8];
-
-            matrix_transpose_product(3, 3, 3, 3, K2_inv, E2, tmp);
-            matrix_product(3, 3, 3, 3, tmp, K1_inv, F);
-
-            inliers = evaluate_Ematrix(n, r_pts, l_pts, // r_pts_norm, l_pts_norm, 
-                                       thresh_norm, F, // E + 9 * i, 
-                                       &best_inlier, &score);
-       
-            if (inliers > max_inliers ||
-                (inliers == max_inliers && score < min_score)) {
-                best = 1;
-                max_inliers = inliers;
-                min_score = score;
-                memcpy(E_best, E + 9 * i, sizeof(double) * 9);
-                r_best = r_pts_norm[best_inlier];
-                l_best = l_pts_norm[best_inlier];
-            }
+    thresh_norm = ransac_threshold * ransac_threshold;
 
-            inliers_hyp[i] = inliers;
-        }
+    data.r_pts = r_pts;
+    data.l_pts = l_pts;
+    data.r_pts_norm = r_pts_norm;
+    data.l_pts_norm = l_pts_norm;
+    data.K1_inv = K1_inv;
+    data.K2_inv = K2_inv;
+    data.n = n;
 
-        if (best) {
-            for (i = 0; i < num_hyp; i++) {
-                if (inliers_hyp[i] > first_hyp) {
-                    first_hyp = inliers_hyp[i];
-                    first_hyp_idx = i;
-                }
-            }
+    /* Up to 10 essential matrices per sample */
+    ransac_params_init(&params, n, 5, 18, 10);
+    params.max_rounds = ransac_rounds;
+    params.threshold = thresh_norm;
+    params.fit = pose_ransac_fit;
+    params.residual = pose_ransac_residual;
+    params.residuals = pose_ransac_residuals;
+    params.data = &data;
 
-            for (i = 0; i < num_hyp; i++) {
-                if (i != first_hyp_idx && inliers_hyp[i] > second_hyp) {
-                    second_hyp = inliers_hyp[i];
-                }
-            }
+    max_inliers = ransac_estimate(&params, model_best, NULL);
 
-            // printf("first: %d, second: %d\n", first_hyp, second_hyp);
-        }
-    }
+    free(data.r_soa);
+    free(data.l_soa);
 
     if (max_inliers > 0) {
         int best_inlier;
@@ -737,8 +754,7 @@ int compute_pose_ransac(int n, v2_t *r_pts, v2_t *l_pts,
                                               r_pts_norm, l_pts_norm, 
                                               R_out, t_out);
         int inliers = 0;
-        double E2[9];
-        double tmp[9], F_best[9];
+        double *F_best = model_best + 9;
 
         if (success == 0) {
             free(r_pts_norm);
@@ -746,16 +762,6 @@ int compute_pose_ransac(int n, v2_t *r_pts, v2_t *l_pts,
             return 0;
         }
 
-        memcpy(E2, E_best, 9 * sizeof(double));
-        E2[0] = -E2[0];
-        E2[1] = -E2[1];
-        E2[3] = -E2[3];
-        E2[4] = -E2[4];
-        E2[8] = -E2[8];
-
-        matrix_transpose_product(3, 3, 3, 3, K2_inv, E2, tmp);
-        matrix_product(3, 3, 3, 3, tmp, K1_inv, F_best);
-
         inliers = evaluate_Ematrix(n, r_pts, l_pts, // r_pts_norm, l_pts_norm, 
                                    thresh_norm, F_best, &best_inlier,
                                    &score);
@@ -39,6 +39,15 @@
 
 #define SGN(x) ((x) < 0 ? (-1) : (1))
 
+/* Storage class for file-scope state handed to callbacks (e.g., the
+ * residual functions passed to lmdif), so that concurrent calls from
+ * different threads don't share it */
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
 #ifdef WIN32
 #ifndef M_PI
 #define M_PI 3.14159265358979323846f
@@ -20,6 +20,11 @@
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
 
 #include "bmp.h"
 #include "color.h"
@@ -27,6 +32,7 @@
 #include "filter.h"
 #include "image.h"
 #include "matrix.h"
+#include "planar.h"
 #include "util.h"
 
 /* Convolve the image about the given pixel with the give m by n
@@ -205,123 +211,172 @@ double *compute_gaussian_filter(double sigma, double num_dev, int *size) {
 }
 
 
-/* Filter is a 1-D filter */
-img_t *img_filter_xy(img_t *img, double *filter, int size, int wrap) {
-    int x, y, i, idx;
-    int rad = size / 2;
-    int w = img->w, h = img->h;
+/* Floats of the output row accumulated at a time, so that the row
+ * stays in cache across the taps of the filter */
+#define FILTER_TILE_WIDTH 1024
 
-    double *tmp_img = (double *)malloc(sizeof(double) * 3 * w * h);
-    img_t *new_img = img_new(w, h);
+/* Index of pixel i of a row (or column) of n pixels, wrapped around or
+ * clamped to the border */
+static int filter_border_index(int i, int n, int wrap) {
+    if (wrap) {
+	i %= n;
+	return (i < 0) ? i + n : i;
+    }
 
-    /* Filter in the x direction */
-    for (y = 0; y < h; y++) {
-	color_t *row = img->pixels + y * w;
-	
-	for (x = 0; x < w; x++) {
-	    double rsum = 0.0, gsum = 0.0, bsum = 0.0;
-	    
-	    for (i = -rad; i <= rad; i++) {
-		if (wrap)
-		    idx = (x + i + w) % w;
-		else
-		    idx = CLAMP(x + i, 0, w - 1);
-		
-		rsum += filter[i+rad] * ((double) row[idx].r);
-		gsum += filter[i+rad] * ((double) row[idx].g);
-		bsum += filter[i+rad] * ((double) row[idx].b);
-	    }
+    return CLAMP(i, 0, n - 1);
+}
 
-	    idx = y * 3 * w + 3 * x;
+/* out[x] += f * in[x] for x in [0, n) */
+static void filter_accumulate(float *out, const float *in, float f, int n) {
+    int x = 0;
 
-	    tmp_img[idx+0] = rsum;
-	    tmp_img[idx+1] = gsum;
-	    tmp_img[idx+2] = bsum;
-	}
+#ifdef __SSE__
+    __m128 fv = _mm_set1_ps(f);
+
+    for (; x + 4 <= n; x += 4) {
+	__m128 o = _mm_loadu_ps(out + x);
+	o = _mm_add_ps(o, _mm_mul_ps(fv, _mm_loadu_ps(in + x)));
+	_mm_storeu_ps(out + x, o);
     }
+#endif
 
-    /* Filter in the y direction */
-    for (x = 0; x < w; x++) {
-	for (y = 0; y < h; y++) {
-	    double rsum = 0.0, gsum = 0.0, bsum = 0.0;
-	    
-	    for (i = -rad; i <= rad; i++) {
-		if (wrap)
-		    idx = ((y + i + h) % h) * 3 * w + x * 3;
-		else
-		    idx = (CLAMP(y + i, 0, h - 1)) * 3 * w + x * 3;
-
-		rsum += filter[i+rad] * ((float) tmp_img[idx + 0]);
-		gsum += filter[i+rad] * ((float) tmp_img[idx + 1]);
-		bsum += filter[i+rad] * ((float) tmp_img[idx + 2]);
-	    }
+    for (; x < n; x++)
+	out[x] += f * in[x];
+}
 
-	    idx = y * 3 * w + 3 * x;
-	    
-	    img_set_pixel(new_img, x, y, 
-			  CLAMP(iround(rsum), 0, 255),
-			  CLAMP(iround(gsum), 0, 255),
-			  CLAMP(iround(bsum), 0, 255));
-	}
-    }
+/* Add in the filtered row of length w, where tap i of the filter
+ * multiplies rows[i] */
+static void filter_rows(float *out, const float **rows, const float *f,
+			int size, int w) {
+    int x, i;
 
-    free(tmp_img);
+    for (x = 0; x < w; x += FILTER_TILE_WIDTH) {
+	int n = MIN(FILTER_TILE_WIDTH, w - x);
 
-    return new_img;
+	for (i = 0; i < size; i++)
+	    filter_accumulate(out + x, rows[i] + x, f[i], n);
+    }
 }
 
-/* Filter is a 1-D filter */
-fimg_t *img_filter_xy_float(img_t *img, double *filter, int size, int wrap) {
-    int x, y, i, idx;
+/* Convolve a w x h plane with the 1-D filter in x and then in y.  The
+ * rows are processed in parallel bands; each pass runs along rows, with
+ * the borders padded up front rather than clamped per tap */
+static void filter_plane_xy(const float *in, int in_stride,
+			    float *out, int out_stride, int w, int h,
+			    const double *filter, int size, int wrap) {
     int rad = size / 2;
-    int w = img->w, h = img->h;
+    int i, y;
+
+    float *f = (float *) malloc(sizeof(float) * size);
+    float *tmp = (float *) malloc(sizeof(float) * w * h);
 
-    double *tmp_img = (double *)malloc(sizeof(double) * w * h);
-    fimg_t *new_img = fimg_new(w, h);
+    for (i = 0; i < size; i++)
+	f[i] = (float) filter[i];
 
     /* Filter in the x direction */
-    for (y = 0; y < h; y++) {
-	color_t *row = img->pixels + y * w;
-	
-	for (x = 0; x < w; x++) {
-	    double sum = 0.0;
-	    
-	    for (i = -rad; i <= rad; i++) {
-		if (wrap)
-		    idx = (x + i + w) % w;
-		else
-		    idx = CLAMP(x + i, 0, w - 1);
-		
-		sum += filter[i+rad] * ((double) row[idx].r);
-	    }
+#ifdef _OPENMP
+#pragma omp parallel private(i, y)
+#endif
+    {
+	float *pad = (float *) malloc(sizeof(float) * (w + 2 * rad));
+	const float **taps = (const float **) malloc(sizeof(float *) * size);
 
-	    idx = y * w + x;
+	for (i = 0; i < size; i++)
+	    taps[i] = pad + i;
 
-	    tmp_img[idx] = sum;
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+	for (y = 0; y < h; y++) {
+	    const float *row = in + (size_t) y * in_stride;
+	    float *row_out = tmp + (size_t) y * w;
+
+	    for (i = 0; i < w + 2 * rad; i++)
+		pad[i] = row[filter_border_index(i - rad, w, wrap)];
+
+	    memset(row_out, 0, sizeof(float) * w);
+	    filter_rows(row_out, taps, f, size, w);
 	}
+
+	free(pad);
+	free(taps);
     }
 
     /* Filter in the y direction */
-    for (x = 0; x < w; x++) {
+#ifdef _OPENMP
+#pragma omp parallel private(i, y)
+#endif
+    {
+	const float **taps = (const float **) malloc(sizeof(float *) * size);
+
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
 	for (y = 0; y < h; y++) {
-	    double sum = 0.0;
-	    
-	    for (i = -rad; i <= rad; i++) {
-		if (wrap)
-		    idx = ((y + i + h) % h) * w + x;
-		else
-		    idx = (CLAMP(y + i, 0, h - 1)) * w + x;
-
-		sum += filter[i+rad] * ((float) tmp_img[idx]);
+	    float *row_out = out + (size_t) y * out_stride;
+
+	    for (i = 0; i < size; i++) {
+		int yi = filter_border_index(y + i - rad, h, wrap);
+		taps[i] = tmp + (size_t) yi * w;
 	    }
 
-	    idx = y * w + x;
-	    
-	    fimg_set_pixel(new_img, x, y, (float) sum);
+	    memset(row_out, 0, sizeof(float) * w);
+	    filter_rows(row_out, taps, f, size, w);
 	}
+
+	free(taps);
+    }
+
+    free(tmp);
+    free(f);
+}
+
+/* Filter each channel of img with the 1-D filter in x and y */
+void pimg_filter_xy(pimg_t *img, pimg_t *out, double *filter, int size,
+		    int wrap) {
+    int c;
+
+    if (out->w != img->w || out->h != img->h ||
+	out->num_channels != img->num_channels) {
+	printf("[pimg_filter_xy] Error: output image doesn't match input\n");
+	return;
+    }
+
+    for (c = 0; c < img->num_channels; c++) {
+	filter_plane_xy(img->planes[c], img->stride,
+			out->planes[c], out->stride,
+			img->w, img->h, filter, size, wrap);
     }
 
-    free(tmp_img);
+    pimg_set_all_valid(out);
+}
+
+/* Filter is a 1-D filter */
+img_t *img_filter_xy(img_t *img, double *filter, int size, int wrap) {
+    pimg_t *in = img2pimg(img, 3, 0);
+    pimg_t *out = pimg_new(img->w, img->h, 3, 0);
+    img_t *new_img;
+
+    pimg_filter_xy(in, out, filter, size, wrap);
+    new_img = pimg2img(out);
+
+    pimg_free(in);
+    pimg_free(out);
+
+    return new_img;
+}
+
+/* Filter is a 1-D filter */
+fimg_t *img_filter_xy_float(img_t *img, double *filter, int size, int wrap) {
+    pimg_t *in = img2pimg(img, 1, 0);
+    pimg_t *out = pimg_new(img->w, img->h, 1, 0);
+    fimg_t *new_img;
+
+    pimg_filter_xy(in, out, filter, size, wrap);
+    new_img = pimg2fimg(out, 0);
+
+    pimg_free(in);
+    pimg_free(out);
 
     return new_img;
 }
@@ -356,6 +411,24 @@ fimg_t *img_smooth_float(img_t *img, double sigma, int wrap) {
     return new_img;
 }
 
+/* Apply a Gaussian filter with variance sigma to each channel of the
+ * image */
+pimg_t *pimg_smooth(pimg_t *img, double sigma, int wrap) {
+    int size;
+    double *filter;
+    pimg_t *new_img = pimg_new(img->w, img->h, img->num_channels,
+			       img->mask != NULL);
+
+    new_img->origin = img->origin;
+
+    filter = compute_gaussian_filter(sigma, 2.0, &size);
+    pimg_filter_xy(img, new_img, filter, size, wrap);
+
+    free(filter);
+
+    return new_img;
+}
+
 /* Scale an image */
 img_t *img_scale(img_t *img, int scale) 
 {
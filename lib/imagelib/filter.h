@@ -25,6 +25,7 @@ extern "C" {
 #define __filter_h__
 
 #include "image.h"
+#include "planar.h"
 
 /* Convolve the image about the given pixel with the give m by n
  * kernel */
@@ -42,6 +43,11 @@ img_t *img_filter(img_t *img, int m, int n, double *coeffs, double scale);
 /* Filter is a 1-D filter */
 img_t *img_filter_xy(img_t *img, double *filter, int size, int wrap);
 
+/* Filter each channel of img with the 1-D filter in x and y, writing
+ * to out (which must have the same size and channels) */
+void pimg_filter_xy(pimg_t *img, pimg_t *out, double *filter, int size,
+		    int wrap);
+
 /* Compute the magnitude of the gradient of the image at the point
  * (x,y) using a sobel filter */
 void img_gradient_sobel_xy(img_t *img, int x, int y, double *dx, double *dy);
@@ -60,6 +66,10 @@ img_t *img_smooth(img_t *img, double sigma, int wrap);
 /* Apply a Gaussian filter with variance sigma to the image */
 fimg_t *img_smooth_float(img_t *img, double sigma, int wrap);
 
+/* Apply a Gaussian filter with variance sigma to each channel of the
+ * image */
+pimg_t *pimg_smooth(pimg_t *img, double sigma, int wrap);
+
 /* Compute a filter kernel for a gaussian filter with the *
  * given standard deviation */
 double *compute_gaussian_filter(double sigma, double num_dev, int *size);
@@ -375,11 +375,33 @@ double plane_point_distance(double *plane, v3_t pt)
     return fabs(dist);
 }
 
+/* A random number from rand(), or, if seed is not NULL, from a
+ * generator whose whole state is *seed */
+static int fit_rand(unsigned int *seed)
+{
+    if (seed == NULL)
+	return rand();
+
+    *seed = *seed * 1103515245u + 12345u;
+    return (int) ((*seed >> 16) & 0x7fff);
+}
+
 /* Fit a plane using orthogonal regression and RANSAC */
 double fit_3D_plane_ortreg_ransac(int num_pts, v3_t *pts, 
 				  int num_ransac_rounds, 
 				  double ransac_threshold, 
 				  int *num_inliers_out, double *params)
+{
+    return fit_3D_plane_ortreg_ransac_r(num_pts, pts, num_ransac_rounds,
+					ransac_threshold, num_inliers_out, 
+					params, NULL);
+}
+
+double fit_3D_plane_ortreg_ransac_r(int num_pts, v3_t *pts, 
+				    int num_ransac_rounds, 
+				    double ransac_threshold, 
+				    int *num_inliers_out, double *params,
+				    unsigned int *seed)
 {
 #define MIN_SAMPLE_SIZE 3
 	// const int min_sample_size = 3; /* Three points determine a plane */
@@ -419,7 +441,7 @@ double fit_3D_plane_ortreg_ransac(int num_pts, v3_t *pts,
 
 	    do {
 		retry = 0;
-		sample = rand() % num_pts;
+		sample = fit_rand(seed) % num_pts;
 
 		for (k = 0; k < j; k++) {
 		    if (sample == samples[k]) {
@@ -62,6 +62,15 @@ double fit_3D_plane_ortreg_ransac(int num_pts, v3_t *pts,
 				  int num_ransac_rounds, 
 				  double ransac_threshold, 
 				  int *num_inliers_out, double *params);
+
+/* As fit_3D_plane_ortreg_ransac, drawing samples from a generator
+ * whose state is *seed instead of from rand() (so that fits can run
+ * on several threads at once, and repeat) */
+double fit_3D_plane_ortreg_ransac_r(int num_pts, v3_t *pts, 
+				    int num_ransac_rounds, 
+				    double ransac_threshold, 
+				    int *num_inliers_out, double *params,
+				    unsigned int *seed);
     
 #ifdef __cplusplus
 }
@@ -28,9 +28,11 @@
 // #include "dmap.h"
 #include "fmatrix.h"
 #include "image.h"
+#include "lm.h"
 #include "matrix.h"
 #include "poly.h"
 #include "qsort.h"
+#include "ransac.h"
 #include "resample.h"
 #include "svd.h"
 #include "vector.h"
@@ -86,41 +88,154 @@ double fmatrix_compute_residual(double *F, v3_t r, v3_t l) {
 }
 
 
-#if 0
-void fmatrix_compute_residuals(int num_pts, double *F, 
-                               double *a, double *b, double *resid) {
+/* Residuals of points num_start through num_pts-1 (scalar code, also
+ * used for the tail of the vectorized loop) */
+static void fmatrix_compute_residuals_scalar(int num_Fs, const double *Fs,
+                                             int num_start, int num_pts,
+                                             const double *r, 
+                                             const double *l,
+                                             double *resid)
+{
+    int i, k;
+    const double *rx = r, *ry = r + num_pts, *rz = r + 2 * num_pts;
+    const double *lx = l, *ly = l + num_pts, *lz = l + 2 * num_pts;
 
-    double FT[9];
-    matrix_transpose(3, 3, F, FT);
+    for (k = 0; k < num_Fs; k++) {
+        const double *F = Fs + 9 * k;
+        double *out = resid + k * num_pts;
 
-    matrix_transpose_product2(3, 3, 3, num_pts, F, b, Fl);
-    matrix_transpose_product2(3, 3, 3, num_pts, FT, a, Fr);
+        for (i = num_start; i < num_pts; i++) {
+            double Fl0 = F[0] * lx[i] + F[1] * ly[i] + F[2] * lz[i];
+            double Fl1 = F[3] * lx[i] + F[4] * ly[i] + F[5] * lz[i];
+            double Fl2 = F[6] * lx[i] + F[7] * ly[i] + F[8] * lz[i];
 
+            double Fr0 = F[0] * rx[i] + F[3] * ry[i] + F[6] * rz[i];
+            double Fr1 = F[1] * rx[i] + F[4] * ry[i] + F[7] * rz[i];
 
-#if 1
-    Fl[0] = F[0] * Vx(l) + F[1] * Vy(l) + F[2] * Vz(l);
-    Fl[1] = F[3] * Vx(l) + F[4] * Vy(l) + F[5] * Vz(l);
-    Fl[2] = F[6] * Vx(l) + F[7] * Vy(l) + F[8] * Vz(l);
+            double pt = rx[i] * Fl0 + ry[i] * Fl1 + rz[i] * Fl2;
 
-    Fr[0] = F[0] * Vx(r) + F[3] * Vy(r) + F[6] * Vz(r);
-    Fr[1] = F[1] * Vx(r) + F[4] * Vy(r) + F[7] * Vz(r);
-    Fr[2] = F[2] * Vx(r) + F[5] * Vy(r) + F[8] * Vz(r);
+            double dl = Fl0 * Fl0 + Fl1 * Fl1;
+            double dr = Fr0 * Fr0 + Fr1 * Fr1;
 
-    pt = Vx(r) * Fl[0] + Vy(r) * Fl[1] + Vz(r) * Fl[2];
-#else
+            /* 1/dl + 1/dr = (dl + dr) / (dl * dr), saving a divide */
+            out[i] = ((dl + dr) * (pt * pt)) / (dl * dr);
+        }
+    }
+}
 
-    matrix_product(3, 3, 3, 1, F, l.p, Fl);
-    matrix_transpose_product(3, 3, 3, 1, F, r.p, Fr);
-    matrix_product(1, 3, 3, 1, r.p, Fl, &pt);
-#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FMATRIX_AVX_DISPATCH
+#include <immintrin.h>
 
-    return
-	(1.0 / (Fl[0] * Fl[0] + Fl[1] * Fl[1]) +
-	 1.0 / (Fr[0] * Fr[0] + Fr[1] * Fr[1])) *
-	(pt * pt);
+#define FMATRIX_MAX_BATCH 16
+
+/* Residuals of four points at a time under every F-matrix.  Compiled
+ * for AVX regardless of the build flags, and only called when the CPU
+ * supports it */
+__attribute__((target("avx")))
+static void fmatrix_compute_residuals_avx(int num_Fs, const double *Fs,
+                                          int num_pts, 
+                                          const double *r, const double *l,
+                                          double *resid)
+{
+    __m256d Fv[FMATRIX_MAX_BATCH][9];
+    int i, j, k;
+    int num_vec = num_pts & ~3;
+
+    const double *rx = r, *ry = r + num_pts, *rz = r + 2 * num_pts;
+    const double *lx = l, *ly = l + num_pts, *lz = l + 2 * num_pts;
+
+    for (k = 0; k < num_Fs; k++) {
+        for (j = 0; j < 9; j++)
+            Fv[k][j] = _mm256_set1_pd(Fs[9 * k + j]);
+    }
+
+    /* One pass over the points, scoring every F on each block */
+    for (i = 0; i < num_vec; i += 4) {
+        __m256d rxv = _mm256_loadu_pd(rx + i);
+        __m256d ryv = _mm256_loadu_pd(ry + i);
+        __m256d rzv = _mm256_loadu_pd(rz + i);
+        __m256d lxv = _mm256_loadu_pd(lx + i);
+        __m256d lyv = _mm256_loadu_pd(ly + i);
+        __m256d lzv = _mm256_loadu_pd(lz + i);
+
+        for (k = 0; k < num_Fs; k++) {
+            const __m256d *F = Fv[k];
+
+            __m256d Fl0 = 
+                _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(F[0], lxv),
+                                            _mm256_mul_pd(F[1], lyv)),
+                              _mm256_mul_pd(F[2], lzv));
+            __m256d Fl1 = 
+                _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(F[3], lxv),
+                                            _mm256_mul_pd(F[4], lyv)),
+                              _mm256_mul_pd(F[5], lzv));
+            __m256d Fl2 = 
+                _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(F[6], lxv),
+                                            _mm256_mul_pd(F[7], lyv)),
+                              _mm256_mul_pd(F[8], lzv));
+
+            __m256d Fr0 = 
+                _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(F[0], rxv),
+                                            _mm256_mul_pd(F[3], ryv)),
+                              _mm256_mul_pd(F[6], rzv));
+            __m256d Fr1 = 
+                _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(F[1], rxv),
+                                            _mm256_mul_pd(F[4], ryv)),
+                              _mm256_mul_pd(F[7], rzv));
+
+            __m256d pt = 
+                _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(rxv, Fl0),
+                                            _mm256_mul_pd(ryv, Fl1)),
+                              _mm256_mul_pd(rzv, Fl2));
+
+            __m256d dl = _mm256_add_pd(_mm256_mul_pd(Fl0, Fl0), 
+                                       _mm256_mul_pd(Fl1, Fl1));
+            __m256d dr = _mm256_add_pd(_mm256_mul_pd(Fr0, Fr0), 
+                                       _mm256_mul_pd(Fr1, Fr1));
+
+            __m256d num = _mm256_mul_pd(_mm256_add_pd(dl, dr),
+                                        _mm256_mul_pd(pt, pt));
+
+            _mm256_storeu_pd(resid + k * num_pts + i, 
+                             _mm256_div_pd(num, _mm256_mul_pd(dl, dr)));
+        }
+    }
+
+    fmatrix_compute_residuals_scalar(num_Fs, Fs, num_vec, num_pts, 
+                                     r, l, resid);
 }
 #endif
 
+void fmatrix_compute_residuals_multi(int num_Fs, const double *Fs,
+                                     int num_pts, 
+                                     const double *r, const double *l,
+                                     double *resid)
+{
+#ifdef FMATRIX_AVX_DISPATCH
+    if (__builtin_cpu_supports("avx")) {
+        int k;
+
+        for (k = 0; k < num_Fs; k += FMATRIX_MAX_BATCH) {
+            int num_batch = MIN(num_Fs - k, FMATRIX_MAX_BATCH);
+            fmatrix_compute_residuals_avx(num_batch, Fs + 9 * k, num_pts, 
+                                          r, l, resid + k * num_pts);
+        }
+
+        return;
+    }
+#endif
+
+    fmatrix_compute_residuals_scalar(num_Fs, Fs, 0, num_pts, r, l, resid);
+}
+
+void fmatrix_compute_residuals(int num_pts, const double *F, 
+                               const double *r, const double *l, 
+                               double *resid) 
+{
+    fmatrix_compute_residuals_multi(1, F, num_pts, r, l, resid);
+}
+
 #if 0
 /* Use RANSAC to estimate an F-matrix */
 void estimate_fmatrix_ransac(img_t *img, img_dmap_t *map, int num_trials, 
@@ -289,236 +404,272 @@ void estimate_fmatrix_ransac(img_t *img, img_dmap_t *map, int num_trials,
 }
 #endif
 
+/* Correspondences handed to the RANSAC callbacks */
+typedef struct {
+    v3_t *a_pts, *b_pts;
+    double *a_soa, *b_soa;    /* The points as 3 x num_pts matrices */
+    int num_pts;
+    int essential;
+} fmatrix_ransac_data_t;
+
+static int fmatrix_ransac_compatible(const int *sample, int num_sampled,
+                                     int idx, void *data)
+{
+    fmatrix_ransac_data_t *d = (fmatrix_ransac_data_t *) data;
+    v3_t *a_pts = d->a_pts, *b_pts = d->b_pts;
+    int k;
+
+    /* Reject correspondences that repeat a point already sampled */
+    for (k = 0; k < num_sampled; k++) {
+        int s = sample[k];
+        if ((Vx(a_pts[idx]) == Vx(a_pts[s]) &&
+             Vy(a_pts[idx]) == Vy(a_pts[s]) &&
+             Vz(a_pts[idx]) == Vz(a_pts[s])) ||
+            (Vx(b_pts[idx]) == Vx(b_pts[s]) &&
+             Vy(b_pts[idx]) == Vy(b_pts[s]) &&
+             Vz(b_pts[idx]) == Vz(b_pts[s]))) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static int fmatrix_ransac_fit(const int *sample, double *F, void *data)
+{
+    fmatrix_ransac_data_t *d = (fmatrix_ransac_data_t *) data;
+    v3_t l_pts[8], r_pts[8];
+    double e1_tmp[3], e2_tmp[3];
+    int j;
+
+    /* Fill in the left and right points */
+    for (j = 0; j < 8; j++) {
+        l_pts[j] = d->b_pts[sample[j]];
+        r_pts[j] = d->a_pts[sample[j]];
+    }
+
+    /* Estimate the F-matrix */
+    if (!estimate_fmatrix_linear(8, r_pts, l_pts, d->essential, 
+                                 F, e1_tmp, e2_tmp))
+        return 0;
+
+    /* Check for nan entries */
+    for (j = 0; j < 9; j++) {
+        if (isnan(F[j])) {
+            printf("[estimate_fmatrix_ransac_matches] "
+                   "nan matrix encountered\n");
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static double fmatrix_ransac_residual(const double *F, int idx, void *data)
+{
+    fmatrix_ransac_data_t *d = (fmatrix_ransac_data_t *) data;
+    return fmatrix_compute_residual((double *) F, d->a_pts[idx], 
+                                    d->b_pts[idx]);
+}
+
+static void fmatrix_ransac_residuals(const double *Fs, int num_Fs, 
+                                     double *resid, void *data)
+{
+    fmatrix_ransac_data_t *d = (fmatrix_ransac_data_t *) data;
+    fmatrix_compute_residuals_multi(num_Fs, Fs, d->num_pts, 
+                                    d->a_soa, d->b_soa, resid);
+}
+
 /* Use RANSAC to estimate an F-matrix */
 int estimate_fmatrix_ransac_matches(int num_pts, v3_t *a_pts, v3_t *b_pts, 
                                     int num_trials, double threshold, 
                                     double success_ratio,
                                     int essential, double *F) 
 {
-    int i, j, k, idx;
-
-    v3_t l_pts_best[8], r_pts_best[8];
-
+    fmatrix_ransac_data_t data;
+    ransac_params_t params;
     double Fbest[9];
-    double *resid;
-    double error_min;
-    int inliers_max;
-
-    double *a_matrix, *b_matrix;
+    int i, inliers_max;
 
-    // double threshold = 1.0e-10;
-
-    // srand(time(0));
-
-    /* Make an array of all good correspondences */
     if (num_pts < 8) {
 	printf("[estimate_fmatrix_ransac] Could not find 8 good correspondences,"
 	       "F-matrix estimation failed\n");
 	return 0;
     }
 
-    a_matrix = malloc(sizeof(double) * 3 * num_pts);
-    b_matrix = malloc(sizeof(double) * 3 * num_pts);
+    data.a_pts = a_pts;
+    data.b_pts = b_pts;
+    data.num_pts = num_pts;
+    data.essential = essential;
+
+    /* Transpose the points for the vectorized residuals */
+    data.a_soa = (double *) malloc(sizeof(double) * 3 * num_pts);
+    data.b_soa = (double *) malloc(sizeof(double) * 3 * num_pts);
 
     for (i = 0; i < num_pts; i++) {
-        a_matrix[i] = Vx(a_pts[i]);
-        a_matrix[i+num_pts] = Vy(a_pts[i]);
-        a_matrix[i+2*num_pts] = Vz(a_pts[i]);
+        data.a_soa[i] = Vx(a_pts[i]);
+        data.a_soa[num_pts + i] = Vy(a_pts[i]);
+        data.a_soa[2 * num_pts + i] = Vz(a_pts[i]);
 
-        b_matrix[i] = Vx(b_pts[i]);
-        b_matrix[i+num_pts] = Vy(b_pts[i]);
-        b_matrix[i+2*num_pts] = Vz(b_pts[i]);        
+        data.b_soa[i] = Vx(b_pts[i]);
+        data.b_soa[num_pts + i] = Vy(b_pts[i]);
+        data.b_soa[2 * num_pts + i] = Vz(b_pts[i]);
     }
 
-    error_min = DBL_MAX;
-    inliers_max = 0;
-    resid = (double *) malloc(sizeof(double) * num_pts);
+    ransac_params_init(&params, num_pts, 8, 9, 1);
+    params.max_rounds = num_trials;
+    params.threshold = threshold;
+    params.success_ratio = success_ratio;
+    params.fit = fmatrix_ransac_fit;
+    params.residual = fmatrix_ransac_residual;
+    params.residuals = fmatrix_ransac_residuals;
+    params.compatible = fmatrix_ransac_compatible;
+    params.data = &data;
 
-    /* Estimate the F-matrix using RANSAC */
-    for (i = 0; i < num_trials; i++) {
-	int idxs[8];
-	v3_t l_pts[8], r_pts[8];
-	double Ftmp[9], e1_tmp[3], e2_tmp[3];
-	// double error;
-	int num_inliers = 0;
-	int success, nan = 0;
-        int round = 0;
+    inliers_max = ransac_estimate(&params, Fbest, NULL);
 
-	/* Sample 8 random correspondences */
-	for (j = 0; j < 8; j++) {
-	    int reselect = 0;
+    free(data.a_soa);
+    free(data.b_soa);
 
-            if (round == 1000)
-                return 0;
+    if (inliers_max == 0)
+        return 0;
 
-	    idx = rand() % num_pts;
-	    
-	    /* Make sure we didn't sample this index yet */
-	    for (k = 0; k < j; k++) {
-		if (idx == idxs[k] ||
-                    (Vx(a_pts[idx]) == Vx(a_pts[idxs[k]]) &&
-                     Vy(a_pts[idx]) == Vy(a_pts[idxs[k]]) &&
-                     Vz(a_pts[idx]) == Vz(a_pts[idxs[k]])) ||
-                    (Vx(b_pts[idx]) == Vx(b_pts[idxs[k]]) &&
-                     Vy(b_pts[idx]) == Vy(b_pts[idxs[k]]) &&
-                     Vz(b_pts[idx]) == Vz(b_pts[idxs[k]]))) {
-		    reselect = 1;
-		    break;
-		}
-	    }
+    /* Copy out the F-matrix */
+    memcpy(F, Fbest, sizeof(double) * 9);
 
-	    if (reselect) {
-                round++;
-		j--;
-		continue;
-	    }
+    return inliers_max;
+}
 
-	    idxs[j] = idx;
-	}
+int double_compare(const void *a, const void *b) {
+    double *ad = (double *) a;
+    double *bd = (double *) b;
+    
+    if (*ad < *bd)
+	return -1;
+    else if (*ad == *bd)
+	return 0;
+    else
+	return 1;
+}
 
-	/* Fill in the left and right points */
-	for (j = 0; j < 8; j++) {
-	    l_pts[j] = b_pts[idxs[j]];
-	    r_pts[j] = a_pts[idxs[j]];
-	}
+/* Matches and per-evaluation state for refining an F-matrix */
+typedef struct {
+    v3_t *ins, *outs;   /* Matches */
+    double scale;       /* F[8], held fixed */
+    double F2[9];       /* Closest rank 2 matrix to the current F */
+    double dF2[9 * 8];  /* Its derivative with respect to F[0..7] */
+} fmatrix_refine_data_t;
+
+/* Find the closest rank 2 matrix F2 to the F-matrix with entries x and
+ * F[8] = scale */
+static void fmatrix_refine_rank2(const double *x, double scale, double *F2)
+{
+    double F[9], U[9], VT[9];
 
-	/* Estimate the F-matrix */
-	success = estimate_fmatrix_linear(8, r_pts, l_pts, essential, 
-                                          Ftmp, e1_tmp, e2_tmp);
+    memcpy(F, x, sizeof(double) * 8);
+    F[8] = scale;
 
-        if (success == 0)
-            nan = 1;
+    closest_rank2_matrix(F, F2, U, VT);
+}
 
-	for (j = 0; j < 9; j++) {
-	    if (Ftmp[j] != Ftmp[j] /* isnan(Ftmp[j]) */) {
-		printf("[estimate_fmatrix_ransac_matches] nan encountered\n");
-                nan = 1;
-		break;
-	    }
-	}
+/* The residuals depend on x only through the rank 2 projection, an
+ * SVD, so its derivative is found once per evaluation by forward
+ * differences (as lmdif would); the residuals are then differentiated
+ * analytically through it */
+static void fmatrix_refine_setup(const double *x, int jacobian, void *data)
+{
+    fmatrix_refine_data_t *d = (fmatrix_refine_data_t *) data;
+    int j, k;
 
-        /* Check for nan entries */
-        if (isnan(Ftmp[0]) || isnan(Ftmp[1]) || isnan(Ftmp[2]) ||
-            isnan(Ftmp[3]) || isnan(Ftmp[4]) || isnan(Ftmp[5]) ||
-            isnan(Ftmp[6]) || isnan(Ftmp[7]) || isnan(Ftmp[8])) {
-            printf("[estimate_fmatrix_ransac_matches] "
-                   "nan matrix encountered\n");
-            nan = 1;
-        }
+    fmatrix_refine_rank2(x, d->scale, d->F2);
 
-	if (nan) {
-	    // error = DBL_MAX;
-	    num_inliers = 0;
-	} else {
-            // printf("%0.3f\n", Ftmp[0]);
+    if (!jacobian)
+        return;
 
-	    /* Compute residuals */
-#if 1
-	    for (j = 0; j < num_pts; j++) {
-		resid[j] = fmatrix_compute_residual(Ftmp, a_pts[j], b_pts[j]);
-		if (resid[j] < threshold)
-		    num_inliers++;
-	    }
-#else
-            fmatrix_compute_residuals(num_pts, Ftmp, a_matrix, b_matrix,
-                                      resid);
+    for (k = 0; k < 8; k++) {
+        double xh[8], F2h[9];
+        double h = sqrt(DBL_EPSILON) * fabs(x[k]);
 
-            for (j = 0; j < num_pts; j++) {
-		if (resid[j] < threshold)
-		    num_inliers++;                
-            }
-#endif
+        if (h == 0.0)
+            h = sqrt(DBL_EPSILON);
 
-#if 0
-	    /* Find the median */
-	    error = median(num_pts, resid);
-
-	    if (error < error_min) {
-		error_min = error;
-		memcpy(Fbest, Ftmp, sizeof(double) * 9);
-		memcpy(l_pts_best, l_pts, sizeof(v3_t) * 8);
-		memcpy(r_pts_best, r_pts, sizeof(v3_t) * 8);
-	    }
-#else
-	    if (num_inliers > inliers_max) {
-		inliers_max = num_inliers;
-		memcpy(Fbest, Ftmp, sizeof(double) * 9);
-		memcpy(l_pts_best, l_pts, sizeof(v3_t) * 8);
-		memcpy(r_pts_best, r_pts, sizeof(v3_t) * 8);
-	    }
-#endif
-	}
-	
-#if 0
-	if (error < threshold)
-	    break;
-#endif
+        memcpy(xh, x, sizeof(double) * 8);
+        xh[k] += h;
+
+        fmatrix_refine_rank2(xh, d->scale, F2h);
 
-        if ((double) num_inliers / num_pts > success_ratio)
-            break;
+        for (j = 0; j < 9; j++)
+            d->dF2[j * 8 + k] = (F2h[j] - d->F2[j]) / h;
     }
+}
 
-    // printf("Minimum error: %0.5e\n", error_min);
-    // printf("Maximum inliers: %d\n", inliers_max);
+/* Residual of match i, the square root of fmatrix_compute_residual
+ * (signed, so that it is smooth where the match fits exactly), and its
+ * jacobian */
+static int fmatrix_refine_block(int i, const double *x, double *r,
+                                double *J, void *data)
+{
+    fmatrix_refine_data_t *d = (fmatrix_refine_data_t *) data;
+    const double *F = d->F2;
+    const double *l = d->ins[i].p, *rp = d->outs[i].p;
+    double Fl[3], Fr[2], pt, dl, dr, s;
+    int a, b, k;
 
-    // matrix_print(3, 3, Fbest);
+    Fl[0] = F[0] * l[0] + F[1] * l[1] + F[2] * l[2];
+    Fl[1] = F[3] * l[0] + F[4] * l[1] + F[5] * l[2];
+    Fl[2] = F[6] * l[0] + F[7] * l[1] + F[8] * l[2];
 
-    free(resid);
+    Fr[0] = F[0] * rp[0] + F[3] * rp[1] + F[6] * rp[2];
+    Fr[1] = F[1] * rp[0] + F[4] * rp[1] + F[7] * rp[2];
 
-    /* Copy out the F-matrix */
-    memcpy(F, Fbest, sizeof(double) * 9);
+    pt = rp[0] * Fl[0] + rp[1] * Fl[1] + rp[2] * Fl[2];
 
-    free(a_matrix);
-    free(b_matrix);
+    dl = Fl[0] * Fl[0] + Fl[1] * Fl[1];
+    dr = Fr[0] * Fr[0] + Fr[1] * Fr[1];
 
-    return inliers_max;
-}
+    s = sqrt(1.0 / dl + 1.0 / dr);
+    r[0] = pt * s;
 
-int double_compare(const void *a, const void *b) {
-    double *ad = (double *) a;
-    double *bd = (double *) b;
-    
-    if (*ad < *bd)
-	return -1;
-    else if (*ad == *bd)
-	return 0;
-    else
-	return 1;
-}
+    if (J != NULL) {
+        double dF[9];
 
-static v3_t *global_ins = NULL;
-static v3_t *global_outs = NULL;
-static int global_num_matches = 0;
-static double global_scale;
+        /* d(pt s) / dF_ab = s d(pt) + pt d(s), with
+         * d(s) = -(d(dl) / dl^2 + d(dr) / dr^2) / (2 s) */
+        for (a = 0; a < 3; a++) {
+            for (b = 0; b < 3; b++) {
+                double ddl = (a < 2) ? 2.0 * Fl[a] * l[b] : 0.0;
+                double ddr = (b < 2) ? 2.0 * Fr[b] * rp[a] : 0.0;
+                double ds = -(ddl / (dl * dl) + ddr / (dr * dr)) / (2.0 * s);
 
-void fmatrix_residuals(int *m, int *n, double *x, double *fvec, int *iflag) {
-    int i;
-    double sum = 0.0;
+                dF[3 * a + b] = s * rp[a] * l[b] + pt * ds;
+            }
+        }
 
-    double F[9], F2[9], U[9], VT[9];
-    memcpy(F, x, sizeof(double) * 8);
-    F[8] = global_scale;
+        for (k = 0; k < 8; k++) {
+            double sum = 0.0;
 
-    closest_rank2_matrix(F, F2, U, VT);
+            for (a = 0; a < 9; a++)
+                sum += dF[a] * d->dF2[a * 8 + k];
 
-    if (global_num_matches != (*m)) {
-	printf("Error: number of matches don't match!\n");
+            J[k] = sum;
+        }
     }
 
-    for (i = 0; i < global_num_matches; i++) {
-	fvec[i] = sqrt(fmatrix_compute_residual(F2, global_outs[i], global_ins[i]));
-	if (*iflag == 0) {
-	    sum += fvec[i];
-	}
-    }
+    return 1;
+}
 
-#if 0
-    if (*iflag == 0) {
-	matrix_print(3, 3, F);
-	matrix_print(3, 3, F2);
-	printf("Residuals: %0.5f\n", sum);
-    }
-#endif
+/* Refine the first eight entries of F (F[8] is held fixed) to best fit
+ * the matches */
+static void fmatrix_refine(int num_pts, v3_t *ins, v3_t *outs, double *F)
+{
+    fmatrix_refine_data_t data;
+
+    data.ins = ins;
+    data.outs = outs;
+    data.scale = F[8];
+
+    lm_solve(fmatrix_refine_block, fmatrix_refine_setup, &data, 
+             num_pts, 8, F, 1.0e-12, 100);
 }
 
 #if 0
@@ -609,17 +760,11 @@ void refine_fmatrix_nonlinear(img_dmap_t *amap, double *F0, double *Fout) {
 	}
     }
 
-    global_ins = ins;
-    global_outs = outs;
-    global_num_matches = num_good;
-    global_scale = F0[8];
-    
     memcpy(Ftmp, F0, sizeof(double) * 9);
     // printf("Pre:\n");
     // print_matrix(3, 3, F0);
 
-    lmdif_driver2(fmatrix_residuals, num_good, 8, Ftmp, 1.0e-12);
-    Ftmp[8] = global_scale;
+    fmatrix_refine(num_good, ins, outs, Ftmp);
     closest_rank2_matrix(Ftmp, Fout, U, VT);
 
     // printf("Post:\n");
@@ -628,8 +773,6 @@ void refine_fmatrix_nonlinear(img_dmap_t *amap, double *F0, double *Fout) {
     free(ins);
     free(outs);
     free(errors);
-    global_ins = global_outs = NULL;
-    global_num_matches = 0;
 }
 #endif
 
@@ -640,22 +783,13 @@ void refine_fmatrix_nonlinear_matches(int num_pts, v3_t *r_pts, v3_t *l_pts,
     double Ftmp[9];
     double U[9], VT[9];
 
-    global_ins = l_pts;
-    global_outs = r_pts;
-    global_num_matches = num_pts;
-    global_scale = F0[8];
-    
     memcpy(Ftmp, F0, sizeof(double) * 9);
 
-    lmdif_driver2(fmatrix_residuals, num_pts, 8, Ftmp, 1.0e-12);
+    fmatrix_refine(num_pts, l_pts, r_pts, Ftmp);
 
-    Ftmp[8] = global_scale;
     matrix_print(3, 3, Ftmp);
     closest_rank2_matrix(Ftmp, Fout, U, VT);
     matrix_print(3, 3, Fout);
-
-    global_ins = global_outs = NULL;
-    global_num_matches = 0;    
 }
 
 int svd3_driver(double *A, double *U, double *S, double *VT) 
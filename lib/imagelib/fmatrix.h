@@ -34,6 +34,21 @@ void fmatrix_compute_epipoles(double *F, double *e1, double *e2);
 /* Compute the distance from l to the epipolar line of r under F */
 double fmatrix_compute_residual(double *F, v3_t r, v3_t l);
 
+/* Batched fmatrix_compute_residual.  The points are stored as 3 x
+ * num_pts matrices (all x's, then all y's, then all z's), and the
+ * residual of point i is written to resid[i] */
+void fmatrix_compute_residuals(int num_pts, const double *F, 
+                               const double *r, const double *l, 
+                               double *resid);
+
+/* Residuals of every point under each of num_Fs F-matrices (stored
+ * consecutively) in a single pass over the points.  Row k of resid
+ * (num_Fs x num_pts) holds the residuals for the kth F-matrix */
+void fmatrix_compute_residuals_multi(int num_Fs, const double *Fs,
+                                     int num_pts, 
+                                     const double *r, const double *l,
+                                     double *resid);
+
 /* Use RANSAC to estimate an F-matrix */
 // void estimate_fmatrix_ransac(img_t *img, img_dmap_t *map, 
 //                              int num_trials, double threshold, 
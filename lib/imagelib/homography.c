@@ -22,7 +22,9 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "defines.h"
 #include "homography.h"
+#include "lm.h"
 #include "matrix.h"
 #include "vector.h"
 
@@ -140,59 +142,51 @@ void align_homography(int num_pts, v3_t *r_pts, v3_t *l_pts,
 #endif
 }
 
-static int global_num_pts;
-static v3_t *global_r_pts;
-static v3_t *global_l_pts;
-static int global_round;
+/* Correspondences for the homography residuals */
+typedef struct {
+    v3_t *r_pts;
+    v3_t *l_pts;
+} homography_data_t;
 
-static void homography_resids(int *m, int *n, double *x, double *fvec, int *iflag)
+/* Residual of correspondence i under the homography x (the first eight
+ * entries, with H[8] = 1), and its jacobian */
+static int homography_block(int i, const double *x, double *r, double *J,
+                            void *data)
 {
-    int i;
+    homography_data_t *pts = (homography_data_t *) data;
+    double p[3], q[3], u, v;
+    int k;
 
-    double resids = 0.0;
+    p[0] = Vx(pts->l_pts[i]);
+    p[1] = Vy(pts->l_pts[i]);
+    p[2] = Vz(pts->l_pts[i]);
 
-    double H[9];
-    memcpy(H, x, 8 * sizeof(double));
-    H[8] = 1.0;
+    q[0] = x[0] * p[0] + x[1] * p[1] + x[2] * p[2];
+    q[1] = x[3] * p[0] + x[4] * p[1] + x[5] * p[2];
+    q[2] = x[6] * p[0] + x[7] * p[1] + p[2];
 
-    if (*iflag == 0 && global_num_pts > 4) {
-	printf("[Round %d]\n", global_round);
-	printf("  H=(%0.5f, %0.5f, %0.5f, %0.5f, %0.5f, %0.5f, %0.5f, %0.5f, %0.1f)\n", 
-	       H[0], H[1], H[2], H[3], H[4], H[5], H[6], H[7], H[8]);
-	global_round++;
-    }
-    
-    for (i = 0; i < global_num_pts; i++) {
-	double p[3], q[3];
+    u = q[0] / q[2];
+    v = q[1] / q[2];
 
-	p[0] = Vx(global_l_pts[i]);
-	p[1] = Vy(global_l_pts[i]);
-	p[2] = Vz(global_l_pts[i]);
+    r[0] = u - Vx(pts->r_pts[i]);
+    r[1] = v - Vy(pts->r_pts[i]);
 
-	if (*iflag == 0 && global_num_pts > 4)
-	    printf("    p=(%0.3f, %0.3f, %0.3f)\n", p[0], p[1], p[2]);
+    if (J != NULL) {
+        for (k = 0; k < 3; k++) {
+            J[k] = p[k] / q[2];
+            J[3 + k] = 0.0;
 
-	matrix_product(3, 3, 3, 1, H, p, q);
-
-	if (*iflag == 0 && global_num_pts > 4)
-	    printf("    q=(%0.3f, %0.3f, %0.3f)\n", q[0], q[1], q[2]);
-	
-	q[0] /= q[2];
-	q[1] /= q[2];
-	
-	fvec[2 * i + 0] = q[0] - Vx(global_r_pts[i]);
-	fvec[2 * i + 1] = q[1] - Vy(global_r_pts[i]);
+            J[8 + k] = 0.0;
+            J[8 + 3 + k] = p[k] / q[2];
+        }
 
-	if (*iflag == 0 && global_num_pts > 4)
-	    printf("    (%0.3f, %0.3f) ==> (%0.3f, %0.3f)\n", q[0], q[1], Vx(global_r_pts[i]), Vy(global_r_pts[i]));
+        for (k = 0; k < 2; k++) {
+            J[6 + k] = -u * p[k] / q[2];
+            J[8 + 6 + k] = -v * p[k] / q[2];
+        }
     }
 
-    for (i = 0; i < 2 * global_num_pts; i++) {
-	resids += fvec[i] * fvec[i];
-    }
-    
-    if (*iflag == 0 && global_num_pts > 4) 
-	printf("resids = %0.3f\n", resids);
+    return 2;
 }
 
 /* Use non-linear least squares to refine a homography */
@@ -200,6 +194,7 @@ void align_homography_non_linear(int num_pts, v3_t *r_pts, v3_t *l_pts,
 				 double *Tin, double *Tout) 
 {
     double x[8];
+    homography_data_t pts;
 
     if (num_pts > 4) {
 	printf("pre: ");
@@ -208,12 +203,10 @@ void align_homography_non_linear(int num_pts, v3_t *r_pts, v3_t *l_pts,
     
     memcpy(x, Tin, 8 * sizeof(double));
 
-    global_num_pts = num_pts;
-    global_r_pts = r_pts;
-    global_l_pts = l_pts;
-    global_round = 0;
+    pts.r_pts = r_pts;
+    pts.l_pts = l_pts;
 
-    lmdif_driver(homography_resids, 2 * num_pts, 8, x, 1.0e-4);
+    lm_solve(homography_block, NULL, &pts, num_pts, 8, x, 1.0e-4, 100);
     
     memcpy(Tout, x, 8 * sizeof(double));
     Tout[8] = 1.0;
@@ -702,12 +702,21 @@ void img_blend(img_t *dest, img_t *src) {
 }
 
 void img_write(FILE *f, img_t *img) {
+    u_int16_t w = (u_int16_t) img->w, h = (u_int16_t) img->h;
+
+    /* The format stores 16-bit dimensions */
+    if (img->w > 0xffff || img->h > 0xffff) {
+        printf("[img_write] Error: image (%d x %d) is too large for the "
+               "file format\n", img->w, img->h);
+        return;
+    }
+
     /* Write the header */
     fwrite(IMG_FILE_HEADER, 1, 4, f);
 
     /* Write the width, height */
-    write_short(&img->w, f);
-    write_short(&img->h, f);
+    write_short(&w, f);
+    write_short(&h, f);
     
     /* Write the pixel data */
     fwrite(img->pixels, sizeof(color_t), img->w * img->h, f);
@@ -715,6 +724,7 @@ void img_write(FILE *f, img_t *img) {
 
 img_t *img_read(FILE *f) {
     char hdr[5];
+    u_int16_t w, h;
     img_t *img = malloc(sizeof(img_t));
     
     /* Read the file header */
@@ -727,8 +737,10 @@ img_t *img_read(FILE *f) {
     }
     
     /* Read the width, height */
-    read_short(&img->w, f);
-    read_short(&img->h, f);
+    read_short(&w, f);
+    read_short(&h, f);
+    img->w = w;
+    img->h = h;
     
     /* Read the pixel data */
     img->pixels = malloc(sizeof(color_t) * img->w * img->h);
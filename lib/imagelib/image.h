@@ -34,7 +34,7 @@ extern "C" {
 
 typedef struct {
     /* Width, height */
-    u_int16_t w, h;
+    int w, h;
   
     /* Pixel data */
     color_t *pixels;
@@ -48,7 +48,7 @@ typedef struct {
 
 typedef struct {
     /* Width, height */
-    u_int16_t w, h;
+    int w, h;
   
     /* Pixel data */
     float *pixels;
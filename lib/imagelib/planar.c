@@ -0,0 +1,264 @@
+/*
+ *  Copyright (c) 2008  Noah Snavely (snavely (at) cs.washington.edu)
+ *    and the University of Washington
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+/* planar.c */
+/* Planar float images with padded rows */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef WIN32
+#include <malloc.h>
+#endif
+
+#include "defines.h"
+#include "image.h"
+#include "planar.h"
+
+static void *pimg_aligned_alloc(size_t size) {
+#ifdef WIN32
+    return _aligned_malloc(size, PIMG_ALIGN);
+#else
+    void *ptr = NULL;
+    if (posix_memalign(&ptr, PIMG_ALIGN, size) != 0)
+	return NULL;
+
+    return ptr;
+#endif
+}
+
+static void pimg_aligned_free(void *ptr) {
+#ifdef WIN32
+    _aligned_free(ptr);
+#else
+    free(ptr);
+#endif
+}
+
+/* Allocate an image, leaving the pixels uninitialized unless zero is
+ * non-zero */
+static pimg_t *pimg_alloc(int w, int h, int num_channels, int masked,
+			  int zero) {
+    int c;
+    int align = PIMG_ALIGN / sizeof(float);
+    size_t plane_size, size;
+    pimg_t *img;
+
+    if (w < 0 || h < 0 ||
+	num_channels < 1 || num_channels > PIMG_MAX_CHANNELS) {
+	printf("[pimg_alloc] Error: bad image size %d x %d x %d\n",
+	       w, h, num_channels);
+	return NULL;
+    }
+
+    img = malloc(sizeof(pimg_t));
+    img->w = w;
+    img->h = h;
+    img->stride = (w + align - 1) / align * align;
+    img->num_channels = num_channels;
+    img->origin = v2_new(0.0, 0.0);
+
+    /* The planes and then the mask, in one block */
+    plane_size = (size_t) img->stride * h;
+    size = plane_size * (sizeof(float) * num_channels + (masked ? 1 : 0));
+    img->data = pimg_aligned_alloc(MAX(size, 1));
+
+    if (img->data == NULL) {
+	printf("[pimg_alloc] Error allocating a %d x %d image\n", w, h);
+	free(img);
+	return NULL;
+    }
+
+    if (zero)
+	memset(img->data, 0, size);
+
+    for (c = 0; c < PIMG_MAX_CHANNELS; c++) {
+	img->planes[c] = (c < num_channels) ?
+	    (float *) img->data + c * plane_size : NULL;
+    }
+
+    if (masked)
+	img->mask = (u_int8_t *) ((float *) img->data +
+				  num_channels * plane_size);
+    else
+	img->mask = NULL;
+
+    return img;
+}
+
+pimg_t *pimg_new(int w, int h, int num_channels, int masked) {
+    return pimg_alloc(w, h, num_channels, masked, 1);
+}
+
+pimg_t *pimg_view(pimg_t *img, int x, int y, int w, int h) {
+    int c;
+    size_t offset;
+    pimg_t *view;
+
+    if (x < 0 || y < 0 || w < 0 || h < 0 ||
+	x + w > img->w || y + h > img->h) {
+	printf("[pimg_view] Error: region (%d, %d) %d x %d is outside "
+	       "the image (%d x %d)\n", x, y, w, h, img->w, img->h);
+	return NULL;
+    }
+
+    view = malloc(sizeof(pimg_t));
+    *view = *img;
+
+    offset = (size_t) y * img->stride + x;
+
+    view->w = w;
+    view->h = h;
+    view->data = NULL;
+
+    for (c = 0; c < img->num_channels; c++)
+	view->planes[c] = img->planes[c] + offset;
+
+    if (img->mask != NULL)
+	view->mask = img->mask + offset;
+
+    view->origin = v2_new(Vx(img->origin) + x, Vy(img->origin) + y);
+
+    return view;
+}
+
+void pimg_free(pimg_t *img) {
+    if (img == NULL)
+	return;
+
+    if (img->data != NULL)
+	pimg_aligned_free(img->data);
+
+    free(img);
+}
+
+void pimg_set_all_valid(pimg_t *img) {
+    int y;
+
+    if (img->mask == NULL)
+	return;
+
+    for (y = 0; y < img->h; y++)
+	memset(img->mask + (size_t) y * img->stride, 1, img->w);
+}
+
+pimg_t *img2pimg(img_t *img, int num_channels, int masked) {
+    int x, y;
+    int w = img->w, h = img->h;
+    pimg_t *out = pimg_alloc(w, h, num_channels, masked, 0);
+
+    if (out == NULL)
+	return NULL;
+
+    out->origin = img->origin;
+
+    for (y = 0; y < h; y++) {
+	const color_t *row = img->pixels + (size_t) y * w;
+
+	if (num_channels == 1) {
+	    float *r = pimg_row(out, 0, y);
+
+	    for (x = 0; x < w; x++)
+		r[x] = (float) row[x].r;
+	} else {
+	    float *r = pimg_row(out, 0, y);
+	    float *g = pimg_row(out, 1, y);
+	    float *b = pimg_row(out, 2, y);
+
+	    for (x = 0; x < w; x++) {
+		r[x] = (float) row[x].r;
+		g[x] = (float) row[x].g;
+		b[x] = (float) row[x].b;
+	    }
+	}
+
+	if (masked) {
+	    u_int8_t *mask = out->mask + (size_t) y * out->stride;
+	    size_t idx = (size_t) y * w;
+
+	    for (x = 0; x < w; x++, idx++)
+		mask[x] = (img->pixel_mask[idx >> 3] >> (idx & 7)) & 1;
+	}
+    }
+
+    return out;
+}
+
+static u_int8_t pimg_to_byte(float v) {
+    if (v <= 0.0f)
+	return 0;
+    else if (v >= 255.0f)
+	return 255;
+    else
+	return (u_int8_t) (v + 0.5f);
+}
+
+img_t *pimg2img(pimg_t *img) {
+    int x, y;
+    int w = img->w, h = img->h;
+    img_t *out = img_new(w, h);
+
+    int cg = (img->num_channels == 1) ? 0 : 1;
+    int cb = (img->num_channels == 1) ? 0 : 2;
+
+    out->origin = img->origin;
+
+    for (y = 0; y < h; y++) {
+	color_t *row = out->pixels + (size_t) y * w;
+	const float *r = pimg_row(img, 0, y);
+	const float *g = pimg_row(img, cg, y);
+	const float *b = pimg_row(img, cb, y);
+
+	for (x = 0; x < w; x++) {
+	    row[x].r = pimg_to_byte(r[x]);
+	    row[x].g = pimg_to_byte(g[x]);
+	    row[x].b = pimg_to_byte(b[x]);
+	    row[x].extra = 0;
+	}
+
+	for (x = 0; x < w; x++) {
+	    size_t idx = (size_t) y * w + x;
+
+	    if (pimg_is_valid(img, x, y))
+		out->pixel_mask[idx >> 3] |= (u_int8_t) (1 << (idx & 7));
+	}
+    }
+
+    return out;
+}
+
+fimg_t *pimg2fimg(pimg_t *img, int c) {
+    int x, y;
+    int w = img->w, h = img->h;
+    fimg_t *out = fimg_new(w, h);
+
+    out->origin = img->origin;
+
+    for (y = 0; y < h; y++) {
+	memcpy(out->pixels + (size_t) y * w, pimg_row(img, c, y),
+	       sizeof(float) * w);
+
+	for (x = 0; x < w; x++) {
+	    size_t idx = (size_t) y * w + x;
+
+	    if (pimg_is_valid(img, x, y))
+		out->pixel_mask[idx >> 3] |= (u_int8_t) (1 << (idx & 7));
+	}
+    }
+
+    return out;
+}
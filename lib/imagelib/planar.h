@@ -0,0 +1,165 @@
+/*
+ *  Copyright (c) 2008  Noah Snavely (snavely (at) cs.washington.edu)
+ *    and the University of Washington
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+/* planar.h */
+/* Planar float images with padded rows */
+
+#ifndef __planar_h__
+#define __planar_h__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <math.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "image.h"
+#include "vector.h"
+
+#if defined(_MSC_VER) && !defined(__cplusplus)
+#define PIMG_INLINE static __inline
+#else
+#define PIMG_INLINE static inline
+#endif
+
+#define PIMG_MAX_CHANNELS 3
+
+/* Rows start on a multiple of this many bytes */
+#define PIMG_ALIGN 32
+
+/* An image stored one channel at a time.  Row y of channel c starts at
+ * planes[c] + y * stride, and rows are padded so that they all start
+ * aligned.  The mask holds a byte per pixel (row y at mask + y *
+ * stride), non-zero for valid pixels; an image without a mask is valid
+ * everywhere.  A view shares the pixels of another image, and doesn't
+ * own them */
+typedef struct {
+    /* Width, height */
+    int w, h;
+
+    /* Elements from one row to the next */
+    int stride;
+
+    /* 1 (grayscale) or 3 (RGB) */
+    int num_channels;
+
+    /* Pixel data */
+    float *planes[PIMG_MAX_CHANNELS];
+
+    /* Mask of valid pixels, or NULL */
+    u_int8_t *mask;
+
+    /* Storage owned by the image (NULL for a view) */
+    void *data;
+
+    /* The location of the image origin in world space */
+    v2_t origin;
+} pimg_t;
+
+/* Create a new image, with all pixels zero.  If masked is non-zero,
+ * the image has a mask and all pixels start out as invalid (as with
+ * img_new) */
+pimg_t *pimg_new(int w, int h, int num_channels, int masked);
+
+/* Create a view of the w x h region of img starting at (x, y).  The
+ * view must be freed before img */
+pimg_t *pimg_view(pimg_t *img, int x, int y, int w, int h);
+
+/* Free an image or a view */
+void pimg_free(pimg_t *img);
+
+/* Convert from an image.  With one channel, the red channel is taken
+ * (as for a grayscale image).  If masked is non-zero, the mask of img
+ * is carried over */
+pimg_t *img2pimg(img_t *img, int num_channels, int masked);
+
+/* Convert to an image, rounding and clamping each channel (a
+ * grayscale image is copied to all three) */
+img_t *pimg2img(pimg_t *img);
+
+/* Convert channel c to a float image */
+fimg_t *pimg2fimg(pimg_t *img, int c);
+
+/* Mark all pixels as valid (a no-op without a mask) */
+void pimg_set_all_valid(pimg_t *img);
+
+PIMG_INLINE float *pimg_row(const pimg_t *img, int c, int y) {
+    return img->planes[c] + (size_t) y * img->stride;
+}
+
+PIMG_INLINE float pimg_get(const pimg_t *img, int c, int x, int y) {
+    return img->planes[c][(size_t) y * img->stride + x];
+}
+
+PIMG_INLINE void pimg_set(pimg_t *img, int c, int x, int y, float v) {
+    img->planes[c][(size_t) y * img->stride + x] = v;
+}
+
+/* Get channel c at (x, y), clamped to the border (as img_get_pixel) */
+PIMG_INLINE float pimg_get_clamped(const pimg_t *img, int c, int x, int y) {
+    x = (x < 0) ? 0 : ((x >= img->w) ? img->w - 1 : x);
+    y = (y < 0) ? 0 : ((y >= img->h) ? img->h - 1 : y);
+
+    return pimg_get(img, c, x, y);
+}
+
+/* Returns 1 if (x, y) is inside the image and valid */
+PIMG_INLINE int pimg_is_valid(const pimg_t *img, int x, int y) {
+    if (x < 0 || x >= img->w || y < 0 || y >= img->h)
+        return 0;
+
+    return (img->mask == NULL ||
+            img->mask[(size_t) y * img->stride + x] != 0);
+}
+
+PIMG_INLINE void pimg_set_valid(pimg_t *img, int x, int y) {
+    if (img->mask != NULL)
+        img->mask[(size_t) y * img->stride + x] = 1;
+}
+
+/* Bilinearly interpolate each channel at (x, y), clamping to the
+ * border (as pixel_lerp), and store the results in out */
+PIMG_INLINE void pimg_lerp(const pimg_t *img, double x, double y,
+                           double *out) {
+    int xf = (int) floor(x), yf = (int) floor(y);
+    double xp = x - xf, yp = y - yf;
+    int c;
+
+    int x0 = (xf < 0) ? 0 : ((xf >= img->w) ? img->w - 1 : xf);
+    int x1 = (xf + 1 < 0) ? 0 : ((xf + 1 >= img->w) ? img->w - 1 : xf + 1);
+    size_t r0 = (size_t) ((yf < 0) ? 0 : 
+                          ((yf >= img->h) ? img->h - 1 : yf)) * img->stride;
+    size_t r1 = (size_t) ((yf + 1 < 0) ? 0 : 
+                          ((yf + 1 >= img->h) ? img->h - 1 : yf + 1)) * 
+        img->stride;
+
+    for (c = 0; c < img->num_channels; c++) {
+        const float *p = img->planes[c];
+        double f0 = p[r0 + x0], f1 = p[r0 + x1];
+        double f2 = p[r1 + x0], f3 = p[r1 + x1];
+
+        out[c] = (1.0 - yp) * ((1.0 - xp) * f0 + xp * f1) +
+            yp * ((1.0 - xp) * f2 + xp * f3);
+    }
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __planar_h__ */
@@ -23,6 +23,7 @@
 #include <string.h>
 #include <float.h>
 
+#include "planar.h"
 #include "pyramid.h"
 #include "resample.h"
 #include "util.h"
@@ -55,8 +56,8 @@ img_pyr_t *img_create_gaussian_pyramid(img_t *img, int extra) {
     /* Assumes that the image size is NxN where N=2^k */
     int num_levels;
     img_pyr_t *pyr;
-    int i, n, x, y;
-    color_t *pxls[4];
+    int i, n, x, y, c;
+    pimg_t *prev;
 
     img_t *i_new = img_upsize_square_power_of_two(img);
 
@@ -78,33 +79,47 @@ img_pyr_t *img_create_gaussian_pyramid(img_t *img, int extra) {
 	transform_free(T);
     }
 
-    /* Resample the smaller images */
-    for (i = extra + 1; i < num_levels; i++) {
-	pyr->imgs[i] = img_new((n >> (i - extra)), (n >> (i - extra)));
-	pyr->imgs[i]->origin = v2_scale(1.0 / (1 << (i - extra)), img->origin);
+    /* Resample the smaller images, each from the one above, averaging
+     * 2x2 blocks of valid pixels */
+    prev = img2pimg(pyr->imgs[extra], 3, 1);
 
-	for (y = 0; y < (n >> (i - extra)); y++) {
-	    for (x = 0; x < (n >> (i - extra)); x++) {
-		color_t p;
-
-		int xmin = (x << 1);
-		int ymin = (y << 1);
-
-		if (img_region_is_valid(pyr->imgs[i-1], xmin, xmin + 1, 
-                                        ymin, ymin + 1)) {
-		    img_get_pixel_square(pyr->imgs[i-1], 
-                                         x << 1, y << 1, pxls);
-		    
-		    p.r = (pxls[0]->r + pxls[1]->r + pxls[2]->r + pxls[3]->r) >> 2;
-		    p.g = (pxls[0]->g + pxls[1]->g + pxls[2]->g + pxls[3]->g) >> 2;
-		    p.b = (pxls[0]->b + pxls[1]->b + pxls[2]->b + pxls[3]->b) >> 2;
-		    
-		    img_set_pixel(pyr->imgs[i], x, y, p.r, p.g, p.b);
+    for (i = extra + 1; i < num_levels; i++) {
+	int size = (n >> (i - extra));
+	pimg_t *curr = pimg_new(size, size, 3, 1);
+
+	for (y = 0; y < size; y++) {
+	    const u_int8_t *m0 = prev->mask + (size_t) (2 * y) * prev->stride;
+	    const u_int8_t *m1 = m0 + prev->stride;
+	    u_int8_t *mask = curr->mask + (size_t) y * curr->stride;
+
+	    for (c = 0; c < 3; c++) {
+		const float *r0 = pimg_row(prev, c, 2 * y);
+		const float *r1 = pimg_row(prev, c, 2 * y + 1);
+		float *row = pimg_row(curr, c, y);
+
+		for (x = 0; x < size; x++) {
+		    int xmin = (x << 1);
+
+		    if (m0[xmin] && m0[xmin + 1] && m1[xmin] && m1[xmin + 1]) {
+			/* The channels are whole numbers, so this matches
+			 * the integer average */
+			row[x] = (float) floor(0.25 * (r0[xmin] + r0[xmin + 1] +
+						       r1[xmin] + r1[xmin + 1]));
+			mask[x] = 1;
+		    }
 		}
 	    }
 	}
+
+	pyr->imgs[i] = pimg2img(curr);
+	pyr->imgs[i]->origin = v2_scale(1.0 / (1 << (i - extra)), img->origin);
+
+	pimg_free(prev);
+	prev = curr;
     }
 
+    pimg_free(prev);
+
 #if 1
     for (i = 0; i < num_levels; i++) {
 	img_t *img_tmp = pyr->imgs[i];
@@ -30,8 +30,8 @@ extern "C" {
 #include "vector.h"
 
 typedef struct {
-    u_int16_t num_levels;  /* Number of levels of the pyramid */
-    u_int16_t w, h;        /* Width and height of the bottom of the pyramid */
+    int num_levels;        /* Number of levels of the pyramid */
+    int w, h;              /* Width and height of the bottom of the pyramid */
     img_t **imgs;          /* Images in the pyramid */
 } img_pyr_t;
 
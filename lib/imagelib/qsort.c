@@ -24,6 +24,7 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "defines.h"
 #include "qsort.h"
 
 typedef enum {
@@ -31,7 +32,8 @@ typedef enum {
     QSORT_DESCENDING
 } qsort_order_t;
 
-static qsort_order_t qsort_order = QSORT_DESCENDING;
+/* Per thread, since callers set the order and then sort */
+static THREAD_LOCAL qsort_order_t qsort_order = QSORT_DESCENDING;
 
 /* Set whether we should sort in ascending or descending order */
 void qsort_ascending() 
@@ -0,0 +1,275 @@
+/*
+ *  Copyright (c) 2008  Noah Snavely (snavely (at) cs.washington.edu)
+ *    and the University of Washington
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+/* ransac.c */
+/* Generic RANSAC loop shared by the robust estimators */
+
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ransac.h"
+
+/* Give up on drawing a sample after this many rejected draws */
+#define RANSAC_MAX_REDRAWS 1000
+
+void ransac_rng_seed(ransac_rng_t *rng, unsigned int seed)
+{
+    /* xorshift state must be non-zero */
+    rng->state = (seed != 0) ? seed : RANSAC_DEFAULT_SEED;
+}
+
+int ransac_rng_uniform(ransac_rng_t *rng, int n)
+{
+    /* xorshift32 */
+    unsigned int x = rng->state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    rng->state = x;
+
+    return (int) (x % (unsigned int) n);
+}
+
+void ransac_params_init(ransac_params_t *params, int num_pts,
+                        int sample_size, int model_size, int max_models)
+{
+    memset(params, 0, sizeof(ransac_params_t));
+
+    params->num_pts = num_pts;
+    params->sample_size = sample_size;
+    params->model_size = model_size;
+    params->max_models = max_models;
+
+    params->max_rounds = 1024;
+    params->confidence = RANSAC_DEFAULT_CONFIDENCE;
+    params->success_ratio = 1.0;
+    params->pre_verify = RANSAC_DEFAULT_PRE_VERIFY;
+    params->seed = RANSAC_DEFAULT_SEED;
+}
+
+/* Returns the number of samples needed to draw an all-inlier sample
+ * (that also passes the T(d,d) test) with the given confidence */
+static int rounds_needed(double confidence, double inlier_ratio,
+                         int m, int d, int max_rounds)
+{
+    double p_good = pow(inlier_ratio, m + d);
+    double log_miss = log1p(-p_good);
+    double k;
+
+    if (p_good >= 1.0)
+        return 1;
+
+    /* A tiny p_good underflows log(1 - p_good) to zero */
+    if (!(log_miss < 0.0))
+        return max_rounds;
+
+    k = log(1.0 - confidence) / log_miss;
+
+    if (k >= max_rounds)
+        return max_rounds;
+
+    return (int) ceil(k);
+}
+
+/* Draw a minimal sample uniformly.  Returns 0 if no valid sample was
+ * found */
+static int draw_sample(const ransac_params_t *params, ransac_rng_t *rng,
+                       int *sample)
+{
+    int m = params->sample_size;
+    int i, j, redraws = 0;
+
+    for (i = 0; i < m; i++) {
+        int idx = ransac_rng_uniform(rng, params->num_pts);
+        int ok = 1;
+
+        for (j = 0; j < i; j++) {
+            if (sample[j] == idx) {
+                ok = 0;
+                break;
+            }
+        }
+
+        if (ok && params->compatible != NULL)
+            ok = params->compatible(sample, i, idx, params->data);
+
+        if (!ok) {
+            if (++redraws >= RANSAC_MAX_REDRAWS)
+                return 0;
+
+            i--;
+            continue;
+        }
+
+        sample[i] = idx;
+    }
+
+    return 1;
+}
+
+/* T(d,d) test: a model survives only if d random correspondences are
+ * all inliers, so most bad models are rejected after d residuals */
+static int pre_verify(const ransac_params_t *params, ransac_rng_t *rng,
+                      const double *model)
+{
+    int i;
+
+    for (i = 0; i < params->pre_verify; i++) {
+        int idx = ransac_rng_uniform(rng, params->num_pts);
+        if (!(params->residual(model, idx, params->data) < params->threshold))
+            return 0;
+    }
+
+    return 1;
+}
+
+int ransac_estimate(const ransac_params_t *params, double *model_best,
+                    ransac_result_t *result)
+{
+    int num_pts = params->num_pts;
+    int m = params->sample_size;
+
+    int *sample;
+    double *models;
+    double *resid = NULL;
+
+    ransac_rng_t rng;
+
+    int round, max_rounds = params->max_rounds;
+    int best_inliers = 0, num_rejected = 0;
+    double best_error = DBL_MAX;
+
+    if (num_pts < m) {
+        printf("[ransac_estimate] Error: need at least %d correspondences\n",
+               m);
+        return 0;
+    }
+
+    sample = (int *) malloc(sizeof(int) * m);
+    models = (double *)
+        malloc(sizeof(double) * params->model_size * params->max_models);
+
+    if (params->residuals != NULL)
+        resid = (double *) 
+            malloc(sizeof(double) * num_pts * params->max_models);
+
+    ransac_rng_seed(&rng, params->seed);
+
+    for (round = 0; round < max_rounds; round++) {
+        int num_models, num_kept, i, j;
+
+        if (!draw_sample(params, &rng, sample))
+            continue;
+
+        num_models = params->fit(sample, models, params->data);
+
+        /* Pre-test the models, packing the survivors to the front */
+        num_kept = 0;
+        for (i = 0; i < num_models; i++) {
+            double *model = models + i * params->model_size;
+
+            if (!pre_verify(params, &rng, model)) {
+                num_rejected++;
+                continue;
+            }
+
+            if (i != num_kept) {
+                memcpy(models + num_kept * params->model_size, model,
+                       sizeof(double) * params->model_size);
+            }
+
+            num_kept++;
+        }
+
+        if (num_kept > 0 && params->residuals != NULL)
+            params->residuals(models, num_kept, resid, params->data);
+
+        for (i = 0; i < num_kept; i++) {
+            const double *model = models + i * params->model_size;
+            int num_inliers = 0;
+            double error = 0.0;
+
+            if (params->residuals != NULL) {
+                const double *r = resid + i * num_pts;
+
+                for (j = 0; j < num_pts; j++) {
+                    if (r[j] < params->threshold) {
+                        num_inliers++;
+                        error += r[j];
+                    }
+                }
+            } else {
+                for (j = 0; j < num_pts; j++) {
+                    double r = params->residual(model, j, params->data);
+
+                    if (r < params->threshold) {
+                        num_inliers++;
+                        error += r;
+                    } else if (num_inliers + num_pts - j - 1 < 
+                               best_inliers) {
+                        /* Can't beat the best model any more */
+                        break;
+                    }
+                }
+
+                if (j < num_pts)
+                    continue;
+            }
+
+            if (num_inliers > best_inliers ||
+                (num_inliers == best_inliers && num_inliers > 0 &&
+                 error < best_error)) {
+                best_inliers = num_inliers;
+                best_error = error;
+                memcpy(model_best, model,
+                       sizeof(double) * params->model_size);
+
+                if (params->confidence > 0.0) {
+                    int needed =
+                        rounds_needed(params->confidence,
+                                      (double) best_inliers / num_pts,
+                                      m, params->pre_verify,
+                                      params->max_rounds);
+                    if (needed < max_rounds)
+                        max_rounds = needed;
+                }
+            }
+        }
+
+        if ((double) best_inliers / num_pts > params->success_ratio) {
+            round++;
+            break;
+        }
+    }
+
+    if (result != NULL) {
+        result->num_inliers = best_inliers;
+        result->error = best_error;
+        result->num_rounds = round;
+        result->num_rejected = num_rejected;
+    }
+
+    free(sample);
+    free(models);
+
+    if (resid != NULL)
+        free(resid);
+
+    return best_inliers;
+}
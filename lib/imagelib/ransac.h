@@ -0,0 +1,111 @@
+/*
+ *  Copyright (c) 2008  Noah Snavely (snavely (at) cs.washington.edu)
+ *    and the University of Washington
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+/* ransac.h */
+/* Generic RANSAC loop shared by the robust estimators */
+
+#ifndef __ransac_h__
+#define __ransac_h__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define RANSAC_DEFAULT_CONFIDENCE 0.9999
+#define RANSAC_DEFAULT_PRE_VERIFY 1
+#define RANSAC_DEFAULT_SEED 0x2545f491
+
+/* Random number state owned by a single RANSAC call, so that
+ * concurrent calls don't share (or race on) the global rand() */
+typedef struct {
+    unsigned int state;
+} ransac_rng_t;
+
+/* Seed a generator (any seed is allowed) */
+void ransac_rng_seed(ransac_rng_t *rng, unsigned int seed);
+
+/* Returns a random integer in [0, n) */
+int ransac_rng_uniform(ransac_rng_t *rng, int n);
+
+/* Fit up to max_models models to the given minimal sample, writing
+ * them consecutively to models.  Returns the number of models (0 if
+ * the sample is degenerate) */
+typedef int (*ransac_fit_fn)(const int *sample, double *models, void *data);
+
+/* Residual of correspondence idx under a model.  The correspondence
+ * is an inlier if the residual is below the threshold */
+typedef double (*ransac_residual_fn)(const double *model, int idx,
+                                     void *data);
+
+/* Residuals of all correspondences under each of num_models models
+ * (stored consecutively), written as num_models rows of resid.  An
+ * optional batched alternative to ransac_residual_fn for estimators
+ * with vectorized scoring */
+typedef void (*ransac_residuals_fn)(const double *models, int num_models,
+                                    double *resid, void *data);
+
+/* Returns 0 if correspondence idx can't join the first num_sampled
+ * entries of a sample (e.g., because it duplicates one of them) */
+typedef int (*ransac_compatible_fn)(const int *sample, int num_sampled,
+                                    int idx, void *data);
+
+typedef struct {
+    int num_pts;              /* Number of correspondences */
+    int sample_size;          /* Size of a minimal sample */
+    int model_size;           /* Number of doubles in a model */
+    int max_models;           /* Max models fit to one sample */
+
+    int max_rounds;           /* Upper bound on the number of samples */
+    double threshold;         /* Inlier threshold on the residual */
+    double confidence;        /* Stop once a better model would have been
+                               * found with this probability (0 to
+                               * disable) */
+    double success_ratio;     /* Stop once this fraction of the
+                               * correspondences are inliers */
+    int pre_verify;           /* Depth d of the T(d,d) pre-test (0 to
+                               * disable) */
+
+    unsigned int seed;        /* Seed for the sampler */
+
+    ransac_fit_fn fit;
+    ransac_residual_fn residual;
+    ransac_residuals_fn residuals;     /* May be NULL */
+    ransac_compatible_fn compatible;   /* May be NULL */
+    void *data;               /* Passed to the callbacks */
+} ransac_params_t;
+
+typedef struct {
+    int num_inliers;          /* Inliers to the best model */
+    double error;             /* Sum of the inlier residuals */
+    int num_rounds;           /* Samples drawn */
+    int num_rejected;         /* Models rejected by the pre-test */
+} ransac_result_t;
+
+/* Fill in default parameters for a problem with the given sizes */
+void ransac_params_init(ransac_params_t *params, int num_pts,
+                        int sample_size, int model_size, int max_models);
+
+/* Run RANSAC.  The model with the most inliers (ties broken by the
+ * smaller inlier error) is written to model_best.  Returns the number
+ * of inliers, or 0 if no model was found */
+int ransac_estimate(const ransac_params_t *params, double *model_best,
+                    ransac_result_t *result);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __ransac_h__ */
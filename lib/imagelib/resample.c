@@ -18,13 +18,22 @@
 /* Contains routines for resampling an image given some transformation */
 
 #include <math.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 #include <float.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "bmp.h"
+#include "defines.h"
 #include "image.h"
 #include "lerp.h"
+#include "planar.h"
+#include "resample.h"
 #include "transform.h"
 #include "util.h"
 #include "vector.h"
@@ -43,6 +52,35 @@ void set_resample_background(int r, int g, int b) {
 }
 
 
+/* Set pixel (x, y) of out to the rounded color c and mark it valid */
+static void resample_set_pixel(img_t *out, int x, int y, fcolor_t c) {
+    size_t idx = (size_t) y * out->w + x;
+    color_t *p = out->pixels + idx;
+
+    p->r = (u_int8_t) iround(c.r);
+    p->g = (u_int8_t) iround(c.g);
+    p->b = (u_int8_t) iround(c.b);
+    p->extra = 0;
+
+    out->pixel_mask[idx >> 3] |= (u_int8_t) (1 << (idx & 7));
+}
+
+/* Set pixel (x, y) of out to a bilinear sample of src at (xs, ys),
+ * rounded as pixel_lerp's result would be, and mark it valid */
+static void resample_lerp_pixel(img_t *out, int x, int y, 
+                                const pimg_t *src, double xs, double ys) {
+    double c[3];
+    fcolor_t col;
+
+    pimg_lerp(src, xs, ys, c);
+
+    col.r = (float) c[0];
+    col.g = (float) c[1];
+    col.b = (float) c[2];
+
+    resample_set_pixel(out, x, y, col);
+}
+
 /* Use linear interpolation to compute the intensity of the point (x,y) 
  * in the given image */
 double pixel_lerp_intensity(img_t *img, double x, double y) {
@@ -288,6 +326,147 @@ fcolor_t pixel_lerp(img_t *img, double x, double y) {
     return col;
 }
 
+/* Fewest samples worth spreading over several threads */
+#define LERP_BATCH_PARALLEL_MIN 4096
+
+/* Bilinearly sample img at (x, y), clamping to the border.  The
+ * arithmetic is that of pixel_lerp, so the results are identical */
+static void lerp_batch_point(const img_t *img, double x, double y,
+                             fcolor_t *out) {
+    int w = img->w, h = img->h;
+    int xf, yf, x0, x1;
+    size_t r0, r1;
+    double xp, yp;
+    const color_t *p00, *p01, *p10, *p11;
+
+    /* Samples further out than one pixel past the border are the same
+     * as those on it; clamping keeps the conversions to int in range
+     * (DistortPoint flags points behind the camera with -DBL_MAX) */
+    if (x < -1.0)
+        x = -1.0;
+    else if (x > w)
+        x = w;
+
+    if (y < -1.0)
+        y = -1.0;
+    else if (y > h)
+        y = h;
+
+    /* floor, without the library call */
+    xf = (int) x;
+    yf = (int) y;
+    xf -= (xf > x);
+    yf -= (yf > y);
+
+    xp = x - xf;
+    yp = y - yf;
+
+    x0 = (xf < 0) ? 0 : ((xf >= w) ? w - 1 : xf);
+    x1 = (xf + 1 < 0) ? 0 : ((xf + 1 >= w) ? w - 1 : xf + 1);
+    r0 = (size_t) ((yf < 0) ? 0 : ((yf >= h) ? h - 1 : yf)) * w;
+    r1 = (size_t) ((yf + 1 < 0) ? 0 : ((yf + 1 >= h) ? h - 1 : yf + 1)) * w;
+
+    p00 = img->pixels + r0 + x0;
+    p01 = img->pixels + r0 + x1;
+    p10 = img->pixels + r1 + x0;
+    p11 = img->pixels + r1 + x1;
+
+#ifdef __SSE2__
+    {
+        const __m128i zero = _mm_setzero_si128();
+        int v00, v01, v10, v11;
+        __m128i top, bot, t0, t1, b0, b1;
+        __m128d ax, bx, ay, by, rg, be;
+        double c[4];
+
+        /* Gather the four pixels, widening the bytes to 32 bits; one
+         * color_t fills one int */
+        memcpy(&v00, p00, sizeof(int));
+        memcpy(&v01, p01, sizeof(int));
+        memcpy(&v10, p10, sizeof(int));
+        memcpy(&v11, p11, sizeof(int));
+
+        top = _mm_unpacklo_epi8(_mm_unpacklo_epi32(_mm_cvtsi32_si128(v00), 
+                                                   _mm_cvtsi32_si128(v01)), 
+                                zero);
+        bot = _mm_unpacklo_epi8(_mm_unpacklo_epi32(_mm_cvtsi32_si128(v10), 
+                                                   _mm_cvtsi32_si128(v11)), 
+                                zero);
+
+        t0 = _mm_unpacklo_epi16(top, zero);
+        t1 = _mm_unpackhi_epi16(top, zero);
+        b0 = _mm_unpacklo_epi16(bot, zero);
+        b1 = _mm_unpackhi_epi16(bot, zero);
+
+        ax = _mm_set1_pd(1.0 - xp);
+        bx = _mm_set1_pd(xp);
+        ay = _mm_set1_pd(1.0 - yp);
+        by = _mm_set1_pd(yp);
+
+        /* LERP on (r, g), then on (b, extra) */
+#define LERP_PD(f0, f1, f2, f3)                                         \
+        _mm_add_pd(_mm_mul_pd(ay, _mm_add_pd(_mm_mul_pd(ax, f0),        \
+                                             _mm_mul_pd(bx, f1))),      \
+                   _mm_mul_pd(by, _mm_add_pd(_mm_mul_pd(ax, f2),        \
+                                             _mm_mul_pd(bx, f3))))
+#define HI_PD(v) _mm_cvtepi32_pd(_mm_shuffle_epi32(v, _MM_SHUFFLE(3, 2, 3, 2)))
+
+        rg = LERP_PD(_mm_cvtepi32_pd(t0), _mm_cvtepi32_pd(t1),
+                     _mm_cvtepi32_pd(b0), _mm_cvtepi32_pd(b1));
+        be = LERP_PD(HI_PD(t0), HI_PD(t1), HI_PD(b0), HI_PD(b1));
+
+#undef HI_PD
+#undef LERP_PD
+
+        _mm_storeu_pd(c, rg);
+        _mm_storeu_pd(c + 2, be);
+
+        out->r = (float) c[0];
+        out->g = (float) c[1];
+        out->b = (float) c[2];
+    }
+#else
+    out->r = (float) LERP(xp, yp, p00->r, p01->r, p10->r, p11->r);
+    out->g = (float) LERP(xp, yp, p00->g, p01->g, p10->g, p11->g);
+    out->b = (float) LERP(xp, yp, p00->b, p01->b, p10->b, p11->b);
+#endif
+}
+
+void img_lerp_batch(const img_t *img, int n, 
+                    const double *xs, const double *ys, fcolor_t *out) {
+    int i;
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) if (n >= LERP_BATCH_PARALLEL_MIN)
+#endif
+    for (i = 0; i < n; i++)
+        lerp_batch_point(img, xs[i], ys[i], out + i);
+}
+
+void img_lerp_batch_radial(const img_t *img, int n, 
+                           const double *xs, const double *ys,
+                           double f, double k1, double k2, 
+                           fcolor_t *out, u_int8_t *in_range) {
+    int i, w = img->w, h = img->h;
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) if (n >= LERP_BATCH_PARALLEL_MIN)
+#endif
+    for (i = 0; i < n; i++) {
+        double xf = (xs[i] - 0.5 * w) / f;
+        double yf = (ys[i] - 0.5 * h) / f;
+        double rsq = xf * xf + yf * yf;
+
+        double xt = f * (xf * (1.0 + rsq * (k1 + rsq * k2))) + 0.5 * w;
+        double yt = f * (yf * (1.0 + rsq * (k1 + rsq * k2))) + 0.5 * h;
+
+        if (in_range != NULL)
+            in_range[i] = !(xt < 0.0 || yt < 0.0 || xt > w - 1 || yt > h - 1);
+
+        lerp_batch_point(img, xt, yt, out + i);
+    }
+}
+
 /* Compute the pixel that would be at location (x, y) if the given
  * image were transformed with the inverse of the given transform */
 fcolor_t pixel_transform(img_t *img, trans2D_t *Tinv, int x, int y) {
@@ -315,46 +494,41 @@ img_t *img_resample(img_t *img, trans2D_t *T) {
     int x, y;
     trans2D_t *Tinv = transform_invert(T);
     img_t *Timg = img_new(w, h);
+    double *xs = malloc(sizeof(double) * w);
+    double *ys = malloc(sizeof(double) * w);
+    fcolor_t *row = malloc(sizeof(fcolor_t) * w);
 
     for (y = 0; y < h; y++) {
-        for (x = 0; x < w; x++) {
-            double Tp[2];
-	    fcolor_t c;
+        /* Invert the points (x, y) of the row */
+        for (x = 0; x < w; x++)
+            transform_point(Tinv, x, y, xs + x, ys + x);
 
-            /* Invert the point (x, y) */
-            transform_point(Tinv, x, y, &Tp[0], &Tp[1]);
-            
-#if 1
+        /* Apply bilinear interpolation */
+        img_lerp_batch(img, w, xs, ys, row);
+
+        for (x = 0; x < w; x++) {
             /* Check if the result is in range */
-            if (Tp[0] < 0.0 || Tp[1] < 0.0 || Tp[0] > w - 1 || Tp[1] > h - 1) {
+            if (xs[x] < 0.0 || ys[x] < 0.0 || xs[x] > w - 1 || ys[x] > h - 1) {
                 img_set_pixel(Timg, x, y, 
 			      background_color.r, background_color.g, background_color.b);
 
                 /* img_nullify_pixel(Timg, x, y); */
             } else {
-                /* Apply bilinear interpolation */
-                c = pixel_lerp(img, Tp[0], Tp[1]);
-                img_set_pixel(Timg, x, y, iround(c.r), iround(c.g), iround(c.b));
+                resample_set_pixel(Timg, x, y, row[x]);
             }
-#else
-	    if (Tp[0] < 0.0) Tp[0] = 0.0;
-	    else if (Tp[0] > w - 1) Tp[0] = w - 1;
-	    if (Tp[1] < 0.0) Tp[1] = 0.0;
-	    else if (Tp[1] > h - 1) Tp[1] = h - 1;
-
-	    c = pixel_lerp(img, Tp[0], Tp[1]);
-	    img_set_pixel(Timg, x, y, (int) rint(c.r), (int) rint(c.g), (int) rint(c.b));
-#endif
         }
     }
 
+    free(xs);
+    free(ys);
+    free(row);
+    transform_free(Tinv);
+
     return Timg;
 }
 
-/* Create a new image by applying transformation T to img and 
- * resampling.  Resize the image so that the whole thing fits when
- * transformed. */
-img_t *img_resample_bbox(img_t *img, trans2D_t *T) {
+/* As img_resample_bbox, sampling a planar RGB image */
+img_t *pimg_resample_bbox(pimg_t *img, trans2D_t *T) {
     int w = img->w, h = img->h;
     int x, y;
     trans2D_t *Tinv = transform_invert(T);
@@ -393,7 +567,6 @@ img_t *img_resample_bbox(img_t *img, trans2D_t *T) {
     for (y = 0; y < h_new; y++) {
         for (x = 0; x < w_new; x++) {
             double Tp[2];
-	    fcolor_t c;
 
             /* Invert the point (x, y) - trans */
             transform_point(Tinv, x + Vx(origin), y + Vy(origin), &Tp[0], &Tp[1]);
@@ -412,20 +585,23 @@ img_t *img_resample_bbox(img_t *img, trans2D_t *T) {
 		int y_f = (int) (Tp[1] - Vy(img->origin));
 		int y_c = y_f + 1;
 
-		if (img_pixel_is_valid(img, x_f, y_f) ||
-		    img_pixel_is_valid(img, x_c, y_f) ||
-		    img_pixel_is_valid(img, x_f, y_c) ||
-		    img_pixel_is_valid(img, x_c, y_c)) {
+		if (pimg_is_valid(img, x_f, y_f) ||
+		    pimg_is_valid(img, x_c, y_f) ||
+		    pimg_is_valid(img, x_f, y_c) ||
+		    pimg_is_valid(img, x_c, y_c)) {
 
 		    /* Apply bilinear interpolation */
-		    c = pixel_lerp(img, Tp[0] - Vx(img->origin), Tp[1] - Vy(img->origin));
-		    img_set_pixel(Timg, x, y, iround(c.r), iround(c.g), iround(c.b));
+		    resample_lerp_pixel(Timg, x, y, img, 
+                                        Tp[0] - Vx(img->origin), 
+                                        Tp[1] - Vy(img->origin));
 		} else {
 		    // img_nullify_pixel(Timg, x, y);
 		}
 		
             }
 #else
+	    fcolor_t c;
+
 	    if (Tp[0] < 0.0) Tp[0] = 0.0;
 	    else if (Tp[0] > w - 1) Tp[0] = w - 1;
 	    if (Tp[1] < 0.0) Tp[1] = 0.0;
@@ -444,9 +620,25 @@ img_t *img_resample_bbox(img_t *img, trans2D_t *T) {
     return Timg;
 }
 
+/* Create a new image by applying transformation T to img and 
+ * resampling.  Resize the image so that the whole thing fits when
+ * transformed. */
+img_t *img_resample_bbox(img_t *img, trans2D_t *T) {
+    pimg_t *src = img2pimg(img, 3, 1);
+    img_t *Timg = pimg_resample_bbox(src, T);
+
+    pimg_free(src);
+
+    return Timg;
+}
+
 img_t *img_fix_radial_distortion(img_t *img, double k1, double k2, double f) {
     int x, y, w = img->w, h = img->h;
     img_t *Timg = img_new(w, h);
+    double *xs = malloc(sizeof(double) * w);
+    double *ys = malloc(sizeof(double) * w);
+    fcolor_t *row = malloc(sizeof(fcolor_t) * w);
+    u_int8_t *in_range = malloc(w);
 
     /* Map each pixel to 
      *       x = x' / (1 + k1 * r^2 + k2 * r^4) 
@@ -454,32 +646,196 @@ img_t *img_fix_radial_distortion(img_t *img, double k1, double k2, double f) {
 
     for (y = 0; y < h; y++) {
 	for (x = 0; x < w; x++) {
-	    double xf = ((double) x - 0.5 * img->w) / f;
-	    double yf = ((double) y - 0.5 * img->h) / f;
-	    double rsq = xf * xf + yf * yf;
-	    
-	    double xt = xf * (1.0 + rsq * (k1 + rsq * k2));
-	    double yt = yf * (1.0 + rsq * (k1 + rsq * k2));
-
-	    fcolor_t c;
+	    xs[x] = x;
+	    ys[x] = y;
+	}
 
-	    xt = f * xt + 0.5 * img->w;
-	    yt = f * yt + 0.5 * img->h;
+	img_lerp_batch_radial(img, w, xs, ys, f, k1, k2, row, in_range);
 
-            if (xt < 0.0 || yt < 0.0 || xt > w - 1 || yt > h - 1) {
+	for (x = 0; x < w; x++) {
+            if (!in_range[x]) {
                 img_set_pixel(Timg, x, y, 
 			      background_color.r, background_color.g, background_color.b);
 	    } else {
-		c = pixel_lerp(img, xt, yt);
-                img_set_pixel(Timg, x, y, iround(c.r), iround(c.g), iround(c.b));
+		resample_set_pixel(Timg, x, y, row[x]);
 	    }
 	}
     }
 
+    free(xs);
+    free(ys);
+    free(row);
+    free(in_range);
+
     return Timg;
 }
 
 
+/* Width of the column tiles used by img_remap_rows; a tile of
+ * output pixels reads a compact region of the source image */
+#define REMAP_TILE_COLS 256
+
+img_remap_t *img_remap_new(int w, int h, int src_w, int src_h) {
+    img_remap_t *map = malloc(sizeof(img_remap_t));
+
+    map->w = w;
+    map->h = h;
+    map->src_w = src_w;
+    map->src_h = src_h;
+    map->entries = malloc(sizeof(remap_entry_t) * w * h);
+
+    return map;
+}
+
+void img_remap_free(img_remap_t *map) {
+    free(map->entries);
+    free(map);
+}
+
+void img_remap_set(img_remap_t *map, int x, int y, double xs, double ys) {
+    remap_entry_t *e = map->entries + y * map->w + x;
+
+    if (xs >= 0.0 && xs < map->src_w - 1 && ys >= 0.0 && ys < map->src_h - 1) {
+        int xf = (int) xs, yf = (int) ys;
+
+        e->offset = yf * map->src_w + xf;
+        e->fx = (float) (xs - xf);
+        e->fy = (float) (ys - yf);
+    } else {
+        e->offset = -1;
+        e->fx = e->fy = 0.0f;
+    }
+}
+
+img_remap_t *img_remap_radial_distortion(int w, int h, 
+                                         double f, double k1, double k2) {
+    int x, y;
+    img_remap_t *map = img_remap_new(w, h, w, h);
+    double f2_inv = 1.0 / (f * f);
+
+    for (y = 0; y < h; y++) {
+        double y_c = y - 0.5 * h;
+
+        for (x = 0; x < w; x++) {
+            double x_c = x - 0.5 * w;
+            double rsq = (x_c * x_c + y_c * y_c) * f2_inv;
+            double factor = 1.0 + k1 * rsq + k2 * rsq * rsq;
+
+            img_remap_set(map, x, y, 
+                          x_c * factor + 0.5 * w, y_c * factor + 0.5 * h);
+        }
+    }
+
+    return map;
+}
+
+/* Bilinearly sample n consecutive output pixels */
+static void remap_span(const color_t *src, int src_w, 
+                       const remap_entry_t *e, color_t *dst, int n) {
+    int i;
+    
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128 half = _mm_set1_ps(0.5f);
+
+    for (i = 0; i < n; i++) {
+        const color_t *p;
+        __m128i top, bot, q;
+        __m128 p0, p1, p2, p3, fx, fy, t, b, c;
+        int rgb;
+
+        if (e[i].offset < 0) {
+            memset(dst + i, 0, sizeof(color_t));
+            continue;
+        }
+
+        /* Each color_t is 4 bytes, so one pixel fills one vector */
+        p = src + e[i].offset;
+        top = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) p), zero);
+        bot = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (p + src_w)), 
+                                zero);
+
+        p0 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(top, zero));
+        p1 = _mm_cvtepi32_ps(_mm_unpackhi_epi16(top, zero));
+        p2 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(bot, zero));
+        p3 = _mm_cvtepi32_ps(_mm_unpackhi_epi16(bot, zero));
+
+        fx = _mm_set1_ps(e[i].fx);
+        fy = _mm_set1_ps(e[i].fy);
+
+        t = _mm_add_ps(p0, _mm_mul_ps(fx, _mm_sub_ps(p1, p0)));
+        b = _mm_add_ps(p2, _mm_mul_ps(fx, _mm_sub_ps(p3, p2)));
+        c = _mm_add_ps(t, _mm_mul_ps(fy, _mm_sub_ps(b, t)));
+
+        /* Round, pack back to bytes and clear the extra channel */
+        q = _mm_cvttps_epi32(_mm_add_ps(c, half));
+        q = _mm_packs_epi32(q, q);
+        q = _mm_packus_epi16(q, q);
+
+        rgb = _mm_cvtsi128_si32(q);
+        memcpy(dst + i, &rgb, sizeof(color_t));
+        dst[i].extra = 0;
+    }
+#else
+    for (i = 0; i < n; i++) {
+        const color_t *p;
+        float fx, fy;
+
+        if (e[i].offset < 0) {
+            memset(dst + i, 0, sizeof(color_t));
+            continue;
+        }
+
+        p = src + e[i].offset;
+        fx = e[i].fx;
+        fy = e[i].fy;
+
+        dst[i].r = (u_int8_t) (LERP(fx, fy, p[0].r, p[1].r, 
+                                    p[src_w].r, p[src_w+1].r) + 0.5);
+        dst[i].g = (u_int8_t) (LERP(fx, fy, p[0].g, p[1].g, 
+                                    p[src_w].g, p[src_w+1].g) + 0.5);
+        dst[i].b = (u_int8_t) (LERP(fx, fy, p[0].b, p[1].b, 
+                                    p[src_w].b, p[src_w+1].b) + 0.5);
+        dst[i].extra = 0;
+    }
+#endif
+}
+
+void img_remap_rows(img_t *img, const img_remap_t *map, img_t *out,
+                    int y_start, int y_end) {
+    int x, y;
+
+    if (img->w != map->src_w || img->h != map->src_h || 
+        out->w != map->w || out->h != map->h) {
+        printf("[img_remap_rows] Error: image dimensions (%d, %d) -> "
+               "(%d, %d) don't match the remap table\n", 
+               img->w, img->h, out->w, out->h);
+        return;
+    }
+
+    for (x = 0; x < map->w; x += REMAP_TILE_COLS) {
+        int n = MIN(REMAP_TILE_COLS, map->w - x);
+
+        for (y = y_start; y < y_end; y++) {
+            remap_span(img->pixels, img->w, map->entries + y * map->w + x,
+                       out->pixels + y * out->w + x, n);
+        }
+    }
+}
+
+img_t *img_remap(img_t *img, const img_remap_t *map) {
+    int num_pixels = map->w * map->h;
+    img_t *out = img_new(map->w, map->h);
+
+    img_remap_rows(img, map, out, 0, map->h);
+
+    /* Every pixel has been written */
+    memset(out->pixel_mask, 0xff, (num_pixels + 7) / 8);
+
+    return out;
+}
+
+
 #define MAX_TRIES 256
 void img_sample_random_pt(img_t *img, trans2D_t *Tinv, img_t *img_old, int nhood_radius, 
 			  int *xout, int *yout, double grad_threshold) 
@@ -24,6 +24,7 @@ extern "C" {
 #include "bmp.h"
 #include "color.h"
 #include "image.h"
+#include "planar.h"
 #include "transform.h"
 
 /* Set the background color for unmapped pixels in resampled images */
@@ -37,6 +38,25 @@ fcolor_t pixel_lerp(img_t *img, double x, double y);
  * in the given image */
 double pixel_lerp_intensity(img_t *img, double x, double y);
 
+/* Use linear interpolation to compute the colors of the n points
+ * (xs[i], ys[i]) in the given image, storing them in out.  The results
+ * are the same as calling pixel_lerp on each point.  Bilinear samples
+ * are taken from the packed pixels, where one load fetches all three
+ * channels; this is faster than sampling a planar copy, even without
+ * counting the conversion */
+void img_lerp_batch(const img_t *img, int n,
+                    const double *xs, const double *ys, fcolor_t *out);
+
+/* As img_lerp_batch, first mapping each point through the radial
+ * distortion (k1, k2) with focal length f, about the center of the
+ * image (the mapping used by img_fix_radial_distortion).  If in_range
+ * is not NULL, in_range[i] is set to 1 if point i lands inside the
+ * image, and 0 otherwise */
+void img_lerp_batch_radial(const img_t *img, int n,
+                           const double *xs, const double *ys,
+                           double f, double k1, double k2,
+                           fcolor_t *out, u_int8_t *in_range);
+
 /* Compute the pixel that would be at location (x, y) if the given
  * image were transformed with the inverse of the given transform */
 fcolor_t pixel_transform(img_t *img, trans2D_t *Tinv, int x, int y);
@@ -48,11 +68,54 @@ img_t *img_resample(img_t *img, trans2D_t *T);
 /* Correct the radial distortion in an image */
 img_t *img_fix_radial_distortion(img_t *img, double k1, double k2, double f);
 
+/* Precomputed lookup table mapping each pixel of an output image to
+ * a bilinear sample of a source image */
+typedef struct {
+    int offset;      /* Index of the top-left source pixel, or -1 if
+                      * the pixel maps outside the source image */
+    float fx, fy;    /* Bilinear weights */
+} remap_entry_t;
+
+typedef struct {
+    int w, h;                  /* Dimensions of the output image */
+    int src_w, src_h;          /* Dimensions of the source image */
+    remap_entry_t *entries;    /* w * h entries, row major */
+} img_remap_t;
+
+/* Create / free a remap table */
+img_remap_t *img_remap_new(int w, int h, int src_w, int src_h);
+void img_remap_free(img_remap_t *map);
+
+/* Set the entry for output pixel (x, y) to sample the source image
+ * at (xs, ys) */
+void img_remap_set(img_remap_t *map, int x, int y, double xs, double ys);
+
+/* Create the remap table that removes radial distortion with
+ * parameters (k1, k2) and focal length f from a w x h image (the same
+ * mapping as img_fix_radial_distortion) */
+img_remap_t *img_remap_radial_distortion(int w, int h, 
+                                         double f, double k1, double k2);
+
+/* Resample rows [y_start, y_end) of the output image through the
+ * remap table.  Pixels that map outside of the source image are set
+ * to black.  Only pixel data is written; the pixel mask is left
+ * untouched so that disjoint row ranges can be filled concurrently */
+void img_remap_rows(img_t *img, const img_remap_t *map, img_t *out,
+                    int y_start, int y_end);
+
+/* Resample a whole image through the remap table, returning a new
+ * image with all pixels marked valid */
+img_t *img_remap(img_t *img, const img_remap_t *map);
+
 /* Create a new image by applying transformation T to img and 
  * resampling.  Resize the image so that the whole thing fits when
  * transformed */
 img_t *img_resample_bbox(img_t *img, trans2D_t *T);
 
+/* As img_resample_bbox, sampling a planar RGB image (pixels outside
+ * its mask, if it has one, are left out) */
+img_t *pimg_resample_bbox(pimg_t *img, trans2D_t *T);
+
 /* Returns true if the image becomes disconnected under the given
  * homography */
 int img_disconnected_under_homography(img_t *img, double *H);
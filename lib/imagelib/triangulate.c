@@ -17,18 +17,19 @@
 /* triangulate.c */
 /* Triangulate two image points */
 
+#include <float.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "defines.h"
+#include "lm.h"
 #include "matrix.h"
+#include "ransac.h"
 #include "triangulate.h"
 #include "vector.h"
 
-static v2_t global_p, global_q;
-static double *global_R0, *global_t0, *global_R1, *global_t1;
-
 void quick_svd(double *E, double *U, double *S, double *VT) {
     double e1[3] = { E[0], E[3], E[6] };
     double e2[3] = { E[1], E[4], E[7] };
@@ -93,39 +94,57 @@ v2_t project(double *R, double *t0, double *P) {
     return result;
 }
 
-void triangulation_residual(const int *m, const int *n, double *x, 
-			    double *fvec, double *iflag) 
+/* Views of a point being triangulated, for lm_solve */
+typedef struct {
+    const v2_t *p;      /* Projection in each view */
+    const double *R;    /* Rotation of each view, 9 entries apiece */
+    const double *t;    /* Translation of each view, 3 entries apiece */
+} triangulate_data_t;
+
+/* Residual of the projection of x into view i, and its jacobian */
+static int triangulate_block(int i, const double *x, double *r, double *J,
+                             void *data)
 {
-    /* Project the point into the two views */
-    v2_t p = project(global_R0, global_t0, x);
-    v2_t q = project(global_R1, global_t1, x);
-    
-    fvec[0] = Vx(global_p) - Vx(p);
-    fvec[1] = Vy(global_p) - Vy(p);
-    fvec[2] = Vx(global_q) - Vx(q);
-    fvec[3] = Vy(global_q) - Vy(q);
-}
+    triangulate_data_t *views = (triangulate_data_t *) data;
+    const double *R = views->R + 9 * i;
+    const double *t = views->t + 3 * i;
+    double q[3], u, v;
+    int k;
+
+    q[0] = R[0] * x[0] + R[1] * x[1] + R[2] * x[2] + t[0];
+    q[1] = R[3] * x[0] + R[4] * x[1] + R[5] * x[2] + t[1];
+    q[2] = R[6] * x[0] + R[7] * x[1] + R[8] * x[2] + t[2];
+
+    u = q[0] / q[2];
+    v = q[1] / q[2];
+
+    r[0] = Vx(views->p[i]) - u;
+    r[1] = Vy(views->p[i]) - v;
+
+    if (J != NULL) {
+        /* d(q0 / q2) / dx = (R_0 - u R_2) / q2 */
+        for (k = 0; k < 3; k++) {
+            J[k] = -(R[k] - u * R[6 + k]) / q[2];
+            J[3 + k] = -(R[3 + k] - v * R[6 + k]) / q[2];
+        }
+    }
 
-static int global_num_points;
-static double *global_Rs = NULL;
-static double *global_ts = NULL;
-static v2_t *global_ps;
+    return 2;
+}
 
-void triangulate_n_residual(const int *m, const int *n, 
-			    double *x, double *fvec, double *iflag) 
+/* Polish the point x to minimize its squared projection error in
+ * num_points views */
+static void triangulate_polish(int num_points, const v2_t *p, 
+                               const double *R, const double *t, 
+                               double *x, double tol)
 {
-    int i;
+    triangulate_data_t views;
 
-    for (i = 0; i < global_num_points; i++) {
-	int Roff = 9 * i;
-	int toff = 3 * i;
+    views.p = p;
+    views.R = R;
+    views.t = t;
 
-	/* Project the point into the view */
-	v2_t p = project(global_Rs + Roff, global_ts + toff, x);
-    
-	fvec[2 * i + 0] = Vx(global_ps[i]) - Vx(p);
-	fvec[2 * i + 1] = Vy(global_ps[i]) - Vy(p);
-    }
+    lm_solve(triangulate_block, NULL, &views, num_points, 3, x, tol, 100);
 }
 
 
@@ -133,19 +152,13 @@ void triangulate_n_residual(const int *m, const int *n,
 v3_t triangulate_n_refine(v3_t pt, int num_points, 
 			  v2_t *p, double *R, double *t, double *error_out) 
 {
-    int num_eqs = 2 * num_points;
-    int num_vars = 3;
-
     double x[3] = { Vx(pt), Vy(pt), Vz(pt) };
     double error;
 
     int i;
 
     /* Run a non-linear optimization to polish the result */
-    global_num_points = num_points;
-    global_ps = p;
-    global_Rs = R;  global_ts = t;
-    lmdif_driver(triangulate_n_residual, num_eqs, num_vars, x, 1.0e-5);
+    triangulate_polish(num_points, p, R, t, x, 1.0e-5);
 
     error = 0.0;
     for (i = 0; i < num_points; i++) {
@@ -237,10 +250,7 @@ v3_t triangulate_n(int num_points,
     // printf("[triangulate_n] Error [before polishing]: %0.3e\n", error);
 
     /* Run a non-linear optimization to refine the result */
-    global_num_points = num_points;
-    global_ps = p;
-    global_Rs = R;  global_ts = t;
-    lmdif_driver(triangulate_n_residual, num_eqs, num_vars, x, 1.0e-5);
+    triangulate_polish(num_points, p, R, t, x, 1.0e-5);
 
     error = 0.0;
     for (i = 0; i < num_points; i++) {
@@ -286,6 +296,8 @@ v3_t triangulate(v2_t p, v2_t q,
     double A[12];
     double b[4];
     double x[3];
+    v2_t ps[2];
+    double Rs[18], ts[6];
 
 	double dx1, dx2, dy1, dy2;
 
@@ -314,11 +326,12 @@ v3_t triangulate(v2_t p, v2_t q,
     dgelsy_driver(A, b, x, 4, 3, 1);
 
     /* Run a non-linear optimization to refine the result */
-    global_p = p;
-    global_q = q;
-    global_R0 = R0;  global_t0 = t0;
-    global_R1 = R1;  global_t1 = t1;
-    lmdif_driver(triangulation_residual, 4, 3, x, 1.0e-10);
+    ps[0] = p;  ps[1] = q;
+    memcpy(Rs + 0, R0, 9 * sizeof(double));
+    memcpy(Rs + 9, R1, 9 * sizeof(double));
+    memcpy(ts + 0, t0, 3 * sizeof(double));
+    memcpy(ts + 3, t1, 3 * sizeof(double));
+    triangulate_polish(2, ps, Rs, ts, x, 1.0e-10);
 
     if (error != NULL) {
 	double pp[3], qp[3];
@@ -858,9 +871,9 @@ int find_projection_3x4(int num_pts, v3_t *points, v2_t *projs, double *P) {
     }
 }
 
-static int global_num_pts;
-static v3_t *global_points;
-static v2_t *global_projs;
+static THREAD_LOCAL int global_num_pts;
+static THREAD_LOCAL v3_t *global_points;
+static THREAD_LOCAL v2_t *global_projs;
 
 static void projection_residual(const int *m, const int *n, double *x, 
 				double *fvec, double *iflag) 
@@ -920,6 +933,90 @@ int find_projection_3x4_nonlinear(int num_pts, v3_t *points, v2_t *projs,
 }
 
 
+/* Correspondences handed to the RANSAC callbacks */
+typedef struct {
+    v3_t *points;
+    v2_t *projs;
+} projection_ransac_data_t;
+
+static int projection_ransac_compatible(const int *sample, int num_sampled,
+                                        int idx, void *data)
+{
+    projection_ransac_data_t *d = (projection_ransac_data_t *) data;
+    int j;
+
+    /* Reject repeated projections */
+    for (j = 0; j < num_sampled; j++) {
+        if (Vx(d->projs[idx]) == Vx(d->projs[sample[j]]) && 
+            Vy(d->projs[idx]) == Vy(d->projs[sample[j]])) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static int projection_ransac_fit(const int *sample, double *P, void *data)
+{
+    projection_ransac_data_t *d = (projection_ransac_data_t *) data;
+    v3_t pts_inner[6];
+    v2_t projs_inner[6];
+    double Rinit[9], triangular[9], orthogonal[9];
+    int i, neg;
+
+    for (i = 0; i < 6; i++) {
+        pts_inner[i] = d->points[sample[i]];
+        projs_inner[i] = d->projs[sample[i]];
+    }
+
+    /* Solve for the parameters */
+    find_projection_3x4(6, pts_inner, projs_inner, P);
+
+    /* Fix the sign on the P matrix */
+    memcpy(Rinit + 0, P + 0, 3 * sizeof(double));
+    memcpy(Rinit + 3, P + 4, 3 * sizeof(double));
+    memcpy(Rinit + 6, P + 8, 3 * sizeof(double));
+
+    dgerqf_driver(3, 3, Rinit, triangular, orthogonal);	    
+
+    /* Check the parity along the diagonal */
+    neg = 
+        (triangular[0] < 0.0) + 
+        (triangular[4] < 0.0) + 
+        (triangular[8] < 0.0);
+
+    P[12] = ((neg % 2) == 1) ? -1.0 : 1.0;
+
+    return 1;
+}
+
+static double projection_ransac_residual(const double *P, int idx, 
+                                         void *data)
+{
+    projection_ransac_data_t *d = (projection_ransac_data_t *) data;
+    double pt[4] = { Vx(d->points[idx]), 
+                     Vy(d->points[idx]), 
+                     Vz(d->points[idx]), 1.0 };
+    double pr[3];
+    double dx, dy;
+
+    matrix_product341((double *) P, pt, pr);
+
+    /* Check cheirality */
+    // EDIT!!!
+    if (P[12] * pr[2] > 0.0) 
+        return DBL_MAX;
+
+    // EDIT!!!
+    pr[0] /= -pr[2];
+    pr[1] /= -pr[2];
+
+    dx = pr[0] - Vx(d->projs[idx]);
+    dy = pr[1] - Vy(d->projs[idx]);
+
+    return dx * dx + dy * dy;
+}
+
 /* Solve for a 3x4 projection matrix using RANSAC, given a set of 3D
  * points and 2D projections */
 int find_projection_3x4_ransac(int num_pts, v3_t *points, v2_t *projs, 
@@ -932,12 +1029,10 @@ int find_projection_3x4_ransac(int num_pts, v3_t *points, v2_t *projs,
     } else {
 #define MIN_PTS 6
 	// const int min_pts = 6;
-	int *inliers = (int *) malloc(sizeof(int) * num_pts);
-	int indices[MIN_PTS];
-	int round, i, j;
+	int i;
 	int max_inliers = 0;
 	double max_error = 0.0;
-	double Pbest[12];
+	double Pbest[13];
 	int num_inliers = 0, num_inliers_new = 0;
 	v3_t *pts_final = NULL;
 	v2_t *projs_final = NULL;
@@ -952,107 +1047,25 @@ int find_projection_3x4_ransac(int num_pts, v3_t *points, v2_t *projs,
 
 	int num_inliers_polished = 0;
 
-	for (round = 0; round < ransac_rounds; round++) {
-	    v3_t pts_inner[MIN_PTS];
-	    v2_t projs_inner[MIN_PTS];
-	    double Ptmp[12];
-
-	    num_inliers = 0;
-	    for (i = 0; i < MIN_PTS; i++) {
-		int redo = 0;
-		int idx;
-                int redo_count = 0;
-
-		do {
-                    if (redo_count > 10000) {
-                        free(inliers);
-                        return -1;
-                    }
-
-		    idx = rand() % num_pts;
-		    
-		    redo = 0;
-		    for (j = 0; j < i; j++) {
-			if (idx == indices[j]) {
-			    redo = 1;
-			    break;
-			} else if (Vx(projs[idx]) == Vx(projs[indices[j]]) && 
-                                   Vy(projs[idx]) == Vy(projs[indices[j]])) {
-                            redo = 1;
-                        }
-		    }
-
-                    redo_count++;
-		} while(redo);
-	    
-		indices[i] = idx;
-		pts_inner[i] = points[idx];
-		projs_inner[i] = projs[idx];
-	    }
-
-	    /* Solve for the parameters */
-	    find_projection_3x4(MIN_PTS, pts_inner, projs_inner, Ptmp);
-
-#if 1
-	    /* Fix the sign on the P matrix */
-            memcpy(Rinit + 0, Ptmp + 0, 3 * sizeof(double));
-            memcpy(Rinit + 3, Ptmp + 4, 3 * sizeof(double));
-            memcpy(Rinit + 6, Ptmp + 8, 3 * sizeof(double));
-
-            dgerqf_driver(3, 3, Rinit, triangular, orthogonal);	    
-
-	    /* Check the parity along the diagonal */
-	    neg = 
-		(triangular[0] < 0.0) + 
-		(triangular[4] < 0.0) + 
-		(triangular[8] < 0.0);
-
-	    if ((neg % 2) == 1) {
-		sign = -1;
-	    } else {
-		sign = 1;
-	    }
-#endif
-	    
-	    /* Count the number of inliers */
-	    error = 0.0;
-	    for (i = 0; i < num_pts; i++) {
-		double pt[4] = { Vx(points[i]), 
-				 Vy(points[i]), 
-				 Vz(points[i]), 1.0 };
-		double pr[3];
-		double dx, dy, dist;
-
-		matrix_product341(Ptmp, pt, pr);
+	ransac_params_t params;
+	ransac_result_t result;
+	projection_ransac_data_t data;
 
-		/* Check cheirality */
-                // EDIT!!!
-		if (sign * pr[2] > 0.0) 
-		    continue;
+	data.points = points;
+	data.projs = projs;
 
-                // EDIT!!!
-		pr[0] /= -pr[2];
-		pr[1] /= -pr[2];
-	    
-		dx = pr[0] - Vx(projs[i]);
-		dy = pr[1] - Vy(projs[i]);
+	/* Models are P followed by the sign fixing its cheirality */
+	ransac_params_init(&params, num_pts, MIN_PTS, 13, 1);
+	params.max_rounds = ransac_rounds;
+	params.threshold = thresh_sq;
+	params.fit = projection_ransac_fit;
+	params.residual = projection_ransac_residual;
+	params.compatible = projection_ransac_compatible;
+	params.data = &data;
 
-		dist = dx * dx + dy * dy;
+	max_inliers = ransac_estimate(&params, Pbest, &result);
+	max_error = result.error;
 
-		if (dist < thresh_sq) {
-		    inliers[num_inliers] = i;
-		    num_inliers++;
-		    error += dist;
-		}
-	    }
-	    
-	    if (num_inliers > max_inliers) {
-		memcpy(Pbest, Ptmp, sizeof(double) * 12);
-		max_error = error;
-		max_inliers = num_inliers;
-	    }
-	}
-	
 	memcpy(P, Pbest, sizeof(double) * 12);
 
 	printf("[find_projection_3x4_ransac] num_inliers = %d (out of %d)\n",
@@ -1063,8 +1076,6 @@ int find_projection_3x4_ransac(int num_pts, v3_t *points, v2_t *projs,
         if (max_inliers < 6) {
             printf("[find_projection_3x4_ransac] "
                    "Too few inliers to continue.\n");
-            
-            free(inliers);
 
             return -1;
         }
@@ -1301,7 +1312,6 @@ int find_projection_3x4_ransac(int num_pts, v3_t *points, v2_t *projs,
 	
 	printf("New error: %0.3e\n", sqrt(error / max_inliers));
 
-	free(inliers);
 	free(pts_final);
 	free(projs_final);
 
@@ -0,0 +1,252 @@
+/*
+ *  Copyright (c) 2008  Noah Snavely (snavely (at) cs.washington.edu)
+ *    and the University of Washington
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+/* lm.c */
+/* Small dense Levenberg-Marquardt solver */
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "lm.h"
+
+#define LM_INIT_MU 1.0e-3   /* Initial damping, relative to the scale */
+#define LM_MAX_MU  1.0e32   /* Give up once the damping reaches this */
+
+/* Return the sum of squared residuals at x */
+static double lm_cost(lm_block_fn block, lm_setup_fn setup, void *data,
+                      int num_blocks, int n, const double *x)
+{
+    double r[LM_MAX_BLOCK_RESIDUALS];
+    double cost = 0.0;
+    int i, k;
+
+    if (setup != NULL)
+        setup(x, 0, data);
+
+    for (i = 0; i < num_blocks; i++) {
+        int nr = block(i, x, r, NULL, data);
+
+        for (k = 0; k < nr; k++)
+            cost += r[k] * r[k];
+    }
+
+    return cost;
+}
+
+/* Accumulate the upper triangle of J^T J in A, J^T r in g, and return
+ * the sum of squared residuals at x */
+static double lm_normal_equations(lm_block_fn block, lm_setup_fn setup,
+                                  void *data, int num_blocks, int n,
+                                  const double *x, double *A, double *g)
+{
+    double r[LM_MAX_BLOCK_RESIDUALS];
+    double J[LM_MAX_BLOCK_RESIDUALS * LM_MAX_PARAMS];
+    double cost = 0.0;
+    int i, j, k, l;
+
+    memset(A, 0, sizeof(double) * n * n);
+    memset(g, 0, sizeof(double) * n);
+
+    if (setup != NULL)
+        setup(x, 1, data);
+
+    for (i = 0; i < num_blocks; i++) {
+        int nr = block(i, x, r, J, data);
+
+        for (k = 0; k < nr; k++) {
+            const double *Jk = J + k * n;
+
+            cost += r[k] * r[k];
+
+            for (j = 0; j < n; j++) {
+                double Jkj = Jk[j];
+
+                if (Jkj == 0.0)
+                    continue;
+
+                g[j] += Jkj * r[k];
+                for (l = j; l < n; l++)
+                    A[j * n + l] += Jkj * Jk[l];
+            }
+        }
+    }
+
+    return cost;
+}
+
+/* Solve the n x n positive definite system M x = b, given the upper
+ * triangle of M, with a Cholesky factorization.  Returns 0 if M is not
+ * positive definite */
+static int lm_cholesky_solve(int n, const double *M, const double *b,
+                             double *x)
+{
+    double L[LM_MAX_PARAMS * LM_MAX_PARAMS];
+    int i, j, k;
+
+    for (j = 0; j < n; j++) {
+        double d = M[j * n + j];
+
+        for (k = 0; k < j; k++)
+            d -= L[j * n + k] * L[j * n + k];
+
+        if (!(d > 0.0))
+            return 0;
+
+        L[j * n + j] = sqrt(d);
+
+        for (i = j + 1; i < n; i++) {
+            double s = M[j * n + i];
+
+            for (k = 0; k < j; k++)
+                s -= L[i * n + k] * L[j * n + k];
+
+            L[i * n + j] = s / L[j * n + j];
+        }
+    }
+
+    /* L y = b, then L^T x = y */
+    for (i = 0; i < n; i++) {
+        double s = b[i];
+
+        for (k = 0; k < i; k++)
+            s -= L[i * n + k] * x[k];
+
+        x[i] = s / L[i * n + i];
+    }
+
+    for (i = n - 1; i >= 0; i--) {
+        double s = x[i];
+
+        for (k = i + 1; k < n; k++)
+            s -= L[k * n + i] * x[k];
+
+        x[i] = s / L[i * n + i];
+    }
+
+    return 1;
+}
+
+int lm_solve(lm_block_fn block, lm_setup_fn setup, void *data,
+             int num_blocks, int n, double *x, double tol, int max_iters)
+{
+    double A[LM_MAX_PARAMS * LM_MAX_PARAMS], M[LM_MAX_PARAMS * LM_MAX_PARAMS];
+    double g[LM_MAX_PARAMS], neg_g[LM_MAX_PARAMS];
+    double D[LM_MAX_PARAMS], dx[LM_MAX_PARAMS], x_new[LM_MAX_PARAMS];
+    double cost, mu = LM_INIT_MU, nu = 2.0;
+    int iter, j, l;
+
+    if (n > LM_MAX_PARAMS) {
+        printf("[lm_solve] Error: too many parameters (%d > %d)\n",
+               n, LM_MAX_PARAMS);
+        return -1;
+    }
+
+    cost = lm_normal_equations(block, setup, data, num_blocks, n, x, A, g);
+
+    /* Scale each parameter by its column norm, as lmdif does, keeping
+     * the largest seen so far */
+    for (j = 0; j < n; j++)
+        D[j] = (A[j * n + j] > 0.0) ? A[j * n + j] : 1.0;
+
+    for (iter = 0; iter < max_iters && cost > 0.0; iter++) {
+        double cost_new, pred, dAd, dx_norm, x_norm;
+        int solved;
+
+        /* Solve (J^T J + mu D) dx = -J^T r */
+        memcpy(M, A, sizeof(double) * n * n);
+        for (j = 0; j < n; j++) {
+            M[j * n + j] += mu * D[j];
+            neg_g[j] = -g[j];
+        }
+
+        solved = lm_cholesky_solve(n, M, neg_g, dx);
+
+        if (!solved) {
+            mu *= nu;
+            nu *= 2.0;
+
+            if (mu > LM_MAX_MU)
+                break;
+
+            continue;
+        }
+
+        for (j = 0; j < n; j++)
+            x_new[j] = x[j] + dx[j];
+
+        cost_new = lm_cost(block, setup, data, num_blocks, n, x_new);
+
+        /* Reduction predicted by the linear model,
+         * -2 g^T dx - dx^T J^T J dx */
+        dAd = 0.0;
+        for (j = 0; j < n; j++) {
+            double s = A[j * n + j] * dx[j];
+
+            for (l = j + 1; l < n; l++)
+                s += 2.0 * A[j * n + l] * dx[l];
+
+            dAd += dx[j] * s;
+        }
+
+        pred = 0.0;
+        for (j = 0; j < n; j++)
+            pred -= 2.0 * g[j] * dx[j];
+        pred -= dAd;
+
+        dx_norm = x_norm = 0.0;
+        for (j = 0; j < n; j++) {
+            dx_norm += D[j] * dx[j] * dx[j];
+            x_norm += D[j] * x[j] * x[j];
+        }
+
+        if (cost_new < cost && pred > 0.0) {
+            double actual = cost - cost_new;
+            double rho = actual / pred;
+            double scale = 2.0 * rho - 1.0;
+            int converged = (actual <= tol * cost && pred <= tol * cost);
+
+            memcpy(x, x_new, sizeof(double) * n);
+
+            scale = 1.0 - scale * scale * scale;
+            mu *= (scale > 1.0 / 3.0) ? scale : 1.0 / 3.0;
+            nu = 2.0;
+
+            if (converged || dx_norm <= tol * tol * x_norm) {
+                iter++;
+                break;
+            }
+
+            cost = lm_normal_equations(block, setup, data, num_blocks, n,
+                                       x, A, g);
+
+            for (j = 0; j < n; j++) {
+                if (A[j * n + j] > D[j])
+                    D[j] = A[j * n + j];
+            }
+        } else {
+            mu *= nu;
+            nu *= 2.0;
+
+            if (mu > LM_MAX_MU || dx_norm <= tol * tol * x_norm) {
+                iter++;
+                break;
+            }
+        }
+    }
+
+    return iter;
+}
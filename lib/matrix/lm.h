@@ -0,0 +1,59 @@
+/*
+ *  Copyright (c) 2008  Noah Snavely (snavely (at) cs.washington.edu)
+ *    and the University of Washington
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+/* lm.h */
+/* Small dense Levenberg-Marquardt solver for problems with a handful
+ * of parameters and an analytic jacobian.  The residuals are evaluated
+ * in blocks, and the normal equations are accumulated block by block,
+ * so all working memory is on the stack and the solver is reentrant */
+
+#ifndef __lm_h__
+#define __lm_h__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define LM_MAX_PARAMS          9   /* Parameters per problem */
+#define LM_MAX_BLOCK_RESIDUALS 4   /* Residuals per block */
+
+/* Evaluate the residuals of block i at x into r, and return how many
+ * there are (at most LM_MAX_BLOCK_RESIDUALS).  If J is not NULL, also
+ * store the derivative of residual k with respect to x[l] in
+ * J[k * n + l] */
+typedef int (*lm_block_fn)(int i, const double *x, double *r, double *J,
+                           void *data);
+
+/* Called once at each point x before its blocks are evaluated, with
+ * jacobian set if the derivatives will be asked for.  Lets the problem
+ * compute what its blocks share (a rotation, say) into data */
+typedef void (*lm_setup_fn)(const double *x, int jacobian, void *data);
+
+/* Minimize the sum of squared residuals of num_blocks blocks over the
+ * n parameters in x (n <= LM_MAX_PARAMS), starting from and
+ * overwriting x.  setup may be NULL.  tol plays the role of the ftol
+ * and xtol of minpack's lmdif: the solver stops once the relative
+ * reduction of the cost, actual and predicted, or the relative size
+ * of the step falls below it.  Returns the number of iterations, or -1
+ * if n is too large */
+int lm_solve(lm_block_fn block, lm_setup_fn setup, void *data,
+             int num_blocks, int n, double *x, double tol, int max_iters);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __lm_h__ */
@@ -39,4 +39,12 @@
 #define SBA_FINITE finite // other than MSVC, ICC, GCC, let's hope this will work
 #endif 
 
+/* storage class for the work buffers that the solvers retain between calls;
+ * per thread, so that independent bundle adjustments can run concurrently */
+#ifdef _MSC_VER
+#define SBA_THREAD_LOCAL __declspec(thread) // MSVC
+#else
+#define SBA_THREAD_LOCAL __thread // ICC, GCC
+#endif
+
 #endif /* _COMPILER_H_ */
@@ -52,7 +52,7 @@ extern "C" {
 #define SBA_MIN_DELTA     1E-06 // finite differentiation minimum delta
 #define SBA_DELTA_SCALE   1E-04 // finite differentiation delta scale
 
-#define SBA_OPTSSZ        5
+#define SBA_OPTSSZ        8
 #define SBA_INFOSZ        10
 #define SBA_ERROR         -1
 #define SBA_INIT_MU       1E-03
@@ -60,6 +60,8 @@ extern "C" {
 #define SBA_CG_NOPREC     0
 #define SBA_CG_JACOBI     1
 #define SBA_CG_SSOR       2
+#define SBA_SOLVER_DIRECT 0 // opts[6]: factor the reduced camera system
+#define SBA_SOLVER_PCG    1 // opts[6]: solve it with preconditioned CG
 #define SBA_VERSION       "1.5 (Jul. 2008)"
 
 
@@ -77,6 +79,17 @@ struct sba_crsm{
                    */
 };
 
+/* The nonzero blocks of the reduced camera matrix S of sba_motstr_levmar_x(), without damping.
+ * S_jk is nonzero only if cameras j and k see a common point, so only the blocks on and above
+ * the diagonal of such camera pairs are kept. pattern has a row for each camera j>=mcon,
+ * numbered from mcon, holding the k>=j of its nonzero blocks, and the cnp x cnp S_jk of
+ * element l of pattern (pattern.val[l]==l) is stored row-major at blocks + l*cnp*cnp
+ */
+struct sba_sblocks{
+    struct sba_crsm pattern;
+    double *blocks;
+};
+
 typedef struct {
     char *constrained;
     double *constraints;
@@ -105,7 +118,8 @@ sba_motstr_levmar(const int n, const int m, const int mcon, char *vmask,
                   int use_constraints, camera_constraints_t *constraints, 
                   int use_point_constraints, 
                   point_constraints_t *point_constraints, 
-                  double *Vout, double *Sout, double *Uout, double *Wout);
+                  double *Vout, double *Sout, double *Uout, double *Wout,
+                  struct sba_sblocks *Sblocks);
 
 extern int
 sba_mot_levmar(const int n, const int m, const int mcon, char *vmask, double *p, const int cnp,
@@ -128,6 +142,7 @@ sba_motstr_levmar_x(const int n, const int m, const int mcon, char *vmask, doubl
            double *x, double *covx, const int mnp,
            void (*func)(double *p, struct sba_crsm *idxij, int *rcidxs, int *rcsubs, double *hx, void *adata),
            void (*fjac)(double *p, struct sba_crsm *idxij, int *rcidxs, int *rcsubs, double *jac, void *adata),
+           void (*fjacf)(double *p, struct sba_crsm *idxij, int *rcidxs, int *rcsubs, float *jac, void *adata),
                     void *adata, const int itmax, const int verbose, const double opts[SBA_OPTSSZ], double info[SBA_INFOSZ],
 		    int use_constraints, 
 		    camera_constraints_t *constraints,
@@ -135,7 +150,8 @@ sba_motstr_levmar_x(const int n, const int m, const int mcon, char *vmask, doubl
 		    point_constraints_t *point_constraints
 		    /* Constraints on camera parameters */,
                     double *Vout, double *Sout /* size cnp * cnp * m*m */,
-                    double *Uout, double *Wout /* size pnp * cnp * m*n */);
+                    double *Uout, double *Wout /* size pnp * cnp * m*n */,
+                    struct sba_sblocks *Sblocks);
 
 extern int
 sba_mot_levmar_x(const int n, const int m, const int mcon, char *vmask, double *p, const int cnp,
@@ -174,6 +190,8 @@ extern int sba_crsm_row_elmidxs(struct sba_crsm *sm, int i, int *vidxs, int *jid
 extern int sba_crsm_col_elmidxs(struct sba_crsm *sm, int j, int *vidxs, int *iidxs);
 /* extern int sba_crsm_common_row(struct sba_crsm *sm, int j, int k); */
 
+extern void sba_sblocks_free(struct sba_sblocks *sb);
+
 #ifdef __cplusplus
 }
 #endif
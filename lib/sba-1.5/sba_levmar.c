@@ -36,6 +36,9 @@
 
 #define SBA_ONE_THIRD     0.3333333334 /* 1.0/3.0 */
 
+#define SBA_PCG_MAX_ETA   0.1 /* loosest relative residual accepted from PCG */
+#define SBA_PCG_MAXITER   500 /* max. PCG iterations per linear system */
+
 
 #define emalloc(sz)       emalloc_(__FILE__, __LINE__, sz)
 
@@ -448,6 +451,501 @@ static void sba_fdjac_x(
 
 typedef int (*PLS)(double *A, double *B, double *x, int m, int iscolmaj);
 
+/* The W_ij=A_ij^T B_ij blocks of sba_motstr_levmar_x(). They are either stored as doubles in W,
+ * or, when the jacobian is kept in single precision, computed on demand from the float A_ij, B_ij
+ * in jacf. The products are accumulated in double precision
+ */
+struct sba_wblocks{
+    double *W;    /* W_ij, NULL when jacf is used */
+    float *jacf;  /* float A_ij, B_ij pairs, in the layout of jac */
+    double *buf;  /* cnp*pnp working memory holding the last W_ij computed from jacf */
+    int cnp, pnp, mnp;
+};
+
+/* return the W_ij with index k in idxij.val */
+inline static double *sba_wblock(struct sba_wblocks *wb, int k)
+{
+register int ii, jj, l;
+register double sum;
+const int cnp=wb->cnp, pnp=wb->pnp, mnp=wb->mnp;
+float *pA, *pB;
+
+    if(wb->W) return wb->W + k*cnp*pnp;
+
+    pA=wb->jacf + k*mnp*(cnp+pnp); pB=pA + mnp*cnp;
+    for(ii=0; ii<cnp; ++ii)
+        for(jj=0; jj<pnp; ++jj){
+            for(l=0, sum=0.0; l<mnp; ++l)
+                sum+=(double)pA[l*cnp+ii]*(double)pB[l*pnp+jj];
+            wb->buf[ii*pnp+jj]=sum;
+        }
+
+    return wb->buf;
+}
+
+/* y+=W_ij^T x for the W_ij with index k in idxij.val. With float storage, this is
+ * computed as B_ij^T (A_ij x), which is cheaper than forming W_ij
+ */
+inline static void sba_wblock_tmulv(struct sba_wblocks *wb, int k, double *x, double *y)
+{
+register int ii, jj;
+register double sum;
+const int cnp=wb->cnp, pnp=wb->pnp, mnp=wb->mnp;
+double *pW, *Ax;
+float *pA, *pB;
+
+    if(wb->W){
+        pW=wb->W + k*cnp*pnp;
+        for(ii=0; ii<pnp; ++ii){
+            for(jj=0, sum=0.0; jj<cnp; ++jj)
+                sum+=pW[jj*pnp+ii]*x[jj];
+            y[ii]+=sum;
+        }
+        return;
+    }
+
+    pA=wb->jacf + k*mnp*(cnp+pnp); pB=pA + mnp*cnp; Ax=wb->buf;
+    for(ii=0; ii<mnp; ++ii){
+        for(jj=0, sum=0.0; jj<cnp; ++jj)
+            sum+=(double)pA[ii*cnp+jj]*x[jj];
+        Ax[ii]=sum;
+    }
+    for(ii=0; ii<pnp; ++ii){
+        for(jj=0, sum=0.0; jj<mnp; ++jj)
+            sum+=(double)pB[jj*pnp+ii]*Ax[jj];
+        y[ii]+=sum;
+    }
+}
+
+/* y-=W_ij x for the W_ij with index k in idxij.val, as A_ij^T (B_ij x) with float storage */
+inline static void sba_wblock_mulv_sub(struct sba_wblocks *wb, int k, double *x, double *y)
+{
+register int ii, jj;
+register double sum;
+const int cnp=wb->cnp, pnp=wb->pnp, mnp=wb->mnp;
+double *pW, *Bx;
+float *pA, *pB;
+
+    if(wb->W){
+        pW=wb->W + k*cnp*pnp;
+        for(ii=0; ii<cnp; ++ii){
+            for(jj=0, sum=0.0; jj<pnp; ++jj)
+                sum+=pW[ii*pnp+jj]*x[jj];
+            y[ii]-=sum;
+        }
+        return;
+    }
+
+    pA=wb->jacf + k*mnp*(cnp+pnp); pB=pA + mnp*cnp; Bx=wb->buf;
+    for(ii=0; ii<mnp; ++ii){
+        for(jj=0, sum=0.0; jj<pnp; ++jj)
+            sum+=(double)pB[ii*pnp+jj]*x[jj];
+        Bx[ii]=sum;
+    }
+    for(ii=0; ii<cnp; ++ii){
+        for(jj=0, sum=0.0; jj<mnp; ++jj)
+            sum+=(double)pA[jj*cnp+ii]*Bx[jj];
+        y[ii]-=sum;
+    }
+}
+
+/* convert the sz floats of a jacobian block to doubles in buf and return buf */
+inline static double *sba_fltblock(float *blk, int sz, double *buf)
+{
+register int i;
+
+    for(i=0; i<sz; ++i)
+        buf[i]=blk[i];
+
+    return buf;
+}
+
+/* number of pieces in which the jacobian is evaluated when a float minimization is finished in double precision */
+#define SBA_DBLJAC_CHUNKS 8
+
+/* Evaluate the jacobian in double precision a few points (i.e. rows of idxij) at a time, store it in
+ * jacf in single precision and compute ea_j=\sum_i A_ij^T e_ij, j=mcon...m-1 and eb_i=\sum_j B_ij^T e_ij
+ * from the double blocks. fjac is called for each chunk with a copy of idxij in which the rows outside
+ * the chunk are empty and val points into jac, so that jac needs room for chunksz A_ij, B_ij pairs only.
+ * chunksz must be at least the largest number of projections of a single point and rowptr must have
+ * room for n+1 ints. The val of idxij are temporarily overwritten and assumed to be 0...nnz-1
+ */
+static void sba_dbljac_grad(double *p, struct sba_crsm *idxij, int *rcidxs, int *rcsubs,
+                            void (*fjac)(double *p, struct sba_crsm *idxij, int *rcidxs, int *rcsubs, double *jac, void *adata),
+                            void *adata, const int mcon, const int cnp, const int pnp, const int mnp,
+                            double *e, float *jacf, double *jac, int chunksz, int *rowptr, double *ea, double *eb)
+{
+register int ii, jj;
+register double sum;
+int i, i0, i1, j, k, k0, k1;
+const int n=idxij->nr, Asz=mnp*cnp, ABsz=Asz + mnp*pnp;
+struct sba_crsm chunk;
+double *pA, *pB, *pe;
+float *pf;
+
+    chunk=*idxij;
+    chunk.rowptr=rowptr;
+
+    _dblzero(ea, idxij->nc*cnp);
+    _dblzero(eb, n*pnp);
+    for(i0=0; i0<n; i0=i1){
+        /* rows i0...i1-1 make up the chunk */
+        k0=idxij->rowptr[i0];
+        for(i1=i0+1; i1<n && idxij->rowptr[i1+1]-k0<=chunksz; ++i1)
+            ;
+        k1=idxij->rowptr[i1];
+
+        for(i=0; i<i0; ++i) rowptr[i]=k0;
+        for( ; i<i1; ++i) rowptr[i]=idxij->rowptr[i];
+        for( ; i<=n; ++i) rowptr[i]=k1;
+        for(k=k0; k<k1; ++k) idxij->val[k]=k-k0;
+
+        (*fjac)(p, &chunk, rcidxs, rcsubs, jac, adata);
+
+        for(i=i0; i<i1; ++i)
+            for(k=idxij->rowptr[i]; k<idxij->rowptr[i+1]; ++k){
+                j=idxij->colidx[k];
+                pA=jac + (k-k0)*ABsz; pB=pA + Asz;
+                pe=e + k*mnp;
+                pf=jacf + k*ABsz;
+
+                for(ii=0; ii<ABsz; ++ii)
+                    pf[ii]=(float)pA[ii];
+
+                if(j>=mcon)
+                    for(ii=0; ii<cnp; ++ii){
+                        for(jj=0, sum=0.0; jj<mnp; ++jj)
+                            sum+=pA[jj*cnp+ii]*pe[jj];
+                        ea[j*cnp+ii]+=sum;
+                    }
+
+                for(ii=0; ii<pnp; ++ii){
+                    for(jj=0, sum=0.0; jj<mnp; ++jj)
+                        sum+=pB[jj*pnp+ii]*pe[jj];
+                    eb[i*pnp+ii]+=sum;
+                }
+            }
+
+        for(k=k0; k<k1; ++k) idxij->val[k]=k;
+    }
+}
+
+static int sba_intcmp(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+/* release the pattern and blocks of sb, if any, leaving it empty */
+void sba_sblocks_free(struct sba_sblocks *sb)
+{
+    if(sb->pattern.val) sba_crsm_free(&sb->pattern);
+    free(sb->blocks);
+    sb->blocks=NULL;
+}
+
+/* Compute in sb the nonzero blocks of S=U - W V^-1 W^T, see struct sba_sblocks. U_j is full,
+ * only the lower triangle of V_i^-1 is stored in V_i and the W_ij are in wb. The pattern is
+ * found from idxij: S_jk is kept iff some row of idxij has both j and k. Only the blocks
+ * of points seen in both j and k are visited, so this is linear in the number of such pairs
+ */
+static void sba_sblocks_compute(const int n, const int m, const int mcon, const int cnp, const int pnp,
+                                struct sba_crsm *idxij, int *rcidxs, int *rcsubs,
+                                double *U, double *V, struct sba_wblocks *wb, double *Y,
+                                struct sba_sblocks *sb)
+{
+register int ii, jj, kk;
+register double sum;
+int i, j, k, l, a, b, nnz, cnt, tot;
+const int mmcon=m-mcon, Ssz=cnp*cnp;
+int *mark, *cols;
+double *pW, *pV, *pS;
+
+    mark=(int *)emalloc(m*sizeof(int));
+    cols=(int *)emalloc(m*sizeof(int));
+
+    /* find the pattern: count the blocks of each row, then fill them in */
+    for(j=0; j<m; ++j) mark[j]=-1;
+    for(j=mcon, tot=0; j<m; ++j){
+        mark[j]=j; cnt=1; /* S_jj is always there */
+        nnz=sba_crsm_col_elmidxs(idxij, j, rcidxs, rcsubs);
+        for(i=0; i<nnz; ++i)
+            for(l=idxij->rowptr[rcsubs[i]]; l<idxij->rowptr[rcsubs[i]+1]; ++l)
+                if((k=idxij->colidx[l])>j && mark[k]!=j){
+                    mark[k]=j;
+                    ++cnt;
+                }
+        tot+=cnt;
+    }
+
+    sba_sblocks_free(sb);
+    sba_crsm_alloc(&sb->pattern, mmcon, mmcon, tot);
+    for(j=0; j<m; ++j) mark[j]=-1;
+    for(j=mcon, tot=0; j<m; ++j){
+        mark[j]=j; cols[0]=j; cnt=1;
+        nnz=sba_crsm_col_elmidxs(idxij, j, rcidxs, rcsubs);
+        for(i=0; i<nnz; ++i)
+            for(l=idxij->rowptr[rcsubs[i]]; l<idxij->rowptr[rcsubs[i]+1]; ++l)
+                if((k=idxij->colidx[l])>j && mark[k]!=j){
+                    mark[k]=j;
+                    cols[cnt++]=k;
+                }
+        qsort(cols, cnt, sizeof(int), sba_intcmp);
+
+        sb->pattern.rowptr[j-mcon]=tot;
+        for(l=0; l<cnt; ++l, ++tot){
+            sb->pattern.val[tot]=tot;
+            sb->pattern.colidx[tot]=cols[l]-mcon;
+        }
+    }
+    sb->pattern.rowptr[mmcon]=tot;
+
+    free(mark);
+    free(cols);
+
+    /* S_jj=U_j */
+    sb->blocks=(double *)emalloc(tot*Ssz*sizeof(double));
+    _dblzero(sb->blocks, tot*Ssz);
+    for(j=mcon; j<m; ++j)
+        memcpy(sb->blocks + sb->pattern.rowptr[j-mcon]*Ssz, U + j*Ssz, Ssz*sizeof(double));
+
+    /* S_jk-=Y_ij W_ik^T for every point i seen in j and k, with Y_ij=W_ij V_i^-1 */
+    for(i=0; i<n; ++i){
+        pV=V + i*pnp*pnp;
+        nnz=sba_crsm_row_elmidxs(idxij, i, rcidxs, rcsubs);
+        for(a=0; a<nnz; ++a){
+            if((j=rcsubs[a])<mcon) continue;
+
+            pW=sba_wblock(wb, idxij->val[rcidxs[a]]);
+            for(ii=0; ii<cnp; ++ii)
+                for(jj=0; jj<pnp; ++jj){
+                    for(kk=0, sum=0.0; kk<=jj; ++kk)
+                        sum+=pW[ii*pnp+kk]*pV[jj*pnp+kk];
+                    for( ; kk<pnp; ++kk)
+                        sum+=pW[ii*pnp+kk]*pV[kk*pnp+jj];
+                    Y[ii*pnp+jj]=sum;
+                }
+
+            for(b=a; b<nnz; ++b){
+                k=rcsubs[b];
+                pS=sb->blocks + sba_crsm_elmidx(&sb->pattern, j-mcon, k-mcon)*Ssz;
+                pW=sba_wblock(wb, idxij->val[rcidxs[b]]);
+                for(ii=0; ii<cnp; ++ii)
+                    for(jj=0; jj<cnp; ++jj){
+                        for(kk=0, sum=0.0; kk<pnp; ++kk)
+                            sum+=Y[ii*pnp+kk]*pW[jj*pnp+kk];
+                        pS[ii*cnp+jj]-=sum;
+                    }
+            }
+        }
+    }
+}
+
+/* The routines below solve the reduced camera system S da=e of sba_motstr_levmar_x()
+ * iteratively, without ever forming S=U* - W (V*)^-1 W^T. Products with S are
+ * computed from the W_ij, U*_j and (V*_i)^-1 blocks, so that the memory and time
+ * needed per iteration are linear in the number of image projections.
+ * All vectors are m*cnp, with the blocks of the first mcon (fixed) cameras kept zero
+ */
+
+/* compute y=A x, A being a symmetric m x m matrix whose lower triangle is stored in A */
+static void sba_symat_lower_mulv(double *A, double *x, double *y, int m)
+{
+register int i, j;
+register double sum;
+
+    for(i=0; i<m; ++i){
+        for(j=0, sum=0.0; j<=i; ++j)
+            sum+=A[i*m+j]*x[j];
+        for( ; j<m; ++j)
+            sum+=A[j*m+i]*x[j];
+        y[i]=sum;
+    }
+}
+
+/* compute y=S x. t (n*pnp) and Wtx (pnp) are working memory */
+static void sba_schur_mulv(const int n, const int m, const int mcon, const int cnp, const int pnp,
+                           struct sba_crsm *idxij, double *U, double *V, struct sba_wblocks *wb,
+                           double *x, double *y, double *t, double *Wtx)
+{
+register int i, j, ii, jj, k;
+register double sum;
+double *ptr1, *ptr2, *ptr3;
+const int Usz=cnp*cnp, Vsz=pnp*pnp;
+
+    /* t_i=(V*_i)^-1 \sum_j W_ij^T x_j */
+    for(i=0; i<n; ++i){
+        _dblzero(Wtx, pnp);
+        for(k=idxij->rowptr[i]; k<idxij->rowptr[i+1]; ++k){
+            if((j=idxij->colidx[k])<mcon) continue; /* W_ij is zero */
+
+            sba_wblock_tmulv(wb, idxij->val[k], x + j*cnp, Wtx);
+        }
+
+        sba_symat_lower_mulv(V + i*Vsz, Wtx, t + i*pnp, pnp);
+    }
+
+    /* y_j=U*_j x_j - \sum_i W_ij t_i */
+    _dblzero(y, mcon*cnp);
+    for(j=mcon; j<m; ++j){
+        ptr1=U + j*Usz; ptr2=x + j*cnp; ptr3=y + j*cnp;
+        for(ii=0; ii<cnp; ++ii){
+            for(jj=0, sum=0.0; jj<cnp; ++jj)
+                sum+=ptr1[ii*cnp+jj]*ptr2[jj];
+            ptr3[ii]=sum;
+        }
+    }
+
+    for(i=0; i<n; ++i){
+        ptr2=t + i*pnp;
+        for(k=idxij->rowptr[i]; k<idxij->rowptr[i+1]; ++k){
+            if((j=idxij->colidx[k])<mcon) continue;
+
+            sba_wblock_mulv_sub(wb, idxij->val[k], ptr2, y + j*cnp);
+        }
+    }
+}
+
+/* compute the right hand side e_j=ea_j - \sum_i W_ij (V*_i)^-1 eb_i of the reduced
+ * camera system in E. t (n*pnp) is working memory
+ */
+static void sba_schur_rhs(const int n, const int m, const int mcon, const int cnp, const int pnp,
+                          struct sba_crsm *idxij, double *V, struct sba_wblocks *wb, double *ea, double *eb,
+                          double *E, double *t)
+{
+register int i, j, k;
+double *ptr2;
+const int Vsz=pnp*pnp;
+
+    for(i=0; i<n; ++i)
+        sba_symat_lower_mulv(V + i*Vsz, eb + i*pnp, t + i*pnp, pnp);
+
+    _dblzero(E, mcon*cnp);
+    memcpy(E + mcon*cnp, ea + mcon*cnp, (m-mcon)*cnp*sizeof(double));
+    for(i=0; i<n; ++i){
+        ptr2=t + i*pnp;
+        for(k=idxij->rowptr[i]; k<idxij->rowptr[i+1]; ++k){
+            if((j=idxij->colidx[k])<mcon) continue;
+
+            sba_wblock_mulv_sub(wb, idxij->val[k], ptr2, E + j*cnp);
+        }
+    }
+}
+
+/* compute the block Jacobi preconditioner of S, i.e. the inverses of its diagonal
+ * blocks S_jj=U*_j - \sum_i W_ij (V*_i)^-1 W_ij^T. As with the V*_i, the upper triangle
+ * of S_jj is formed in P_j and its inverse is saved in the lower triangle.
+ * Y (cnp*pnp) is working memory. Returns 0 if some S_jj is not positive definite, 1 otherwise
+ */
+static int sba_schur_precond(const int n, const int m, const int mcon, const int cnp, const int pnp,
+                             struct sba_crsm *idxij, double *U, double *V, struct sba_wblocks *wb,
+                             double *P, double *Y)
+{
+register int i, j, ii, jj, k, l;
+register double sum;
+double *ptr1, *ptr2, *ptr3;
+const int Usz=cnp*cnp, Vsz=pnp*pnp;
+
+    memcpy(P + mcon*Usz, U + mcon*Usz, (m-mcon)*Usz*sizeof(double));
+    for(i=0; i<n; ++i){
+        ptr3=V + i*Vsz; // set ptr3 to point to (V*_i)^-1
+        for(k=idxij->rowptr[i]; k<idxij->rowptr[i+1]; ++k){
+            if((j=idxij->colidx[k])<mcon) continue;
+
+            ptr1=sba_wblock(wb, idxij->val[k]);
+            /* Y=W_ij (V*_i)^-1 */
+            for(ii=0; ii<cnp; ++ii)
+                sba_symat_lower_mulv(ptr3, ptr1 + ii*pnp, Y + ii*pnp, pnp);
+
+            /* subtract the UPPER TRIANGULAR PART of Y W_ij^T from P_j */
+            ptr2=P + j*Usz;
+            for(ii=0; ii<cnp; ++ii)
+                for(jj=ii; jj<cnp; ++jj){
+                    for(l=0, sum=0.0; l<pnp; ++l)
+                        sum+=Y[ii*pnp+l]*ptr1[jj*pnp+l];
+                    ptr2[ii*cnp+jj]-=sum;
+                }
+        }
+    }
+
+    for(j=mcon; j<m; ++j)
+        if(!sba_symat_invert_Chol(P + j*Usz, cnp)) return 0;
+
+    return 1;
+}
+
+/* solve S x=E with conjugate gradients preconditioned by the block Jacobi preconditioner P
+ * computed by sba_schur_precond(). Starting from x=0, the iterations stop as soon as
+ * ||E - S x||_2<=eta*||E||_2 or after maxit iterations. Since x is then the minimizer of
+ * x^T S x/2 - x^T E over a Krylov subspace, x^T S x=x^T E also holds for a truncated solution,
+ * so the gain ratio of the LM step remains meaningful.
+ * work is 4*m*cnp + n*pnp + pnp. The achieved relative residual is returned in relres.
+ * Returns the number of iterations, -1 if S turned out to be not positive definite
+ */
+static int sba_schur_pcg(const int n, const int m, const int mcon, const int cnp, const int pnp,
+                         struct sba_crsm *idxij, double *U, double *V, struct sba_wblocks *wb, double *P,
+                         double *E, double *x, double eta, int maxit, double *work, double *relres)
+{
+register int i, j;
+const int nvars=m*cnp, off=mcon*cnp, Usz=cnp*cnp;
+double *r, *z, *d, *q, *t, *Wtx;
+double rz, rz_new, dq, alpha, beta, E_L2, r_L2;
+int iter;
+
+    r=work; z=r + nvars; d=z + nvars; q=d + nvars; t=q + nvars; Wtx=t + n*pnp;
+
+    for(i=off, E_L2=0.0; i<nvars; ++i)
+        E_L2+=E[i]*E[i];
+    E_L2=sqrt(E_L2);
+
+    _dblzero(x, nvars);
+    *relres=0.0;
+    if(E_L2==0.0) return 0;
+
+    memcpy(r, E, nvars*sizeof(double)); /* r=E - S 0 */
+    _dblzero(z, off); _dblzero(d, off);
+    for(j=mcon; j<m; ++j)
+        sba_symat_lower_mulv(P + j*Usz, r + j*cnp, z + j*cnp, cnp);
+    for(i=off, rz=0.0; i<nvars; ++i){
+        d[i]=z[i];
+        rz+=r[i]*z[i];
+    }
+
+    r_L2=E_L2;
+    for(iter=0; iter<maxit; ){
+        sba_schur_mulv(n, m, mcon, cnp, pnp, idxij, U, V, wb, d, q, t, Wtx);
+        for(i=off, dq=0.0; i<nvars; ++i)
+            dq+=d[i]*q[i];
+        if(!(dq>0.0)){ /* S is not positive definite, numerically */
+            if(iter==0) return -1;
+            break;
+        }
+
+        alpha=rz/dq;
+        for(i=off, r_L2=0.0; i<nvars; ++i){
+            x[i]+=alpha*d[i];
+            r[i]-=alpha*q[i];
+            r_L2+=r[i]*r[i];
+        }
+        r_L2=sqrt(r_L2);
+        ++iter;
+
+        if(r_L2<=eta*E_L2) break;
+
+        for(j=mcon; j<m; ++j)
+            sba_symat_lower_mulv(P + j*Usz, r + j*cnp, z + j*cnp, cnp);
+        for(i=off, rz_new=0.0; i<nvars; ++i)
+            rz_new+=r[i]*z[i];
+
+        beta=rz_new/rz;
+        rz=rz_new;
+        for(i=off; i<nvars; ++i)
+            d[i]=z[i] + beta*d[i];
+    }
+
+    *relres=r_L2/E_L2;
+    return iter;
+}
+
 /* Bundle adjustment on camera and structure parameters 
  * using the sparse Levenberg-Marquardt as described in HZ p. 568
  *
@@ -501,13 +999,27 @@ int sba_motstr_levmar_x(
                          * If NULL, the jacobian is approximated by repetitive func calls and finite
                          * differences. This is computationally inefficient and thus NOT recommended.
                          */
-                        void *adata,       /* pointer to possibly additional data, passed uninterpreted to func, fjac */ 
+                        void (*fjacf)(double *p, struct sba_crsm *idxij, int *rcidxs, int *rcsubs, float *jac, void *adata),
+                        /* as fjac, storing the A_ij, B_ij in single precision. Used when opts[7] asks for float
+                         * jacobian storage; if NULL, the jacobian is always kept in double precision
+                         */
+                        void *adata,       /* pointer to possibly additional data, passed uninterpreted to func, fjac, fjacf */ 
 
                         const int itmax,   /* I: maximum number of iterations. itmax==0 signals jacobian verification followed by immediate return */
                         const int verbose, /* I: verbosity */
                         const double opts[SBA_OPTSSZ],
                         /* I: minim. options [\mu, \epsilon1, \epsilon2, \epsilon3, \epsilon4]. Respectively the scale factor for initial \mu,
                          * stopping thresholds for ||J^T e||_inf, ||dp||_2, ||e||_2 and (||e||_2-||e_new||_2)/||e||_2
+                         * opts[5] is the threshold on the max. relative change of the e_ij.
+                         * opts[6] selects how the reduced camera system is solved: SBA_SOLVER_DIRECT forms the dense
+                         * S and factors it, SBA_SOLVER_PCG solves it with preconditioned conjugate gradients without
+                         * forming S, in memory linear in the number of projections (meant for very many cameras).
+                         * If opts[7] is nonzero, the A_ij, B_ij are stored in single precision by fjacf and the
+                         * W_ij are not stored at all, but formed from them when needed. All sums are accumulated
+                         * in double precision, and once converged the minimization is finished with J^T e computed
+                         * from the jacobian in double precision, evaluated by fjac a few points at a time so that
+                         * it is never held whole. This is ignored if fjac or fjacf is NULL, covx is given or Sout,
+                         * Wout or Sblocks are requested
                          */
                         double info[SBA_INFOSZ],
                         /* O: information regarding the minimization. Set to NULL if don't care
@@ -527,7 +1039,11 @@ int sba_motstr_levmar_x(
                          */
                         int use_constraints, camera_constraints_t *constraints,  /* Constraints on camera parameters */
                         int use_point_constraints, point_constraints_t *point_constraints,
-                        double *Vout, double *Sout, double *Uout, double *Wout
+                        double *Vout, double *Sout, double *Uout, double *Wout,
+                        struct sba_sblocks *Sblocks
+                        /* O: if not NULL, the nonzero blocks of S at the solution. Sblocks must be
+                         * zeroed or hold the blocks of a previous call, which are released first
+                         */
                         )
 {
     register int i, j, ii, jj, k, l;
@@ -556,7 +1072,15 @@ int sba_motstr_levmar_x(
     double *Yj;   /* work array for storing the Y_ij for a *fixed* j in the order Y_1j, Y_nj,
                      max. size n*cnp*pnp */
     double *YWt;  /* work array for storing \sum_i Y_ij W_ik^T, size cnp*cnp */
-    double *S;    /* work array for storing the block array S_jk, size m*m*cnp*cnp */
+    double *S;    /* work array for storing the block array S_jk, size m*m*cnp*cnp. Not allocated by the
+                   * PCG solver unless Sout is requested */
+    float *jacf=NULL; /* float storage only: the jacobian, in the layout of jac, size nvis*(mnp*cnp + mnp*pnp) */
+    double *Wbuf; /* working memory for W_ij formed from jacf, and for converting A_ij, B_ij from it, size max(cnp*pnp, mnp*cnp + mnp*pnp) */
+    double *jacd=NULL; /* float storage only: a chunk of the jacobian in double precision while finishing, see sba_dbljac_grad() */
+    int *jacdrowptr=NULL; /* row pointers of the chunks of jacd */
+    struct sba_wblocks wb;
+    double *P=NULL; /* PCG only: the inverses of the diagonal blocks S_jj, size m*cnp*cnp */
+    double *pcgwork=NULL; /* PCG only: working memory, size 4*m*cnp + n*pnp + pnp */
     double *dp;   /* work array for storing the parameter vector updates da_1, ..., da_m, db_1, ..., db_n, size m*cnp + n*pnp */
     double *Wtda; /* work array for storing \sum_j W_ij^T da_j, size pnp */
     double *wght= /* work array for storing the weights computed from the covariance inverses, max. size n*m*mnp*mnp */
@@ -612,6 +1136,11 @@ int sba_motstr_levmar_x(
     int nu=2, nu2, stop=0, nfev, njev=0, nlss=0;
     int nobs, nvars;
     const int mmcon=m-mcon;
+    const int pcg=((int)opts[6]==SBA_SOLVER_PCG);
+    int wflt; /* is the jacobian currently stored in floats? */
+    int wdbl=0, jacdsz=0; /* is a float minimization being finished in double precision? size of jacd in A_ij, B_ij pairs */
+    double eab_inf0=0.0, eta, relres; /* ||J^T e||_inf at the first iteration, PCG forcing term & residual */
+    int pcgits;
     PLS linsolver=NULL;
     int (*matinv)(double *A, int m)=NULL;
 
@@ -684,9 +1213,19 @@ int sba_motstr_levmar_x(
     printf("\nS density: %.5g\n", ((double)ii)/(mmcon*mmcon)); fflush(stdout);
 #endif
 
+    wflt=(opts[7]!=0.0 && fjac!=NULL && fjacf!=NULL && covx==NULL && Sout==NULL && Wout==NULL && Sblocks==NULL);
+
     /* allocate work arrays */
-    /* W is big enough to hold both jac & W. Note also the extra Wsz, see the initialization of jac below for explanation */
-    W=(double *)emalloc((nvis*((Wsz>=ABsz)? Wsz : ABsz) + Wsz)*sizeof(double));
+    /* W is big enough to hold both jac & W. Note also the extra Wsz, see the initialization of jac below for explanation.
+     * When the jacobian is stored in floats, only jacf is allocated
+     */
+    if(wflt){
+        jacf=(float *)emalloc(nvis*ABsz*sizeof(float));
+        W=NULL;
+    }
+    else
+        W=(double *)emalloc((nvis*((Wsz>=ABsz)? Wsz : ABsz) + Wsz)*sizeof(double));
+    Wbuf=(double *)emalloc(((Wsz>=ABsz)? Wsz : ABsz)*sizeof(double));
     U=(double *)emalloc(m*Usz*sizeof(double));
     V=(double *)emalloc(n*Vsz*sizeof(double));
     e=(double *)emalloc(nobs*sizeof(double));
@@ -694,7 +1233,14 @@ int sba_motstr_levmar_x(
     E=(double *)emalloc(m*cnp*sizeof(double));
     Yj=(double *)emalloc(maxPvis*Ysz*sizeof(double));
     YWt=(double *)emalloc(YWtsz*sizeof(double));
-    S=(double *)emalloc(m*m*Sblsz*sizeof(double));
+    if(!pcg || Sout!=NULL)
+        S=(double *)emalloc(m*m*Sblsz*sizeof(double));
+    else
+        S=NULL;
+    if(pcg){
+        P=(double *)emalloc(m*Usz*sizeof(double));
+        pcgwork=(double *)emalloc((4*m*cnp + n*pnp + pnp)*sizeof(double));
+    }
     dp=(double *)emalloc(nvars*sizeof(double));
     Wtda=(double *)emalloc(pnp*sizeof(double));
     rcidxs=(int *)emalloc(maxCPvis*sizeof(int));
@@ -737,7 +1283,10 @@ int sba_motstr_levmar_x(
      * W_ij is guaranteed not to overlap with that allocated to their corresponding
      * A_ij, B_ij pairs
      */
-    jac=W + Wsz + ((Wsz>ABsz)? nvis*(Wsz-ABsz) : 0);
+    jac=(W)? W + Wsz + ((Wsz>ABsz)? nvis*(Wsz-ABsz) : 0) : NULL;
+
+    wb.W=W; wb.jacf=jacf; wb.buf=Wbuf;
+    wb.cnp=cnp; wb.pnp=pnp; wb.mnp=mnp;
 
     /* set up auxiliary pointers */
     pa=p; pb=p+m*cnp;
@@ -845,15 +1394,26 @@ int sba_motstr_levmar_x(
     init_p_eL2=p_eL2;
     if(!SBA_FINITE(p_eL2)) stop=7;
 
-    for(itno=0; itno<itmax && !stop; ++itno){
+    itno=0;
+ iterate:
+    for( ; itno<itmax && !stop; ++itno){
         /* Note that p, e and ||e||_2 have been updated at the previous iteration */
 
 #ifdef TIMINGS
         start = clock();
 #endif
 
-        /* compute derivative submatrices A_ij, B_ij */
-        (*fjac)(p, &idxij, rcidxs, rcsubs, jac, jac_adata); ++njev;
+        /* compute derivative submatrices A_ij, B_ij. When finishing in double precision,
+         * ea & eb are computed along with them, from the double A_ij, B_ij
+         */
+        if(wdbl)
+            sba_dbljac_grad(p, &idxij, rcidxs, rcsubs, fjac, jac_adata, mcon, cnp, pnp, mnp,
+                            e, jacf, jacd, jacdsz, jacdrowptr, ea, eb);
+        else if(wflt)
+            (*fjacf)(p, &idxij, rcidxs, rcsubs, jacf, jac_adata);
+        else
+            (*fjac)(p, &idxij, rcidxs, rcsubs, jac, jac_adata);
+        ++njev;
 
 #ifdef TIMINGS
         end = clock();
@@ -917,7 +1477,7 @@ int sba_motstr_levmar_x(
 #endif
 
         _dblzero(U, m*Usz); /* clear all U_j */
-        _dblzero(ea, m*easz); /* clear all ea_j */
+        if(!wdbl) _dblzero(ea, m*easz); /* clear all ea_j */
         for(j=mcon; j<m; ++j){
             ptr1=U + j*Usz; // set ptr1 to point to U_j
             ptr2=ea + j*easz; // set ptr2 to point to ea_j
@@ -925,7 +1485,8 @@ int sba_motstr_levmar_x(
             nnz=sba_crsm_col_elmidxs(&idxij, j, rcidxs, rcsubs); /* find nonzero A_ij, i=0...n-1 */
             for(i=0; i<nnz; ++i){
                 /* set ptr3 to point to A_ij, actual row number in rcsubs[i] */
-                ptr3=jac + idxij.val[rcidxs[i]]*ABsz;
+                ptr3=(wflt)? sba_fltblock(jacf + idxij.val[rcidxs[i]]*ABsz, Asz, Wbuf) :
+                             jac + idxij.val[rcidxs[i]]*ABsz;
 
                 /* compute the UPPER TRIANGULAR PART of A_ij^T A_ij and add it to U_j */
                 for(ii=0; ii<cnp; ++ii){
@@ -940,6 +1501,8 @@ int sba_motstr_levmar_x(
                         ptr1[ii*cnp+jj]=ptr1[jj*cnp+ii];
                 }
 
+                if(wdbl) continue; /* ea_j is already there */
+
                 ptr4=e + idxij.val[rcidxs[i]]*esz; /* set ptr4 to point to e_ij */
                 /* compute A_ij^T e_ij and add it to ea_j */
                 for(ii=0; ii<cnp; ++ii){
@@ -985,7 +1548,7 @@ int sba_motstr_levmar_x(
 #endif
 
         _dblzero(V, n*Vsz); /* clear all V_i */
-        _dblzero(eb, n*ebsz); /* clear all eb_i */
+        if(!wdbl) _dblzero(eb, n*ebsz); /* clear all eb_i */
         for(i=0; i<n; ++i){
             ptr1=V + i*Vsz; // set ptr1 to point to V_i
             ptr2=eb + i*ebsz; // set ptr2 to point to eb_i
@@ -993,7 +1556,8 @@ int sba_motstr_levmar_x(
             nnz=sba_crsm_row_elmidxs(&idxij, i, rcidxs, rcsubs); /* find nonzero B_ij, j=0...m-1 */
             for(j=0; j<nnz; ++j){
                 /* set ptr3 to point to B_ij, actual column number in rcsubs[j] */
-                ptr3=jac + idxij.val[rcidxs[j]]*ABsz + Asz;
+                ptr3=(wflt)? sba_fltblock(jacf + idxij.val[rcidxs[j]]*ABsz + Asz, Bsz, Wbuf) :
+                             jac + idxij.val[rcidxs[j]]*ABsz + Asz;
       
                 /* compute the UPPER TRIANGULAR PART of B_ij^T B_ij and add it to V_i */
                 for(ii=0; ii<pnp; ++ii){
@@ -1004,6 +1568,8 @@ int sba_motstr_levmar_x(
                     }
                 }
 
+                if(wdbl) continue; /* eb_i is already there */
+
                 ptr4=e + idxij.val[rcidxs[j]]*esz; /* set ptr4 to point to e_ij */
                 /* compute B_ij^T e_ij and add it to eb_i */
                 for(ii=0; ii<pnp; ++ii){
@@ -1051,9 +1617,10 @@ int sba_motstr_levmar_x(
         }
         
         /* compute W_ij =  A_ij^T B_ij */ // \Sigma here!
-        /* Recall that A_ij is mnp x cnp and B_ij is mnp x pnp
+        /* Recall that A_ij is mnp x cnp and B_ij is mnp x pnp.
+         * With float storage, the W_ij are not stored but formed when needed, see sba_wblock()
          */
-        for(i=0; i<n; ++i){
+        for(i=0; i<n && !wflt; ++i){
             nnz=sba_crsm_row_elmidxs(&idxij, i, rcidxs, rcsubs); /* find nonzero W_ij, j=0...m-1 */
             for(j=0; j<nnz; ++j){
                 /* set ptr1 to point to W_ij, actual column number in rcsubs[j] */
@@ -1125,6 +1692,7 @@ int sba_motstr_levmar_x(
             for(i=mcon*cnp, tmp=DBL_MIN; i<nvars; ++i)
                 if(diagUV[i]>tmp) tmp=diagUV[i]; /* find max diagonal element */
             mu=tau*tmp;
+            eab_inf0=eab_inf;
         }
 
         /* determine increment using adaptive damping */
@@ -1167,6 +1735,30 @@ int sba_motstr_levmar_x(
                    (end - start) / (float) CLOCKS_PER_SEC);
 #endif
 
+            if(pcg){
+                /* solve S dpa = E inexactly, with a relative residual eta that is loose far from
+                 * the minimum and tightens as ||J^T e||_inf drops (forcing sequence of an inexact
+                 * Newton method)
+                 */
+                eta=sqrt(eab_inf/eab_inf0);
+                if(eta>SBA_PCG_MAX_ETA) eta=SBA_PCG_MAX_ETA;
+
+                sba_schur_rhs(n, m, mcon, cnp, pnp, &idxij, V, &wb, ea, eb, E, pcgwork);
+                if(!sba_schur_precond(n, m, mcon, cnp, pnp, &idxij, U, V, &wb, P, Yj))
+                    issolved=0;
+                else{
+                    pcgits=sba_schur_pcg(n, m, mcon, cnp, pnp, &idxij, U, V, &wb, P, E, dpa,
+                                         eta, (Sdim<SBA_PCG_MAXITER)? Sdim : SBA_PCG_MAXITER, pcgwork, &relres);
+                    issolved=(pcgits>=0);
+                    if(verbose>1 && issolved){
+                        printf("PCG: %d iterations, relative residual %g (eta %g)\n", pcgits, relres, eta);
+                        fflush(stdout);
+                    }
+                }
+
+                goto schur_solved;
+            }
+
             _dblzero(E, m*easz); /* clear all e_j */
             /* compute the mmcon x mmcon block matrix S and e_j */
 
@@ -1199,7 +1791,7 @@ int sba_motstr_levmar_x(
                     /* set ptr1 to point to Y_ij, actual row number in rcsubs[i] */
                     ptr1=Yj + i*Ysz;
                     /* set ptr2 to point to W_ij resp. */
-                    ptr2=W + idxij.val[rcidxs[i]]*Wsz;
+                    ptr2=sba_wblock(&wb, idxij.val[rcidxs[i]]);
                     /* compute W_ij (V*_i)^-1 and store it in Y_ij.
                      * Recall that only the lower triangle of (V*_i)^-1 is stored
                      */
@@ -1244,7 +1836,7 @@ int sba_motstr_levmar_x(
                         //l=sba_crsm_elmidx(&idxij, rcsubs[i], k);
                         if(l==-1) continue; /* W_ik == 0 */
 
-                        ptr2=W + idxij.val[l]*Wsz;
+                        ptr2=sba_wblock(&wb, idxij.val[l]);
                         /* set ptr1 to point to Y_ij, actual row number in rcsubs[i] */
                         ptr1=Yj + i*Ysz;
 
@@ -1372,6 +1964,7 @@ int sba_motstr_levmar_x(
 	    //issolved=sba_Axb_SVD(S, E+mcon*cnp, dpa+mcon*cnp, Sdim, MAT_STORAGE); linsolver=sba_Axb_SVD;
 	    //issolved=sba_Axb_CG(S, E+mcon*cnp, dpa+mcon*cnp, Sdim, (3*Sdim)/2, 1E-10, SBA_CG_JACOBI, MAT_STORAGE); linsolver=(PLS)sba_Axb_CG;
 
+        schur_solved:
             ++nlss;
 
 	    _dblzero(dpa, mcon*cnp); /* no change for the first mcon camera params */
@@ -1401,7 +1994,7 @@ int sba_motstr_levmar_x(
                         /* set ptr2 to point to W_ij, actual column number in rcsubs[j] */
                         if(rcsubs[j]<mcon) continue; /* W_ij is zero */
 
-                        ptr2=W + idxij.val[rcidxs[j]]*Wsz;
+                        ptr2=sba_wblock(&wb, idxij.val[rcidxs[j]]);
 
                         /* set ptr3 to point to da_j */
                         ptr3=dpa + rcsubs[j]*cnp;
@@ -1614,6 +2207,27 @@ int sba_motstr_levmar_x(
         if(p_eL2<=eps3_sq) stop=5; // error is small, force termination of outer loop
     }
 
+    /* if the minimization converged with the jacobian stored in floats, finish it with J^T e
+     * in double precision. The jacobian is then evaluated in doubles in SBA_DBLJAC_CHUNKS pieces,
+     * each of which gives its part of J^T e before being stored in jacf, so that only a fraction
+     * of it is ever held in double precision. The normal equations are still formed from jacf
+     */
+    if(wflt && !wdbl && (stop==1 || stop==2 || stop==4 || stop==5 || stop==8) && itno<itmax){
+        jacdsz=(nvis + SBA_DBLJAC_CHUNKS-1)/SBA_DBLJAC_CHUNKS;
+        if(jacdsz<maxCvis) jacdsz=maxCvis;
+
+        jacd=(double *)malloc(jacdsz*ABsz*sizeof(double));
+        jacdrowptr=(int *)malloc((n+1)*sizeof(int));
+        if(jacd && jacdrowptr){
+            if(verbose) printf("motstr-SBA: finishing in double precision after %d iterations\n", itno);
+            wdbl=1;
+            stop=0;
+            goto iterate;
+        }
+
+        fprintf(stderr, "SBA: not enough memory for the jacobian in double precision, keeping the single precision solution\n");
+    }
+
     if(itno>=itmax) stop=3;
 
     /* restore U, V diagonal entries */
@@ -1630,7 +2244,7 @@ int sba_motstr_levmar_x(
             ptr1[j*pnp+j]=ptr2[j];
     }
 
-    if (Sout != NULL) {
+    if (Sout != NULL || Sblocks != NULL) {
         /* compute derivative submatrices A_ij, B_ij */
         (*fjac)(p, &idxij, rcidxs, rcsubs, jac, jac_adata); ++njev;
 
@@ -1886,9 +2500,11 @@ int sba_motstr_levmar_x(
         }
 #endif
 
-        /* Compute S with no damping */
+        /* Compute S with no damping, only its nonzero blocks if Sblocks is given */
+        if (Sblocks != NULL)
+            sba_sblocks_compute(n, m, mcon, cnp, pnp, &idxij, rcidxs, rcsubs, U, V, &wb, Yj, Sblocks);
 
-        for(j=mcon; j<m; ++j){
+        for(j=mcon; j<m && Sout!=NULL; ++j){
             int mmconxUsz=mmcon*Usz;
 
             nnz=sba_crsm_col_elmidxs(&idxij, j, rcidxs, rcsubs); /* find nonzero Y_ij, i=0...n-1 */
@@ -2015,13 +2631,14 @@ int sba_motstr_levmar_x(
         }
     
 #if MAT_STORAGE==COLUMN_MAJOR
-        for (i = 0; i < m * cnp; i++) {
+        for (i = 0; i < m * cnp && Sout != NULL; i++) {
             for (j = 0; j < m * cnp; j++) {
                 Sout[i * m * cnp + j] = S[j * m * cnp + i];
             }
         }
 #else
-        memcpy(Sout, S, sizeof(double) * Ssz * m * m);
+        if (Sout != NULL)
+            memcpy(Sout, S, sizeof(double) * Ssz * m * m);
 #endif
     }
     
@@ -2058,6 +2675,9 @@ int sba_motstr_levmar_x(
     free(e);   free(eab);
     free(E);   free(Yj); free(YWt);
     free(S);   free(dp); free(Wtda);
+    free(P);   free(pcgwork);
+    free(jacf); free(Wbuf);
+    free(jacd); free(jacdrowptr);
     free(rcidxs); free(rcsubs);
 #ifndef SBA_DESTROY_COVS
     if(wght) free(wght);
@@ -2076,6 +2696,7 @@ int sba_motstr_levmar_x(
     /* free the memory allocated by the matrix inversion & linear solver routines */
     if(matinv) (*matinv)(NULL, 0);
     if(linsolver) (*linsolver)(NULL, NULL, NULL, 0, 0);
+    if(pcg) sba_symat_invert_Chol(NULL, 0);
 
     return retval;
 }
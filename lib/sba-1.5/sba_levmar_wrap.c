@@ -110,12 +110,15 @@ static void sba_motstr_Qs(double *p, struct sba_crsm *idxij, int *rcidxs, int *r
  * Caller supplies rcidxs and rcsubs which can be used as working memory.
  * Notice that depending on idxij, some of the A_ij, B_ij might be missing
  *
+ *
+ * If jacf is not NULL, the jacobian is stored in it in single precision instead
  */
-static void sba_motstr_Qs_jac(double *p, struct sba_crsm *idxij, int *rcidxs, int *rcsubs, double *jac, void *adata)
+static void sba_motstr_Qs_jac_(double *p, struct sba_crsm *idxij, int *rcidxs, int *rcsubs, double *jac, float *jacf, void *adata)
 {
-  register int i, j;
+  register int i, j, k;
   int cnp, pnp, mnp;
-  double *pa, *pb, *paj, *pbi, *pAij, *pBij;
+  double *pa, *pb, *paj, *pbi, *pAij, *pBij, *ABij=NULL;
+  float *pABf;
   int n, m, nnz, Asz, Bsz, ABsz, idx;
   struct wrap_motstr_data_ *wdata;
   void (*projac)(int j, int i, double *aj, double *bi, double *Aij, double *Bij, void *projac_adata);
@@ -131,6 +134,12 @@ static void sba_motstr_Qs_jac(double *p, struct sba_crsm *idxij, int *rcidxs, in
   pa=p; pb=p+m*cnp;
   Asz=mnp*cnp; Bsz=mnp*pnp; ABsz=Asz+Bsz;
 
+  /* with single precision storage, each A_ij, B_ij pair is evaluated in ABij and then converted */
+  if(jacf && (ABij=(double *)malloc(ABsz*sizeof(double)))==NULL){
+    fprintf(stderr, "memory allocation request failed in sba_motstr_Qs_jac_()!\n");
+    exit(1);
+  }
+
   for(j=0; j<m; ++j){
     /* j-th camera parameters */
     paj=pa+j*cnp;
@@ -140,12 +149,30 @@ static void sba_motstr_Qs_jac(double *p, struct sba_crsm *idxij, int *rcidxs, in
     for(i=0; i<nnz; ++i){
       pbi=pb + rcsubs[i]*pnp;
       idx=idxij->val[rcidxs[i]];
-      pAij=jac  + idx*ABsz; // set pAij to point to A_ij
+      pAij=(jacf)? ABij : jac + idx*ABsz; // set pAij to point to A_ij
       pBij=pAij + Asz; // set pBij to point to B_ij
 
       (*projac)(j, rcsubs[i], paj, pbi, pAij, pBij, projac_adata); // evaluate dQ/da, dQ/db in pAij, pBij
+
+      if(jacf){
+        pABf=jacf + idx*ABsz;
+        for(k=0; k<ABsz; ++k)
+          pABf[k]=(float)ABij[k];
+      }
     }
   }
+
+  if(ABij) free(ABij);
+}
+
+static void sba_motstr_Qs_jac(double *p, struct sba_crsm *idxij, int *rcidxs, int *rcsubs, double *jac, void *adata)
+{
+  sba_motstr_Qs_jac_(p, idxij, rcidxs, rcsubs, jac, NULL, adata);
+}
+
+static void sba_motstr_Qs_jacf(double *p, struct sba_crsm *idxij, int *rcidxs, int *rcsubs, float *jac, void *adata)
+{
+  sba_motstr_Qs_jac_(p, idxij, rcidxs, rcsubs, NULL, jac, adata);
 }
 
 /* Given a parameter vector p made up of the 3D coordinates of n points and the parameters of m cameras, compute in
@@ -160,17 +187,19 @@ static void sba_motstr_Qs_jac(double *p, struct sba_crsm *idxij, int *rcidxs, in
  * NOTE: This function is provided mainly for illustration purposes; in case that execution time is a concern,
  * the jacobian should be computed analytically
  */
-static void sba_motstr_Qs_fdjac(
+static void sba_motstr_Qs_fdjac_(
     double *p,                /* I: current parameter estimate, (m*cnp+n*pnp)x1 */
     struct sba_crsm *idxij,   /* I: sparse matrix containing the location of x_ij in hx */
     int    *rcidxs,           /* work array for the indexes of nonzero elements of a single sparse matrix row/column */
     int    *rcsubs,           /* work array for the subscripts of nonzero elements in a single sparse matrix row/column */
     double *jac,              /* O: array for storing the approximated jacobian */
+    float  *jacf,             /* O: if not NULL, the jacobian is stored here in single precision instead of in jac */
     void   *dat)              /* I: points to a "wrap_motstr_data_" structure */
 {
   register int i, j, ii, jj;
   double *pa, *pb, *paj, *pbi;
   register double *pAB;
+  register float *pABf;
   int n, m, nnz, Asz, Bsz, ABsz;
 
   double tmp;
@@ -194,7 +223,7 @@ static void sba_motstr_Qs_fdjac(
 
   /* allocate memory for hxij, hxxij */
   if((hxij=malloc(2*mnp*sizeof(double)))==NULL){
-    fprintf(stderr, "memory allocation request failed in sba_motstr_Qs_fdjac()!\n");
+    fprintf(stderr, "memory allocation request failed in sba_motstr_Qs_fdjac_()!\n");
     exit(1);
   }
   hxxij=hxij+mnp;
@@ -220,6 +249,13 @@ static void sba_motstr_Qs_fdjac(
           (*proj)(j, rcsubs[i], paj, pbi, hxxij, adata);
           paj[jj]=tmp; /* restore */
 
+          if(jacf){
+            pABf=jacf + idxij->val[rcidxs[i]]*ABsz; // set pABf to point to A_ij
+            for(ii=0; ii<mnp; ++ii)
+              pABf[ii*cnp+jj]=(float)((hxxij[ii]-hxij[ii])*d1);
+            continue;
+          }
+
           pAB=jac + idxij->val[rcidxs[i]]*ABsz; // set pAB to point to A_ij
           for(ii=0; ii<mnp; ++ii)
             pAB[ii*cnp+jj]=(hxxij[ii]-hxij[ii])*d1;
@@ -248,6 +284,13 @@ static void sba_motstr_Qs_fdjac(
           (*proj)(rcsubs[j], i, paj, pbi, hxxij, adata);
           pbi[jj]=tmp; /* restore */
 
+          if(jacf){
+            pABf=jacf + idxij->val[rcidxs[j]]*ABsz + Asz; // set pABf to point to B_ij
+            for(ii=0; ii<mnp; ++ii)
+              pABf[ii*pnp+jj]=(float)((hxxij[ii]-hxij[ii])*d1);
+            continue;
+          }
+
           pAB=jac + idxij->val[rcidxs[j]]*ABsz + Asz; // set pAB to point to B_ij
           for(ii=0; ii<mnp; ++ii)
             pAB[ii*pnp+jj]=(hxxij[ii]-hxij[ii])*d1;
@@ -258,6 +301,16 @@ static void sba_motstr_Qs_fdjac(
   free(hxij);
 }
 
+static void sba_motstr_Qs_fdjac(double *p, struct sba_crsm *idxij, int *rcidxs, int *rcsubs, double *jac, void *dat)
+{
+  sba_motstr_Qs_fdjac_(p, idxij, rcidxs, rcsubs, jac, NULL, dat);
+}
+
+static void sba_motstr_Qs_fdjacf(double *p, struct sba_crsm *idxij, int *rcidxs, int *rcsubs, float *jac, void *dat)
+{
+  sba_motstr_Qs_fdjac_(p, idxij, rcidxs, rcsubs, NULL, jac, dat);
+}
+
 /* BUNDLE ADJUSTMENT FOR CAMERA PARAMETERS ONLY */
 
 /* Given a parameter vector p made up of the parameters of m cameras, compute in
@@ -665,11 +718,13 @@ int sba_motstr_levmar(
                   int use_constraints, camera_constraints_t *constraints, 
                   int use_point_constraints, 
                   point_constraints_t *point_constraints, 
-                  double *Vout, double *Sout, double *Uout, double *Wout)
+                  double *Vout, double *Sout, double *Uout, double *Wout,
+                  struct sba_sblocks *Sblocks)
 {
 int retval;
 struct wrap_motstr_data_ wdata;
 static void (*fjac)(double *p, struct sba_crsm *idxij, int *rcidxs, int *rcsubs, double *jac, void *adata);
+void (*fjacf)(double *p, struct sba_crsm *idxij, int *rcidxs, int *rcsubs, float *jac, void *adata);
 
   wdata.proj=proj;
   wdata.projac=projac;
@@ -679,7 +734,8 @@ static void (*fjac)(double *p, struct sba_crsm *idxij, int *rcidxs, int *rcsubs,
   wdata.adata=adata;
 
   fjac=(projac)? sba_motstr_Qs_jac : sba_motstr_Qs_fdjac;
-  retval=sba_motstr_levmar_x(n, m, mcon, vmask, p, cnp, pnp, x, covx, mnp, sba_motstr_Qs, fjac, &wdata, itmax, verbose, opts, info, use_constraints, constraints, use_point_constraints, point_constraints, Vout, Sout, Uout, Wout);
+  fjacf=(projac)? sba_motstr_Qs_jacf : sba_motstr_Qs_fdjacf;
+  retval=sba_motstr_levmar_x(n, m, mcon, vmask, p, cnp, pnp, x, covx, mnp, sba_motstr_Qs, fjac, fjacf, &wdata, itmax, verbose, opts, info, use_constraints, constraints, use_point_constraints, point_constraints, Vout, Sout, Uout, Wout, Sblocks);
 
   if(info){
     register int i;
@@ -24,9 +24,12 @@
 
 #include "sba.h"
 
+#include "defines.h"
+#include "lm.h"
 #include "matrix.h"
 #include "vector.h"
 #include "sfm.h"
+#include "sfm_project.h"
 
 #ifdef WIN32
 #ifndef M_PI
@@ -52,6 +55,11 @@ typedef struct {
     camera_params_t *init_params;  /* Initial camera parameters */
 
     v3_t *points;
+
+    /* Rotations of the cameras at their last update (cached per call,
+     * so that concurrent run_sfm calls don't share them) */
+    double *last_ws;
+    double *last_Rs;
 } sfm_global_t;
 
 static void *safe_malloc(int n, char *where)
@@ -78,14 +86,7 @@ static void *safe_malloc(int n, char *where)
 void rot_update(double *R, double *w, double *Rnew) 
 {
     double theta, sinth, costh, n[3];
-    double nx[9], nxsq[9];
-    double term2[9], term3[9];
-    double tmp[9], dR[9];
-
-    double ident[9] = 
-	{ 1.0, 0.0, 0.0,
-	  0.0, 1.0, 0.0,
-	  0.0, 0.0, 1.0 };
+    double a, b, dR[9];
 
     theta = sqrt(w[0] * w[0] + w[1] * w[1] + w[2] * w[2]);
 
@@ -98,85 +99,86 @@ void rot_update(double *R, double *w, double *Rnew)
     n[1] = w[1] / theta;
     n[2] = w[2] / theta;
 
-    nx[0] = 0.0;   nx[1] = -n[2];  nx[2] = n[1];
-    nx[3] = n[2];  nx[4] = 0.0;    nx[5] = -n[0];
-    nx[6] = -n[1]; nx[7] = n[0];   nx[8] = 0.0;
-
-    matrix_product33(nx, nx, nxsq);
-
     sinth = sin(theta);
     costh = cos(theta);
 
-    matrix_scale(3, 3, nx, sinth, term2);
-    matrix_scale(3, 3, nxsq, 1.0 - costh, term3);
+    /* Rodrigues' formula, dR = I + sin(theta) [n]_x + 
+     * (1 - cos(theta)) [n]_x^2, written out since this runs once per
+     * projection inside the bundle adjuster */
+    a = sinth;
+    b = 1.0 - costh;
 
-    matrix_sum(3, 3, 3, 3, ident, term2, tmp);
-    matrix_sum(3, 3, 3, 3, tmp, term3, dR);
+    dR[0] = 1.0 - b * (n[1] * n[1] + n[2] * n[2]);
+    dR[1] = -a * n[2] + b * n[0] * n[1];
+    dR[2] =  a * n[1] + b * n[0] * n[2];
+
+    dR[3] =  a * n[2] + b * n[0] * n[1];
+    dR[4] = 1.0 - b * (n[0] * n[0] + n[2] * n[2]);
+    dR[5] = -a * n[0] + b * n[1] * n[2];
+
+    dR[6] = -a * n[1] + b * n[0] * n[2];
+    dR[7] =  a * n[0] + b * n[1] * n[2];
+    dR[8] = 1.0 - b * (n[0] * n[0] + n[1] * n[1]);
 
     matrix_product33(dR, R, Rnew);
 }
 
-v2_t sfm_project_final(camera_params_t *params, v3_t pt, 
-		       int explicit_camera_centers, int undistort)
-{
-    double b_cam[3], b_proj[3];
-    double b[3] = { Vx(pt), Vy(pt), Vz(pt) };
-    v2_t proj;
+/* Instantiate the projection kernels for every camera model */
+#define SFM_PROJ_MODEL_CASES(CASE)                                      \
+    CASE(0)  CASE(1)  CASE(2)  CASE(3)  CASE(4)  CASE(5)  CASE(6)  CASE(7) \
+    CASE(8)  CASE(9)  CASE(10) CASE(11) CASE(12) CASE(13) CASE(14) CASE(15)
 
-    /* Project! */
-    if (!explicit_camera_centers) {
-	matrix_product331(params->R, b, b_cam);
-	b_cam[0] += params->t[0];
-	b_cam[1] += params->t[1];
-	b_cam[2] += params->t[2];
-    } else {
-	double b2[3];
-	b2[0] = b[0] - params->t[0];
-	b2[1] = b[1] - params->t[1];
-	b2[2] = b[2] - params->t[2];
-	matrix_product331(params->R, b2, b_cam);
+void sfm_project_points(int model, const camera_params_t *params,
+                        const double *R, const double *t,
+                        double f, double k1, double k2,
+                        int n, const v3_t *pts, double *x, double *y)
+{
+#define SFM_PROJ_POINTS_CASE(m)                                         \
+    case m:                                                             \
+        sfm_proj_points(m, params, R, t, f, k1, k2, n, pts, x, y);      \
+        break;
+
+    switch (model) {
+        SFM_PROJ_MODEL_CASES(SFM_PROJ_POINTS_CASE)
+    default:
+        printf("[sfm_project_points] Error: bad camera model %d\n", model);
+        break;
     }
-    
-    if (!params->known_intrinsics) {
-        b_proj[0] = b_cam[0] * params->f;
-        b_proj[1] = b_cam[1] * params->f;
-        b_proj[2] = b_cam[2];
 
-        b_proj[0] /= -b_proj[2];
-        b_proj[1] /= -b_proj[2];
-
-        if (undistort) {
-            double rsq = 
-                (b_proj[0] * b_proj[0] + b_proj[1] * b_proj[1]) / 
-                (params->f * params->f);
-            double factor = 1.0 + params->k[0] * rsq + params->k[1] * rsq * rsq;
-
-            b_proj[0] *= factor;
-            b_proj[1] *= factor;
-        }
-    } else {
-        /* Apply intrinsics */
-        double x_n = -b_cam[0] / b_cam[2];
-        double y_n = -b_cam[1] / b_cam[2];
-
-        double *k = params->k_known;
-	double rsq = x_n * x_n + y_n * y_n;
-	double factor = 1.0 + k[0] * rsq + 
-            k[1] * rsq * rsq + k[4] * rsq * rsq * rsq;
+#undef SFM_PROJ_POINTS_CASE
+}
 
-        double dx_x = 2 * k[2] * x_n * y_n + k[3] * (rsq + 2 * x_n * x_n);
-        double dx_y = k[2] * (rsq + 2 * y_n * y_n) + 2 * k[3] * x_n * y_n;
+void sfm_project_point_model(int model, const camera_params_t *params,
+                             const double *R, const double *t,
+                             double f, double k1, double k2,
+                             const double *b, double *p)
+{
+#define SFM_PROJ_POINT_CASE(m)                                          \
+    case m:                                                             \
+        sfm_proj_point(m, params, R, t, f, k1, k2, b, p);               \
+        break;
+
+    switch (model) {
+        SFM_PROJ_MODEL_CASES(SFM_PROJ_POINT_CASE)
+    default:
+        printf("[sfm_project_point_model] Error: bad camera model %d\n", 
+               model);
+        break;
+    }
 
-	double x_d = x_n * factor + dx_x;
-	double y_d = y_n * factor + dx_y;
+#undef SFM_PROJ_POINT_CASE
+}
 
-        double *K = params->K_known;
-        b_proj[0] = K[0] * x_d + K[1] * y_d + K[2];
-        b_proj[1] = K[4] * y_d + K[5];        
-    }
+v2_t sfm_project_final(camera_params_t *params, v3_t pt, 
+		       int explicit_camera_centers, int undistort)
+{
+    /* With known intrinsics, the distortion is part of the intrinsics */
+    int model = sfm_proj_model(params, explicit_camera_centers, 
+                               undistort && !params->known_intrinsics, 0);
+    v2_t proj;
 
-    Vx(proj) = b_proj[0];
-    Vy(proj) = b_proj[1];
+    sfm_project_point_model(model, params, params->R, params->t, params->f,
+                            params->k[0], params->k[1], pt.p, proj.p);
 
     return proj;
 }
@@ -185,265 +187,43 @@ void sfm_project(camera_params_t *init, double *K,
 		 double *w, double *dt, double *b, double *p,
 		 int explicit_camera_centers)
 {
-    double *R, *t;
-
     double Rnew[9];
-    double tnew[3];
-
-    double b_cam[3], b_proj[3];
-
-    R = init->R;
-    t = init->t;
-
-    rot_update(R, w, Rnew);
-
-    tnew[0] = dt[0]; // t[0] + dt[0];
-    tnew[1] = dt[1]; // t[1] + dt[1];  // 0.0
-    tnew[2] = dt[2]; // t[2] + dt[2];  // 0.0
-
-    /* Project! */
-    if (!explicit_camera_centers) {
-	matrix_product331(Rnew, b, b_cam);
-	b_cam[0] += tnew[0];
-	b_cam[1] += tnew[1];
-	b_cam[2] += tnew[2];
-    } else {
-	double b2[3];
-	b2[0] = b[0] - tnew[0];
-	b2[1] = b[1] - tnew[1];
-	b2[2] = b[2] - tnew[2];
-	matrix_product331(Rnew, b2, b_cam);
-    }
-    
-    if (!init->known_intrinsics) {
-        matrix_product331(K, b_cam, b_proj);
-        p[0] = -b_proj[0] / b_proj[2];
-        p[1] = -b_proj[1] / b_proj[2];
-    } else {
-        /* Apply intrinsics */
-        double x_n = -b_cam[0] / b_cam[2];
-        double y_n = -b_cam[1] / b_cam[2];
+    int model = sfm_proj_model(init, explicit_camera_centers, 0, 0);
 
-        double *k = init->k_known;
-	double rsq = x_n * x_n + y_n * y_n;
-	double factor = 1.0 + k[0] * rsq + 
-            k[1] * rsq * rsq + k[4] * rsq * rsq * rsq;
+    rot_update(init->R, w, Rnew);
 
-        double dx_x = 2 * k[2] * x_n * y_n + k[3] * (rsq + 2 * x_n * x_n);
-        double dx_y = k[2] * (rsq + 2 * y_n * y_n) + 2 * k[3] * x_n * y_n;
-
-	double x_d = x_n * factor + dx_x;
-	double y_d = y_n * factor + dx_y;
-
-        double *K = init->K_known;
-        p[0] = K[0] * x_d + K[1] * y_d + K[2];
-        p[1] = K[4] * y_d + K[5];
-    }
+    sfm_project_point_model(model, init, Rnew, dt, K[0], 0.0, 0.0, b, p);
 }
 
-void sfm_project2(camera_params_t *init, double f,
-                  double *R, double *dt, double *b, double *p,
-                  int explicit_camera_centers)
+/* Return the radial distortion parameters stored in k for a camera */
+static void sfm_distortion_params(camera_params_t *init, double *k,
+                                  double *k1, double *k2)
 {
-    double *t;
-
-    double tnew[3];
-    double b_cam[3];
-
-    t = init->t;
-
-    tnew[0] = dt[0];
-    tnew[1] = dt[1];
-    tnew[2] = dt[2];
-
-    /* Project! */
-    if (!explicit_camera_centers) {
-	matrix_product331(R, b, b_cam);
-	b_cam[0] += tnew[0];
-	b_cam[1] += tnew[1];
-	b_cam[2] += tnew[2];
-    } else {
-	double b2[3];
-	b2[0] = b[0] - tnew[0];
-	b2[1] = b[1] - tnew[1];
-	b2[2] = b[2] - tnew[2];
-
-	// matrix_product(3, 3, 3, 1, R, b2, b_cam);
-        b_cam[0] = R[0] * b2[0] + R[1] * b2[1] + R[2] * b2[2];
-        b_cam[1] = R[3] * b2[0] + R[4] * b2[1] + R[5] * b2[2];
-        b_cam[2] = R[6] * b2[0] + R[7] * b2[1] + R[8] * b2[2];
-    }
-    
-    if (!init->known_intrinsics) {
-        p[0] = -b_cam[0] * f / b_cam[2];
-        p[1] = -b_cam[1] * f / b_cam[2];
-    } else {
-        /* Apply intrinsics */
-        double x_n = -b_cam[0] / b_cam[2];
-        double y_n = -b_cam[1] / b_cam[2];
-
-        double *k = init->k_known;
-	double rsq = x_n * x_n + y_n * y_n;
-	double factor = 1.0 + k[0] * rsq + 
-            k[1] * rsq * rsq + k[4] * rsq * rsq * rsq;
-
-        double dx_x = 2 * k[2] * x_n * y_n + k[3] * (rsq + 2 * x_n * x_n);
-        double dx_y = k[2] * (rsq + 2 * y_n * y_n) + 2 * k[3] * x_n * y_n;
-
-	double x_d = x_n * factor + dx_x;
-	double y_d = y_n * factor + dx_y;
-
-        double *K = init->K_known;
-        p[0] = K[0] * x_d + K[1] * y_d + K[2];
-        p[1] = K[4] * y_d + K[5];
-    }
-}
-
-
-void sfm_project_rd(camera_params_t *init, double *K, double *k,
-                    double *R, double *dt, double *b, double *p,
-                    int undistort, int explicit_camera_centers)
-{
-    double *t;
-
-    double tnew[3];
-    double b_cam[3];
-
-    t = init->t;
-
-    tnew[0] = dt[0];
-    tnew[1] = dt[1];
-    tnew[2] = dt[2];
-
-    /* Project! */
-    if (!explicit_camera_centers) {
-	matrix_product331(R, b, b_cam);
-	b_cam[0] += tnew[0];
-	b_cam[1] += tnew[1];
-	b_cam[2] += tnew[2];
-    } else {
-	double b2[3];
-	b2[0] = b[0] - tnew[0];
-	b2[1] = b[1] - tnew[1];
-	b2[2] = b[2] - tnew[2];
-	matrix_product331(R, b2, b_cam);
-    }
-    
-    if (!init->known_intrinsics) {
-        p[0] = -b_cam[0] * K[0] / b_cam[2];
-        p[1] = -b_cam[1] * K[0] / b_cam[2];
-    } else {
-        /* Apply intrinsics */
-        double x_n = -b_cam[0] / b_cam[2];
-        double y_n = -b_cam[1] / b_cam[2];
-
-        double *k = init->k_known;
-	double rsq = x_n * x_n + y_n * y_n;
-	double factor = 1.0 + k[0] * rsq + 
-            k[1] * rsq * rsq + k[4] * rsq * rsq * rsq;
-
-        double dx_x = 2 * k[2] * x_n * y_n + k[3] * (rsq + 2 * x_n * x_n);
-        double dx_y = k[2] * (rsq + 2 * y_n * y_n) + 2 * k[3] * x_n * y_n;
-
-	double x_d = x_n * factor + dx_x;
-	double y_d = y_n * factor + dx_y;
-
-        double *K = init->K_known;
-        p[0] = K[0] * x_d + K[1] * y_d + K[2];
-        p[1] = K[4] * y_d + K[5];
-    }
-
-    // p[0] = b_cam[0] * K[0] / b_cam[2];
-    // p[1] = b_cam[1] * K[0] / b_cam[2];
-
-    /* Apply radial distortion */
-    if (undistort) {
 #ifndef TEST_FOCAL
-        double k1 = k[0], k2 = k[1];
+    *k1 = k[0];
+    *k2 = k[1];
 #else
-        double k1 = k[0] / init->k_scale;
-        double k2 = k[1] / init->k_scale;
+    *k1 = k[0] / init->k_scale;
+    *k2 = k[1] / init->k_scale;
 #endif
-
-	double rsq = (p[0] * p[0] + p[1] * p[1]) / (K[0] * K[0]);
-	double factor = 1.0 + k1 * rsq + k2 * rsq * rsq;
-
-	p[0] *= factor;
-	p[1] *= factor;
-    }
 }
 
-static double *global_last_ws = NULL;
-static double *global_last_Rs = NULL;
-
-static void sfm_project_point(int j, int i, double *aj, double *bi, 
-                              double *xij, void *adata)
+void sfm_project_rd(camera_params_t *init, double *K, double *k,
+                    double *R, double *dt, double *b, double *p,
+                    int undistort, int explicit_camera_centers)
 {
-    sfm_global_t *globs = (sfm_global_t *) adata;
-
-    double K[9] = 
-	{ 1.0, 0.0, 0.0,
-	  0.0, 1.0, 0.0,
-	  0.0, 0.0, 1.0 };
-
-    double *w, *dt;
+    int model = sfm_proj_model(init, explicit_camera_centers, undistort, 0);
+    double k1 = 0.0, k2 = 0.0;
 
-    /* Compute intrinsics */
-    if (!globs->est_focal_length) {
-	K[0] = K[4] = globs->init_params[j].f; // globs->global_params.f;
-    } else if (globs->const_focal_length) {
-	printf("Error: case of constant focal length "
-	       "has not been implemented.\n");
-	K[0] = K[4] = globs->global_params.f;
-    } else {
-	K[0] = K[4] = aj[6];
-    }
-    
-    /* Compute translation, rotation update */
-    dt = aj + 0;
-    w = aj + 3;
-
-#ifdef COLIN_HACK
-    w[0] = w[1] = w[2] = 0.0;
-    dt[2] = 0.0;
-#endif
+    if (undistort)
+        sfm_distortion_params(init, k, &k1, &k2);
 
-    if (globs->estimate_distortion == 0) {
-        sfm_project(globs->init_params + j, K, w, dt, bi, xij, 
-                    globs->explicit_camera_centers);
-    } else {
-        double Rnew[9];
-        rot_update(globs->init_params->R, w, Rnew);
-        sfm_project_rd(globs->init_params + j, K, aj + 7,
-                       Rnew, dt, bi, xij, 1, globs->explicit_camera_centers);
-    }
+    sfm_project_point_model(model, init, R, dt, K[0], k1, k2, b, p);
 }
 
 // k_scale 100.0
 // focal_scale 0.001
 
-static void sfm_fisheye_distort(camera_params_t *cam,
-                                double *x_u, double *x_d)
-{
-    double xn, yn, r, angle, rnew;
-
-    if (cam->fisheye == 0) {
-        x_d[0] = x_u[0];
-        x_d[1] = x_u[1];
-        return;
-    }
-    
-    xn = x_u[0];
-    yn = x_u[1];
-    
-    r = sqrt(xn * xn + yn * yn);
-    angle = 180.0 * atan(r / cam->f_focal) / M_PI;
-    rnew = cam->f_rad * angle / (0.5 * cam->f_angle);
-    
-    x_d[0] = xn * (rnew / r) + cam->f_cx;
-    x_d[1] = yn * (rnew / r) + cam->f_cy;    
-}
-
 static void sfm_project_point2_fisheye(int j, int i, double *aj, double *bi, 
                                        double *xij, void *adata)
 {
@@ -452,7 +232,7 @@ static void sfm_project_point2_fisheye(int j, int i, double *aj, double *bi,
     double f;
 
     double *w, *dt;
-    double xij_tmp[2];
+    int model;
 
     /* Compute intrinsics */
     if (!globs->est_focal_length) {
@@ -478,23 +258,26 @@ static void sfm_project_point2_fisheye(int j, int i, double *aj, double *bi,
     dt[2] = 0.0;
 #endif
 
-    if (w[0] != global_last_ws[3 * j + 0] ||
-	w[1] != global_last_ws[3 * j + 1] ||
-	w[2] != global_last_ws[3 * j + 2]) {
+    if (w[0] != globs->last_ws[3 * j + 0] ||
+	w[1] != globs->last_ws[3 * j + 1] ||
+	w[2] != globs->last_ws[3 * j + 2]) {
 
 	// printf("updating w: %0.3f, %0.3f, %0.3f\n", w[0], w[1], w[2]);
 
-	rot_update(globs->init_params[j].R, w, global_last_Rs + 9 * j);
-	global_last_ws[3 * j + 0] = w[0];
-	global_last_ws[3 * j + 1] = w[1];
-	global_last_ws[3 * j + 2] = w[2];
+	rot_update(globs->init_params[j].R, w, globs->last_Rs + 9 * j);
+	globs->last_ws[3 * j + 0] = w[0];
+	globs->last_ws[3 * j + 1] = w[1];
+	globs->last_ws[3 * j + 2] = w[2];
     }
     
-    sfm_project2(globs->init_params + j, f, global_last_Rs + 9 * j, 
-		 dt, bi, xij_tmp, globs->explicit_camera_centers);
-
-    /* Distort the point */
-    sfm_fisheye_distort(globs->init_params + j, xij_tmp, xij);
+    /* Project and distort the point */
+    model = sfm_proj_model(globs->init_params + j, 
+                           globs->explicit_camera_centers, 0,
+                           globs->init_params[j].fisheye);
+
+    sfm_project_point_model(model, globs->init_params + j, 
+                            globs->last_Rs + 9 * j, dt, f, 0.0, 0.0,
+                            bi, xij);
 }
 
 static void sfm_project_point2_fisheye_mot(int j, int i, double *aj, 
@@ -510,26 +293,24 @@ static void sfm_project_point3(int j, int i, double *aj, double *bi,
 			       double *xij, void *adata)
 {
     sfm_global_t *globs = (sfm_global_t *) adata;
+    camera_params_t *init = globs->init_params + j;
 
-    double K[9] = 
-	{ 1.0, 0.0, 0.0,
-	  0.0, 1.0, 0.0,
-	  0.0, 0.0, 1.0 };
-
+    double f, k1 = 0.0, k2 = 0.0;
     double *w, *dt, *k;
+    int model;
 
     /* Compute intrinsics */
     if (!globs->est_focal_length) {
-	K[0] = K[4] = globs->init_params[j].f; // globs->global_params.f;
+	f = init->f; // globs->global_params.f;
     } else if (globs->const_focal_length) {
 	printf("Error: case of constant focal length "
 	       "has not been implemented.\n");
-	K[0] = K[4] = globs->global_params.f;
+	f = globs->global_params.f;
     } else {
 #ifndef TEST_FOCAL
-	K[0] = K[4] = aj[6];
+	f = aj[6];
 #else
-	K[0] = K[4] = aj[6] / globs->init_params[j].f_scale;
+	f = aj[6] / init->f_scale;
 #endif
     }
     
@@ -542,19 +323,24 @@ static void sfm_project_point3(int j, int i, double *aj, double *bi,
     else
         k = aj + 6;
 
-    if (w[0] != global_last_ws[3 * j + 0] ||
-	w[1] != global_last_ws[3 * j + 1] ||
-	w[2] != global_last_ws[3 * j + 2]) {
+    if (w[0] != globs->last_ws[3 * j + 0] ||
+	w[1] != globs->last_ws[3 * j + 1] ||
+	w[2] != globs->last_ws[3 * j + 2]) {
 
-	rot_update(globs->init_params[j].R, w, global_last_Rs + 9 * j);
-	global_last_ws[3 * j + 0] = w[0];
-	global_last_ws[3 * j + 1] = w[1];
-	global_last_ws[3 * j + 2] = w[2];
+	rot_update(init->R, w, globs->last_Rs + 9 * j);
+	globs->last_ws[3 * j + 0] = w[0];
+	globs->last_ws[3 * j + 1] = w[1];
+	globs->last_ws[3 * j + 2] = w[2];
     }
-    
-    sfm_project_rd(globs->init_params + j, K, k, global_last_Rs + 9 * j, 
-                   dt, bi, xij, globs->estimate_distortion, 
-                   globs->explicit_camera_centers);
+
+    if (globs->estimate_distortion)
+        sfm_distortion_params(init, k, &k1, &k2);
+
+    model = sfm_proj_model(init, globs->explicit_camera_centers,
+                           globs->estimate_distortion, 0);
+
+    sfm_project_point_model(model, init, globs->last_Rs + 9 * j, dt, 
+                            f, k1, k2, bi, xij);
 }
 
 static void sfm_project_point3_mot(int j, int i, double *aj, 
@@ -595,7 +381,8 @@ static void sfm_mot_project_point(int j, int i, double *bi,
 
 #define SBA_V121
 
-void run_sfm(int num_pts, int num_cameras, int ncons,
+/* Returns the number of iterations taken */
+int run_sfm(int num_pts, int num_cameras, int ncons,
              char *vmask,
              double *projections,
              int est_focal_length,
@@ -611,16 +398,19 @@ void run_sfm(int num_pts, int num_cameras, int ncons,
              int fix_points,
              int optimize_for_fisheye,
              double eps2,
+             int use_pcg,
+             int float_jacobians,
              double *Vout, 
              double *Sout,
              double *Uout, double *Wout
-             /* size num_cameras ** 2 * cnp * cnp */)
+             /* size num_cameras ** 2 * cnp * cnp */,
+             struct sba_sblocks *Sblocks)
 {
     int cnp;
     double *params;
 
 #ifdef SBA_V121
-    double opts[6]; // opts[5];
+    double opts[8]; // opts[5];
 #else
     double opts[3];
 #endif
@@ -717,6 +507,8 @@ void run_sfm(int num_pts, int num_cameras, int ncons,
     // opts[4] = 4.0e-2;
     opts[4] = 0.0;
     opts[5] = 4.0e-2; // change this back to opts[4] for sba v1.2.1
+    opts[6] = use_pcg ? SBA_SOLVER_PCG : SBA_SOLVER_DIRECT;
+    opts[7] = float_jacobians ? 1.0 : 0.0;
 #endif
 
     // opts[1] = 1.0e-8;
@@ -799,20 +591,20 @@ void run_sfm(int num_pts, int num_cameras, int ncons,
     global_params.global_params.f = 1.0;
     global_params.init_params = init_camera_params;
 
-    global_last_ws = 
-	safe_malloc(3 * num_cameras * sizeof(double), "global_last_ws");
+    global_params.last_ws = 
+	safe_malloc(3 * num_cameras * sizeof(double), "last_ws");
 
-    global_last_Rs = 
-	safe_malloc(9 * num_cameras * sizeof(double), "global_last_ws");
+    global_params.last_Rs = 
+	safe_malloc(9 * num_cameras * sizeof(double), "last_Rs");
 
     global_params.points = init_pts;
 
     for (i = 0; i < num_cameras; i++) {
-	global_last_ws[3 * i + 0] = 0.0;
-	global_last_ws[3 * i + 1] = 0.0;
-	global_last_ws[3 * i + 2] = 0.0;
+	global_params.last_ws[3 * i + 0] = 0.0;
+	global_params.last_ws[3 * i + 1] = 0.0;
+	global_params.last_ws[3 * i + 2] = 0.0;
 
-	memcpy(global_last_Rs + 9 * i, 
+	memcpy(global_params.last_Rs + 9 * i, 
 	       init_camera_params[i].R, 9 * sizeof(double));
     }
 
@@ -831,7 +623,7 @@ void run_sfm(int num_pts, int num_cameras, int ncons,
                               MAX_ITERS, VERBOSITY, opts, info,
                               use_constraints, constraints,
                               use_point_constraints,
-                              point_constraints, Vout, Sout, Uout, Wout);
+                              point_constraints, Vout, Sout, Uout, Wout, Sblocks);
         } else {
             sba_motstr_levmar(num_pts, num_cameras, ncons, 
                               vmask, params, cnp, 3, projections, NULL, 2,
@@ -840,7 +632,7 @@ void run_sfm(int num_pts, int num_cameras, int ncons,
                               MAX_ITERS, VERBOSITY, opts, info,
                               use_constraints, constraints,
                               use_point_constraints,
-                              point_constraints, Vout, Sout, Uout, Wout); 
+                              point_constraints, Vout, Sout, Uout, Wout, Sblocks);
         }
     } else {
         if (optimize_for_fisheye == 0) {
@@ -1002,93 +794,263 @@ void run_sfm(int num_pts, int num_cameras, int ncons,
 	free(constraints);
     }
 
-    free(global_last_ws);
-    free(global_last_Rs);
+    free(global_params.last_ws);
+    free(global_params.last_Rs);
 
     // #endif
-}
 
+    return (int) info[5];
+}
 
-static int global_num_points = 0;
-static sfm_global_t *global_params = NULL;
-static v3_t *global_points = NULL;
-static v2_t *global_projections = NULL;
-static int global_constrain_focal = 0;
-static double global_init_focal = 0.0;
-static double global_constrain_focal_weight = 0.0;
-static double global_constrain_rd_weight = 0.0;
-static int global_round = 0;
 
-void camera_refine_residual(const int *m, const int *n, 
-			    double *x, double *fvec, int *iflag) 
+/* Problem solved by camera_refine: the camera center (x[0..2]), a
+ * rotation update (x[3..5]) and, if adjusting the focal length, f
+ * (x[6]) and the distortion (x[7..8]) */
+typedef struct {
+    camera_params_t *params;  /* Initial camera */
+    int num_points;
+    v3_t *points;
+    v2_t *projs;
+    int n;                    /* Number of parameters */
+    int estimate_distortion;  /* Is the distortion in x[7..8]? */
+    int model;                /* SFM_PROJ_* model */
+    int num_constraints;      /* Residuals in the prior block */
+    int constrain_focal;
+    double init_focal, focal_weight, rd_weight;
+
+    /* Set by camera_refine_setup for the current x */
+    double R[9];              /* Rotation */
+    double Jw[9];             /* Derivative of the rotation update */
+    double f, k1, k2;
+} camera_refine_data_t;
+
+/* Compute the left jacobian of the rotation exp([w]_x), which maps a
+ * change in w to the rotation applied on top of exp([w]_x) */
+static void rot_update_jacobian(const double *w, double *J)
 {
+    double theta2 = w[0] * w[0] + w[1] * w[1] + w[2] * w[2];
+    double theta = sqrt(theta2);
+    double a, b, W[9], W2[9];
     int i;
-    double error = 0.0, error2 = 0.0;
 
-    for (i = 0; i < global_num_points; i++) {
-	double pt[3] = { Vx(global_points[i]), 
-			 Vy(global_points[i]),
-			 Vz(global_points[i]) };
+    if (theta < 1.0e-4) {
+        a = 0.5 - theta2 / 24.0;
+        b = 1.0 / 6.0 - theta2 / 120.0;
+    } else {
+        a = (1.0 - cos(theta)) / theta2;
+        b = (theta - sin(theta)) / (theta2 * theta);
+    }
 
-	double proj[2], dx, dy;
-        
-	sfm_project_point(0, i, x, pt, proj, (void *) global_params);
+    W[0] = 0.0;    W[1] = -w[2];  W[2] = w[1];
+    W[3] = w[2];   W[4] = 0.0;    W[5] = -w[0];
+    W[6] = -w[1];  W[7] = w[0];   W[8] = 0.0;
 
-	dx = Vx(global_projections[i]) - proj[0];
-	dy = Vy(global_projections[i]) - proj[1];
+    matrix_product33(W, W, W2);
 
-	fvec[2 * i + 0] = dx;
-	fvec[2 * i + 1] = dy;
+    for (i = 0; i < 9; i++)
+        J[i] = a * W[i] + b * W2[i];
 
-	if (*iflag == 0) {
-	    error += dx * dx + dy * dy;
-	    error2 += sqrt(dx * dx + dy * dy);
-	}
+    J[0] += 1.0;  J[4] += 1.0;  J[8] += 1.0;
+}
+
+static void camera_refine_setup(const double *x, int jacobian, void *data)
+{
+    camera_refine_data_t *d = (camera_refine_data_t *) data;
+    camera_params_t *init = d->params;
+
+    rot_update(init->R, (double *) x + 3, d->R);
+
+    if (jacobian)
+        rot_update_jacobian(x + 3, d->Jw);
+
+    d->f = (d->n > 6) ? x[6] : init->f;
+    d->k1 = d->k2 = 0.0;
+
+    if (d->model & SFM_PROJ_DISTORT) {
+        sfm_distortion_params(init, 
+                              d->estimate_distortion ? (double *) x + 7 : 
+                              init->k, &d->k1, &d->k2);
     }
+}
 
-    if (global_constrain_focal == 1) {
-	double focal_diff = global_init_focal - x[6];
-	fvec[2 * global_num_points] = 
-	    global_constrain_focal_weight * focal_diff;
+/* Residual of point i (or of the priors, for i == num_points), and its
+ * jacobian */
+static int camera_refine_block(int i, const double *x, double *r, 
+                               double *J, void *data)
+{
+    camera_refine_data_t *d = (camera_refine_data_t *) data;
+    camera_params_t *init = d->params;
+    const int n = d->n;
+    const double *R = d->R;
+
+    double bc[3], p[2], pu[2];
+    double dbc[3 * 6];    /* d(bc) / d(c, w) */
+    double dp[2 * 9];     /* d(p) / dx */
+    double dpn[2 * 3];    /* d(p) / d(bc) */
+    int j, k;
+
+    if (i == d->num_points) {
+        /* Priors on the focal length and distortion */
+        int nr = 0;
+
+        if (J != NULL)
+            memset(J, 0, sizeof(double) * d->num_constraints * n);
+
+        if (d->constrain_focal) {
+            r[nr] = d->focal_weight * (d->init_focal - x[6]);
+            if (J != NULL)
+                J[nr * n + 6] = -d->focal_weight;
+            nr++;
+        }
 
-        if (global_params->estimate_distortion) {
-            fvec[2 * global_num_points + 1] = 
-                -global_constrain_rd_weight * x[7];
-            fvec[2 * global_num_points + 2] = 
-                -global_constrain_rd_weight * x[8];
+        if (d->estimate_distortion) {
+            for (k = 0; k < 2; k++) {
+                r[nr] = -d->rd_weight * x[7 + k];
+                if (J != NULL)
+                    J[nr * n + 7 + k] = -d->rd_weight;
+                nr++;
+            }
         }
-    } else if (global_params->estimate_distortion) {
-        fvec[2 * global_num_points + 0] = 
-            -global_constrain_rd_weight * x[7];
-        fvec[2 * global_num_points + 1] = 
-            -global_constrain_rd_weight * x[8];
+
+        return nr;
     }
 
-    if (*iflag == 0) {
-        if (global_params->estimate_distortion) {
-            printf("  Round[%d]: RMS error = %0.8f [%0.8f], "
-                   "f = %0.3f; %0.3e %0.3e\n", 
-                   global_round, sqrt(error / global_num_points), 
-                   error2 / global_num_points, x[6], x[7], x[8]);
+    sfm_project_point_model(d->model, init, R, x, 
+                            d->f, d->k1, d->k2, d->points[i].p, p);
+
+    r[0] = Vx(d->projs[i]) - p[0];
+    r[1] = Vy(d->projs[i]) - p[1];
+
+    if (J == NULL)
+        return 2;
+
+    /* bc = R (b - c), so d(bc)/dc = -R and d(bc)/dw = -[bc]_x Jw */
+    sfm_proj_to_camera(SFM_PROJ_CENTER, R, x, d->points[i].p, bc);
+
+    {
+        double B[9] = {  0.0,    bc[2], -bc[1],
+                        -bc[2],  0.0,    bc[0],
+                         bc[1], -bc[0],  0.0 };   /* -[bc]_x */
+        double BJ[9];
+
+        matrix_product33(B, d->Jw, BJ);
+
+        for (j = 0; j < 3; j++) {
+            for (k = 0; k < 3; k++) {
+                dbc[j * 6 + k] = -R[j * 3 + k];
+                dbc[j * 6 + 3 + k] = BJ[j * 3 + k];
+            }
+        }
+    }
+
+    memset(dp, 0, sizeof(double) * 2 * 9);
+
+    {
+        double xn = -bc[0] / bc[2];
+        double yn = -bc[1] / bc[2];
+
+        /* d(xn, yn) / d(bc) */
+        double dxn[3] = { -1.0 / bc[2], 0.0, -xn / bc[2] };
+        double dyn[3] = { 0.0, -1.0 / bc[2], -yn / bc[2] };
+
+        if (d->model & SFM_PROJ_KNOWN) {
+            /* Through the distortion polynomial and K of 
+             * sfm_proj_known */
+            const double *kk = init->k_known;
+            const double *K = init->K_known;
+
+            double rsq = xn * xn + yn * yn;
+            double factor = 1.0 + kk[0] * rsq + kk[1] * rsq * rsq + 
+                kk[4] * rsq * rsq * rsq;
+            double dfactor = kk[0] + 2.0 * kk[1] * rsq + 
+                3.0 * kk[4] * rsq * rsq;   /* d(factor) / d(rsq) */
+
+            double xd_x = factor + 2.0 * xn * xn * dfactor + 
+                2.0 * kk[2] * yn + 6.0 * kk[3] * xn;
+            double xd_y = 2.0 * xn * yn * dfactor + 
+                2.0 * kk[2] * xn + 2.0 * kk[3] * yn;
+            double yd_x = 2.0 * xn * yn * dfactor + 
+                2.0 * kk[2] * xn + 2.0 * kk[3] * yn;
+            double yd_y = factor + 2.0 * yn * yn * dfactor + 
+                6.0 * kk[2] * yn + 2.0 * kk[3] * xn;
+
+            /* Projection before the radial distortion */
+            sfm_proj_known(init, bc, pu);
+
+            for (k = 0; k < 3; k++) {
+                double dxd = xd_x * dxn[k] + xd_y * dyn[k];
+                double dyd = yd_x * dxn[k] + yd_y * dyn[k];
+
+                dpn[k] = K[0] * dxd + K[1] * dyd;
+                dpn[3 + k] = K[4] * dyd;
+            }
+
+            /* p does not depend on f before the radial distortion */
         } else {
-            if (global_params->est_focal_length) {
-                printf("  Round[%d]: RMS error = %0.8f [%0.8f], f = %0.3f\n", 
-                       global_round, sqrt(error / global_num_points),
-                       error2 / global_num_points, x[6]);
-            } else {
-                printf("  Round[%d]: RMS error = %0.8f [%0.8f]\n", 
-                       global_round, sqrt(error / global_num_points),
-                       error2 / global_num_points);        
+            pu[0] = d->f * xn;
+            pu[1] = d->f * yn;
+
+            for (k = 0; k < 3; k++) {
+                dpn[k] = d->f * dxn[k];
+                dpn[3 + k] = d->f * dyn[k];
+            }
+
+            if (n > 6) {
+                dp[6] = xn;
+                dp[9 + 6] = yn;
             }
         }
-        
-	if (global_constrain_focal == 1) {
-	    printf("  Round[%d]: df = %0.3f\n", 
-		   global_round, global_init_focal - x[6]);
-	}
-	
-	global_round++;
     }
+
+    for (j = 0; j < 2; j++) {
+        for (k = 0; k < 6; k++) {
+            dp[j * 9 + k] = dpn[j * 3 + 0] * dbc[0 * 6 + k] + 
+                dpn[j * 3 + 1] * dbc[1 * 6 + k] + 
+                dpn[j * 3 + 2] * dbc[2 * 6 + k];
+        }
+    }
+
+    if (d->model & SFM_PROJ_DISTORT) {
+        /* p' = g p, g = 1 + k1 rsq + k2 rsq^2, rsq = |p|^2 / f^2, 
+         * where p is the undistorted projection */
+        double rsq, g, dg_drsq, dg[2], dg_df;
+
+        g = sfm_proj_radial_factor(d->f, d->k1, d->k2, pu, &rsq);
+
+        dg_drsq = d->k1 + 2.0 * d->k2 * rsq;
+        dg[0] = dg_drsq * 2.0 * pu[0] / (d->f * d->f);
+        dg[1] = dg_drsq * 2.0 * pu[1] / (d->f * d->f);
+        dg_df = dg_drsq * -2.0 * rsq / d->f;
+
+        for (k = 0; k < 7 && k < n; k++) {
+            double dgk = dg[0] * dp[k] + dg[1] * dp[9 + k];
+
+            if (k == 6)
+                dgk += dg_df;
+
+            dp[k] = g * dp[k] + pu[0] * dgk;
+            dp[9 + k] = g * dp[9 + k] + pu[1] * dgk;
+        }
+
+        if (d->estimate_distortion) {
+#ifndef TEST_FOCAL
+            double kscale = 1.0;
+#else
+            double kscale = 1.0 / init->k_scale;
+#endif
+            dp[7] = pu[0] * rsq * kscale;
+            dp[9 + 7] = pu[1] * rsq * kscale;
+            dp[8] = pu[0] * rsq * rsq * kscale;
+            dp[9 + 8] = pu[1] * rsq * rsq * kscale;
+        }
+    }
+
+    for (j = 0; j < 2; j++) {
+        for (k = 0; k < n; k++)
+            J[j * n + k] = -dp[j * 9 + k];
+    }
+
+    return 2;
 }
 
 /* Refine the position of a single camera */
@@ -1096,103 +1058,73 @@ void camera_refine(int num_points, v3_t *points, v2_t *projs,
 		   camera_params_t *params, int adjust_focal, 
                    int estimate_distortion)
 {
-    if (adjust_focal) {
-        int num_camera_params = 7;
-	double x[9] = { params->t[0], params->t[1], params->t[2], 
-			0.0, 0.0, 0.0, params->f, params->k[0], params->k[1] };
-	double Rnew[9];
+    camera_refine_data_t data;
+    double x[9] = { params->t[0], params->t[1], params->t[2], 
+                    0.0, 0.0, 0.0, params->f, params->k[0], params->k[1] };
+    double Rnew[9];
+    double error = 0.0;
+    int i, num_iters;
+
+    data.params = params;
+    data.num_points = num_points;
+    data.points = points;
+    data.projs = projs;
+    data.model = sfm_proj_model(params, 1, estimate_distortion, 0);
+    data.estimate_distortion = adjust_focal && estimate_distortion;
+    data.n = adjust_focal ? (estimate_distortion ? 9 : 7) : 6;
+    data.constrain_focal = 0;
+    data.init_focal = 0.0;
+    data.focal_weight = 0.0;
+    data.rd_weight = 0.0;
+
+    if (adjust_focal && params->constrained[6]) {
+        printf("[camera_refine] Constraining focal length to %0.3f "
+               "(weight: %0.3f)\n",
+               params->constraints[6], 
+               num_points * params->weights[6]);
+        data.constrain_focal = 1;
+        data.init_focal = params->constraints[6];
+        data.focal_weight = 1.0e0 /*1.0e1*/ * num_points * params->weights[6];
+    }
 
-	sfm_global_t globs;
-	int focal_constraint = 0;
-    
-        if (estimate_distortion)
-            num_camera_params += 2;
-
-	globs.num_cameras = 1;
-	globs.num_points = num_points;
-	globs.est_focal_length = 1;
-	globs.const_focal_length = 0;
-	globs.explicit_camera_centers = 1;
-	globs.global_params.f = params->f;
-	globs.init_params = params;
-        globs.estimate_distortion = estimate_distortion;
-
-	global_num_points = num_points;
-	global_params = &globs;
-	global_points = points;
-	global_projections = projs;
-	global_round = 0;
-
-	if (params->constrained[6]) {
-	    printf("[camera_refine] Constraining focal length to %0.3f "
-		   "(weight: %0.3f)\n",
-		   params->constraints[6], 
-		   num_points * params->weights[6]);
-	    focal_constraint = 1;
-	    global_init_focal = params->constraints[6];
-	    global_constrain_focal = 1;
-	    global_constrain_focal_weight = 
-		1.0e0 /*1.0e1*/ * num_points * params->weights[6];
-	} else {
-	    focal_constraint = 0;
-	    global_init_focal = 0.0;
-	    global_constrain_focal = 0;
-	    global_constrain_focal_weight = 0.0;	    
-	}
+    if (data.estimate_distortion) {       
+        data.rd_weight = 0.05 * num_points; 
+            // 1.0e-1 * num_points;
+    }
 
-        if (estimate_distortion) {       
-            global_constrain_rd_weight = 0.05 * num_points; 
-                // 1.0e-1 * num_points;
-        }
-    
-	lmdif_driver2(camera_refine_residual, 
-                      2 * num_points + focal_constraint + 
-                      2 * estimate_distortion, 
-                      num_camera_params, x, 1.0e-12);
+    data.num_constraints = data.constrain_focal + 2 * data.estimate_distortion;
+
+    num_iters = lm_solve(camera_refine_block, camera_refine_setup, &data, 
+                         num_points + (data.num_constraints > 0 ? 1 : 0), 
+                         data.n, x, 1.0e-12, 100);
 
-	/* Copy out the parameters */
-	memcpy(params->t, x + 0, 3 * sizeof(double));
-	rot_update(params->R, x + 3, Rnew);
-	memcpy(params->R, Rnew, 9 * sizeof(double));    
-	params->f = x[6];
+    /* Report the final error */
+    camera_refine_setup(x, 0, &data);
+    for (i = 0; i < num_points; i++) {
+        double r[2];
+        camera_refine_block(i, x, r, NULL, &data);
+        error += r[0] * r[0] + r[1] * r[1];
+    }
+
+    printf("  Round[%d]: RMS error = %0.8f", 
+           num_iters, sqrt(error / num_points));
+    if (adjust_focal)
+        printf(", f = %0.3f", x[6]);
+    if (data.estimate_distortion)
+        printf("; %0.3e %0.3e", x[7], x[8]);
+    printf("\n");
+
+    /* Copy out the parameters */
+    memcpy(params->t, x + 0, 3 * sizeof(double));
+    rot_update(params->R, x + 3, Rnew);
+    memcpy(params->R, Rnew, 9 * sizeof(double));    
+
+    if (adjust_focal) {
+        params->f = x[6];
 
         if (estimate_distortion) {
             params->k[0] = x[7];
             params->k[1] = x[8];
         }
-    } else {
-	double x[6] = { params->t[0], params->t[1], params->t[2], 
-			0.0, 0.0, 0.0 };
-	double Rnew[9];
-
-	sfm_global_t globs;
-    
-	globs.num_cameras = 1;
-	globs.num_points = num_points;
-	globs.est_focal_length = 0;
-	globs.const_focal_length = 1;
-	globs.explicit_camera_centers = 1;
-	globs.global_params.f = params->f;
-	globs.init_params = params;
-        globs.estimate_distortion = estimate_distortion;
-
-	global_num_points = num_points;
-	global_params = &globs;
-	global_points = points;
-	global_projections = projs;
-	global_round = 0;
-
-	global_init_focal = 0.0;
-	global_constrain_focal = 0;
-	global_constrain_focal_weight = 0.0;	    
-    
-	lmdif_driver2(camera_refine_residual, 2 * num_points, 6, x, 1.0e-12);
-
-	/* Copy out the parameters */
-	memcpy(params->t, x + 0, 3 * sizeof(double));
-	rot_update(params->R, x + 3, Rnew);
-	memcpy(params->R, Rnew, 9 * sizeof(double));    
     }
 }
-
-
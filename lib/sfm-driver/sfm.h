@@ -65,7 +65,17 @@ void sfm_project_rd(camera_params_t *init, double *K, double *k,
 v2_t sfm_project_final(camera_params_t *params, v3_t pt,
 		       int explicit_camera_centers, int undistort);
 
-void run_sfm(int num_pts, int num_cameras, int ncons,
+/* Run bundle adjustment.  Returns the number of iterations taken.  If
+ * use_pcg is non-zero, the reduced camera system is solved with
+ * preconditioned conjugate gradients instead of being formed and
+ * factored, which needs far less memory when there are many cameras.
+ * If float_jacobians is non-zero, the jacobian is stored in single
+ * precision until convergence, and then refined with the gradient in
+ * double precision.  If Sblocks is not NULL, it receives the nonzero
+ * blocks of the reduced camera system at the solution (see sba.h) */
+struct sba_sblocks;
+
+int run_sfm(int num_pts, int num_cameras, int ncons,
              char *vmask,
              double *projections,
              int est_focal_length,
@@ -81,9 +91,12 @@ void run_sfm(int num_pts, int num_cameras, int ncons,
              int fix_points,
              int optimize_for_fisheye, 
              double eps2,
+             int use_pcg,
+             int float_jacobians,
              double *Vout,
              double *Sout,
-             double *Uout, double *Wout);
+             double *Uout, double *Wout,
+             struct sba_sblocks *Sblocks);
 
 /* Refine the position of a single camera */
 void camera_refine(int num_points, v3_t *points, v2_t *projs, 
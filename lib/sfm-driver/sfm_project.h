@@ -0,0 +1,243 @@
+/*
+ *  Copyright (c) 2008  Noah Snavely (snavely (at) cs.washington.edu)
+ *    and the University of Washington
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+/* sfm_project.h */
+/* Inline projection kernels shared by the bundle adjuster and Bundler.
+ * Each kernel takes a camera model, a mask of SFM_PROJ_* flags.  The
+ * kernels are forced inline, so a call with a constant model compiles
+ * to straight-line code for that model alone, with the tests on the
+ * other flags folded away.  sfm_project_points (sfm.c) instantiates
+ * every model once, and dispatches to the right one for a whole batch
+ * of points */
+
+#ifndef __sfm_project_h__
+#define __sfm_project_h__
+
+#include <math.h>
+
+#include "sfm.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(_MSC_VER)
+#define SFM_PROJ_INLINE static __forceinline
+#elif defined(__GNUC__)
+#define SFM_PROJ_INLINE static inline __attribute__((always_inline))
+#else
+#define SFM_PROJ_INLINE static inline
+#endif
+
+/* Camera model flags */
+#define SFM_PROJ_CENTER   0x1  /* t is the camera center, rather than
+                                * the translation */
+#define SFM_PROJ_KNOWN    0x2  /* Project through the known intrinsics
+                                * (K_known, k_known) */
+#define SFM_PROJ_DISTORT  0x4  /* Apply radial distortion (k1, k2) */
+#define SFM_PROJ_FISHEYE  0x8  /* Apply the fisheye distortion */
+
+#define SFM_PROJ_NUM_MODELS 16
+
+/* Return the model used for camera params with the given options */
+SFM_PROJ_INLINE int sfm_proj_model(const camera_params_t *params,
+                                   int explicit_camera_centers,
+                                   int distort, int fisheye)
+{
+    return (explicit_camera_centers ? SFM_PROJ_CENTER : 0) |
+        (params->known_intrinsics ? SFM_PROJ_KNOWN : 0) |
+        (distort ? SFM_PROJ_DISTORT : 0) |
+        (fisheye ? SFM_PROJ_FISHEYE : 0);
+}
+
+/* Move the world point b into the camera frame of (R, t) */
+SFM_PROJ_INLINE void sfm_proj_to_camera(int model, const double *R,
+                                        const double *t, const double *b,
+                                        double *b_cam)
+{
+    if (model & SFM_PROJ_CENTER) {
+        double b0 = b[0] - t[0], b1 = b[1] - t[1], b2 = b[2] - t[2];
+
+        b_cam[0] = R[0] * b0 + R[1] * b1 + R[2] * b2;
+        b_cam[1] = R[3] * b0 + R[4] * b1 + R[5] * b2;
+        b_cam[2] = R[6] * b0 + R[7] * b1 + R[8] * b2;
+    } else {
+        b_cam[0] = R[0] * b[0] + R[1] * b[1] + R[2] * b[2] + t[0];
+        b_cam[1] = R[3] * b[0] + R[4] * b[1] + R[5] * b[2] + t[1];
+        b_cam[2] = R[6] * b[0] + R[7] * b[1] + R[8] * b[2] + t[2];
+    }
+}
+
+/* Project the camera-frame point b_cam through the known intrinsics
+ * of params (five-parameter distortion, then K_known) */
+SFM_PROJ_INLINE void sfm_proj_known(const camera_params_t *params,
+                                    const double *b_cam, double *p)
+{
+    const double *k = params->k_known;
+    const double *K = params->K_known;
+
+    double x_n = -b_cam[0] / b_cam[2];
+    double y_n = -b_cam[1] / b_cam[2];
+
+    double rsq = x_n * x_n + y_n * y_n;
+    double factor = 1.0 + k[0] * rsq +
+        k[1] * rsq * rsq + k[4] * rsq * rsq * rsq;
+
+    double dx_x = 2 * k[2] * x_n * y_n + k[3] * (rsq + 2 * x_n * x_n);
+    double dx_y = k[2] * (rsq + 2 * y_n * y_n) + 2 * k[3] * x_n * y_n;
+
+    double x_d = x_n * factor + dx_x;
+    double y_d = y_n * factor + dx_y;
+
+    p[0] = K[0] * x_d + K[1] * y_d + K[2];
+    p[1] = K[4] * y_d + K[5];
+}
+
+/* Return the factor by which the radial distortion (k1, k2) of a
+ * camera with focal length f scales the image point p, and the
+ * squared normalized radius of p in rsq */
+SFM_PROJ_INLINE double sfm_proj_radial_factor(double f, double k1,
+                                              double k2, const double *p,
+                                              double *rsq)
+{
+    *rsq = (p[0] * p[0] + p[1] * p[1]) / (f * f);
+    return 1.0 + k1 * *rsq + k2 * *rsq * *rsq;
+}
+
+/* Scale the image point p by the radial distortion (k1, k2) of a
+ * camera with focal length f.  Returns the distortion factor */
+SFM_PROJ_INLINE double sfm_proj_radial(double f, double k1, double k2,
+                                       double *p)
+{
+    double rsq;
+    double factor = sfm_proj_radial_factor(f, k1, k2, p, &rsq);
+
+    p[0] *= factor;
+    p[1] *= factor;
+
+    return factor;
+}
+
+/* Map the undistorted image point x_u through the fisheye lens of
+ * params */
+SFM_PROJ_INLINE void sfm_proj_fisheye(const camera_params_t *params,
+                                      const double *x_u, double *x_d)
+{
+    double xn = x_u[0], yn = x_u[1];
+    double r = sqrt(xn * xn + yn * yn);
+    double angle = 180.0 * atan(r / params->f_focal) / M_PI;
+    double rnew = params->f_rad * angle / (0.5 * params->f_angle);
+
+    x_d[0] = xn * (rnew / r) + params->f_cx;
+    x_d[1] = yn * (rnew / r) + params->f_cy;
+}
+
+/* Undistort the normalized image point p with the inverse distortion
+ * polynomial k_inv (POLY_INVERSE_DEGREE coefficients) */
+SFM_PROJ_INLINE void sfm_proj_undistort_normalized(const double *k_inv,
+                                                   double *p)
+{
+    double r = sqrt(p[0] * p[0] + p[1] * p[1]);
+    double t = 1.0, a = 0.0, factor;
+    int i;
+
+    if (r == 0.0)
+        return;
+
+    for (i = 0; i < POLY_INVERSE_DEGREE; i++) {
+        a += t * k_inv[i];
+        t = t * r;
+    }
+
+    factor = a / r;
+
+    p[0] *= factor;
+    p[1] *= factor;
+}
+
+/* Project the world point b into the camera with rotation R,
+ * translation (or center) t, focal length f and radial distortion
+ * (k1, k2).  params supplies the known intrinsics and fisheye
+ * parameters, for the models that use them */
+SFM_PROJ_INLINE void sfm_proj_point(int model,
+                                    const camera_params_t *params,
+                                    const double *R, const double *t,
+                                    double f, double k1, double k2,
+                                    const double *b, double *p)
+{
+    double b_cam[3];
+
+    sfm_proj_to_camera(model, R, t, b, b_cam);
+
+    if (model & SFM_PROJ_KNOWN) {
+        sfm_proj_known(params, b_cam, p);
+    } else {
+        p[0] = -b_cam[0] * f / b_cam[2];
+        p[1] = -b_cam[1] * f / b_cam[2];
+    }
+
+    if (model & SFM_PROJ_DISTORT)
+        sfm_proj_radial(f, k1, k2, p);
+
+    if (model & SFM_PROJ_FISHEYE) {
+        double p_u[2] = { p[0], p[1] };
+        sfm_proj_fisheye(params, p_u, p);
+    }
+}
+
+/* Project n world points, storing the coordinates of point i in x[i]
+ * and y[i] */
+SFM_PROJ_INLINE void sfm_proj_points(int model,
+                                     const camera_params_t *params,
+                                     const double *R, const double *t,
+                                     double f, double k1, double k2,
+                                     int n, const v3_t *pts,
+                                     double *x, double *y)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        double p[2];
+
+        sfm_proj_point(model, params, R, t, f, k1, k2, pts[i].p, p);
+
+        x[i] = p[0];
+        y[i] = p[1];
+    }
+}
+
+/* Project n world points with the given model, through the kernel
+ * specialized for it.  Defined in sfm.c */
+void sfm_project_points(int model, const camera_params_t *params,
+                        const double *R, const double *t,
+                        double f, double k1, double k2,
+                        int n, const v3_t *pts, double *x, double *y);
+
+/* As sfm_project_points, for one point */
+void sfm_project_point_model(int model, const camera_params_t *params,
+                             const double *R, const double *t,
+                             double f, double k1, double k2,
+                             const double *b, double *p);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __sfm_project_h__ */
@@ -22,12 +22,13 @@
 
 
 #ifndef __USE_ANN__
-#include "BruteForceSearch.h"
+#include "KdTreeSearch.h"
 #else
 #include "anniface.h"
 #endif /* __USE_ANN__ */
 
 #include "ImageData.h"
+#include "KeyCache.h"
 
 
 
@@ -345,6 +346,52 @@ private:
     std::vector<MatchAdjList> m_match_lists;
 };
 
+/* Number of tracks shared by each pair of images.  Row i holds
+ * (j, count) entries for the images j > i that share at least one
+ * track with i, sorted by j */
+class TrackCovisibility
+{
+public:
+    TrackCovisibility() : m_built(false) { }
+
+    void Clear() {
+        m_rows.clear();
+        m_built = false;
+    }
+
+    bool IsBuilt() const {
+        return m_built;
+    }
+
+    int GetNumShared(int i1, int i2) const {
+        if (i1 == i2)
+            return 0;
+
+        if (i1 > i2)
+            std::swap(i1, i2);
+
+        const std::vector<std::pair<int, int> > &row = m_rows[i1];
+        std::vector<std::pair<int, int> >::const_iterator p = 
+            std::lower_bound(row.begin(), row.end(), 
+                             std::make_pair(i2, 0));
+
+        if (p == row.end() || p->first != i2)
+            return 0;
+
+        return p->second;
+    }
+
+    const std::vector<std::pair<int, int> > &GetRow(int i) const {
+        return m_rows[i];
+    }
+
+private:
+    friend class BaseApp;
+
+    std::vector<std::vector<std::pair<int, int> > > m_rows;
+    bool m_built;
+};
+
 /* Return the match index of a pair of images */
 MatchIndex GetMatchIndex(int i1, int i2);
 MatchIndex GetMatchIndexUnordered(int i1, int i2);
@@ -381,6 +428,8 @@ public:
 
     /* Load a list of image names from a file */
     void LoadImageNamesFromFile(FILE *f);
+    /* Read the dimensions of all jpeg images in one parallel pass */
+    void CacheImageDimensions();
 
     /* Load matches from files */
     void LoadMatches();
@@ -389,6 +438,12 @@ public:
     void LoadMatchIndexes(const char *index_dir);
     /* Load keys from files */
     void LoadKeys(bool descriptor = true);
+    /* Load (or reuse the cached) keys of an image and keep them
+     * loaded until unpinned */
+    void PinKeys(int img, bool undistort = true);
+    void UnpinKeys(int img);
+    /* Load the keys of images about to be used */
+    void PrefetchKeys(const std::vector<int> &imgs, bool undistort = true);
     void RemoveAllMatches();
     /* Prune points that match to multiple targets */
     void PruneDoubleMatches();
@@ -447,7 +502,11 @@ public:
     void SetMatchesFromTracks();
     void SetMatchesFromTracks(int img1, int img2);
     // void ClearMatches(MatchIndex idx);
-    int GetNumTrackMatches(int img1, int img2);
+    int GetNumTrackMatches(int img1, int img2) const;
+    /* Count the tracks shared by every pair of images in one pass */
+    void ComputeTrackCovisibility();
+    /* Shared track counts, computed on first use */
+    const TrackCovisibility &GetTrackCovisibility();
 
     /* Use the bundle-adjusted points to create a new set of matches */
     void SetMatchesFromPoints(int threshold = 0);
@@ -458,7 +517,7 @@ public:
 #ifdef __USE_ANN__
     ANNkd_tree *CreateCameraSearchTree();
 #else
-    BruteForceSearch *CreateCameraSearchTree();
+    KdTreeSearch *CreateCameraSearchTree();
 #endif
 
 #ifndef __DEMO__
@@ -477,6 +536,14 @@ public:
 			std::vector<ImageKeyVector> &pt_views
                         /*bool output_radial_distortion = false*/);
 
+    /* Write the same information in the binary bundle format */
+    void DumpOutputFileBinary(const char *filename, 
+                              int num_images, int num_cameras, int num_points,
+                              int *added_order, 
+                              camera_params_t *cameras, 
+                              v3_t *points, v3_t *colors,
+                              std::vector<ImageKeyVector> &pt_views);
+
 #endif /* __DEMO__ */
 
     /* XML output routines */
@@ -528,6 +595,7 @@ public:
     /* Geometry data */
 
     std::vector<ImageData> m_image_data;   /* Image data */
+    KeyCache m_key_cache;                  /* Keys loaded on demand */
     int m_num_original_images;
 
     std::vector<PointData> m_point_data;   /* Information about 3D
@@ -537,6 +605,8 @@ public:
 
     std::vector<TrackData> m_track_data;   /* Information about the
                                             * detected 3D tracks */
+    TrackCovisibility m_track_covisibility; /* Tracks shared by each
+                                             * pair of images */
 
     ImageKeyVector m_outliers;             /* Outliers detected among
 					    * the feature points */    
@@ -592,6 +662,8 @@ public:
 
     bool m_bundle_provided;      /* Was a bundle adjustment file given? */
     char *m_bundle_file;         /* Bundle file */
+    bool m_output_binary;        /* Write bundle files in binary form? */
+    bool m_output_ply_binary;    /* Write ply files in binary form? */
 
     char *m_match_directory;     /* Which directory are the matches
 				  * stored in? */
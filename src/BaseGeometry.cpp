@@ -24,6 +24,7 @@
 #include <time.h>
 
 #include "BaseApp.h"
+#include "Profiler.h"
 #include "SifterUtil.h"
 
 #include "defines.h"
@@ -101,6 +102,8 @@ void BaseApp::WriteTrackPairs(const char *filename)
 }
 
 void BaseApp::ReadGeometricConstraints(char *filename) {
+    ProfileScope scope("ReadGeometricConstraints");
+
     FILE *f = fopen(filename, "r");
 
     int num_images; // = GetNumImages();
@@ -180,6 +183,7 @@ void BaseApp::ReadGeometricConstraints(char *filename) {
 	   num_tracks);
 
     m_track_data.clear();
+    m_track_covisibility.Clear();
 
     clock_t start = clock();
     int count = 0;
@@ -273,6 +277,8 @@ void BaseApp::ReadGeometricConstraints(char *filename) {
 }
 
 void BaseApp::WriteGeometricConstraints(char *filename) {
+    ProfileScope scope("WriteGeometricConstraints");
+
     FILE *f = fopen(filename, "w");
 
     if (f == NULL) {
@@ -1333,7 +1339,7 @@ ANNkd_tree *Create3DSearchTree(int n, v3_t *v)
 #ifdef __USE_ANN__
 ANNkd_tree *BaseApp::CreateCameraSearchTree()
 #else
-BruteForceSearch *BaseApp::CreateCameraSearchTree()
+KdTreeSearch *BaseApp::CreateCameraSearchTree()
 #endif
 {
     int num_images = GetNumImages();
@@ -1360,7 +1366,7 @@ BruteForceSearch *BaseApp::CreateCameraSearchTree()
 #ifdef __USE_ANN__
     ANNkd_tree *tree = Create3DSearchTree(num_cameras, cameras);
 #else
-    BruteForceSearch *search = new BruteForceSearch(num_cameras, cameras);
+    KdTreeSearch *search = new KdTreeSearch(num_cameras, cameras);
 #endif
 
     delete [] cameras;
@@ -1448,6 +1454,9 @@ void BaseApp::EstimatePointNormals()
 #define NUM_NNS 32 // 100
     int num_points = (int) m_point_data.size();
 
+    ProfileScope scope("EstimatePointNormals");
+    scope.AddItems(num_points);
+
     v3_t *pts = new v3_t[num_points];
 
     for (int i = 0; i < num_points; i++) {
@@ -1460,136 +1469,154 @@ void BaseApp::EstimatePointNormals()
         m_point_data[i].m_norm[2] = 0.0;
     }
 
+    /* The neighbors of a block of points are found at once, then the
+     * planes of the block are fit in parallel.  Each point seeds its
+     * own random numbers, so the normals don't depend on the number
+     * of threads */
+#define NN_BLOCK_SIZE 4096
+    int *block_idxs = new int[NN_BLOCK_SIZE * NUM_NNS];
+
 #ifdef __USE_ANN__
     ANNkd_tree *tree = Create3DSearchTree(num_points, pts);
+    int num_nns = NUM_NNS;
 #else
-    BruteForceSearch *search = new BruteForceSearch(num_points, pts);
+    KdTreeSearch *search = new KdTreeSearch(num_points, pts);
+    int num_nns = MIN(NUM_NNS, num_points);
+    double *block_dists = new double[NN_BLOCK_SIZE * NUM_NNS];
 #endif
 
-    int num_points_inc = 0;
-    for (int i = 0; i < num_points; i++) {
-        if (i % 500 == 0) {
-            printf(".");
-            fflush(stdout);
-        }
-
-        /* For each point, find the NUM_NNS nearest neighbors */
-        PointData &p = m_point_data[i];
-        v3_t q = v3_new(p.m_pos[0], p.m_pos[1], p.m_pos[2]);
+    for (int block = 0; block < num_points; block += NN_BLOCK_SIZE) {
+        int num_queries = MIN(NN_BLOCK_SIZE, num_points - block);
 
-        int nn_idxs[NUM_NNS];
+        printf(".");
+        fflush(stdout);
 
+        /* For each point, find the NUM_NNS nearest neighbors */
 #ifdef __USE_ANN__
-        float dists[NUM_NNS];
-        float query[3] = { Vx(q), Vy(q), Vz(q) };
-        tree->annkPriSearch(query, NUM_NNS, nn_idxs, dists, 0.0);
+        /* ANN keeps its search state in globals */
+        for (int i = 0; i < num_queries; i++) {
+            v3_t q = pts[block + i];
+            float dists[NUM_NNS];
+            float query[3] = { Vx(q), Vy(q), Vz(q) };
+            tree->annkPriSearch(query, NUM_NNS, block_idxs + i * NUM_NNS, 
+                                dists, 0.0);
+        }
 #else
-        double dists[NUM_NNS];
-        search->GetClosestPoints(q, NUM_NNS, nn_idxs, dists);
+        search->GetClosestPoints(num_queries, pts + block, num_nns,
+                                 block_idxs, block_dists);
 #endif
 
-        v3_t nns[NUM_NNS];
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 64)
+#endif
+        for (int b = 0; b < num_queries; b++) {
+            int i = block + b;
+            int *nn_idxs = block_idxs + b * num_nns;
 
-        for (int j = 0; j < NUM_NNS; j++) {
-            PointData &nn = m_point_data[nn_idxs[j]];
-            nns[j] = v3_new(nn.m_pos[0], nn.m_pos[1], nn.m_pos[2]);
-        }
+            v3_t nns[NUM_NNS];
 
-        /* Fit a plane to the nns */
-        double params[4];
+            for (int j = 0; j < num_nns; j++) {
+                PointData &nn = m_point_data[nn_idxs[j]];
+                nns[j] = v3_new(nn.m_pos[0], nn.m_pos[1], nn.m_pos[2]);
+            }
+
+            /* Fit a plane to the nns */
+            double params[4];
 
-        int num_inliers;
-        // double error = 
-        fit_3D_plane_ortreg_ransac(NUM_NNS, nns, 64, 0.1, 
-            &num_inliers, params);
+            int num_inliers;
+            unsigned int seed = (unsigned int) i;
+            // double error = 
+            fit_3D_plane_ortreg_ransac_r(num_nns, nns, 64, 0.1, 
+                &num_inliers, params, &seed);
 
 #if 0
 #define INLIER_THRESHOLD (0.7 * NUM_NNS)
-        if (num_inliers < INLIER_THRESHOLD)
-            continue;
+            if (num_inliers < INLIER_THRESHOLD)
+                continue;
 #endif
 
-        // printf("inliers = %d\n", num_inliers);
+            // printf("inliers = %d\n", num_inliers);
 
 #if 0
 #define ERROR_THRESHOLD 0.1
-        if (error > ERROR_THRESHOLD)
-            continue;
+            if (error > ERROR_THRESHOLD)
+                continue;
 #endif
 
-        /* Project the normal onto the x-z plane */
-        double normal[3] = { params[0], params[1], params[2] };
+            /* Project the normal onto the x-z plane */
+            double normal[3] = { params[0], params[1], params[2] };
 
-        int ref_image = -1;
-        double max_dot = 0.0;
-        double max_dot_signed = 0.0;
-        int num_views = (int) m_point_data[i].m_views.size();
+            int ref_image = -1;
+            double max_dot = 0.0;
+            double max_dot_signed = 0.0;
+            int num_views = (int) m_point_data[i].m_views.size();
 
-        for (int j = 0; j < num_views; j++) {
-            int idx = m_point_data[i].m_views[j].first;
+            for (int j = 0; j < num_views; j++) {
+                int idx = m_point_data[i].m_views[j].first;
 
-            double dir[3];
-            m_image_data[idx].m_camera.GetViewDirection(dir);
+                double dir[3];
+                m_image_data[idx].m_camera.GetViewDirection(dir);
 
-            double dot;
-            matrix_product(1, 3, 3, 1, normal, dir, &dot);
+                double dot;
+                matrix_product(1, 3, 3, 1, normal, dir, &dot);
 
-            if (fabs(dot) > max_dot) {
-                max_dot = fabs(dot);
-                max_dot_signed = dot;
-                ref_image = idx;
+                if (fabs(dot) > max_dot) {
+                    max_dot = fabs(dot);
+                    max_dot_signed = dot;
+                    ref_image = idx;
+                }
             }
-        }
 
-        if (ref_image == -1) {
-            printf("ref image = -1\n");
-        }
+            if (ref_image == -1) {
+                printf("ref image = -1\n");
+            }
 
-        if (max_dot_signed < 0.0) {
-            matrix_scale(3, 1, normal, -1.0, normal);
-        }
+            if (max_dot_signed < 0.0) {
+                matrix_scale(3, 1, normal, -1.0, normal);
+            }
 
-        memcpy(m_point_data[i].m_norm, normal, 3 * sizeof(double));
-        m_point_data[i].m_ref_image = ref_image;
+            memcpy(m_point_data[i].m_norm, normal, 3 * sizeof(double));
+            m_point_data[i].m_ref_image = ref_image;
 
 #if 0
-        double dot;
-        matrix_product(1, 3, 3, 1, normal, up, &dot);
+            double dot;
+            matrix_product(1, 3, 3, 1, normal, up, &dot);
 
-        double parallel[3];
-        matrix_scale(3, 1, up, dot, parallel);
+            double parallel[3];
+            matrix_scale(3, 1, up, dot, parallel);
 
-        double perp[3];
-        matrix_diff(3, 1, 3, 1, normal, parallel, perp);
+            double perp[3];
+            matrix_diff(3, 1, 3, 1, normal, parallel, perp);
 
 #define NORM_THRESHOLD 0.95 // 0.9
-        double norm = matrix_norm(3, 1, perp);
+            double norm = matrix_norm(3, 1, perp);
 
-        if (norm < NORM_THRESHOLD)
-            continue;
+            if (norm < NORM_THRESHOLD)
+                continue;
 
-        matrix_scale(3, 1, perp, 1.0 / norm, perp);
+            matrix_scale(3, 1, perp, 1.0 / norm, perp);
 
-        /* Compute the angle of the new normal */
-        matrix_product(1, 3, 3, 1, perp, xaxis, &dot);
-        double theta = acos(dot);
+            /* Compute the angle of the new normal */
+            matrix_product(1, 3, 3, 1, perp, xaxis, &dot);
+            double theta = acos(dot);
 
-        double cross[3];
-        matrix_cross(perp, xaxis, cross);
-        matrix_product(1, 3, 3, 1, cross, up, &dot);	
+            double cross[3];
+            matrix_cross(perp, xaxis, cross);
+            matrix_product(1, 3, 3, 1, cross, up, &dot);	
 #endif
-
-        num_points_inc++;
+        }
     }
 
     printf("\n");
 
     delete [] pts;
+    delete [] block_idxs;
 
 #ifdef __USE_ANN__
     delete tree;
 #else
     delete search;
+    delete [] block_dists;
 #endif
 }
 
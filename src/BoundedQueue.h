@@ -0,0 +1,77 @@
+/*
+ *  Copyright (c) 2008-2010  Noah Snavely (snavely (at) cs.cornell.edu)
+ *    and the University of Washington
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+/* BoundedQueue.h */
+/* Blocking FIFO with a fixed capacity, for connecting pipeline stages */
+
+#ifndef __bounded_queue_h__
+#define __bounded_queue_h__
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+template <class T>
+class BoundedQueue {
+public:
+    BoundedQueue(int capacity, int num_producers = 1)
+        : m_capacity(capacity), m_num_producers(num_producers) { }
+
+    /* Add an item, blocking while the queue is full */
+    void Push(const T &item) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while ((int) m_items.size() >= m_capacity)
+            m_not_full.wait(lock);
+
+        m_items.push_back(item);
+        m_not_empty.notify_one();
+    }
+
+    /* Remove an item, blocking while the queue is empty.  Returns
+     * false once all producers are done and the queue is drained */
+    bool Pop(T &item) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (m_items.empty() && m_num_producers > 0)
+            m_not_empty.wait(lock);
+
+        if (m_items.empty())
+            return false;
+
+        item = m_items.front();
+        m_items.pop_front();
+        m_not_full.notify_one();
+
+        return true;
+    }
+
+    /* Called by each producer when it will push no more items */
+    void ProducerDone() {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_num_producers--;
+        if (m_num_producers <= 0)
+            m_not_empty.notify_all();
+    }
+
+private:
+    int m_capacity;
+    int m_num_producers;
+
+    std::deque<T> m_items;
+    std::mutex m_mutex;
+    std::condition_variable m_not_full, m_not_empty;
+};
+
+#endif /* __bounded_queue_h__ */
@@ -22,6 +22,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
+#include <algorithm>
 #include <queue>
 #include <vector>
 
@@ -32,6 +33,7 @@
 #include "qsort.h"
 #include "resample.h"
 #include "sfm.h"
+#include "sfm_project.h"
 #include "triangulate.h"
 #include "util.h"
 
@@ -40,6 +42,8 @@
 #include "BundleAdd.h"
 #include "Epipolar.h"
 #include "Distortion.h"
+#include "Profiler.h"
+#include "SmallMatrix.h"
 
 /* Use a 180 rotation to fix up the intrinsic matrix */
 void FixIntrinsics(double *P, double *K, double *R, double *t) 
@@ -107,9 +111,10 @@ double ComputeRayAngle(v2_t p, v2_t q,
     GetIntrinsics(cam1, K1);
     GetIntrinsics(cam2, K2);
 
+    /* A camera without a focal length has no rays */
     double K1_inv[9], K2_inv[9];
-    matrix_invert(3, K1, K1_inv);
-    matrix_invert(3, K2, K2_inv);
+    if (!SmallMatrixInvert3(K1, K1_inv) || !SmallMatrixInvert3(K2, K2_inv))
+        return 0.0;
 
     double p3[3] = { Vx(p), Vy(p), 1.0 };
     double q3[3] = { Vx(q), Vy(q), 1.0 };
@@ -182,7 +187,7 @@ bool CheckCheirality(v3_t p, const camera_params_t &camera)
     pt[0] -= camera.t[0];
     pt[1] -= camera.t[1];
     pt[2] -= camera.t[2];
-    matrix_product(3, 3, 3, 1, (double *) camera.R, pt, cam);
+    SmallMatrixProduct<3,3,1>(camera.R, pt, cam);
 
     // EDIT!!!
     if (cam[2] > 0.0)
@@ -277,7 +282,8 @@ CheckPointKeyConsistency(const std::vector<ImageKeyVector> pt_views,
     printf("[CheckPointKeyConsistency] There were %d errors\n", errors);
 }
 
-void BundlerApp::ReRunSFM(double *S, double *U, double *V, double *W) 
+void BundlerApp::ReRunSFM(double *S, double *U, double *V, double *W,
+                          sba_sblocks *S_blocks)
 {
     // #define RERUN_ADD_POINTS
 #ifdef RERUN_ADD_POINTS
@@ -311,7 +317,7 @@ void BundlerApp::ReRunSFM(double *S, double *U, double *V, double *W)
         fflush(stdout);
 
         if (m_image_data[i].m_camera.m_adjusted) {
-            m_image_data[i].LoadKeys(false, !m_optimize_for_fisheye);
+            PinKeys(i, !m_optimize_for_fisheye);
 
 #ifdef RERUN_ADD_POINTS
             m_image_data[i].ReadKeyColors();
@@ -438,7 +444,7 @@ void BundlerApp::ReRunSFM(double *S, double *U, double *V, double *W)
         added_order, cameras, init_pts, colors, pt_views);
 
     RunSFM(num_pts, num_init_cams, 0, false, cameras, init_pts, added_order, 
-        colors, pt_views, 0.0 /*eps2*/, S, U, V, W);
+        colors, pt_views, 0.0 /*eps2*/, S, U, V, W, true, S_blocks);
 
     /* Save the camera parameters and points */
 
@@ -520,14 +526,61 @@ void BundlerApp::ReRunSFM(double *S, double *U, double *V, double *W)
     delete [] added_order_inv;
 }
 
-static int compare_doubles(const void *d1, const void *d2)
+/* Reprojection errors of the points seen by one camera */
+struct CameraErrorStats {
+    std::vector<double> m_dists;  /* Error of each point, in key order */
+    double m_thresh;              /* Outlier threshold */
+    double m_median;              /* Median error */
+};
+
+/* Return the kth smallest of the given errors (0.0 if k is out of
+ * range, as kth_element).  The errors are reordered */
+static double KthError(std::vector<double> &errors, int k)
+{
+    if (k >= (int) errors.size()) {
+        printf("[kth_element] Error: k should be < n\n");
+        return 0.0;
+    }
+
+    std::nth_element(errors.begin(), errors.begin() + k, errors.end());
+
+    return errors[k];
+}
+
+#define NUM_ERROR_BINS 10
+
+/* Print a histogram of the given errors, in NUM_ERROR_BINS equal bins
+ * between the smallest and the largest */
+static void PrintErrorHistogram(const std::vector<double> &errors)
 {
-    double a = *(double *) d1;
-    double b = *(double *) d2;
+    int n = (int) errors.size();
+
+    if (n == 0)
+        return;
+
+    double pr_min = *std::min_element(errors.begin(), errors.end());
+    double pr_max = *std::max_element(errors.begin(), errors.end());
+    double pr_step = (pr_max - pr_min) / NUM_ERROR_BINS;
+
+    int bin_sizes[NUM_ERROR_BINS] = { 0 };
+
+    for (int j = 0; j < n; j++) {
+        /* Find the first bin whose upper end is at least errors[j]
+         * (the bin ends are compared exactly as they are printed) */
+        for (int i = 0; i < NUM_ERROR_BINS; i++) {
+            if (errors[j] <= pr_min + (i+1) * pr_step) {
+                bin_sizes[i]++;
+                break;
+            }
+        }
+    }
 
-    if (a < b) return -1;
-    if (a > b) return 1;
-    return 0;
+    for (int i = 0; i < NUM_ERROR_BINS; i++) {
+        double max = pr_min + (i+1) * pr_step;
+        printf("   E[%0.3e--%0.3e]: %d [%0.3f]\n", 
+            max - pr_step, max, bin_sizes[i], 
+            bin_sizes[i] / (double) n);
+    }
 }
 
 
@@ -536,9 +589,11 @@ double BundlerApp::RunSFM(int num_pts, int num_cameras, int start_camera,
                           v3_t *init_pts, int *added_order, v3_t *colors,
                           std::vector<ImageKeyVector> &pt_views, double eps2, 
                           double *S, double *U, double *V, double *W,
-                          bool remove_outliers)
+                          bool remove_outliers, sba_sblocks *S_blocks)
 {
 #define MIN_POINTS 20
+    ProfileScope scope("RunSFM");
+
     int num_outliers = 0;
     int total_outliers = 0;
     double dist_total = 0.0;
@@ -602,40 +657,49 @@ double BundlerApp::RunSFM(int num_pts, int num_cameras, int start_camera,
         num_dists = 0;
 
         bool fixed_focal = m_fixed_focal_length;
-        clock_t start = clock();
+        bool use_pcg = m_pcg_camera_threshold > 0 &&
+            num_cameras - start_camera > m_pcg_camera_threshold;
+        double start = GetWallTime();
 
-        run_sfm(nz_count, num_cameras, start_camera, vmask, projections, 
-            fixed_focal ? 0 : 1, 0,
-            m_estimate_distortion ? 1 : 0, 1,
-            init_camera_params, nz_pts, 
-            (m_use_constraints || m_constrain_focal) ? 1 : 0,
-            (m_use_point_constraints) ? 1 : 0,
-            m_point_constraints, m_point_constraint_weight,
-            fix_points ? 1 : 0, m_optimize_for_fisheye, eps2, V, S, U, W);
+        {
+            ProfileScope sba_scope("SBA");
+
+            int num_iters = 
+                run_sfm(nz_count, num_cameras, start_camera, vmask, 
+                    projections, fixed_focal ? 0 : 1, 0,
+                    m_estimate_distortion ? 1 : 0, 1,
+                    init_camera_params, nz_pts, 
+                    (m_use_constraints || m_constrain_focal) ? 1 : 0,
+                    (m_use_point_constraints) ? 1 : 0,
+                    m_point_constraints, m_point_constraint_weight,
+                    fix_points ? 1 : 0, m_optimize_for_fisheye, eps2, 
+                    use_pcg ? 1 : 0, m_float_jacobians ? 1 : 0,
+                    V, S, U, W, S_blocks);
+
+            sba_scope.AddItems(num_iters);
+        }
 
-        clock_t end = clock();
+        double end = GetWallTime();
 
-        printf("[RunSFM] run_sfm took %0.3fs\n",
-            (double) (end - start) / (double) CLOCKS_PER_SEC);
+        printf("[RunSFM] run_sfm took %0.3fs\n", end - start);
 
         /* Check for outliers */
 
-        start = clock();
+        start = GetWallTime();
 
         std::vector<int> outliers;
         std::vector<double> reproj_errors;
 
+        /* Project the points seen by each camera, in parallel, and
+         * pick the outlier threshold for each camera */
+        std::vector<CameraErrorStats> stats(num_cameras);
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
         for (int i = 0; i < num_cameras; i++) {
             ImageData &data = m_image_data[added_order[i]];
 
-            double K[9] = { init_camera_params[i].f, 0.0, 0.0, 
-                0.0, init_camera_params[i].f, 0.0,
-                0.0, 0.0, 1.0 };
-            // double w[3] = { 0.0, 0.0, 0.0 };
-            double dt[3] = { init_camera_params[i].t[0],
-                init_camera_params[i].t[1],
-                init_camera_params[i].t[2] };		    
-
             /* Compute inverse distortion parameters */
             if (m_estimate_distortion) {
                 double *k = init_camera_params[i].k;
@@ -663,91 +727,92 @@ double BundlerApp::RunSFM(int num_pts, int num_cameras, int start_camera,
                     init_camera_params[i].k_inv);
             }
 
-            int num_keys = GetNumKeys(added_order[i]);
+            /* Gather the points seen by this camera, and project them
+             * all at once */
+            std::vector<v3_t> pts_proj;
+            std::vector<double> keys_x, keys_y;
 
-            int num_pts_proj = 0;
-            for (int j = 0; j < num_keys; j++) {
-                if (GetKey(added_order[i], j).m_extra >= 0) {
-                    num_pts_proj++;
+            std::vector<Keypoint>::iterator iter;
+            for (iter = data.m_keys.begin(); iter != data.m_keys.end(); 
+                 iter++) {
+                if (iter->m_extra >= 0) {
+                    pts_proj.push_back(nz_pts[remap[iter->m_extra]]);
+                    keys_x.push_back(iter->m_x);
+                    keys_y.push_back(iter->m_y);
                 }
             }
 
-            double *dists = new double[num_pts_proj];
-            int pt_count = 0;
-
-            std::vector<Keypoint>::iterator iter;
-            // for (int j = 0; j < num_keys; j++) {
-            for (iter = m_image_data[added_order[i]].m_keys.begin();
-                iter != m_image_data[added_order[i]].m_keys.end();
-                iter++) {
-
-                    const Keypoint &key = *iter;
+            int num_pts_proj = (int) pts_proj.size();
 
-                    if (key.m_extra >= 0) {
-                        double b[3], pr[2];
-                        double dx, dy, dist;
-                        int pt_idx = key.m_extra;
+            std::vector<double> pr_x(num_pts_proj), pr_y(num_pts_proj);
 
-                        b[0] = Vx(nz_pts[remap[pt_idx]]);
-                        b[1] = Vy(nz_pts[remap[pt_idx]]);
-                        b[2] = Vz(nz_pts[remap[pt_idx]]);
+            if (num_pts_proj > 0) {
+                camera_params_t *camera = init_camera_params + i;
+                int model = sfm_proj_model(camera, 1, 
+                                           m_estimate_distortion ? 1 : 0, 0);
 
-                        sfm_project_rd(&(init_camera_params[i]), K, 
-                            init_camera_params[i].k,
-                            init_camera_params[i].R, dt, b, pr, 
-                            m_estimate_distortion, true);
+                sfm_project_points(model, camera, camera->R, camera->t,
+                                   camera->f, camera->k[0], camera->k[1],
+                                   num_pts_proj, &pts_proj[0], 
+                                   &pr_x[0], &pr_y[0]);
 
-                        if (m_optimize_for_fisheye) {
-                            /* Distort the points */
-                            double x = pr[0], y = pr[1];
-                            m_image_data[added_order[i]].
-                                DistortPoint(x, y, pr[0], pr[1]);
-                        }
-
-                        dx = pr[0] - key.m_x;
-                        dy = pr[1] - key.m_y;
+                if (m_optimize_for_fisheye) {
+                    /* Distort the points */
+                    data.DistortPoints(num_pts_proj, &pr_x[0], &pr_y[0],
+                                       &pr_x[0], &pr_y[0]);
+                }
+            }
 
-                        dist = sqrt(dx * dx + dy * dy);
-                        dist_total += dist;
-                        num_dists++;
+            std::vector<double> &dists = stats[i].m_dists;
+            dists.resize(num_pts_proj);
 
-                        dists[pt_count] = dist;
+            for (int j = 0; j < num_pts_proj; j++) {
+                double dx = pr_x[j] - keys_x[j];
+                double dy = pr_y[j] - keys_y[j];
 
-                        pt_count++;
-                    }
+                dists[j] = sqrt(dx * dx + dy * dy);
             }
 
             /* Estimate the median of the distances */
-            double med = kth_element_copy(num_pts_proj, 
-                iround(0.8 /* 0.9 */ * num_pts_proj),
-                dists);
-
-            median_copy(num_pts_proj, dists);
+            std::vector<double> sorted = dists;
+            double med = 
+                KthError(sorted, iround(0.8 /* 0.9 */ * num_pts_proj));
 
 #define NUM_STDDEV 2.0 // 3.0 // 6.0
             double thresh = 1.2 * NUM_STDDEV * med; /* k * stddev */
-            thresh = CLAMP(thresh, m_min_proj_error_threshold, 
-                m_max_proj_error_threshold);  
+            stats[i].m_thresh = CLAMP(thresh, m_min_proj_error_threshold, 
+                                      m_max_proj_error_threshold);  
+            stats[i].m_median = KthError(sorted, iround(0.5 * num_pts_proj));
+        }
+
+        std::vector<bool> is_outlier(num_pts, false);
+
+        for (int i = 0; i < num_cameras; i++) {
+            const std::vector<double> &dists = stats[i].m_dists;
+            int num_pts_proj = (int) dists.size();
+            double thresh = stats[i].m_thresh;
 
             /* Compute the average reprojection error for this
             * camera */
 
             double sum = 0.0;
             for (int j = 0; j < num_pts_proj; j++) {
+                dist_total += dists[j];
                 sum += dists[j];
             }
 
+            num_dists += num_pts_proj;
+
             double avg = sum / num_pts_proj;
             printf("[RunSFM] Mean error cam %d[%d] [%d pts]: %0.3e "
                 "[med: %0.3e, %0.3e]\n",
                 i, added_order[i], num_pts_proj, avg, 
-                kth_element_copy(num_pts_proj, 
-                iround(0.5 * num_pts_proj), dists), 
-                thresh);
+                stats[i].m_median, thresh);
 
             // printf("Outlier threshold is %0.3f\n", thresh);
 
-            pt_count = 0;
+            int num_keys = GetNumKeys(added_order[i]);
+            int pt_count = 0;
             for (int j = 0; j < num_keys; j++) {
                 int pt_idx = GetKey(added_order[i],j).m_extra;
 
@@ -761,50 +826,19 @@ double BundlerApp::RunSFM(int num_pts, int num_cameras, int start_camera,
                         continue;
                 }
 
-                if (dists[pt_count] > thresh) {
+                if (dists[pt_count] > thresh && !is_outlier[pt_idx]) {
                     /* Remove this point from consideration */
-                    bool found = false;
-                    for (int k = 0; k < (int) outliers.size(); k++) {
-                        if (outliers[k] == pt_idx) {
-                            found = true;
-                            break;
-                        }
-                    }
-
-                    if (!found) {
-                        outliers.push_back(pt_idx);
-                        reproj_errors.push_back(dists[pt_count]);
-                    }
+                    is_outlier[pt_idx] = true;
+                    outliers.push_back(pt_idx);
+                    reproj_errors.push_back(dists[pt_count]);
                 }
                 pt_count++;
             }
 
 #define OUTPUT_VERBOSE_STATS
 #ifdef OUTPUT_VERBOSE_STATS
-#define NUM_ERROR_BINS 10
-            qsort(dists, num_pts_proj, sizeof(double), compare_doubles);
-
-            double pr_min = dists[0];
-            double pr_max = dists[num_pts_proj-1];
-            double pr_step = (pr_max - pr_min) / NUM_ERROR_BINS;
-
-            /* Break histogram into 10 bins */
-            int idx_count = 0;
-            for (int i = 0; i < NUM_ERROR_BINS; i++) {
-                double max = pr_min + (i+1) * pr_step;
-                int start = idx_count;
-
-                while (idx_count < num_pts_proj && dists[idx_count] <= max)
-                    idx_count++;
-
-                int bin_size = idx_count - start;
-                printf("   E[%0.3e--%0.3e]: %d [%0.3f]\n", 
-                    max - pr_step, max, bin_size, 
-                    bin_size / (double) num_pts_proj);
-            }
+            PrintErrorHistogram(dists);
 #endif
-
-            delete [] dists;
         }
 
         /* Remove outlying points */
@@ -845,9 +879,8 @@ double BundlerApp::RunSFM(int num_pts, int num_cameras, int start_camera,
             num_outliers = outliers.size();
             total_outliers += num_outliers;
 
-            end = clock();
-            printf("[RunSFM] outlier removal took %0.3fs\n",
-                (double) (end - start) / (double) CLOCKS_PER_SEC);
+            end = GetWallTime();
+            printf("[RunSFM] outlier removal took %0.3fs\n", end - start);
 
             printf("[RunSFM] Removing %d outliers\n", num_outliers);
         }
@@ -969,7 +1002,7 @@ void BundlerApp::InitializeBundleAdjust(int &num_init_cams,
         if (m_image_data[i].m_camera.m_adjusted) {
             printf("[InitializeBundleAdjust] Loading keys for "
                 "image %d\n", i);
-            m_image_data[i].LoadKeys(false, !m_optimize_for_fisheye);
+            PinKeys(i, !m_optimize_for_fisheye);
             m_image_data[i].ReadKeyColors();
             SetTracks(i);
 
@@ -1135,6 +1168,199 @@ void BundlerApp::InitializeBundleAdjust(int &num_init_cams,
         sqrt(error / n));
 }
 
+/* Save the state of the incremental bundle adjustment before the
+ * given round to the checkpoint file (every m_checkpoint_interval
+ * rounds).  The state is copied here, and written out in the
+ * background while the round runs */
+void BundlerApp::SaveCheckpoint(int round, int num_cameras, int num_points,
+                                int *added_order, camera_params_t *cameras,
+                                v3_t *points, v3_t *colors,
+                                const std::vector<ImageKeyVector> &pt_views)
+{
+    if (m_checkpoint_file == NULL || round % m_checkpoint_interval != 0)
+        return;
+
+    int num_images = GetNumImages();
+    int num_tracks = (int) m_track_data.size();
+
+    BundleCheckpoint *checkpoint = new BundleCheckpoint;
+
+    checkpoint->m_num_images = num_images;
+    checkpoint->m_num_tracks = num_tracks;
+    checkpoint->m_round = round;
+    checkpoint->m_num_cameras = num_cameras;
+    checkpoint->m_num_points = num_points;
+
+    checkpoint->m_added_order.assign(added_order, added_order + num_cameras);
+    checkpoint->m_cameras.assign(cameras, cameras + num_cameras);
+    checkpoint->m_points.assign(points, points + num_points);
+    checkpoint->m_colors.assign(colors, colors + num_points);
+    checkpoint->m_pt_views.assign(pt_views.begin(), 
+                                  pt_views.begin() + num_points);
+
+    checkpoint->m_track_points.resize(num_tracks);
+    for (int i = 0; i < num_tracks; i++)
+        checkpoint->m_track_points[i] = m_track_data[i].m_extra;
+
+    checkpoint->m_image_flags.resize(num_images);
+    for (int i = 0; i < num_images; i++) {
+        char flags = 0;
+
+        if (m_image_data[i].m_camera.m_adjusted)
+            flags |= CHECKPOINT_ADJUSTED;
+        if (m_image_data[i].m_ignore_in_bundle)
+            flags |= CHECKPOINT_IGNORED;
+
+        checkpoint->m_image_flags[i] = flags;
+    }
+
+    /* The keys of the added images stay pinned */
+    for (int i = 0; i < num_cameras; i++) {
+        int img = added_order[i];
+        int num_keys = (int) m_image_data[img].m_keys.size();
+
+        for (int j = 0; j < num_keys; j++) {
+            int extra = m_image_data[img].m_keys[j].m_extra;
+
+            if (extra == -1)
+                continue;
+
+            checkpoint->m_key_extras.push_back(img);
+            checkpoint->m_key_extras.push_back(j);
+            checkpoint->m_key_extras.push_back(extra);
+        }
+    }
+
+    printf("[SaveCheckpoint] Saving state before round %d (%d cameras, "
+           "%d points) to %s\n",
+           round, num_cameras, num_points, m_checkpoint_file);
+
+    m_checkpoint_writer.Write(m_checkpoint_file, checkpoint);
+}
+
+/* Restore the state saved to the checkpoint file, reloading the keys
+ * of the added images.  Returns false (leaving the state untouched)
+ * if there is no usable checkpoint */
+bool BundlerApp::RestoreCheckpoint(int &round, int &num_cameras, 
+                                   int &num_points, 
+                                   int *added_order, int *added_order_inv,
+                                   camera_params_t *cameras, 
+                                   v3_t *points, v3_t *colors,
+                                   std::vector<ImageKeyVector> &pt_views)
+{
+    if (m_checkpoint_file == NULL) {
+        printf("[RestoreCheckpoint] Error: no checkpoint file given "
+               "(use --checkpoint <file>)\n");
+        return false;
+    }
+
+    BundleCheckpoint checkpoint;
+    if (!ReadCheckpoint(m_checkpoint_file, checkpoint))
+        return false;
+
+    int num_images = GetNumImages();
+    int num_tracks = (int) m_track_data.size();
+
+    if (checkpoint.m_num_images != num_images || 
+        checkpoint.m_num_tracks != num_tracks) {
+        printf("[RestoreCheckpoint] Error: checkpoint has %d images and "
+               "%d tracks (expected %d and %d)\n", 
+               checkpoint.m_num_images, checkpoint.m_num_tracks,
+               num_images, num_tracks);
+        return false;
+    }
+
+    /* Check the indices before touching anything */
+    for (int i = 0; i < checkpoint.m_num_cameras; i++) {
+        int img = checkpoint.m_added_order[i];
+        if (img < 0 || img >= num_images) {
+            printf("[RestoreCheckpoint] Error: bad image %d\n", img);
+            return false;
+        }
+    }
+
+    for (int i = 0; i < checkpoint.m_num_points; i++) {
+        const ImageKeyVector &views = checkpoint.m_pt_views[i];
+
+        for (int j = 0; j < (int) views.size(); j++) {
+            int cam = views[j].first;
+            int key = views[j].second;
+
+            if (cam < 0 || cam >= checkpoint.m_num_cameras || key < 0 ||
+                key >= m_image_data[checkpoint.m_added_order[cam]].
+                           GetNumKeys()) {
+                printf("[RestoreCheckpoint] Error: bad view (%d, %d) of "
+                       "point %d\n", cam, key, i);
+                return false;
+            }
+        }
+    }
+
+    int num_key_extras = (int) checkpoint.m_key_extras.size() / 3;
+    for (int i = 0; i < num_key_extras; i++) {
+        int img = checkpoint.m_key_extras[3 * i + 0];
+        int key = checkpoint.m_key_extras[3 * i + 1];
+
+        if (img < 0 || img >= num_images || key < 0 ||
+            key >= m_image_data[img].GetNumKeys()) {
+            printf("[RestoreCheckpoint] Error: bad key (%d, %d)\n", img, key);
+            return false;
+        }
+    }
+
+    round = checkpoint.m_round;
+    num_cameras = checkpoint.m_num_cameras;
+    num_points = checkpoint.m_num_points;
+
+    for (int i = 0; i < num_images; i++) {
+        added_order_inv[i] = -1;
+
+        char flags = checkpoint.m_image_flags[i];
+        m_image_data[i].m_camera.m_adjusted = 
+            ((flags & CHECKPOINT_ADJUSTED) != 0);
+        m_image_data[i].m_ignore_in_bundle = 
+            ((flags & CHECKPOINT_IGNORED) != 0);
+    }
+
+    for (int i = 0; i < num_cameras; i++) {
+        int img = checkpoint.m_added_order[i];
+
+        added_order[i] = img;
+        added_order_inv[img] = i;
+        cameras[i] = checkpoint.m_cameras[i];
+
+        PinKeys(img, !m_optimize_for_fisheye);
+        m_image_data[img].ReadKeyColors();
+        SetTracks(img);
+
+        int num_keys = (int) m_image_data[img].m_keys.size();
+        for (int j = 0; j < num_keys; j++)
+            m_image_data[img].m_keys[j].m_extra = -1;
+    }
+
+    for (int i = 0; i < num_key_extras; i++) {
+        int img = checkpoint.m_key_extras[3 * i + 0];
+        int key = checkpoint.m_key_extras[3 * i + 1];
+
+        GetKey(img, key).m_extra = checkpoint.m_key_extras[3 * i + 2];
+    }
+
+    for (int i = 0; i < num_tracks; i++)
+        m_track_data[i].m_extra = checkpoint.m_track_points[i];
+
+    if (num_points > 0) {
+        memcpy(points, &checkpoint.m_points[0], num_points * sizeof(v3_t));
+        memcpy(colors, &checkpoint.m_colors[0], num_points * sizeof(v3_t));
+    }
+
+    pt_views.swap(checkpoint.m_pt_views);
+
+    printf("[RestoreCheckpoint] Resuming at round %d "
+           "(%d cameras, %d points)\n", round, num_cameras, num_points);
+
+    return true;
+}
+
 /* Set up the matrix of projections and the visibility mask */
 void BundlerApp::SetupProjections(int num_cameras, int num_points, 
                                   int *added_order,
@@ -1165,6 +1391,7 @@ int BundlerApp::FindCameraWithMostConnectivity(int num_cameras, int num_points,
                                                int &max_matches)
 {
     int num_images = GetNumImages();
+    const TrackCovisibility &covis = GetTrackCovisibility();
 
     /* Find the current "frontier" */
     bool *frontier = new bool[num_images];
@@ -1189,18 +1416,9 @@ int BundlerApp::FindCameraWithMostConnectivity(int num_cameras, int num_points,
 
         /* Find the adjacent nodes in the graph */
         for (int j = 0; j < num_images; j++) {
-            SetMatchesFromTracks(i, j);
-
-            MatchIndex base = GetMatchIndex(i, j);
-            unsigned int num_matches = // (int) m_match_lists[base].size();
-                m_matches.GetNumMatches(base); 
-
-            if (num_matches > 32) {
+            if (covis.GetNumShared(i, j) > 32) {
                 frontier[j] = true;
             }
-
-            // m_match_lists[base].clear();
-            m_matches.ClearMatch(base);
         }
     }
 
@@ -1250,6 +1468,10 @@ int BundlerApp::FindCameraWithMostConnectivity(int num_cameras, int num_points,
 
         for (int j = 0; j < num_cameras; j++) {
             int camera_idx = added_order[j];
+
+            if (covis.GetNumShared(i, camera_idx) == 0)
+                continue;
+
             MatchIndex base = GetMatchIndex(i, camera_idx);
 
             SetMatchesFromTracks(i, camera_idx);
@@ -1294,16 +1516,8 @@ int BundlerApp::FindCameraWithMostConnectivity(int num_cameras, int num_points,
         for (int j = 0; j < num_images; j++) {
             if (frontier[j]) continue;
 
-            SetMatchesFromTracks(i, j);
-
-            MatchIndex base = GetMatchIndex(i, j);
-            // int num_matches = (int) m_match_lists[base].size();
-            unsigned int num_matches = m_matches.GetNumMatches(base);
-
-            if (num_matches > 32)
+            if (covis.GetNumShared(i, j) > 32)
                 frontier_scores[i]++;
-
-            // m_match_lists[base].clear();
         }
 
         seen_scores[i] = num_existing_matches;
@@ -1526,6 +1740,84 @@ std::vector<ImagePair> BundlerApp::FindCamerasWithNMatches(int n,
 * adjustment */
 #define INIT_REPROJECTION_ERROR 16.0 /* 6.0 */ /* 8.0 */
 
+/* Order initial pair candidates by decreasing match count */
+static bool CompareCandidateMatches(const std::pair<int, ImagePair> &a,
+                                    const std::pair<int, ImagePair> &b)
+{
+    return a.first > b.first;
+}
+
+bool BundlerApp::PickInitialPairFromCandidates
+    (const std::vector<ImagePair> &candidates, int &i_best, int &j_best)
+{
+    int num_candidates = (int) candidates.size();
+
+    /* Load the keys up front, so the evaluations only read shared
+     * data */
+    for (int k = 0; k < num_candidates; k++) {
+        PinKeys(candidates[k].first, !m_optimize_for_fisheye);
+        PinKeys(candidates[k].second, !m_optimize_for_fisheye);
+    }
+
+    std::vector<int> success(num_candidates, 0);
+    std::vector<int> num_good(num_candidates, 0);
+    std::vector<double> median_angle(num_candidates, 0.0);
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+    for (int k = 0; k < num_candidates; k++) {
+        success[k] = 
+            EvaluateInitialPair(candidates[k].first, candidates[k].second, 
+                                num_good[k], median_angle[k]) ? 1 : 0;
+    }
+
+    /* Most well-conditioned inliers wins, then the wider median
+     * triangulation angle */
+    int k_best = -1;
+    for (int k = 0; k < num_candidates; k++) {
+        if (!success[k]) {
+            printf("[BundlePickInitialPair] Candidate %d, %d: "
+                   "no relative pose\n", 
+                   candidates[k].first, candidates[k].second);
+            continue;
+        }
+
+        printf("[BundlePickInitialPair] Candidate %d, %d: "
+               "%d good points, median angle %0.3f\n", 
+               candidates[k].first, candidates[k].second, 
+               num_good[k], median_angle[k]);
+
+        if (k_best == -1 || num_good[k] > num_good[k_best] ||
+            (num_good[k] == num_good[k_best] && 
+             median_angle[k] > median_angle[k_best])) {
+            k_best = k;
+        }
+    }
+
+    if (k_best != -1) {
+        i_best = candidates[k_best].first;
+        j_best = candidates[k_best].second;
+
+        printf("[BundlePickInitialPair] Picked candidate pair %d, %d\n",
+               i_best, j_best);
+    }
+
+    /* Release the keys, except for those of the winning pair, which
+     * seeds the reconstruction */
+    for (int k = 0; k < num_candidates; k++) {
+        if (k == k_best)
+            continue;
+
+        UnpinKeys(candidates[k].first);
+        UnpinKeys(candidates[k].second);
+    }
+
+    fflush(stdout);
+
+    return (k_best != -1);
+}
+
 /*----------------------- BundlePickInitialPair ----------------------*/
 /* 
    Pick a good initial pair of cameras to bootstrap the bundle
@@ -1535,6 +1827,8 @@ std::vector<ImagePair> BundlerApp::FindCamerasWithNMatches(int n,
 void BundlerApp::BundlePickInitialPair(int &i_best, int &j_best, 
                                        bool use_init_focal_only)
 {
+    ProfileScope scope("BundlePickInitialPair");
+
     /* Compute the match matrix */
     int num_images = GetNumImages();
     int max_matches = 0;
@@ -1568,7 +1862,13 @@ void BundlerApp::BundlePickInitialPair(int &i_best, int &j_best,
         SCORE_THRESHOLD = 2.0; // 1.0 // 2.0 // 1.0
     }
 
-    /* Compute score for each image pair */
+    /* Compute score for each image pair (pairs sharing no tracks
+     * are absent from the table and skipped outright) */
+    const TrackCovisibility &covis = GetTrackCovisibility();
+
+    /* Pairs passing the primary test, with their match counts */
+    std::vector<std::pair<int, ImagePair> > candidates;
+
     int max_pts = 0;
     for (int i = 0; i < num_images; i++) {
         if (m_image_data[i].m_ignore_in_bundle)
@@ -1578,7 +1878,12 @@ void BundlerApp::BundlePickInitialPair(int &i_best, int &j_best,
             !m_image_data[i].m_has_init_focal)
             continue;
 
-        for (int j = i+1; j < num_images; j++) {
+        const std::vector<std::pair<int, int> > &row = covis.GetRow(i);
+        int num_nbrs = (int) row.size();
+
+        for (int n = 0; n < num_nbrs; n++) {
+            int j = row[n].first;
+
             if (m_image_data[j].m_ignore_in_bundle)
                 continue;
 
@@ -1588,7 +1893,7 @@ void BundlerApp::BundlePickInitialPair(int &i_best, int &j_best,
 
             MatchIndex idx = GetMatchIndex(i, j);
 
-            int num_matches = GetNumTrackMatches(i, j);
+            int num_matches = row[n].second;
             max_pts += num_matches;
 
 #define MATCH_THRESHOLD 32
@@ -1612,6 +1917,11 @@ void BundlerApp::BundlePickInitialPair(int &i_best, int &j_best,
                 }
             }
 
+            if (score > SCORE_THRESHOLD) {
+                candidates.push_back(std::make_pair(num_matches, 
+                                                    ImagePair(i, j)));
+            }
+
             /* Compute the primary score */
             if (num_matches > max_matches && score > SCORE_THRESHOLD) {
                 max_matches = num_matches;
@@ -1631,10 +1941,25 @@ void BundlerApp::BundlePickInitialPair(int &i_best, int &j_best,
         }
     }
 
-    /* Set track pointers to -1 (GetNumTrackMatches alters these
-     * values) */
-    for (int i = 0; i < (int) m_track_data.size(); i++) {
-        m_track_data[i].m_extra = -1;
+    /* Let the top-ranked candidates compete on their actual two-view
+     * geometry.  The sort is stable, so the first candidate is the
+     * pair picked above */
+    if (m_initial_pair_candidates > 1 && candidates.size() > 1) {
+        std::stable_sort(candidates.begin(), candidates.end(), 
+                         CompareCandidateMatches);
+
+        int num_candidates = 
+            MIN((int) candidates.size(), m_initial_pair_candidates);
+
+        std::vector<ImagePair> top;
+        for (int k = 0; k < num_candidates; k++)
+            top.push_back(candidates[k].second);
+
+        int i_cand, j_cand;
+        if (PickInitialPairFromCandidates(top, i_cand, j_cand)) {
+            i_best = i_cand;
+            j_best = j_cand;
+        }
     }
 
     if (i_best == -1 && j_best == -1) {
@@ -1665,9 +1990,11 @@ int BundlerApp::SetupInitialCameraPair(int i_best, int j_best,
                                        v3_t *points, v3_t *colors,
                                        std::vector<ImageKeyVector> &pt_views)
 {
+    ProfileScope scope("SetupInitialCameraPair");
+
     /* Load the keys for the images */
-    m_image_data[i_best].LoadKeys(false, !m_optimize_for_fisheye);
-    m_image_data[j_best].LoadKeys(false, !m_optimize_for_fisheye);
+    PinKeys(i_best, !m_optimize_for_fisheye);
+    PinKeys(j_best, !m_optimize_for_fisheye);
     m_image_data[i_best].ReadKeyColors();
     m_image_data[j_best].ReadKeyColors();
 
@@ -1832,6 +2159,8 @@ int BundlerApp::SetupInitialCameraPair(int i_best, int j_best,
 
     m_matches.ClearMatch(list_idx);
 
+    scope.AddItems(pt_count);
+
     return pt_count;
 }
 
@@ -2031,7 +2360,8 @@ void BundlerApp::EstimateIgnoredCameras(int &curr_num_cameras,
 */
 void BundlerApp::BundleAdjust() 
 {
-clock_t start = clock();
+ProfileScope scope("BundleAdjust");
+double start = GetWallTime();
 
 /* Compute initial image information */
 ComputeGeometricConstraints();
@@ -2082,8 +2412,27 @@ int i_best = -1, j_best = -1, max_matches = 0;
 double max_score = 0.0;
 int curr_num_cameras, curr_num_pts;
 int pt_count;
+int resume_round;
+
+if (m_resume && 
+    RestoreCheckpoint(resume_round, curr_num_cameras, curr_num_pts, 
+                      added_order, added_order_inv, cameras, points, colors, 
+                      pt_views)) 
+ {
+  /* This loop adds one camera per round, so it numbers its rounds by
+   * the number of cameras; a checkpoint written by the fast loop
+   * numbers them differently and can't be resumed here */
+  if (resume_round != curr_num_cameras)
+   {
+    printf("[BundleAdjust] Error: checkpoint round %d doesn't match its "
+           "%d cameras\n", resume_round, curr_num_cameras);
+    printf("[BundleAdjust] (was it saved by a run without --slow_bundle?)\n");
+    exit(1);
+   }
 
-if (num_init_cams == 0) 
+  pt_count = curr_num_pts;
+ }
+else if (num_init_cams == 0) 
  {
   BundlePickInitialPair(i_best, j_best, true);
 
@@ -2267,6 +2616,8 @@ else
 for (int round = curr_num_cameras; round < num_images; 
                                    round++, curr_num_cameras++) 
  {
+  ProfileScope round_scope("Round");
+
   int parent_idx = -1;
   int next_idx;
 
@@ -2371,12 +2722,16 @@ for (int round = curr_num_cameras; round < num_images;
      }
 #endif
    }
+
+  SaveCheckpoint(round + 1, curr_num_cameras + 1, curr_num_pts, added_order, 
+                                             cameras, points, colors, pt_views);
  }
 
-clock_t end = clock();
+m_checkpoint_writer.Wait();
+
+double end = GetWallTime();
 
-printf("[BundleAdjust] Bundle adjustment took %0.3fs\n",
-                                     (end - start) / ((double) CLOCKS_PER_SEC));
+printf("[BundleAdjust] Bundle adjustment took %0.3fs\n", end - start);
 
 if (m_estimate_ignored) 
  {
@@ -2528,21 +2883,27 @@ std::vector<int> RefineCameraParameters(const ImageData &data,
         std::vector<int> inliers_next;
 
         double *errors = new double[num_points_curr];
+        std::vector<double> pr_x(num_points_curr), pr_y(num_points_curr);
 
-        for (int i = 0; i < num_points_curr; i++) {
-            v2_t pr = sfm_project_final(camera, points_curr[i], 1,
-                estimate_distortion ? 1 : 0);
+        /* Project all the points (as sfm_project_final) */
+        int model = sfm_proj_model(camera, 1, 
+            (estimate_distortion && !camera->known_intrinsics) ? 1 : 0, 0);
 
-            if (optimize_for_fisheye) {
-                /* Distort pr */
+        if (num_points_curr > 0) {
+            sfm_project_points(model, camera, camera->R, camera->t, 
+                camera->f, camera->k[0], camera->k[1],
+                num_points_curr, points_curr, &pr_x[0], &pr_y[0]);
 
-                double x = Vx(pr);
-                double y = Vy(pr);
-                data.DistortPoint(x, y, Vx(pr), Vy(pr));
+            if (optimize_for_fisheye) {
+                /* Distort the projections */
+                data.DistortPoints(num_points_curr, &pr_x[0], &pr_y[0],
+                    &pr_x[0], &pr_y[0]);
             }
+        }
 
-            double dx = Vx(pr) - Vx(projs_curr[i]);
-            double dy = Vy(pr) - Vy(projs_curr[i]);
+        for (int i = 0; i < num_points_curr; i++) {
+            double dx = pr_x[i] - Vx(projs_curr[i]);
+            double dy = pr_y[i] - Vy(projs_curr[i]);
             double diff = sqrt(dx * dx + dy * dy);
 
             errors[i] = diff;
@@ -2588,26 +2949,8 @@ std::vector<int> RefineCameraParameters(const ImageData &data,
         }
 
 #if 1
-        qsort(errors, num_points_curr, sizeof(double), compare_doubles);
-
-        double pr_min = errors[0];
-        double pr_max = errors[num_points_curr-1];
-        double pr_step = (pr_max - pr_min) / NUM_ERROR_BINS;
-
-        /* Break histogram into 10 bins */
-        int idx_count = 0;
-        for (int i = 0; i < NUM_ERROR_BINS; i++) {
-            double max = pr_min + (i+1) * pr_step;
-            int start = idx_count;
-
-            while (idx_count < num_points_curr && errors[idx_count] <= max)
-                idx_count++;
-
-            int bin_size = idx_count - start;
-            printf("   E[%0.3e--%0.3e]: %d [%0.3f]\n", 
-                max - pr_step, max, bin_size, 
-                bin_size / (double) num_points_curr);
-        }
+        PrintErrorHistogram(std::vector<double>(errors, 
+                                                errors + num_points_curr));
 #endif
 
         delete [] points_curr;
@@ -2650,9 +2993,14 @@ double BundlerApp::RefinePoints(int num_points, v3_t *points, v2_t *projs,
                                 const std::vector<ImageKeyVector> &pt_views,
                                 camera_params_t *camera_out)
 {
-    double error = 0.0;
+    /* Triangulate each of the points.  The per-point errors are summed
+     * afterwards, in order, so the result does not depend on the
+     * threads */
+    std::vector<double> errors(num_points, 0.0);
 
-    /* Triangulate each of the points */
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 16)
+#endif
     for (int i = 0; i < num_points; i++) {
         int pt_idx = pt_idxs[i];
 
@@ -2714,13 +3062,17 @@ double BundlerApp::RefinePoints(int num_points, v3_t *points, v2_t *projs,
         double dx = Vx(pr) - Vx(projs[i]);
         double dy = Vy(pr) - Vy(projs[i]);
 
-        error += dx * dx + dy * dy;
+        errors[i] = dx * dx + dy * dy;
 
         delete [] pv;
         delete [] Rs;
         delete [] ts;
     }
 
+    double error = 0.0;
+    for (int i = 0; i < num_points; i++)
+        error += errors[i];
+
     return sqrt(error / num_points);
 }
 
@@ -2960,13 +3312,14 @@ BundlerApp::BundleInitializeImage(ImageData &data,
                                   bool *success_out,
                                   bool refine_cameras_and_points)
 {
+    ProfileScope scope("BundleInitializeImage");
     clock_t start = clock();
 
     if (success_out != NULL)
         *success_out = true;
 
     /* Load the keys */
-    data.LoadKeys(false, !m_optimize_for_fisheye);
+    PinKeys(image_idx, !m_optimize_for_fisheye);
     SetTracks(image_idx);
 
     /* **** Connect the new camera to any existing points **** */
@@ -3036,7 +3389,7 @@ BundlerApp::BundleInitializeImage(ImageData &data,
         delete [] idxs_solve;
         delete [] keys_solve;
 
-        m_image_data[image_idx].UnloadKeys();
+        UnpinKeys(image_idx);
 
         return dummy;
     }
@@ -3067,7 +3420,7 @@ BundlerApp::BundleInitializeImage(ImageData &data,
         delete [] idxs_solve;
         delete [] keys_solve;
 
-        m_image_data[image_idx].UnloadKeys();
+        UnpinKeys(image_idx);
 
         return dummy;
     }
@@ -3188,12 +3541,15 @@ BundlerApp::BundleInitializeImage(ImageData &data,
         delete [] idxs_solve;
         delete [] keys_solve;
 
+        UnpinKeys(image_idx);
+
         camera_params_t dummy;
         return dummy;
     }
 
     /* Point the keys to their corresponding points */
     num_inliers = (int) inliers.size();
+    scope.AddItems(num_inliers);
     for (int i = 0; i < num_inliers; i++) {
         int inlier_idx = inliers[i];
         // printf("[BundleInitializeImage] Connecting point [%d]\n",
@@ -3236,7 +3592,9 @@ void BundlerApp::BundleInitializeImageFullBundle(int image_idx, int parent_idx,
                                                  std::vector<ImageKeyVector> 
                                                  &pt_views) 
 {
-    m_image_data[image_idx].LoadKeys(false, !m_optimize_for_fisheye);
+    ProfileScope scope("BundleInitializeImageFullBundle");
+
+    PinKeys(image_idx, !m_optimize_for_fisheye);
     m_image_data[image_idx].ReadKeyColors();
 
     SetTracks(image_idx);
@@ -3679,7 +4037,7 @@ bool BundlerApp::BundleRegisterImage(ImageData &data, bool init_location)
 #ifdef __USE_ANN__
         ANNkd_tree *tree = CreateCameraSearchTree();
 #else
-        BruteForceSearch *search = CreateCameraSearchTree();
+        KdTreeSearch *search = CreateCameraSearchTree();
 #endif    
 
 #define NUM_NNS 20
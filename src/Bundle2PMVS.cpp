@@ -14,6 +14,7 @@
 #include "image.h"
 #include "matrix.h"
 #include "sfm.h"
+#include "BundleReader.h"
 #include "LoadJPEG.h"
 
 #ifdef WIN32
@@ -54,100 +55,46 @@ void ReadBundleFile(char *bundle_file,
                     std::vector<camera_params_t> &cameras,
                     std::vector<point_t> &points, double &bundle_version)
 {
-    FILE *f = fopen(bundle_file, "r");
-    if (f == NULL) {
-	printf("Error opening file %s for reading\n", bundle_file);
-	return;
-    }
-
-    int num_images, num_points;
+    BundleData bundle;
+    if (!ReadBundle(bundle_file, bundle))
+        return;
 
-    char first_line[256];
-    fgets(first_line, 256, f);
-    if (first_line[0] == '#') {
-        double version;
-        sscanf(first_line, "# Bundle file v%lf", &version);
+    bundle_version = bundle.m_version;
+    printf("[ReadBundleFile] Bundle version: %0.3f\n", bundle_version);
 
-        bundle_version = version;
-        printf("[ReadBundleFile] Bundle version: %0.3f\n", version);
-
-        fscanf(f, "%d %d\n", &num_images, &num_points);
-    } else if (first_line[0] == 'v') {
-        double version;
-        sscanf(first_line, "v%lf", &version);
-        bundle_version = version;
-        printf("[ReadBundleFile] Bundle version: %0.3f\n", version);
-
-        fscanf(f, "%d %d\n", &num_images, &num_points);
-    } else {
-        bundle_version = 0.1;
-        sscanf(first_line, "%d %d\n", &num_images, &num_points);
-    }
+    int num_images = bundle.GetNumCameras();
+    int num_points = bundle.GetNumPoints();
 
     printf("[ReadBundleFile] Reading %d images and %d points...\n",
 	   num_images, num_points);
 
     /* Read cameras */
     for (int i = 0; i < num_images; i++) {
-	double focal_length, k0, k1;
-	double R[9];
-	double t[3];
-        
-        if (bundle_version < 0.2) {
-            /* Focal length */
-            fscanf(f, "%lf\n", &focal_length);
-        } else {
-            fscanf(f, "%lf %lf %lf\n", &focal_length, &k0, &k1);
-        }
-
-	/* Rotation */
-	fscanf(f, "%lf %lf %lf\n%lf %lf %lf\n%lf %lf %lf\n", 
-	       R+0, R+1, R+2, R+3, R+4, R+5, R+6, R+7, R+8);
-	/* Translation */
-	fscanf(f, "%lf %lf %lf\n", t+0, t+1, t+2);
-
-        // if (focal_length == 0.0)
-        //     continue;
+        const bundle_camera_t &c = bundle.m_cameras[i];
 
         camera_params_t cam;
 
-        cam.f = focal_length;
-        memcpy(cam.R, R, sizeof(double) * 9);
-        memcpy(cam.t, t, sizeof(double) * 3);
+        cam.f = c.f;
+        memcpy(cam.R, c.R, sizeof(double) * 9);
+        memcpy(cam.t, c.t, sizeof(double) * 3);
 
         cameras.push_back(cam);
     }
     
     /* Read points */
+    points.reserve(num_points);
     for (int i = 0; i < num_points; i++) {
-	point_t pt;
-
-	/* Position */
-	fscanf(f, "%lf %lf %lf\n", 
-	       pt.pos + 0, pt.pos + 1, pt.pos + 2);
-
-	/* Color */
-	fscanf(f, "%lf %lf %lf\n", 
-	       pt.color + 0, pt.color + 1, pt.color + 2);
-
-	int num_visible;
-	fscanf(f, "%d", &num_visible);
-
-	for (int j = 0; j < num_visible; j++) {
-	    int view, key;
-	    fscanf(f, "%d %d", &view, &key);
-
-            double x, y;
-            if (bundle_version >= 0.3)
-                fscanf(f, "%lf %lf", &x, &y);
-	}
+        if (bundle.GetNumViews(i) == 0)
+            continue;
 
-        if (num_visible > 0) {
-            points.push_back(pt);
+	point_t pt;
+        for (int j = 0; j < 3; j++) {
+            pt.pos[j] = bundle.m_pos[3 * i + j];
+            pt.color[j] = bundle.m_color[3 * i + j];
         }
-    }
 
-    fclose(f);
+        points.push_back(pt);
+    }
 }
 
 void WritePMVS(const char *output_path, char *list_file, char *bundle_file,
@@ -181,6 +128,10 @@ void WritePMVS(const char *output_path, char *list_file, char *bundle_file,
     fprintf(f_scr, "mkdir -p %s/models/\n", output_path);
     fprintf(f_scr, "\n# Copy and rename files\n");
 
+    /* Read all image dimensions up front */
+    std::vector<int> widths, heights;
+    GetJPEGDimensionsBatch(images, widths, heights);
+
     int count = 0;
     for (int i = 0; i < num_cameras; i++) {
         if (cameras[i].f == 0.0)
@@ -196,8 +147,7 @@ void WritePMVS(const char *output_path, char *list_file, char *bundle_file,
         double *R = cameras[i].R;
         double *t = cameras[i].t;
 
-        int w, h;
-        GetJPEGDimensions(images[i].c_str(), w, h);
+        int w = widths[i], h = heights[i];
 
         double K[9] = 
             { -focal, 0.0, 0.5 * w - 0.5,
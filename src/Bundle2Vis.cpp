@@ -8,6 +8,7 @@
 #include <vector>
 
 #include "sfm.h"
+#include "BundleReader.h"
 
 typedef std::pair<int,int> ImageKey;
 
@@ -22,114 +23,56 @@ void ReadBundleFile(const char *bundle_file,
                     std::vector<camera_params_t> &cameras,
                     std::vector<point_t> &points, double &bundle_version)
 {
-    FILE *f = fopen(bundle_file, "r");
-    if (f == NULL) {
-	printf("Error opening file %s for reading\n", bundle_file);
-	return;
-    }
-
-    int num_images, num_points;
-
-    char first_line[256];
-    fgets(first_line, 256, f);
-    if (first_line[0] == '#') {
-        double version;
-        sscanf(first_line, "# Bundle file v%lf", &version);
-
-        bundle_version = version;
-        printf("[ReadBundleFile] Bundle version: %0.3f\n", version);
+    BundleData bundle;
+    if (!ReadBundle(bundle_file, bundle))
+        return;
 
-        fscanf(f, "%d %d\n", &num_images, &num_points);
-    } else if (first_line[0] == 'v') {
-        double version;
-        sscanf(first_line, "v%lf", &version);
-        bundle_version = version;
-        printf("[ReadBundleFile] Bundle version: %0.3f\n", version);
+    bundle_version = bundle.m_version;
+    printf("[ReadBundleFile] Bundle version: %0.3f\n", bundle_version);
 
-        fscanf(f, "%d %d\n", &num_images, &num_points);
-    } else {
-        bundle_version = 0.1;
-        sscanf(first_line, "%d %d\n", &num_images, &num_points);
-    }
+    int num_images = bundle.GetNumCameras();
+    int num_points = bundle.GetNumPoints();
 
     printf("[ReadBundleFile] Reading %d images and %d points...\n",
 	   num_images, num_points);
 
-    // int *map = new int[num_images];
-
     /* Read cameras */
-    // int count = 0;
     for (int i = 0; i < num_images; i++) {
-	double focal_length, k0, k1;
-	double R[9];
-	double t[3];
-        
-        if (bundle_version < 0.2) {
-            /* Focal length */
-            fscanf(f, "%lf\n", &focal_length);
-        } else {
-            fscanf(f, "%lf %lf %lf\n", &focal_length, &k0, &k1);
-        }
-
-	/* Rotation */
-	fscanf(f, "%lf %lf %lf\n%lf %lf %lf\n%lf %lf %lf\n", 
-	       R+0, R+1, R+2, R+3, R+4, R+5, R+6, R+7, R+8);
-	/* Translation */
-	fscanf(f, "%lf %lf %lf\n", t+0, t+1, t+2);
-
-        // if (focal_length == 0.0)
-        //     continue;
+        const bundle_camera_t &c = bundle.m_cameras[i];
 
         camera_params_t cam;
 
-        cam.f = focal_length;
-        memcpy(cam.R, R, sizeof(double) * 9);
-        memcpy(cam.t, t, sizeof(double) * 3);
-
-        // map[i] = count;
-        // count++;
+        cam.f = c.f;
+        memcpy(cam.R, c.R, sizeof(double) * 9);
+        memcpy(cam.t, c.t, sizeof(double) * 3);
 
         cameras.push_back(cam);
     }
     
     /* Read points */
-    int total_num_visible = 0;
+    points.reserve(num_points);
     for (int i = 0; i < num_points; i++) {
-	point_t pt;
-
-	/* Position */
-	fscanf(f, "%lf %lf %lf\n", 
-	       pt.pos + 0, pt.pos + 1, pt.pos + 2);
-
-	/* Color */
-	fscanf(f, "%lf %lf %lf\n", 
-	       pt.color + 0, pt.color + 1, pt.color + 2);
+	int num_visible = bundle.GetNumViews(i);
+        if (num_visible == 0)
+            continue;
 
-	int num_visible;
-	fscanf(f, "%d", &num_visible);
-        total_num_visible += num_visible;
+	point_t pt;
+        for (int j = 0; j < 3; j++) {
+            pt.pos[j] = bundle.m_pos[3 * i + j];
+            pt.color[j] = bundle.m_color[3 * i + j];
+        }
 
+        const bundle_view_t *views = bundle.GetViews(i);
+        pt.views.reserve(num_visible);
 	for (int j = 0; j < num_visible; j++) {
-	    int view, key;
-	    fscanf(f, "%d %d", &view, &key);
-
-            // pt.views.push_back(ImageKey(map[view],key));
-            assert(view >= 0 && view < num_images);
-            pt.views.push_back(ImageKey(view, key));
-
-            double x, y;
-            if (bundle_version >= 0.3)
-                fscanf(f, "%lf %lf", &x, &y);
+            assert(views[j].image >= 0 && views[j].image < num_images);
+            pt.views.push_back(ImageKey(views[j].image, views[j].key));
 	}
 
-        if (num_visible > 0) {
-            points.push_back(pt);
-        }
+        points.push_back(pt);
     }
 
-    printf("Num visible: %d\n", total_num_visible);
-
-    fclose(f);
+    printf("Num visible: %d\n", (int) bundle.m_views.size());
 }
 
 void WriteVisFile(const char *vis_file, 
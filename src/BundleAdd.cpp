@@ -40,6 +40,8 @@
 #include "BundlerApp.h"
 #include "Bundle.h"
 #include "Distortion.h"
+#include "Profiler.h"
+#include "SmallMatrix.h"
 
 #define INIT_REPROJECTION_ERROR 16.0 /* 6.0 */ /* 8.0 */
 #define ADD_REPROJECTION_ERROR 16.0 /* 1.0e2 */ /* 8.0 */ /* 4.0 */
@@ -73,10 +75,18 @@ v3_t BundlerApp::TriangulateNViews(const ImageKeyVector &views,
 
 	double K[9], Kinv[9];
 	GetIntrinsics(cameras[camera_idx], K);
-	matrix_invert(3, K, Kinv);
+	if (!SmallMatrixInvert3(K, Kinv)) {
+            /* Singular intrinsics, so the point can't be triangulated */
+            delete [] pv;
+            delete [] Rs;
+            delete [] ts;
+
+            error = DBL_MAX;
+            return v3_new(0.0, 0.0, 0.0);
+        }
 
 	double p_n[3];
-	matrix_product(3, 3, 3, 1, Kinv, p3, p_n);
+	SmallMatrixProduct<3,3,1>(Kinv, p3, p_n);
 
         // EDIT!!!
 	pv[i] = v2_new(-p_n[0], -p_n[1]);
@@ -88,8 +98,8 @@ v3_t BundlerApp::TriangulateNViews(const ImageKeyVector &views,
 	if (!explicit_camera_centers) {
 	    memcpy(ts + 3 * i, cam->t, 3 * sizeof(double));
 	} else {
-	    matrix_product(3, 3, 3, 1, cam->R, cam->t, ts + 3 * i);
-	    matrix_scale(3, 1, ts + 3 * i, -1.0, ts + 3 * i);
+	    SmallMatrixProduct<3,3,1>(cam->R, cam->t, ts + 3 * i);
+	    SmallMatrixScale<3,1>(ts + 3 * i, -1.0, ts + 3 * i);
 	}
     }
     
@@ -151,14 +161,17 @@ v3_t BundlerApp::GeneratePointAtInfinity(const ImageKeyVector &views,
 
     double K[9], Kinv[9];
     GetIntrinsics(cameras[camera_idx], K);
-    matrix_invert(3, K, Kinv);
+    if (!SmallMatrixInvert3(K, Kinv)) {
+        error = DBL_MAX;
+        return v3_new(0.0, 0.0, 0.0);
+    }
 
     double ray[3];
-    matrix_product(3, 3, 3, 1, Kinv, p3, ray);
+    SmallMatrixProduct<3,3,1>(Kinv, p3, ray);
 
     /* We now have a ray, put it at infinity */
     double ray_world[3];
-    matrix_transpose_product(3, 3, 3, 1, cam->R, ray, ray_world);
+    SmallMatrixTransposeProduct<3,3,1>(cam->R, ray, ray_world);
 
     double pos[3] = { 0.0, 0.0, 0.0 };
     double pt_inf[3] = { 0.0, 0.0, 0.0 };
@@ -199,6 +212,8 @@ BundlerApp::BundleAdjustAddAllNewPoints(int num_points, int num_cameras,
                                         double max_reprojection_error,
                                         int min_views)
 {
+    ProfileScope scope("AddAllNewPoints");
+
     std::vector<int> track_idxs;
     std::vector<ImageKeyVector> new_tracks;
 
@@ -258,7 +273,18 @@ BundlerApp::BundleAdjustAddAllNewPoints(int num_points, int num_cameras,
     int num_cheirality_failed = 0;
     int num_added = 0;
 
+    /* The tracks are triangulated and tested independently, so do that
+     * in parallel, then add the points that pass in track order */
+    enum { TRACK_SKIPPED, TRACK_ILL_CONDITIONED, TRACK_HIGH_REPROJECTION,
+           TRACK_CHEIRALITY_FAILED, TRACK_GOOD };
+
     int num_tracks = (int) new_tracks.size();
+    std::vector<int> status(num_tracks, TRACK_SKIPPED);
+    std::vector<v3_t> track_points(num_tracks);
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 16)
+#endif
     for (int i = 0; i < num_tracks; i++) {
 	int num_views = (int) new_tracks[i].size();
 	
@@ -327,7 +353,7 @@ BundlerApp::BundleAdjustAddAllNewPoints(int num_points, int num_cameras,
 	}
 	
 	if (!conditioned || !good_distance) {
-	    num_ill_conditioned++;
+	    status[i] = TRACK_ILL_CONDITIONED;
 
 #if 0
 	    printf(">> Track is ill-conditioned [max_angle = %0.3f]\n", 
@@ -338,7 +364,7 @@ BundlerApp::BundleAdjustAddAllNewPoints(int num_points, int num_cameras,
 	}
 	
 	double error;
-	v3_t pt;
+	v3_t &pt = track_points[i];
 
         if (!m_panorama_mode) {
             pt = TriangulateNViews(new_tracks[i], added_order, cameras, 
@@ -349,7 +375,7 @@ BundlerApp::BundleAdjustAddAllNewPoints(int num_points, int num_cameras,
         }
         
 	if (isnan(error) || error > max_reprojection_error) {
-	    num_high_reprojection++;
+	    status[i] = TRACK_HIGH_REPROJECTION;
 #if 0
 	    printf(">> Reprojection error [%0.3f] is too large\n", error);
 	    fflush(stdout);
@@ -369,7 +395,7 @@ BundlerApp::BundleAdjustAddAllNewPoints(int num_points, int num_cameras,
 	}
 
 	if (!all_in_front) {
-	    num_cheirality_failed++;
+	    status[i] = TRACK_CHEIRALITY_FAILED;
 
 #if 0
 	    printf(">> Cheirality check failed\n");
@@ -378,15 +404,28 @@ BundlerApp::BundleAdjustAddAllNewPoints(int num_points, int num_cameras,
 	    continue;
 	}
 	
-	/* All tests succeeded, so let's add the point */
-#if 0
-	printf("Triangulating track ");
-	PrintTrack(new_tracks[i]);
-	printf("\n");
-	printf(">> All tests succeeded [%0.3f, %0.3f] for point [%d]\n", 
-	       RAD2DEG(max_angle), error, pt_count);
-#endif
+	status[i] = TRACK_GOOD;
+    }
 
+    for (int i = 0; i < num_tracks; i++) {
+	switch (status[i]) {
+	case TRACK_ILL_CONDITIONED:
+	    num_ill_conditioned++;
+	    continue;
+	case TRACK_HIGH_REPROJECTION:
+	    num_high_reprojection++;
+	    continue;
+	case TRACK_CHEIRALITY_FAILED:
+	    num_cheirality_failed++;
+	    continue;
+	case TRACK_SKIPPED:
+	    continue;
+	}
+
+	int num_views = (int) new_tracks[i].size();
+	v3_t pt = track_points[i];
+
+	/* All tests succeeded, so let's add the point */
 	fflush(stdout);
 
 	points[pt_count] = pt;
@@ -417,6 +456,8 @@ BundlerApp::BundleAdjustAddAllNewPoints(int num_points, int num_cameras,
         num_added++;
     }
 
+    scope.AddItems(num_added);
+
     printf("[AddAllNewPoints] Added %d new points\n", num_added);
     printf("[AddAllNewPoints] Ill-conditioned tracks: %d\n", 
            num_ill_conditioned);
@@ -439,8 +480,13 @@ v3_t Triangulate(v2_t p, v2_t q,
     GetIntrinsics(c1, K1);
     GetIntrinsics(c2, K2);
     
-    matrix_invert(3, K1, K1inv);
-    matrix_invert(3, K2, K2inv);
+    if (!SmallMatrixInvert3(K1, K1inv) || !SmallMatrixInvert3(K2, K2inv)) {
+        /* Singular intrinsics, so the point can't be triangulated */
+        proj_error = DBL_MAX;
+        in_front = false;
+        angle = 0.0;
+        return v3_new(0.0, 0.0, 0.0);
+    }
 
     /* Set up the 3D point */
     // EDIT!!!
@@ -449,8 +495,8 @@ v3_t Triangulate(v2_t p, v2_t q,
 
     double proj1_norm[3], proj2_norm[3];
 
-    matrix_product(3, 3, 3, 1, K1inv, proj1, proj1_norm);
-    matrix_product(3, 3, 3, 1, K2inv, proj2, proj2_norm);
+    SmallMatrixProduct<3,3,1>(K1inv, proj1, proj1_norm);
+    SmallMatrixProduct<3,3,1>(K2inv, proj2, proj2_norm);
 
     v2_t p_norm = v2_new(proj1_norm[0] / proj1_norm[2],
 			 proj1_norm[1] / proj1_norm[2]);
@@ -474,10 +520,10 @@ v3_t Triangulate(v2_t p, v2_t q,
 	double t2[3];
 			
 	/* Put the translation in standard form */
-	matrix_product(3, 3, 3, 1, c1.R, c1.t, t1);
-	matrix_scale(3, 1, t1, -1.0, t1);
-	matrix_product(3, 3, 3, 1, c2.R, c2.t, t2);
-	matrix_scale(3, 1, t2, -1.0, t2);
+	SmallMatrixProduct<3,3,1>(c1.R, c1.t, t1);
+	SmallMatrixScale<3,1>(t1, -1.0, t1);
+	SmallMatrixProduct<3,3,1>(c2.R, c2.t, t2);
+	SmallMatrixScale<3,1>(t2, -1.0, t2);
 			
 	pt = triangulate(p_norm, q_norm, c1.R, t1, c2.R, t2, &proj_error);
     }
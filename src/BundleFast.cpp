@@ -28,6 +28,7 @@
 
 #include "BundlerApp.h"
 #include "Bundle.h"
+#include "Profiler.h"
 
 #define MIN_INLIERS_EST_PROJECTION 15 /* 30 */ /* This constant needs
 						* adjustment */
@@ -36,7 +37,8 @@
 /* Quickly compute pose of all cameras */
 void BundlerApp::BundleAdjustFast() 
 {
-    clock_t start = clock();
+    ProfileScope scope("BundleAdjustFast");
+    double start = GetWallTime();
 
     /* Compute initial image information */
     ComputeGeometricConstraints();
@@ -91,8 +93,14 @@ void BundlerApp::BundleAdjustFast()
     double max_score = 0.0;
     int curr_num_cameras, curr_num_pts;
     int pt_count;
+    int round = 0;
 
-    if (num_init_cams == 0) {
+    if (m_resume && 
+        RestoreCheckpoint(round, curr_num_cameras, curr_num_pts, 
+                          added_order, added_order_inv, cameras, 
+                          points, colors, pt_views)) {
+        pt_count = curr_num_pts;
+    } else if (num_init_cams == 0) {
 	BundlePickInitialPair(i_best, j_best, true);
 
 	added_order[0] = i_best;
@@ -259,8 +267,9 @@ void BundlerApp::BundleAdjustFast()
 	pt_count = curr_num_pts = (int) m_point_data.size();
     }
     
-    int round = 0;
     while (curr_num_cameras < num_images) {
+        ProfileScope round_scope("Round");
+
 	int parent_idx;
 	int max_cam = 
             FindCameraWithMostMatches(curr_num_cameras, curr_num_pts, 
@@ -295,6 +304,13 @@ void BundlerApp::BundleAdjustFast()
 	    printf("[SifterApp::BundleAdjustFast] Adjusting camera %d\n",
 		   image_set[i].first);
 
+        /* Fetch the keys of the whole set before registering it */
+        std::vector<int> images_next;
+        for (int i = 0; i < num_added_images; i++)
+            images_next.push_back(image_set[i].first);
+
+        PrefetchKeys(images_next, !m_optimize_for_fisheye);
+
 	/* Now, throw the new cameras into the mix */
         int image_count = 0;
 	for (int i = 0; i < num_added_images; i++) {
@@ -352,6 +368,7 @@ void BundlerApp::BundleAdjustFast()
 #endif
 	
 	curr_num_cameras += image_count;
+        round_scope.AddItems(image_count);
 
         if (!m_skip_add_points) {
             pt_count = 
@@ -426,12 +443,16 @@ void BundlerApp::BundleAdjustFast()
 	}
 
 	round++;
+
+        SaveCheckpoint(round, curr_num_cameras, curr_num_pts, added_order,
+                       cameras, points, colors, pt_views);
     }
 
-    clock_t end = clock();
+    m_checkpoint_writer.Wait();
+
+    double end = GetWallTime();
 
-    printf("[BundleAdjust] Bundle adjustment took %0.3fs\n",
-	   (end - start) / ((double) CLOCKS_PER_SEC));
+    printf("[BundleAdjust] Bundle adjustment took %0.3fs\n", end - start);
 
     if (m_estimate_ignored) {
         EstimateIgnoredCameras(curr_num_cameras,
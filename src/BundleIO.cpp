@@ -25,7 +25,10 @@
 #include <time.h>
 
 #include "BaseApp.h"
+#include "BundleReader.h"
+#include "ChunkWriter.h"
 #include "LoadJPEG.h"
+#include "Profiler.h"
 #include "SifterUtil.h"
 
 #include "defines.h"
@@ -42,6 +45,8 @@
 */
 void BaseApp::LoadKeys(bool descriptor)
 {
+ProfileScope scope("LoadKeys");
+
 #ifdef _DEBUG_
 printf("[BaseApp::LoadKeys] Loading keys...\n");
 #endif
@@ -65,6 +70,21 @@ printf("[BaseApp::LoadKeys] Loaded keys in %0.3fs\n",
 #endif
 }
 
+void BaseApp::PinKeys(int img, bool undistort)
+{
+    m_key_cache.Pin(m_image_data, img, undistort);
+}
+
+void BaseApp::UnpinKeys(int img)
+{
+    m_key_cache.Unpin(m_image_data, img);
+}
+
+void BaseApp::PrefetchKeys(const std::vector<int> &imgs, bool undistort)
+{
+    m_key_cache.Prefetch(m_image_data, imgs, undistort);
+}
+
 /*--------------------------- ReadMatchFile --------------------------*/
 /*
    Read from file containing key point matches.  The matches are
@@ -284,6 +304,8 @@ void BaseApp::LoadMatches()
 if (m_matches_loaded)               // Are matches already loaded?
   return;  
 
+ProfileScope scope("LoadMatches");
+
 if (m_match_table != NULL)          // Is there a filename specified?
  {
   LoadMatchTable(m_match_table);
@@ -403,10 +425,55 @@ RemoveAllMatches();
 m_matches_computed = true;
 m_num_original_images = GetNumImages();
 
+CacheImageDimensions();
+
 if (m_use_intrinsics)
   ReadIntrinsicsFile();
 }
 
+/*----------------------- CacheImageDimensions -----------------------*/
+/*
+   Read the jpeg headers of all images in parallel, rather than one at
+   a time as each image is first queried.  Images that aren't jpegs
+   are left to ImageData::CacheDimensions.
+*/
+void BaseApp::CacheImageDimensions()
+{
+std::vector<std::string> jpeg_files;
+std::vector<int> jpeg_images;
+
+int num_images = GetNumImages();
+for (int i = 0; i < num_images; i++) 
+ {
+  const char *name = m_image_data[i].m_name;
+  int len = strlen(name);
+
+  if (!m_image_data[i].m_cached_dimensions && len > 3 &&
+      strcmp(name + len - 3, "jpg") == 0 && FileExists(name)) 
+   {
+    jpeg_files.push_back(std::string(name));
+    jpeg_images.push_back(i);
+   }
+ }
+
+if (jpeg_files.empty())
+  return;
+
+std::vector<int> w, h;
+GetJPEGDimensionsBatch(jpeg_files, w, h);
+
+for (int i = 0; i < (int) jpeg_images.size(); i++) 
+ {
+  if (w[i] == 0 || h[i] == 0)
+    continue;
+
+  ImageData &data = m_image_data[jpeg_images[i]];
+  data.m_width = w[i];
+  data.m_height = h[i];
+  data.m_cached_dimensions = true;
+ }
+}
+
 /*-------------------------- ReadBundleFile --------------------------*/
 /* 
    Read in information about the "world" from the specified file.
@@ -418,47 +485,18 @@ printf("[BaseApp::ReadBundleFile] Reading file...\n");
 #endif 
 
 
-//--[1] See if file will open ...
-FILE *f = fopen(filename, "r");
-if (f == NULL) 
- {
-  printf("Error opening file %s for reading\n", filename);
+//--[1] Parse the whole file (text or binary) in one pass.
+BundleData bundle;
+if (!ReadBundle(filename, bundle))
   return;
- }
 
-//--[2] If so, then process the header.  Get #images and #points.
-int num_images, num_points;
-char first_line[256];
-fgets(first_line, 256, f);
-if (first_line[0] == '#') 
- {
-  double version;
-  sscanf(first_line, "# Bundle file v%lf", &version);
-  m_bundle_version = version;
-  fscanf(f, "%d %d\n", &num_images, &num_points);
-
-  #ifdef _DEBUG_
-  printf("[ReadBundleFile] Bundle version: %0.3f\n", version);
-  #endif
- } 
-else if (first_line[0] == 'v') 
- {
-  double version;
-  sscanf(first_line, "v%lf", &version);
-  m_bundle_version = version;
-  fscanf(f, "%d %d\n", &num_images, &num_points);
-
-  #ifdef _DEBUG_
-  printf("[ReadBundleFile] Bundle version: %0.3f\n", version);
-  #endif
- } 
-else 
- {
-  m_bundle_version = 0.1;
-  sscanf(first_line, "%d %d\n", &num_images, &num_points);
- }
+//--[2] Process the header.  Get #images and #points.
+m_bundle_version = bundle.m_version;
+int num_images = bundle.GetNumCameras();
+int num_points = bundle.GetNumPoints();
 
 #ifdef _DEBUG_
+printf("[ReadBundleFile] Bundle version: %0.3f\n", m_bundle_version);
 printf("[BaseApp::ReadBundleFile] Reading %d images and %d points...\n",
         num_images, num_points);
 #endif
@@ -473,32 +511,10 @@ if (num_images != GetNumImages())   // Compare to known info (sanity check).
 //      Camera has focal length, two nonlinear parms, and extrinsic parms.
 for (int i = 0; i < num_images; i++) 
  {
-  double focal_length;
-  double R[9];
-  double t[3];
-  double k[2] = { 0.0, 0.0 };
+  const bundle_camera_t &cam = bundle.m_cameras[i];
 
-  if (m_bundle_version >= 0.4) 
-   {
-    char name[512];
-    int w, h;
-    fscanf(f, "%s %d %d\n", name, &w, &h);
-   }
-        
-  //--[3.1] Focal length 
-  if (m_bundle_version > 0.1) 
-    fscanf(f, "%lf %lf %lf\n", &focal_length, k+0, k+1);
-  else 
-    fscanf(f, "%lf\n", &focal_length);
-
-  //--[3.2] Rotation 
-  fscanf(f, "%lf %lf %lf\n%lf %lf %lf\n%lf %lf %lf\n", 
-                             R+0, R+1, R+2, R+3, R+4, R+5, R+6, R+7, R+8);
-  //--[3.3] Translation 
-  fscanf(f, "%lf %lf %lf\n", t+0, t+1, t+2);
-
-  //--[3.4] If data is "sane" then aggregate data into camera info object.
-  if (focal_length <= 100.0 || m_image_data[i].m_ignore_in_bundle) 
+  //--[3.1] If data is "sane" then aggregate data into camera info object.
+  if (cam.f <= 100.0 || m_image_data[i].m_ignore_in_bundle) 
    {
     /* No (or bad) information about this camera */
     m_image_data[i].m_camera.m_adjusted = false;
@@ -510,11 +526,11 @@ for (int i = 0; i < num_images; i++)
     cd.m_adjusted = true;
     cd.m_width = m_image_data[i].GetWidth();
     cd.m_height = m_image_data[i].GetHeight();
-    cd.m_focal = focal_length;
-    cd.m_k[0] = k[0];
-    cd.m_k[1] = k[1];
-    memcpy(cd.m_R, R, sizeof(double) * 9);
-    memcpy(cd.m_t, t, sizeof(double) * 3);
+    cd.m_focal = cam.f;
+    cd.m_k[0] = cam.k[0];
+    cd.m_k[1] = cam.k[1];
+    memcpy(cd.m_R, cam.R, sizeof(double) * 9);
+    memcpy(cd.m_t, cam.t, sizeof(double) * 3);
 
     cd.Finalize();
 
@@ -527,28 +543,33 @@ m_point_data.clear();
 m_point_data.resize(num_points);
 
 int num_min_views_points = 0;
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 1024) \
+                         reduction(+:num_min_views_points)
+#endif
 for (int i = 0; i < num_points; i++) 
  {
   PointData &pt = m_point_data[i];
 
   //--[4.1] Position 
-  fscanf(f, "%lf %lf %lf\n", pt.m_pos + 0, pt.m_pos + 1, pt.m_pos + 2);
+  memcpy(pt.m_pos, &bundle.m_pos[3 * i], sizeof(double) * 3);
 
   //--[4.2] Color
-  fscanf(f, "%f %f %f\n", pt.m_color + 0, pt.m_color + 1, pt.m_color + 2);
+  memcpy(pt.m_color, &bundle.m_color[3 * i], sizeof(float) * 3);
 
   //--[4.3] Visibility info (frame, keypoint index, coord location).
-  int num_visible;
-  fscanf(f, "%d", &num_visible);    // How many images have this point?
+  int num_visible = bundle.GetNumViews(i);  // How many images have it?
   pt.m_num_vis=num_visible;
 
   if (num_visible >=3)              // If more than three, add as good point.
     num_min_views_points++;
 
+  const bundle_view_t *views = bundle.GetViews(i);
   for (int j = 0; j < num_visible; j++) 
    {
-    int view, key;
-    fscanf(f, "%d %d", &view, &key);
+    int view = views[j].image;
+    int key = views[j].key;
 
     if (m_image_data[view].m_camera.m_adjusted) 
      {
@@ -566,12 +587,6 @@ for (int i = 0; i < num_points; i++)
                "Excluding view %d from point %d [chirality]\n", view, i);
        }   
      }
-            
-    if (m_bundle_version >= 0.3) 
-     {
-      double x, y;
-      fscanf(f, "%lf %lf", &x, &y);
-     }
    }
 
   // #define CROP_POINT_CLOUD
@@ -590,8 +605,6 @@ for (int i = 0; i < num_points; i++)
   #endif /* CROP_POINT_CLOUD */
  }
 
-fclose(f);
-
 #ifdef _DEBUG_
 printf("[BaseApp::ReadBundleFile] %d / %d points visible to over 2 cameras!\n",
        num_min_views_points, num_points);
@@ -736,6 +749,7 @@ void BaseApp::DumpOutputFile(char *output_dir, char *filename,
                              v3_t *points, v3_t *colors,
                              std::vector<ImageKeyVector> &pt_views)
 {
+ProfileScope scope("DumpOutputFile");
 clock_t start = clock();
 int num_visible_points = 0;
     
@@ -750,6 +764,13 @@ for (int i = 0; i < num_points; i++)
 char buf[256];
 sprintf(buf, "%s/%s", output_dir, filename);
 
+if (m_output_binary) 
+ {
+  DumpOutputFileBinary(buf, num_images, num_cameras, num_points, added_order,
+                       cameras, points, colors, pt_views);
+  return;
+ }
+
 FILE *f = fopen(buf, "w");
 if (f == NULL)  
  {
@@ -836,6 +857,89 @@ printf("[BaseApp::DumpOutputFile] Wrote file in %0.3fs\n",
 #endif
 
 
+#ifndef __DEMO__
+/*----------------------- DumpOutputFileBinary -----------------------*/
+/* 
+   Same as DumpOutputFile, but writes the binary bundle format read by
+   ReadBundle.
+*/
+void BaseApp::DumpOutputFileBinary(const char *filename, 
+                                   int num_images, int num_cameras, 
+                                   int num_points, int *added_order, 
+                                   camera_params_t *cameras, 
+                                   v3_t *points, v3_t *colors,
+                                   std::vector<ImageKeyVector> &pt_views)
+{
+clock_t start = clock();
+
+BundleData bundle;
+bundle.m_version = m_bundle_version;
+
+//--[1] Cameras (zeros for those not used in SBA).
+bundle.m_cameras.resize(num_images);
+for (int i = 0; i < num_images; i++) 
+ {
+  bundle_camera_t &cam = bundle.m_cameras[i];
+  memset(&cam, 0, sizeof(bundle_camera_t));
+
+  int idx = -1;
+  for (int j = 0; j < num_cameras; j++) 
+    if (added_order[j] == i) 
+     {
+      idx = j;
+      break;
+     }
+
+  if (idx == -1)
+    continue;
+
+  cam.f = cameras[idx].f;
+  cam.k[0] = cameras[idx].k[0];
+  cam.k[1] = cameras[idx].k[1];
+  memcpy(cam.R, cameras[idx].R, sizeof(double) * 9);
+  matrix_product(3, 3, 3, 1, cameras[idx].R, cameras[idx].t, cam.t);
+  matrix_scale(3, 1, cam.t, -1.0, cam.t);
+ }
+
+//--[2] Visible points and their views.
+bundle.m_view_start.push_back(0);
+for (int i = 0; i < num_points; i++) 
+ {
+  int num_visible = (int) pt_views[i].size();
+  if (num_visible == 0)
+    continue;
+
+  bundle.m_pos.push_back(Vx(points[i]));
+  bundle.m_pos.push_back(Vy(points[i]));
+  bundle.m_pos.push_back(Vz(points[i]));
+
+  bundle.m_color.push_back((float) iround(Vx(colors[i])));
+  bundle.m_color.push_back((float) iround(Vy(colors[i])));
+  bundle.m_color.push_back((float) iround(Vz(colors[i])));
+
+  for (int j = 0; j < num_visible; j++) 
+   {
+    bundle_view_t view;
+    view.image = added_order[pt_views[i][j].first];
+    view.key = pt_views[i][j].second;
+    view.x = m_image_data[view.image].m_keys[view.key].m_x;
+    view.y = m_image_data[view.image].m_keys[view.key].m_y;
+
+    bundle.m_views.push_back(view);
+   }
+
+  bundle.m_view_start.push_back((int) bundle.m_views.size());
+ }
+
+WriteBundleBinary(filename, bundle);
+clock_t end = clock();
+
+printf("[BaseApp::DumpOutputFileBinary] Wrote file in %0.3fs\n",
+                            (double) (end - start) / (double) CLOCKS_PER_SEC);
+}
+#endif
+
+
 /*-------------------------- WriteCamerasXML -------------------------*/
 /* 
    Write XML files 
@@ -1060,7 +1164,7 @@ void BaseApp::WriteMatchTableDrew(const char *append)
 #ifndef __DEMO__
 static char ply_header[] = 
 "ply\n"
-"format ascii 1.0\n"
+"format %s 1.0\n"
 "element face 0\n"
 "property list uchar int vertex_indices\n"
 "element vertex %d\n"
@@ -1072,6 +1176,55 @@ static char ply_header[] =
 "property uchar diffuse_blue\n"
 "end_header\n";
 
+/* Points colored pure blue have been thrown out */
+static bool PlyPointIsBad(const v3_t &color)
+{
+    return (Vx(color) == 0x0 && Vy(color) == 0x0 && Vz(color) == 0xff);
+}
+
+/* Encode a ply vertex, as text or as binary little-endian */
+static void AppendPlyVertex(std::string &buf, bool binary, 
+                            const double *p, int r, int g, int b)
+{
+    if (!binary) {
+        AppendFormat(buf, "%0.6e %0.6e %0.6e %d %d %d\n", 
+                     p[0], p[1], p[2], r, g, b);
+        return;
+    }
+
+    for (int i = 0; i < 3; i++) {
+        float x = (float) p[i];
+        AppendLittleEndian(buf, &x, sizeof(float));
+    }
+
+    unsigned char rgb[3] = { (unsigned char) r, (unsigned char) g, 
+                             (unsigned char) b };
+    buf.append((const char *) rgb, 3);
+}
+
+/* Encodes the good points for WriteChunks */
+class PlyPointEncoder
+{
+public:
+    PlyPointEncoder(const v3_t *points, const v3_t *colors, bool binary) :
+        m_points(points), m_colors(colors), m_binary(binary) { }
+
+    void operator()(int i, std::string &buf) const {
+        if (PlyPointIsBad(m_colors[i]))
+            return;
+
+        AppendPlyVertex(buf, m_binary, m_points[i].p, 
+                        iround(Vx(m_colors[i])), 
+                        iround(Vy(m_colors[i])), 
+                        iround(Vz(m_colors[i])));
+    }
+
+private:
+    const v3_t *m_points;
+    const v3_t *m_colors;
+    bool m_binary;
+};
+
 /* Write point files to a ply file */
 void BaseApp::DumpPointsToPly(char *output_directory, char *filename, 
                               int num_points, int num_cameras, 
@@ -1079,20 +1232,24 @@ void BaseApp::DumpPointsToPly(char *output_directory, char *filename,
                               camera_params_t *cameras 
                               /*bool reflect*/) 
 {
+    ProfileScope scope("DumpPointsToPly");
+    scope.AddItems(num_points);
+
     int num_good_pts = 0;
 
+#ifdef _OPENMP
+#pragma omp parallel for reduction(+:num_good_pts)
+#endif
     for (int i = 0; i < num_points; i++) {
-	if (Vx(colors[i]) == 0x0 && 
-	    Vy(colors[i]) == 0x0 && 
-	    Vz(colors[i]) == 0xff) 
-	    continue;
-	num_good_pts++;
+	if (!PlyPointIsBad(colors[i]))
+	    num_good_pts++;
     }
     
     char ply_out[256];
     sprintf(ply_out, "%s/%s", output_directory, filename);
 
-    FILE *f = fopen(ply_out, "w");
+    bool binary = m_output_ply_binary;
+    FILE *f = fopen(ply_out, binary ? "wb" : "w");
 
     if (f == NULL) {
 	printf("Error opening file %s for writing\n", ply_out);
@@ -1100,25 +1257,14 @@ void BaseApp::DumpPointsToPly(char *output_directory, char *filename,
     }
 
     /* Print the ply header */
-    fprintf(f, ply_header, num_good_pts + 2 * num_cameras);
+    fprintf(f, ply_header, binary ? "binary_little_endian" : "ascii",
+            num_good_pts + 2 * num_cameras);
 
     /* Now triangulate all the correspondences */
-    for (int i = 0; i < num_points; i++) {
-	if (Vx(colors[i]) == 0x0 && 
-	    Vy(colors[i]) == 0x0 && 
-	    Vz(colors[i]) == 0xff) 
-	    continue;
-
-	/* Output the vertex */
-	fprintf(f, "%0.6e %0.6e %0.6e %d %d %d\n", 
-		Vx(points[i]), Vy(points[i]), Vz(points[i]),
-		// Vx(points[idx]), Vy(points[idx]), Vz(points[idx]),
-                // (reflect ? -1 : 1) * Vz(points[i]),
-		iround(Vx(colors[i])), 
-		iround(Vy(colors[i])), 
-		iround(Vz(colors[i])));
-    }
+    bool success = 
+        WriteChunks(f, num_points, PlyPointEncoder(points, colors, binary));
 
+    std::string buf;
     for (int i = 0; i < num_cameras; i++) {
 	double c[3];
 
@@ -1128,11 +1274,9 @@ void BaseApp::DumpPointsToPly(char *output_directory, char *filename,
         memcpy(c, cameras[i].t, 3 * sizeof(double));
 	
 	if ((i % 2) == 0)
-	    fprintf(f, "%0.6e %0.6e %0.6e 0 255 0\n", c[0], c[1], c[2]);
-                    // (reflect ? -1 : 1) * c[2]);
+            AppendPlyVertex(buf, binary, c, 0, 255, 0);
 	else
-	    fprintf(f, "%0.6e %0.6e %0.6e 255 0 0\n", c[0], c[1], c[2]);
-                    // (reflect ? -1 : 1) * c[2]);
+            AppendPlyVertex(buf, binary, c, 255, 0, 0);
 
 	double p_cam[3] = { 0.0, 0.0, -0.05 };
 	double p[3];
@@ -1146,11 +1290,14 @@ void BaseApp::DumpPointsToPly(char *output_directory, char *filename,
 	p[1] += c[1];
 	p[2] += c[2];
 
-	fprintf(f, "%0.6e %0.6e %0.6e 255 255 0\n",
-		p[0], p[1], p[2]); // (reflect ? -1 : 1) * p[2]);
+        AppendPlyVertex(buf, binary, p, 255, 255, 0);
     }
 
-    fclose(f);
+    if (fwrite(buf.data(), 1, buf.size(), f) != buf.size())
+        success = false;
+
+    if (fclose(f) != 0 || !success)
+        printf("Error writing to %s\n", ply_out);
 }
 #endif
 
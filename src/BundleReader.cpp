@@ -0,0 +1,818 @@
+/*
+ *  Copyright (c) 2008-2010  Noah Snavely (snavely (at) cs.cornell.edu)
+ *    and the University of Washington
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+/* BundleReader.cpp */
+/* Shared reader for bundle.out files (text and binary variants) */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "BundleReader.h"
+
+/* Don't bother splitting the point section into chunks smaller than
+ * this many points */
+#define MIN_POINTS_PER_THREAD 4096
+
+void BundleData::Clear()
+{
+    m_version = 0.1;
+    m_coalesced = false;
+    m_cameras.clear();
+    m_names.clear();
+    m_pos.clear();
+    m_color.clear();
+    m_view_start.clear();
+    m_views.clear();
+}
+
+bool MappedFile::Open(const char *filename)
+{
+#ifndef WIN32
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void *addr = mmap(NULL, (size_t) st.st_size, PROT_READ,
+                          MAP_PRIVATE, fd, 0);
+
+        if (addr != MAP_FAILED) {
+            madvise(addr, (size_t) st.st_size, MADV_WILLNEED);
+            close(fd);
+
+            m_data = (const char *) addr;
+            m_size = (size_t) st.st_size;
+            m_mapped = true;
+            return true;
+        }
+    }
+
+    close(fd);
+#endif
+
+    /* Fall back to reading the whole file into memory */
+    FILE *f = fopen(filename, "rb");
+    if (f == NULL)
+        return false;
+
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    if (len > 0) {
+        m_buffer.resize(len);
+        m_size = fread(&m_buffer[0], 1, len, f);
+        m_data = &m_buffer[0];
+    }
+
+    fclose(f);
+    return true;
+}
+
+void MappedFile::Close()
+{
+#ifndef WIN32
+    if (m_mapped)
+        munmap((void *) m_data, m_size);
+#endif
+
+    m_buffer.clear();
+    m_data = NULL;
+    m_size = 0;
+    m_mapped = false;
+}
+
+/* **** Text parsing helpers **** */
+
+static const double s_pow10[] =
+    { 1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,
+      1e8,  1e9,  1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+      1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+static inline bool IsSpace(char c)
+{
+    return c == ' ' || c == '\n' || c == '\t' || c == '\r' ||
+        c == '\v' || c == '\f';
+}
+
+static inline bool IsDigit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+static inline const char *SkipSpace(const char *p, const char *end)
+{
+    while (p < end && IsSpace(*p))
+        p++;
+    return p;
+}
+
+/* Parse a number with strtod (handles inf / nan and values that the
+ * fast path cannot represent exactly) */
+static bool ParseDoubleSlow(const char *&p, const char *end, double &out)
+{
+    char buf[64];
+    int n = 0;
+    while (p + n < end && n < 63 && !IsSpace(p[n])) {
+        buf[n] = p[n];
+        n++;
+    }
+    buf[n] = 0;
+
+    char *stop;
+    out = strtod(buf, &stop);
+    if (stop == buf)
+        return false;
+
+    p += stop - buf;
+    return true;
+}
+
+/* Parse a floating point number.  Mantissas of up to 15 significant
+ * digits with a decimal exponent in [-22, 22] are converted exactly
+ * with a single multiply or divide; everything else goes through
+ * strtod */
+static inline bool ParseDouble(const char *&p, const char *end, double &out)
+{
+    p = SkipSpace(p, end);
+
+    const char *q = p;
+    bool neg = false;
+    if (q < end && (*q == '-' || *q == '+')) {
+        neg = (*q == '-');
+        q++;
+    }
+
+    unsigned long long mant = 0;
+    int num_digits = 0, exp10 = 0;
+    bool any_digits = false, truncated = false;
+
+    while (q < end && IsDigit(*q)) {
+        any_digits = true;
+        if (num_digits < 19) {
+            mant = mant * 10 + (*q - '0');
+            if (mant != 0) num_digits++;
+        } else {
+            truncated = true;
+            exp10++;
+        }
+        q++;
+    }
+
+    if (q < end && *q == '.') {
+        q++;
+        while (q < end && IsDigit(*q)) {
+            any_digits = true;
+            if (num_digits < 19) {
+                mant = mant * 10 + (*q - '0');
+                if (mant != 0) num_digits++;
+                exp10--;
+            } else {
+                truncated = true;
+            }
+            q++;
+        }
+    }
+
+    if (!any_digits)
+        return ParseDoubleSlow(p, end, out);
+
+    if (q < end && (*q == 'e' || *q == 'E')) {
+        const char *r = q + 1;
+        bool exp_neg = false;
+        if (r < end && (*r == '-' || *r == '+')) {
+            exp_neg = (*r == '-');
+            r++;
+        }
+
+        if (r < end && IsDigit(*r)) {
+            int e = 0;
+            while (r < end && IsDigit(*r)) {
+                if (e < 100000) e = e * 10 + (*r - '0');
+                r++;
+            }
+            exp10 += exp_neg ? -e : e;
+            q = r;
+        }
+    }
+
+    if (mant == 0) {
+        out = neg ? -0.0 : 0.0;
+        p = q;
+        return true;
+    }
+
+    if (truncated || mant > (1ULL << 53) || exp10 < -22 || exp10 > 22)
+        return ParseDoubleSlow(p, end, out);
+
+    double v = (double) mant;
+    if (exp10 < 0)
+        v /= s_pow10[-exp10];
+    else
+        v *= s_pow10[exp10];
+
+    out = neg ? -v : v;
+    p = q;
+    return true;
+}
+
+static inline bool ParseInt(const char *&p, const char *end, int &out)
+{
+    p = SkipSpace(p, end);
+
+    const char *q = p;
+    bool neg = false;
+    if (q < end && (*q == '-' || *q == '+')) {
+        neg = (*q == '-');
+        q++;
+    }
+
+    if (q >= end || !IsDigit(*q))
+        return false;
+
+    long long v = 0;
+    while (q < end && IsDigit(*q)) {
+        v = v * 10 + (*q - '0');
+        q++;
+    }
+
+    out = (int) (neg ? -v : v);
+    p = q;
+    return true;
+}
+
+/* Read a whitespace-delimited token */
+static std::string ParseToken(const char *&p, const char *end)
+{
+    p = SkipSpace(p, end);
+    const char *q = p;
+    while (q < end && !IsSpace(*q))
+        q++;
+
+    std::string token(p, q - p);
+    p = q;
+    return token;
+}
+
+/* Parse the numbers remaining on the current line (storing at most
+ * max of them) and advance past the newline.  Returns the number of
+ * values found on the line */
+static int ParseRestOfLine(const char *&p, const char *end,
+                           double *vals, int max)
+{
+    int n = 0;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+            p++;
+
+        if (p >= end)
+            break;
+
+        if (*p == '\n') {
+            p++;
+            break;
+        }
+
+        double v;
+        if (!ParseDouble(p, end, v)) {
+            /* Not a number; skip the rest of the line */
+            while (p < end && *p != '\n')
+                p++;
+            continue;
+        }
+
+        if (n < max) vals[n] = v;
+        n++;
+    }
+
+    return n;
+}
+
+/* Same as ParseRestOfLine, but starting at the next non-blank line */
+static int ParseLineValues(const char *&p, const char *end,
+                           double *vals, int max)
+{
+    p = SkipSpace(p, end);
+    return ParseRestOfLine(p, end, vals, max);
+}
+
+static long long CountNewlines(const char *p, const char *end)
+{
+    long long count = 0;
+    while (p < end) {
+        const char *nl = (const char *) memchr(p, '\n', end - p);
+        if (nl == NULL)
+            break;
+        count++;
+        p = nl + 1;
+    }
+
+    return count;
+}
+
+/* Parse the header and camera section of a text bundle file.  On
+ * return p points to the start of the point section */
+static bool ParseTextHeader(const char *&p, const char *end,
+                            BundleData &bundle, int &num_points)
+{
+    /* The first line holds either a version string or (for v0.1
+     * files) the image and point counts */
+    const char *line_end = (const char *) memchr(p, '\n', end - p);
+    if (line_end == NULL) line_end = end;
+
+    char first_line[256];
+    int len = (int) (line_end - p);
+    if (len > 255) len = 255;
+    memcpy(first_line, p, len);
+    first_line[len] = 0;
+
+    if (first_line[0] == '#') {
+        sscanf(first_line, "# Bundle file v%lf", &bundle.m_version);
+        p = line_end;
+    } else if (first_line[0] == 'v') {
+        sscanf(first_line, "v%lf", &bundle.m_version);
+        p = line_end;
+    } else {
+        bundle.m_version = 0.1;
+    }
+
+    double counts[3];
+    int n = ParseLineValues(p, end, counts, 3);
+    if (n < 2)
+        return false;
+
+    int num_images = (int) counts[0];
+    num_points = (int) counts[1];
+    bundle.m_coalesced =
+        (bundle.m_version >= 0.4 && n >= 3 && counts[2] != 0.0);
+
+    if (num_images < 0 || num_points < 0)
+        return false;
+
+    bundle.m_cameras.resize(num_images);
+
+    for (int i = 0; i < num_images; i++) {
+        bundle_camera_t &cam = bundle.m_cameras[i];
+        memset(&cam, 0, sizeof(bundle_camera_t));
+
+        if (bundle.m_version >= 0.4) {
+            /* Name of the file and other info */
+            bundle.m_names.push_back(ParseToken(p, end));
+
+            double info[3] = { 0.0, 0.0, 0.0 };
+            ParseRestOfLine(p, end, info, 3);
+            cam.w = (int) info[0];
+            cam.h = (int) info[1];
+            cam.focal_est = info[2];
+        }
+
+        /* Focal length (and distortion for v0.2 and later) */
+        double intrinsics[3] = { 0.0, 0.0, 0.0 };
+        if (ParseLineValues(p, end, intrinsics, 3) < 1)
+            return false;
+
+        cam.f = intrinsics[0];
+        cam.k[0] = intrinsics[1];
+        cam.k[1] = intrinsics[2];
+
+        /* Rotation */
+        for (int j = 0; j < 9; j++) {
+            if (!ParseDouble(p, end, cam.R[j]))
+                return false;
+        }
+
+        /* Translation */
+        for (int j = 0; j < 3; j++) {
+            if (!ParseDouble(p, end, cam.t[j]))
+                return false;
+        }
+    }
+
+    p = SkipSpace(p, end);
+    return true;
+}
+
+/* Parse count points starting at point index first.  The number of
+ * views of each point is stored in m_view_start[i+1] and the views
+ * are appended to views.  Returns the position after the last point,
+ * or NULL on a parse error */
+static const char *ParsePoints(const char *p, const char *end,
+                               BundleData &bundle, int first, int count,
+                               std::vector<bundle_view_t> &views)
+{
+    double version = bundle.m_version;
+    bool coalesced = bundle.m_coalesced;
+
+    for (int i = first; i < first + count; i++) {
+        if (version >= 0.4) {
+            int player_id;
+            if (!ParseInt(p, end, player_id))
+                return NULL;
+        }
+
+        /* Position */
+        double *pos = &bundle.m_pos[3 * i];
+        if (!ParseDouble(p, end, pos[0]) ||
+            !ParseDouble(p, end, pos[1]) ||
+            !ParseDouble(p, end, pos[2]))
+            return NULL;
+
+        /* Color */
+        float *color = &bundle.m_color[3 * i];
+        for (int j = 0; j < 3; j++) {
+            double c;
+            if (!ParseDouble(p, end, c))
+                return NULL;
+            color[j] = (float) c;
+        }
+
+        /* Descriptor (skipped) */
+        if (version >= 0.4 && coalesced) {
+            for (int j = 0; j < 128; j++) {
+                double d;
+                if (!ParseDouble(p, end, d))
+                    return NULL;
+            }
+        }
+
+        int num_visible;
+        if (!ParseInt(p, end, num_visible) || num_visible < 0)
+            return NULL;
+
+        bundle.m_view_start[i+1] = num_visible;
+
+        for (int j = 0; j < num_visible; j++) {
+            bundle_view_t view;
+            if (!ParseInt(p, end, view.image) || !ParseInt(p, end, view.key))
+                return NULL;
+
+            view.x = view.y = 0.0;
+            if (version >= 0.3) {
+                if (!ParseDouble(p, end, view.x) ||
+                    !ParseDouble(p, end, view.y))
+                    return NULL;
+            }
+
+            views.push_back(view);
+        }
+    }
+
+    return p;
+}
+
+/* Parse the point section in num_threads chunks.  Chunks are aligned
+ * to point records by counting lines, so this only succeeds if the
+ * file has the standard layout of one record field per line; returns
+ * false otherwise and the caller falls back to a serial parse */
+static bool ParsePointsParallel(const char *start, const char *end,
+                                BundleData &bundle, int num_points,
+                                int num_threads)
+{
+    int lines_per_point = 3;
+    if (bundle.m_version >= 0.4) {
+        lines_per_point++;
+        if (bundle.m_coalesced)
+            lines_per_point += 16;
+    }
+
+    /* Count the lines in each chunk */
+    std::vector<const char *> chunk(num_threads + 1);
+    size_t len = end - start;
+    for (int t = 0; t <= num_threads; t++)
+        chunk[t] = start + (len / num_threads) * t;
+    chunk[num_threads] = end;
+
+    std::vector<long long> newlines(num_threads);
+
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(num_threads)
+#endif
+    for (int t = 0; t < num_threads; t++)
+        newlines[t] = CountNewlines(chunk[t], chunk[t+1]);
+
+    /* Make sure the line count is what we expect */
+    const char *last = end;
+    while (last > start && IsSpace(last[-1]))
+        last--;
+
+    long long num_lines = 1 - CountNewlines(last, end);
+    for (int t = 0; t < num_threads; t++)
+        num_lines += newlines[t];
+
+    if (num_lines != (long long) num_points * lines_per_point)
+        return false;
+
+    /* Find the first point record starting in each chunk */
+    std::vector<const char *> pt_start(num_threads + 1);
+    std::vector<int> pt_first(num_threads + 1);
+    pt_start[0] = start;
+    pt_first[0] = 0;
+    pt_start[num_threads] = end;
+    pt_first[num_threads] = num_points;
+
+    long long line = 0;
+    for (int t = 1; t < num_threads; t++) {
+        line += newlines[t-1];
+
+        const char *q = chunk[t];
+        long long idx = line;
+        if (q[-1] != '\n') {
+            q = (const char *) memchr(q, '\n', end - q);
+            q = (q == NULL) ? end : q + 1;
+            idx++;
+        }
+
+        while (idx % lines_per_point != 0 && q < end) {
+            q = (const char *) memchr(q, '\n', end - q);
+            q = (q == NULL) ? end : q + 1;
+            idx++;
+        }
+
+        long long pt = (idx + lines_per_point - 1) / lines_per_point;
+        if (q >= end || pt > num_points) {
+            pt = num_points;
+            q = end;
+        }
+
+        pt_start[t] = q;
+        pt_first[t] = (int) pt;
+    }
+
+    /* Parse each chunk */
+    std::vector<std::vector<bundle_view_t> > views(num_threads);
+    std::vector<char> ok(num_threads, 0);
+
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(num_threads) schedule(static, 1)
+#endif
+    for (int t = 0; t < num_threads; t++) {
+        int count = pt_first[t+1] - pt_first[t];
+        const char *q =
+            ParsePoints(pt_start[t], end, bundle, pt_first[t], count, views[t]);
+
+        if (q != NULL &&
+            (pt_first[t+1] == num_points ||
+             SkipSpace(q, end) == pt_start[t+1]))
+            ok[t] = 1;
+    }
+
+    for (int t = 0; t < num_threads; t++) {
+        if (!ok[t])
+            return false;
+    }
+
+    /* Stitch the views back together in point order */
+    size_t num_views = 0;
+    for (int t = 0; t < num_threads; t++)
+        num_views += views[t].size();
+
+    bundle.m_views.resize(num_views);
+
+    size_t offset = 0;
+    for (int t = 0; t < num_threads; t++) {
+        if (views[t].size() > 0) {
+            memcpy(&bundle.m_views[offset], &views[t][0],
+                   sizeof(bundle_view_t) * views[t].size());
+        }
+        offset += views[t].size();
+    }
+
+    return true;
+}
+
+/* **** Binary bundle files **** */
+
+/* Layout (native byte order):
+ *   char magic[8]                    BUNDLE_BINARY_MAGIC
+ *   double version
+ *   int num_cameras, num_points, has_names, coalesced
+ *   long long num_views
+ *   bundle_camera_t cameras[num_cameras]
+ *   { int len; char name[len]; }     per camera, if has_names
+ *   double pos[3 * num_points]
+ *   float color[3 * num_points]
+ *   int view_start[num_points + 1]
+ *   bundle_view_t views[num_views]
+ */
+
+static bool ReadBytes(const char *&p, const char *end, void *dst, size_t n)
+{
+    if ((size_t) (end - p) < n)
+        return false;
+
+    if (n > 0)
+        memcpy(dst, p, n);
+    p += n;
+    return true;
+}
+
+static bool ReadBundleBinary(const char *p, const char *end,
+                             BundleData &bundle)
+{
+    p += 8; /* Magic */
+
+    int header[4];
+    long long num_views;
+    if (!ReadBytes(p, end, &bundle.m_version, sizeof(double)) ||
+        !ReadBytes(p, end, header, sizeof(int) * 4) ||
+        !ReadBytes(p, end, &num_views, sizeof(long long)))
+        return false;
+
+    int num_cameras = header[0];
+    int num_points = header[1];
+    bool has_names = (header[2] != 0);
+    bundle.m_coalesced = (header[3] != 0);
+
+    if (num_cameras < 0 || num_points < 0 || num_views < 0)
+        return false;
+
+    bundle.m_cameras.resize(num_cameras);
+    if (num_cameras > 0 &&
+        !ReadBytes(p, end, &bundle.m_cameras[0],
+                   sizeof(bundle_camera_t) * num_cameras))
+        return false;
+
+    if (has_names) {
+        for (int i = 0; i < num_cameras; i++) {
+            int len;
+            if (!ReadBytes(p, end, &len, sizeof(int)) || len < 0 ||
+                end - p < len)
+                return false;
+
+            bundle.m_names.push_back(std::string(p, len));
+            p += len;
+        }
+    }
+
+    bundle.m_pos.resize(3 * num_points);
+    bundle.m_color.resize(3 * num_points);
+    bundle.m_view_start.resize(num_points + 1);
+    bundle.m_views.resize((size_t) num_views);
+
+    if (num_points > 0 &&
+        (!ReadBytes(p, end, &bundle.m_pos[0],
+                    sizeof(double) * 3 * num_points) ||
+         !ReadBytes(p, end, &bundle.m_color[0],
+                    sizeof(float) * 3 * num_points)))
+        return false;
+
+    if (!ReadBytes(p, end, &bundle.m_view_start[0],
+                   sizeof(int) * (num_points + 1)))
+        return false;
+
+    if (num_views > 0 &&
+        !ReadBytes(p, end, &bundle.m_views[0],
+                   sizeof(bundle_view_t) * (size_t) num_views))
+        return false;
+
+    return bundle.m_view_start[num_points] == num_views;
+}
+
+bool WriteBundleBinary(const char *filename, const BundleData &bundle)
+{
+    FILE *f = fopen(filename, "wb");
+    if (f == NULL) {
+        printf("[WriteBundleBinary] Error opening file %s for writing\n",
+               filename);
+        return false;
+    }
+
+    int num_cameras = bundle.GetNumCameras();
+    int num_points = bundle.GetNumPoints();
+    long long num_views = (long long) bundle.m_views.size();
+    bool has_names = ((int) bundle.m_names.size() == num_cameras &&
+                      num_cameras > 0);
+
+    int header[4] =
+        { num_cameras, num_points, has_names ? 1 : 0,
+          bundle.m_coalesced ? 1 : 0 };
+
+    fwrite(BUNDLE_BINARY_MAGIC, 1, 8, f);
+    fwrite(&bundle.m_version, sizeof(double), 1, f);
+    fwrite(header, sizeof(int), 4, f);
+    fwrite(&num_views, sizeof(long long), 1, f);
+
+    if (num_cameras > 0)
+        fwrite(&bundle.m_cameras[0], sizeof(bundle_camera_t), num_cameras, f);
+
+    if (has_names) {
+        for (int i = 0; i < num_cameras; i++) {
+            int len = (int) bundle.m_names[i].length();
+            fwrite(&len, sizeof(int), 1, f);
+            fwrite(bundle.m_names[i].c_str(), 1, len, f);
+        }
+    }
+
+    if (num_points > 0) {
+        fwrite(&bundle.m_pos[0], sizeof(double), 3 * num_points, f);
+        fwrite(&bundle.m_color[0], sizeof(float), 3 * num_points, f);
+    }
+
+    int zero = 0;
+    if (num_points > 0 || bundle.m_view_start.size() > 0)
+        fwrite(&bundle.m_view_start[0], sizeof(int), num_points + 1, f);
+    else
+        fwrite(&zero, sizeof(int), 1, f);
+
+    if (num_views > 0)
+        fwrite(&bundle.m_views[0], sizeof(bundle_view_t),
+               (size_t) num_views, f);
+
+    bool success = (ferror(f) == 0);
+    fclose(f);
+
+    return success;
+}
+
+bool ReadBundle(const char *filename, BundleData &bundle, int num_threads)
+{
+    bundle.Clear();
+
+    MappedFile file;
+    if (!file.Open(filename)) {
+        printf("Error opening file %s for reading\n", filename);
+        return false;
+    }
+
+    const char *p = file.m_data;
+    const char *end = file.m_data + file.m_size;
+
+    if (file.m_size >= 8 && memcmp(p, BUNDLE_BINARY_MAGIC, 8) == 0) {
+        if (!ReadBundleBinary(p, end, bundle)) {
+            printf("[ReadBundle] Error: binary bundle file %s "
+                   "is truncated\n", filename);
+            bundle.Clear();
+            return false;
+        }
+
+        return true;
+    }
+
+    int num_points = 0;
+    if (file.m_size == 0 || !ParseTextHeader(p, end, bundle, num_points)) {
+        printf("[ReadBundle] Error reading header of %s\n", filename);
+        bundle.Clear();
+        return false;
+    }
+
+    bundle.m_pos.resize(3 * num_points);
+    bundle.m_color.resize(3 * num_points);
+    bundle.m_view_start.assign(num_points + 1, 0);
+
+#ifdef _OPENMP
+    if (num_threads < 0)
+        num_threads = omp_get_max_threads();
+#else
+    num_threads = 1;
+#endif
+
+    if (num_threads > num_points / MIN_POINTS_PER_THREAD)
+        num_threads = num_points / MIN_POINTS_PER_THREAD;
+
+    bool parsed = false;
+    if (num_threads > 1)
+        parsed = ParsePointsParallel(p, end, bundle, num_points, num_threads);
+
+    if (!parsed) {
+        bundle.m_views.clear();
+        if (ParsePoints(p, end, bundle, 0, num_points,
+                        bundle.m_views) == NULL) {
+            printf("[ReadBundle] Error reading points from %s\n", filename);
+            bundle.Clear();
+            return false;
+        }
+    }
+
+    /* Convert view counts to offsets */
+    for (int i = 0; i < num_points; i++)
+        bundle.m_view_start[i+1] += bundle.m_view_start[i];
+
+    return true;
+}
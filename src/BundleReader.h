@@ -0,0 +1,105 @@
+/*
+ *  Copyright (c) 2008-2010  Noah Snavely (snavely (at) cs.cornell.edu)
+ *    and the University of Washington
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+/* BundleReader.h */
+/* Shared reader for bundle.out files (text and binary variants) */
+
+#ifndef __bundle_reader_h__
+#define __bundle_reader_h__
+
+#include <stddef.h>
+
+#include <string>
+#include <vector>
+
+/* Magic string at the start of a binary bundle file */
+#define BUNDLE_BINARY_MAGIC "BNDLBIN1"
+
+typedef struct {
+    double f;             /* Focal length */
+    double k[2];          /* Radial distortion parameters */
+    double R[9];          /* Rotation */
+    double t[3];          /* Translation */
+    int w, h;             /* Image dimensions (v0.4 files only) */
+    double focal_est;     /* Focal length estimate (v0.4 files only) */
+} bundle_camera_t;
+
+typedef struct {
+    int image;            /* Image index */
+    int key;              /* Key index */
+    double x, y;          /* Key location (v0.3 files and later) */
+} bundle_view_t;
+
+/* Read-only contents of a whole file, memory mapped if possible */
+class MappedFile {
+public:
+    MappedFile() : m_data(NULL), m_size(0), m_mapped(false) { }
+    ~MappedFile() { Close(); }
+
+    bool Open(const char *filename);
+    void Close();
+
+    const char *m_data;
+    size_t m_size;
+
+private:
+    bool m_mapped;
+    std::vector<char> m_buffer;
+};
+
+/* Contents of a bundle file.  Points are stored as flat arrays so
+ * that a multi-million point file is a handful of allocations */
+class BundleData {
+public:
+    BundleData() : m_version(0.1), m_coalesced(false) { }
+
+    int GetNumCameras() const { return (int) m_cameras.size(); }
+    int GetNumPoints() const { return (int) m_view_start.size() - 1; }
+
+    int GetNumViews(int pt) const {
+        return m_view_start[pt+1] - m_view_start[pt];
+    }
+
+    const bundle_view_t *GetViews(int pt) const {
+        return &m_views[0] + m_view_start[pt];
+    }
+
+    void Clear();
+
+    double m_version;                      /* Bundle file version */
+    bool m_coalesced;                      /* Are descriptors present? */
+
+    std::vector<bundle_camera_t> m_cameras;
+    std::vector<std::string> m_names;      /* Image names (v0.4 only) */
+
+    std::vector<double> m_pos;             /* 3 * num_points positions */
+    std::vector<float> m_color;            /* 3 * num_points colors */
+    std::vector<int> m_view_start;         /* num_points + 1 offsets
+                                            * into m_views */
+    std::vector<bundle_view_t> m_views;    /* All point observations */
+};
+
+/* Read a text or binary bundle file (the format is detected from the
+ * file contents).  The point section of a text file is parsed in
+ * num_threads chunks (-1 means use all available threads).  Returns
+ * false if the file could not be read. */
+bool ReadBundle(const char *filename, BundleData &bundle,
+                int num_threads = -1);
+
+/* Write a binary bundle file */
+bool WriteBundleBinary(const char *filename, const BundleData &bundle);
+
+#endif /* __bundle_reader_h__ */
@@ -36,15 +36,22 @@
 #include <string>
 #include <time.h>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 #include "BundlerApp.h"
 #include "Bundle.h"
 #include "BundleAdd.h"
+#include "Profiler.h"
 // #include "Epipolar.h"  //TODO: Get rid of these?
 // #include "Register.h"
 #include "Decompose.h"
 #include "SifterUtil.h"
+#include "SparseCovariance.h"
 #include "TwoFrameModel.h"
 
+#include "sba.h"
 #include "sfm.h"
 
 #include "defines.h"
@@ -800,7 +807,6 @@ bool BundlerApp::BundleTwoFrame(int i1, int i2, TwoFrameModel *model,
 
         if (bundle_from_tracks) {
             int track_idx = GetKey(i1,key_idx1).m_track;
-            m_track_data[track_idx].m_extra = pt_count;
             tracks.push_back(track_idx);
         } 
 
@@ -863,7 +869,6 @@ bool BundlerApp::BundleTwoFrame(int i1, int i2, TwoFrameModel *model,
 
     // m_match_lists[list_idx].clear();
     m_matches.ClearMatch(list_idx);
-    matches.clear();
 
     /* Add constraints to camera 0 to fix position and rotation */
     cameras[0].constrained[0] = true;
@@ -1768,13 +1773,169 @@ bool BundlerApp::BundleTwoFrame(int i1, int i2, TwoFrameModel *model,
     return true;
 }
 
+/* Compute the two-frame model of every matching pair of images,
+ * reusing (and extending) the models in the store.  Pairs are split
+ * into rounds in which no image appears twice, since BundleTwoFrame
+ * writes to the keys (the key-to-point map RunSFM reads) and match
+ * list of its two images; the pairs of a round are then reconstructed
+ * in parallel.  Each model is appended to the store as soon as it is
+ * done, so that an interrupted run can be resumed */
+void BundlerApp::ComputeTwoFrameModels(const char *store_file, 
+                                       ModelMap &models)
+{
+    ProfileScope scope("ComputeTwoFrameModels");
+
+    int num_images = GetNumImages();
+
+    TwoFrameModelStore store;
+    if (!store.Open(store_file))
+        return;
+
+    int num_stored = ReadModelsBinary(store, models);
+
+    /* Find the pairs that still need a model */
+    const TrackCovisibility &covis = GetTrackCovisibility();
+
+    std::vector<MatchIndex> pending;
+    std::vector<int> num_uses(num_images, 0);
+    std::vector<bool> pinned(num_images, false);
+
+    for (int i = 0; i < num_images; i++) {
+        const std::vector<std::pair<int, int> > &row = covis.GetRow(i);
+
+        int row_size = (int) row.size();
+        for (int r = 0; r < row_size; r++) {
+            int j = row[r].first;
+
+            if (row[r].second < MATCH_THRESHOLD)
+                continue;
+
+            MatchIndex idx = GetMatchIndex(i, j);
+            if (store.Contains(idx))
+                continue;
+
+            pending.push_back(idx);
+            num_uses[i]++;
+            num_uses[j]++;
+        }
+    }
+
+    printf("[ComputeTwoFrameModels] %d models read from %s, "
+           "%d pairs to compute\n", 
+           num_stored, store_file, (int) pending.size());
+    fflush(stdout);
+
+    std::vector<int> round_stamp(num_images, -1);
+    int num_computed = 0, num_failed = 0, num_rounds = 0;
+
+    while (!pending.empty()) {
+        /* Greedily pick pairs with no image in common */
+        std::vector<MatchIndex> round, deferred;
+        int num_pending = (int) pending.size();
+        for (int p = 0; p < num_pending; p++) {
+            int i1 = pending[p].first, i2 = pending[p].second;
+
+            if (round_stamp[i1] == num_rounds || 
+                round_stamp[i2] == num_rounds) {
+                deferred.push_back(pending[p]);
+                continue;
+            }
+
+            round_stamp[i1] = round_stamp[i2] = num_rounds;
+            round.push_back(pending[p]);
+        }
+
+        pending.swap(deferred);
+        num_rounds++;
+
+        /* Keys are pinned from the first pair that uses them to the
+         * last (LoadKeys and SetTracks aren't thread-safe) */
+        int num_pairs = (int) round.size();
+        std::vector<int> round_images;
+        for (int p = 0; p < num_pairs; p++) {
+            round_images.push_back(round[p].first);
+            round_images.push_back(round[p].second);
+        }
+
+        PrefetchKeys(round_images, !m_optimize_for_fisheye);
+
+        for (int k = 0; k < (int) round_images.size(); k++) {
+            int img = round_images[k];
+
+            if (pinned[img])
+                continue;
+
+            PinKeys(img, !m_optimize_for_fisheye);
+            SetTracks(img);
+            pinned[img] = true;
+        }
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+        for (int p = 0; p < num_pairs; p++) {
+            int i1 = round[p].first, i2 = round[p].second;
+
+            ProfileScope pair_scope("BundleTwoFrame");
+
+            TwoFrameModel model;
+            double angle;
+            int num_pts;
+
+            bool success = 
+                BundleTwoFrame(i1, i2, &model, angle, num_pts, true);
+
+            /* BundleTwoFrame succeeds without a model on (near)
+             * identical images */
+            if (success && model.m_num_points == 0)
+                success = false;
+
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+            {
+                if (success) {
+                    store.Append(round[p], &model);
+                    models.AddModel(round[p], model);
+                    num_computed++;
+                } else {
+                    model.Clear();
+                    store.Append(round[p], NULL);
+                    num_failed++;
+                }
+            }
+        }
+
+        /* Release keys that no remaining pair needs */
+        for (int p = 0; p < num_pairs; p++) {
+            int i1 = round[p].first, i2 = round[p].second;
+
+            if (--num_uses[i1] == 0)
+                UnpinKeys(i1);
+            if (--num_uses[i2] == 0)
+                UnpinKeys(i2);
+        }
+    }
+
+    scope.AddItems(num_computed + num_failed);
+
+    printf("[ComputeTwoFrameModels] Computed %d models (%d failed) "
+           "in %d rounds\n", num_computed, num_failed, num_rounds);
+    fflush(stdout);
+}
+
 void BundlerApp::ComputeCameraCovariance()
 {
     int num_images = GetNumImages();
 
+    /* ReRunSFM adjusts the cameras with m_adjusted set, in order */
+    int num_cameras = 0;
+    for (int i = 0; i < num_images; i++) {
+        if (m_image_data[i].m_camera.m_adjusted)
+            num_cameras++;
+    }
+
     int cnp = (m_estimate_distortion) ? 9 : 7;
-    int num_vars = cnp * num_images;
-    double *S = new double[num_vars * num_vars];
 
     /* Add constraints */
     m_use_point_constraints = true;
@@ -1788,82 +1949,55 @@ void BundlerApp::ComputeCameraCovariance()
         m_point_constraints[i] = v3_new(p.m_pos[0], p.m_pos[1], p.m_pos[2]);
     }
 
-    ReRunSFM(S);
-
-#if 0
-    /* Debugging stuff */
-    for (int i = 1; i < num_images + 1; i++) {
-        int num_vars_sub = i * cnp;
-        double *Ssub = new double[num_vars_sub * num_vars_sub];
-
-        for (int j = 0; j < num_vars_sub; j++) {
-            memcpy(Ssub + j * num_vars_sub, S + j * num_vars, 
-                   sizeof(double) * num_vars_sub);
-        }
-
-        double *U, *S, *VT;
-        U = new double[num_vars_sub * num_vars_sub];
-        S = new double[num_vars_sub];
-        VT = new double[num_vars_sub * num_vars_sub];
-        
-        dgesvd_driver(num_vars_sub, num_vars_sub, Ssub, U, S, VT);
-        printf("Sing. values [round %d]\n", i);
-        for (int j = 0; j < num_vars_sub; j++) {
-            printf("   S[%d] = %0.5e\n", j, S[j]);
-        }
-
-        printf("Smallest eigenvector [round %d]:\n", i);
-        matrix_print(i, cnp, VT + (num_vars_sub-1) * num_vars_sub);
-
-        delete [] U;
-        delete [] S;
-        delete [] VT;
-
-        double *Sinv_sub = new double[num_vars_sub * num_vars_sub];
-        matrix_invert(num_vars_sub, Ssub, Sinv_sub);
-
-        for (int j = 0; j < i; j++) {
-            int row0 = (cnp * j + 0) * num_vars_sub;
-            int row1 = (cnp * j + 1) * num_vars_sub;
-            int row2 = (cnp * j + 2) * num_vars_sub;
-            int off = cnp * j;
+    /* Only the blocks of S for cameras that share a point are
+     * non-zero, so have sba return just those */
+    sba_sblocks S_blocks;
+    memset(&S_blocks, 0, sizeof(sba_sblocks));
 
-            double C[9] = { Sinv_sub[row0+off+0], Sinv_sub[row0+off+1], Sinv_sub[row0+off+2],
-                            Sinv_sub[row1+off+0], Sinv_sub[row1+off+1], Sinv_sub[row1+off+2],
-                            Sinv_sub[row2+off+0], Sinv_sub[row2+off+1], Sinv_sub[row2+off+2] };
-            
-            printf("Covariance[%d] [Image %d]:\n", i, j);
-            matrix_print(3, 3, C);
-        }
+    ReRunSFM(NULL, NULL, NULL, NULL, &S_blocks);
 
-        delete [] Ssub;
-        delete [] Sinv_sub;
+    if (S_blocks.blocks == NULL || S_blocks.pattern.nr != num_cameras) {
+        printf("[ComputeCameraCovariance] Error: bundle adjustment did not "
+               "return the reduced camera system\n");
+        sba_sblocks_free(&S_blocks);
+        return;
     }
-#endif
 
-    /* Invert S */
-    double *Sinv = new double[num_vars * num_vars];
-    matrix_invert(num_vars, S, Sinv);
+    /* Only the diagonal blocks of the inverse are needed, so recover
+     * them from a sparse factorization of S rather than inverting it */
+    double *Sinv_diag = new double[num_cameras * cnp * cnp];
+    bool success = 
+        ComputeSparseInverseDiagonal(num_cameras, cnp,
+                                     S_blocks.pattern.rowptr,
+                                     S_blocks.pattern.colidx,
+                                     S_blocks.blocks, Sinv_diag);
+
+    sba_sblocks_free(&S_blocks);
+
+    if (!success) {
+        printf("[ComputeCameraCovariance] Error: could not invert the "
+               "reduced camera system\n");
+        delete [] Sinv_diag;
+        return;
+    }
     
     FILE *f = fopen("covariance.txt", "w");
     if (f == NULL) {
         printf("[ComputeCameraCovariance] Error opening file %s for writing\n",
                "covariance.txt");
+        delete [] Sinv_diag;
         return;
     }
 
     int count = 0;
     for (int i = 0; i < num_images; i++) {
         if (m_image_data[i].m_camera.m_adjusted) {
-            int row0 = (cnp * count + 0) * num_vars;
-            int row1 = (cnp * count + 1) * num_vars;
-            int row2 = (cnp * count + 2) * num_vars;
-            int off = cnp * count;
+            const double *B = Sinv_diag + count * cnp * cnp;
 
             double C[9] = 
-                { Sinv[row0+off+0], Sinv[row0+off+1], Sinv[row0+off+2],
-                  Sinv[row1+off+0], Sinv[row1+off+1], Sinv[row1+off+2],
-                  Sinv[row2+off+0], Sinv[row2+off+1], Sinv[row2+off+2] };
+                { B[0 * cnp + 0], B[0 * cnp + 1], B[0 * cnp + 2],
+                  B[1 * cnp + 0], B[1 * cnp + 1], B[1 * cnp + 2],
+                  B[2 * cnp + 0], B[2 * cnp + 1], B[2 * cnp + 2] };
 
             fprintf(f, "%d\n", i);
             fprintf(f, "%0.6e %0.6e %0.6e "
@@ -1878,6 +2012,9 @@ void BundlerApp::ComputeCameraCovariance()
             count++;
         }
     }
+
+    fclose(f);
+    delete [] Sinv_diag;
 }
 
 #if 0
@@ -43,13 +43,14 @@
 #endif
 
 #include "BundlerApp.h"
+#include "Profiler.h"
 
 #include "Epipolar.h"
 #include "Register.h"
 #include "SifterUtil.h"
 
 #ifndef __USE_ANN__
-#include "BruteForceSearch.h"
+#include "KdTreeSearch.h"
 #endif
 
 #include "defines.h"
@@ -100,6 +101,8 @@ m_use_constraints = false;
 m_constrain_focal = false;
 m_constrain_focal_weight = 100.0;
 m_distortion_weight = 1.0e2;
+m_pcg_camera_threshold = 0;
+m_float_jacobians = false;
     
 m_use_point_constraints = false;
 m_point_constraint_weight = 0.0;
@@ -110,6 +113,7 @@ m_only_bundle_init_focal = false;
 m_init_focal_length = 532.0;
 m_initial_pair[0] = -1;
 m_initial_pair[1] = -1;
+m_initial_pair_candidates = 1;
 
 m_panorama_mode = false;
 m_homography_threshold = 6.0;
@@ -141,6 +145,8 @@ m_keypoint_border_bottom = 0;
 m_fisheye_params = NULL;
 m_bundle_output_file = m_bundle_output_base = NULL;
 m_bundle_file = NULL;
+m_output_binary = false;
+m_output_ply_binary = false;
 m_intrinsics_file = NULL;
 m_match_directory = ".";
 m_match_index_dir = NULL;
@@ -199,6 +205,10 @@ m_enrich_points = false;
 m_fix_necker = false;
 
 m_ignore_file = NULL;
+m_two_frame_model_file = NULL;
+m_checkpoint_file = NULL;
+m_checkpoint_interval = 1;
+m_resume = false;
 m_add_image_file = NULL;
 m_add_images_fast = false;
 
@@ -268,8 +278,20 @@ printf("Usage:  bundler <input.txt> [options]\n"
    "     --init_pair1 <img1>\n"
    "     --init_pair2 <img2>\n"
    "        Indices of the images with which to seed bundle adjustment\n"
+   "     --init_pair_candidates <k>\n"
+   "        Evaluate the <k> best-ranked initial pairs in parallel (relative\n"
+   "        pose and triangulation) and seed with the best one.  Default is 1.\n"
    "     --estimate_distortion\n"
    "        Estimate radial distortion parameters (2 coefficients)\n"
+   "     --pcg_camera_threshold <n>\n"
+   "        When more than <n> cameras are being adjusted, solve for the\n"
+   "        camera updates with preconditioned conjugate gradients\n"
+   "        instead of a dense factorization.  Uses memory linear in the\n"
+   "        number of observations.  Default is 0 (never)\n"
+   "     --float_jacobians\n"
+   "        Store the bundle adjustment jacobian in single precision,\n"
+   "        halving its memory; each adjustment is finished with a few\n"
+   "        iterations on the gradient in double precision\n"
    "     --ray_angle_threshold <degrees>\n"
    "        Don't triangulate points whose rays have an angle less\n"
    "        than <degrees>.  Default is 2 degrees.\n"
@@ -286,6 +308,25 @@ printf("Usage:  bundler <input.txt> [options]\n"
    "        Don't try to register any image whose index appears in <file>\n"
    "     --slow_bundle\n"
    "        Run slow version of bundle adjustment (adds an image at a time)\n"
+   "     --two_frame_models <file>\n"
+   "        Compute the two-frame model of every matching pair (in parallel)\n"
+   "        and exit.  Models are kept in the binary store <file>, and\n"
+   "        pairs already in it are not recomputed\n"
+   "     --key_cache_size <MB>\n"
+   "        Load keys on demand, keeping up to <MB> megabytes of them\n"
+   "        and dropping the least recently used keys not in use,\n"
+   "        instead of loading all keys up front.  Default is 0\n"
+   "        (no cache)\n"
+   "     --checkpoint <file>\n"
+   "        Save the state of the bundle adjustment to <file> after each\n"
+   "        round (written in the background)\n"
+   "     --checkpoint_interval <N>\n"
+   "        Save a checkpoint every <N> rounds.  Default is 1\n"
+   "     --resume\n"
+   "        Resume the bundle adjustment from the checkpoint file\n"
+   "     --profile <file>\n"
+   "        Time the stages of the run, print a summary table at the\n"
+   "        end, and write a Chrome trace (chrome://tracing) to <file>\n"
    "\n"
    "  [Output options]\n"
    "     --output <file>\n"
@@ -294,6 +335,10 @@ printf("Usage:  bundler <input.txt> [options]\n"
    "       Save intermediate bundle adjustment results\n"
    "     --output_dir\n"
    "       Specifies the directory in which to save output files\n"
+   "     --output_binary\n"
+   "       Write bundle files in the (faster to load) binary format\n"
+   "     --output_ply_binary\n"
+   "       Write point clouds (.ply files) in binary little-endian form\n"
    "\n"
    "  [Other options]\n"
    "     --options_file <file>\n"
@@ -413,6 +458,15 @@ while (1)
     
     {"init_pair1",   1, 0, 'p'},
     {"init_pair2",   1, 0, 'q'},
+    {"init_pair_candidates", 1, 0, 371},
+    {"two_frame_models", 1, 0, 372},
+    {"key_cache_size", 1, 0, 373},
+    {"checkpoint",   1, 0, 374},
+    {"checkpoint_interval", 1, 0, 375},
+    {"resume",       0, 0, 376},
+    {"profile",      1, 0, 377},
+    {"pcg_camera_threshold", 1, 0, 379},
+    {"float_jacobians", 0, 0, 380},
     {"output",       1, 0, 'o'},
     {"output_all",   1, 0, 'a'},
     {"init_focal_length",  1, 0, 'i'},
@@ -507,6 +561,8 @@ while (1)
     {"global_nn_sigma", 1, 0, 304},
     
     {"output_dir",   1, 0, 'u'},
+    {"output_binary", 0, 0, 370},
+    {"output_ply_binary", 0, 0, 378},
     {"use_constraints", 0, 0, '=' },
     {"constrain_focal", 0, 0, '$'},
     {"constrain_focal_weight", 1, 0, 'J'},
@@ -559,6 +615,33 @@ while (1)
     case 'q':
       m_initial_pair[1] = atoi(optarg);
       break;
+    case 371:
+      m_initial_pair_candidates = atoi(optarg);
+      break;
+    case 372:
+      m_two_frame_model_file = strdup(optarg);
+      break;
+    case 373:
+      m_key_cache.SetBudget((size_t) (atof(optarg) * 1048576.0));
+      break;
+    case 374:
+      m_checkpoint_file = strdup(optarg);
+      break;
+    case 375:
+      m_checkpoint_interval = MAX(1, atoi(optarg));
+      break;
+    case 376:
+      m_resume = true;
+      break;
+    case 377:
+      ProfilerStart(optarg);
+      break;
+    case 379:
+      m_pcg_camera_threshold = atoi(optarg);
+      break;
+    case 380:
+      m_float_jacobians = true;
+      break;
     case 347:
       m_estimate_distortion = true;
       break;
@@ -808,6 +891,12 @@ while (1)
     case 'u':
       m_output_directory = strdup(optarg);
       break;
+    case 370:
+      m_output_binary = true;
+      break;
+    case 378:
+      m_output_ply_binary = true;
+      break;
     case '=':
       m_use_constraints = true;
       break;
@@ -1101,6 +1190,17 @@ if (m_ignore_file != NULL)
   ReadIgnoreFile();
  }
 
+#ifndef __DEMO__
+if (m_two_frame_model_file != NULL) 
+ {
+  ComputeGeometricConstraints();
+
+  ModelMap models(GetNumImages());
+  ComputeTwoFrameModels(m_two_frame_model_file, models);
+  exit(0);
+ }
+#endif
+
 /* Do bundle adjustment (or read from file if provided) */
 // ParseCommand("UndistortAll", NULL);
 if (m_bundle_provided) 
@@ -36,6 +36,7 @@
 #define __bundlerapp_h__
 
 #include "BaseApp.h"
+#include "Checkpoint.h"
 #include "LinkDirection.h"
 #include "TwoFrameModel.h"
 
@@ -76,6 +77,9 @@ public:
   /* Compute transforms between all matching images */
   void ComputeTransforms(bool removeBadMatches, int new_image_start = 0);
 
+  /* Pin the keys of an image and prefetch those of its neighbors */
+  void PinNeighborKeys(int i);
+
   /* Compute epipolar geometry between a given pair of images */
   bool ComputeEpipolarGeometry(int idx1, int idx2, bool removeBadMatches);
 
@@ -108,6 +112,19 @@ public:
 				std::vector<ImageKeyVector> &pt_views,
 				bool use_constraints);
 
+  /* Save the state of the incremental bundle adjustment after a
+   * round to the checkpoint file (every m_checkpoint_interval rounds) */
+  void SaveCheckpoint(int round, int num_cameras, int num_points,
+                      int *added_order, camera_params_t *cameras,
+                      v3_t *points, v3_t *colors,
+                      const std::vector<ImageKeyVector> &pt_views);
+
+  /* Restore the state saved to the checkpoint file */
+  bool RestoreCheckpoint(int &round, int &num_cameras, int &num_points,
+                         int *added_order, int *added_order_inv,
+                         camera_params_t *cameras, v3_t *points,
+                         v3_t *colors, std::vector<ImageKeyVector> &pt_views);
+
   /* Set up the matrix of projections and the visibility mask */
   void SetupProjections(int num_cameras, int num_points, int *added_order,
 			  v2_t *projections, char *vmask);
@@ -170,6 +187,11 @@ public:
   void BundlePickInitialPair(int &i_best, int &j_best, 
                              bool use_init_focal_only);
 
+  /* Evaluate several candidate initial pairs in parallel and pick
+   * the best one */
+  bool PickInitialPairFromCandidates(const std::vector<ImagePair> &candidates,
+                                     int &i_best, int &j_best);
+
   /* Setup the initial camera pair for bundle adjustment */
   int SetupInitialCameraPair(int i_best, int j_best,
 			       double &init_focal_length_0, double &init_focal_length_1,
@@ -216,13 +238,14 @@ public:
   void RunSFMWithNewImages(int new_images, double *S = NULL, double *U = NULL,
                            double *V = NULL, double *W = NULL);
   void ReRunSFM(double *S = NULL, double *U = NULL, double *V = NULL, 
-                double *W = NULL);
+                double *W = NULL, sba_sblocks *S_blocks = NULL);
   double RunSFM(int num_pts, int num_cameras, int start_camera,
 		        bool fix_points, camera_params_t *init_camera_params,
 		        v3_t *init_pts, int *added_order, v3_t *colors,
 		        std::vector<ImageKeyVector> &pt_views, double eps2 = 1.0e-12,
                 double *S = NULL, double *U = NULL, double *V = NULL,
-                double *W = NULL, bool remove_outliers = true);
+                double *W = NULL, bool remove_outliers = true,
+                sba_sblocks *S_blocks = NULL);
   double RunSFMNecker(int i1, int i2, camera_params_t *cameras, int num_points,
                 v3_t *points, v3_t *colors,
                 std::vector<ImageKeyVector> &pt_views,
@@ -233,6 +256,9 @@ public:
   bool BundleTwoFrame(int i1, int i2, TwoFrameModel *model, 
                       double &angle_out, int &num_pts_out, 
                       bool bundle_from_tracks);
+  /* Compute (or read back) the two-frame models of all matching
+   * pairs, using the binary model store in store_file */
+  void ComputeTwoFrameModels(const char *store_file, ModelMap &models);
   bool EstimateRelativePose(int i1, int i2, 
                             camera_params_t &camera1, 
                             camera_params_t &camera2);
@@ -241,6 +267,10 @@ public:
                              camera_params_t &camera1, 
                              camera_params_t &camera2);
 
+  /* Score a candidate initial pair by its well-triangulated inliers */
+  bool EvaluateInitialPair(int i1, int i2, int &num_good, 
+                           double &median_angle);
+
   /* Register a new image with the existing model */
   bool BundleRegisterImage(ImageData &data, bool init_location);
   void RunBundleServer();
@@ -372,6 +402,13 @@ public:
   double m_distortion_weight;  /* Weight on distortion parameter
                                 * constraints */
 
+  int m_pcg_camera_threshold;  /* Solve bundle adjustment with
+                                * preconditioned conjugate gradients
+                                * above this many free cameras (0 means
+                                * never) */
+  bool m_float_jacobians;      /* Store the bundle adjustment jacobian
+                                * in single precision */
+
   bool m_construct_max_connectivity;  /* Do bundle adjustment using
                                        * the connectivity score? */
 
@@ -382,6 +419,16 @@ public:
 
   int m_initial_pair[2];    /* Images to use as the initial pair
 				             * during bundle adjustment */
+  int m_initial_pair_candidates;  /* Number of top-ranked pairs to
+                                   * evaluate when picking the
+                                   * initial pair */
+
+  char *m_two_frame_model_file;   /* Binary store of two-frame models */
+
+  char *m_checkpoint_file;     /* Checkpoint of the bundle adjustment */
+  int m_checkpoint_interval;   /* Rounds between checkpoints */
+  bool m_resume;               /* Resume from the checkpoint? */
+  CheckpointWriter m_checkpoint_writer;
 
   bool m_features_coalesced;   /* Have features been coalesced */
 
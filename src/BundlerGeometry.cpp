@@ -27,6 +27,7 @@
 #include "BundlerApp.h"
 
 #include "Epipolar.h"
+#include "Profiler.h"
 #include "Register.h"
 #include "SifterUtil.h"
 
@@ -36,10 +37,6 @@
 #include "qsort.h"
 #include "util.h"
 
-
-
-double global_scale = 1.0;
-
 int BundlerApp::GetNumCameraParameters() {
     int cnp = 6;
      
@@ -100,6 +97,8 @@ void TransformInfo::WriteToFile(FILE *f) {
 void BundlerApp::ComputeGeometricConstraints(bool overwrite, 
                                              int new_image_start) 
 {
+    ProfileScope scope("ComputeGeometricConstraints");
+
     int num_images = GetNumImages();
 
     /* Read information from files if they exist */
@@ -114,29 +113,39 @@ void BundlerApp::ComputeGeometricConstraints(bool overwrite,
         if (num_images < 40000) 
             WriteMatchTableDrew(".prune");
 
-        if (!m_skip_fmatrix || !m_skip_homographies || 
-            m_keypoint_border_width > 0 || m_keypoint_border_bottom > 0)
+        /* With a key cache, keys are loaded pair by pair instead */
+        if ((!m_skip_fmatrix || !m_skip_homographies || 
+             m_keypoint_border_width > 0 || m_keypoint_border_bottom > 0) &&
+            m_key_cache.GetBudget() == 0)
             LoadKeys(false);
 
         if (m_keypoint_border_width > 0) {
             for (int i = 0; i < num_images; i++) {
+                PinKeys(i);
                 for (int j = i+1; j < num_images; j++) {
                     if (!ImagesMatch(i, j))
                         continue;
 
+                    PinKeys(j);
                     RemoveMatchesNearBorder(i, j, m_keypoint_border_width);
+                    UnpinKeys(j);
                 }
+                UnpinKeys(i);
             }
         }
 
         if (m_keypoint_border_bottom > 0) {
             for (int i = 0; i < num_images; i++) {
+                PinKeys(i);
                 for (int j = i+1; j < num_images; j++) {
                     if (!ImagesMatch(i, j))
                         continue;
 
+                    PinKeys(j);
                     RemoveMatchesNearBottom(i, j, m_keypoint_border_bottom);
+                    UnpinKeys(j);
                 }
+                UnpinKeys(i);
             }
         }
 
@@ -156,6 +165,12 @@ void BundlerApp::ComputeGeometricConstraints(bool overwrite,
 #endif
         }
 
+        if (m_key_cache.GetBudget() > 0) {
+            printf("[ComputeGeometricConstraints] Key cache read %d key "
+                   "files, holds %0.1fMB\n", m_key_cache.GetNumLoads(),
+                   m_key_cache.GetNumBytes() / 1048576.0);
+        }
+
 	MakeMatchListsSymmetric();
 
         if (num_images < 40000)
@@ -301,6 +316,8 @@ bool BundlerApp::ComputeTransform(int idx1, int idx2, bool removeBadMatches)
 /* Compute rigid transforms between all matching images */
 void BundlerApp::ComputeTransforms(bool removeBadMatches, int new_image_start) 
 {
+    ProfileScope scope("ComputeTransforms");
+
     unsigned int num_images = GetNumImages();
 
     m_transforms.clear();
@@ -309,6 +326,8 @@ void BundlerApp::ComputeTransforms(bool removeBadMatches, int new_image_start)
     //    for (int j = i+1; j < num_images; j++) {
 
     for (unsigned int i = 0; i < num_images; i++) {
+        PinNeighborKeys(i);
+
         MatchAdjList::iterator iter;
         for (iter = m_matches.Begin(i); iter != m_matches.End(i); iter++) {
             // unsigned int i = iter->first;
@@ -321,10 +340,14 @@ void BundlerApp::ComputeTransforms(bool removeBadMatches, int new_image_start)
             MatchIndex idx = GetMatchIndex(i, j);
             MatchIndex idx_rev = GetMatchIndex(j, i);
 
+            scope.AddItems(1);
+
             m_transforms[idx] = TransformInfo();
             m_transforms[idx_rev] = TransformInfo();
 
+            PinKeys(j);
             bool connect12 = ComputeTransform(i, j, removeBadMatches);
+            UnpinKeys(j);
 
             if (!connect12) {
                 if (removeBadMatches) {
@@ -344,6 +367,8 @@ void BundlerApp::ComputeTransforms(bool removeBadMatches, int new_image_start)
                               m_transforms[idx_rev].m_H);
             }
         }
+
+        UnpinKeys(i);
     }
 
 #ifdef SBK_OUTPUT
@@ -383,6 +408,20 @@ void BundlerApp::ComputeTransforms(bool removeBadMatches, int new_image_start)
     fclose(f);
 }
 
+/* Pin the keys of image i, and prefetch those of its neighbors in
+ * the match graph, which are verified against it next */
+void BundlerApp::PinNeighborKeys(int i)
+{
+    std::vector<int> nbrs;
+
+    MatchAdjList::iterator iter;
+    for (iter = m_matches.Begin(i); iter != m_matches.End(i); iter++)
+        nbrs.push_back(iter->m_index);
+
+    PinKeys(i);
+    PrefetchKeys(nbrs);
+}
+
 /* Compute epipolar geometry between a given pair of images */
 bool BundlerApp::ComputeEpipolarGeometry(int idx1, int idx2, 
                                          bool removeBadMatches) 
@@ -444,6 +483,8 @@ bool BundlerApp::ComputeEpipolarGeometry(int idx1, int idx2,
 void BundlerApp::ComputeEpipolarGeometry(bool removeBadMatches, 
                                          int new_image_start) 
 {
+    ProfileScope scope("ComputeEpipolarGeometry");
+
     unsigned int num_images = GetNumImages();
     
     m_transforms.clear();
@@ -454,6 +495,8 @@ void BundlerApp::ComputeEpipolarGeometry(bool removeBadMatches,
     std::vector<MatchIndex> remove;
 
     for (unsigned int i = 0; i < num_images; i++) {
+        PinNeighborKeys(i);
+
         MatchAdjList::iterator iter;
 
         for (iter = m_matches.Begin(i); iter != m_matches.End(i); iter++) {
@@ -467,8 +510,12 @@ void BundlerApp::ComputeEpipolarGeometry(bool removeBadMatches,
             MatchIndex idx = GetMatchIndex(i, j);
             MatchIndex idx_rev = GetMatchIndex(j, i);
 
+            PinKeys(j);
             bool connect12 = 
                 ComputeEpipolarGeometry(i, j, removeBadMatches);
+            UnpinKeys(j);
+
+            scope.AddItems(1);
 
             if (!connect12) {
                 if (removeBadMatches) {
@@ -489,6 +536,8 @@ void BundlerApp::ComputeEpipolarGeometry(bool removeBadMatches,
                                  m_transforms[idx_rev].m_fmatrix);
             }
         }
+
+        UnpinKeys(i);
     }
 
     int num_removed = (int) remove.size();
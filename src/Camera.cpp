@@ -23,10 +23,12 @@
 #include "Camera.h"
 #include "Geometry.h"
 #include "SifterUtil.h"
+#include "SmallMatrix.h"
 
 #include "defines.h"
 #include "fit.h"
 #include "matrix.h"
+#include "sfm_project.h"
 #include "vector.h"
 
 
@@ -148,7 +150,7 @@ bool CameraInfo::Project(const double *p, double *proj) const
     double p4[4] = { p[0], p[1], p[2], 1.0 };
     double proj3[3];
 
-    matrix_product(3, 4, 4, 1, (double *) m_Pmatrix, p4, proj3);
+    SmallMatrixProduct<3,4,1>(m_Pmatrix, p4, proj3);
 
     if (proj3[2] == 0.0)
         return false;
@@ -159,11 +161,12 @@ bool CameraInfo::Project(const double *p, double *proj) const
     if (m_k[0] == 0.0 && m_k[1] == 0.0)
         return (proj3[2] < 0.0);
 
-    double rsq = (proj[0] * proj[0] + proj[1] * proj[1]) / (m_focal * m_focal);
-    double factor = 1.0 + m_k[0] * rsq + m_k[1] * rsq * rsq;
+    double rsq;
+    double factor = 
+        sfm_proj_radial_factor(m_focal, m_k[0], m_k[1], proj, &rsq);
 
     if (rsq > 8.0 || factor < 0.0) // bad extrapolation
-        return (proj[2] < 0.0);
+        return (proj3[2] < 0.0);
 
     proj[0] *= factor;
     proj[1] *= factor;
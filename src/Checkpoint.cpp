@@ -0,0 +1,300 @@
+/*
+ *  Copyright (c) 2008-2010  Noah Snavely (snavely (at) cs.cornell.edu)
+ *    and the University of Washington
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+/* Checkpoint.cpp */
+/* Checkpoints of the incremental bundle adjustment */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "Checkpoint.h"
+#include "Profiler.h"
+
+#define CHECKPOINT_MAGIC "BCKPT001"
+#define CHECKPOINT_MAGIC_LEN 8
+#define CHECKPOINT_VERSION 1
+
+typedef struct {
+    char magic[CHECKPOINT_MAGIC_LEN];
+    int version;
+    int camera_size;            /* sizeof(camera_params_t) */
+    int num_images;
+    int num_tracks;
+    int round;
+    int num_cameras;
+    int num_points;
+    int num_views;              /* Total over all points */
+    int num_key_extras;
+    int reserved;
+} checkpoint_header_t;
+
+BundleCheckpoint::BundleCheckpoint() : m_num_images(0), m_num_tracks(0),
+    m_round(0), m_num_cameras(0), m_num_points(0)
+{
+}
+
+bool WriteCheckpoint(const char *filename, const BundleCheckpoint &checkpoint)
+{
+    ProfileScope scope("WriteCheckpoint");
+
+    int num_cameras = checkpoint.m_num_cameras;
+    int num_points = checkpoint.m_num_points;
+
+    std::vector<int> num_views(num_points);
+    std::vector<int> views;
+
+    for (int i = 0; i < num_points; i++) {
+        const ImageKeyVector &pt_views = checkpoint.m_pt_views[i];
+        num_views[i] = (int) pt_views.size();
+
+        for (int j = 0; j < num_views[i]; j++) {
+            views.push_back(pt_views[j].first);
+            views.push_back(pt_views[j].second);
+        }
+    }
+
+    checkpoint_header_t header;
+    memset(&header, 0, sizeof(checkpoint_header_t));
+    memcpy(header.magic, CHECKPOINT_MAGIC, CHECKPOINT_MAGIC_LEN);
+    header.version = CHECKPOINT_VERSION;
+    header.camera_size = (int) sizeof(camera_params_t);
+    header.num_images = checkpoint.m_num_images;
+    header.num_tracks = checkpoint.m_num_tracks;
+    header.round = checkpoint.m_round;
+    header.num_cameras = num_cameras;
+    header.num_points = num_points;
+    header.num_views = (int) views.size() / 2;
+    header.num_key_extras = (int) checkpoint.m_key_extras.size() / 3;
+
+    std::string tmp_file = std::string(filename) + ".tmp";
+
+    FILE *f = fopen(tmp_file.c_str(), "wb");
+    if (f == NULL) {
+        printf("[WriteCheckpoint] Error opening file %s for writing\n",
+               tmp_file.c_str());
+        return false;
+    }
+
+    fwrite(&header, sizeof(checkpoint_header_t), 1, f);
+
+    if (num_cameras > 0) {
+        fwrite(&checkpoint.m_added_order[0], sizeof(int), num_cameras, f);
+        fwrite(&checkpoint.m_cameras[0], sizeof(camera_params_t),
+               num_cameras, f);
+    }
+
+    if (num_points > 0) {
+        fwrite(&checkpoint.m_points[0], sizeof(v3_t), num_points, f);
+        fwrite(&checkpoint.m_colors[0], sizeof(v3_t), num_points, f);
+        fwrite(&num_views[0], sizeof(int), num_points, f);
+    }
+
+    if (!views.empty())
+        fwrite(&views[0], sizeof(int), views.size(), f);
+
+    if (header.num_tracks > 0)
+        fwrite(&checkpoint.m_track_points[0], sizeof(int),
+               header.num_tracks, f);
+
+    if (header.num_images > 0)
+        fwrite(&checkpoint.m_image_flags[0], sizeof(char),
+               header.num_images, f);
+
+    if (!checkpoint.m_key_extras.empty())
+        fwrite(&checkpoint.m_key_extras[0], sizeof(int),
+               checkpoint.m_key_extras.size(), f);
+
+    bool error = (fflush(f) != 0 || ferror(f));
+    if (fclose(f) != 0)
+        error = true;
+
+    if (error) {
+        printf("[WriteCheckpoint] Error writing to %s\n", tmp_file.c_str());
+        remove(tmp_file.c_str());
+        return false;
+    }
+
+#ifdef WIN32
+    /* rename doesn't replace an existing file on Windows */
+    remove(filename);
+#endif
+
+    if (rename(tmp_file.c_str(), filename) != 0) {
+        printf("[WriteCheckpoint] Error renaming %s to %s\n",
+               tmp_file.c_str(), filename);
+        return false;
+    }
+
+    return true;
+}
+
+bool ReadCheckpoint(const char *filename, BundleCheckpoint &checkpoint)
+{
+    FILE *f = fopen(filename, "rb");
+    if (f == NULL) {
+        printf("[ReadCheckpoint] Error opening file %s for reading\n",
+               filename);
+        return false;
+    }
+
+    checkpoint_header_t header;
+
+    if (fread(&header, sizeof(checkpoint_header_t), 1, f) != 1 ||
+        memcmp(header.magic, CHECKPOINT_MAGIC, CHECKPOINT_MAGIC_LEN) != 0) {
+        printf("[ReadCheckpoint] Error: %s is not a checkpoint\n", filename);
+        fclose(f);
+        return false;
+    }
+
+    if (header.version != CHECKPOINT_VERSION ||
+        header.camera_size != (int) sizeof(camera_params_t)) {
+        printf("[ReadCheckpoint] Error: %s was written by an incompatible "
+               "version of bundler\n", filename);
+        fclose(f);
+        return false;
+    }
+
+    if (header.num_images < 0 || header.num_tracks < 0 ||
+        header.num_cameras < 0 || header.num_cameras > header.num_images ||
+        header.num_points < 0 || header.num_points > header.num_tracks ||
+        header.num_views < 0 || header.num_key_extras < 0) {
+        printf("[ReadCheckpoint] Error: bad header in %s\n", filename);
+        fclose(f);
+        return false;
+    }
+
+    int num_cameras = header.num_cameras;
+    int num_points = header.num_points;
+
+    checkpoint.m_num_images = header.num_images;
+    checkpoint.m_num_tracks = header.num_tracks;
+    checkpoint.m_round = header.round;
+    checkpoint.m_num_cameras = num_cameras;
+    checkpoint.m_num_points = num_points;
+
+    checkpoint.m_added_order.resize(num_cameras);
+    checkpoint.m_cameras.resize(num_cameras);
+    checkpoint.m_points.resize(num_points);
+    checkpoint.m_colors.resize(num_points);
+    checkpoint.m_track_points.resize(header.num_tracks);
+    checkpoint.m_image_flags.resize(header.num_images);
+    checkpoint.m_key_extras.resize(3 * header.num_key_extras);
+
+    std::vector<int> num_views(num_points);
+    std::vector<int> views(2 * header.num_views);
+
+    bool error = false;
+
+    if (num_cameras > 0) {
+        error |= fread(&checkpoint.m_added_order[0], sizeof(int),
+                       num_cameras, f) != (size_t) num_cameras;
+        error |= fread(&checkpoint.m_cameras[0], sizeof(camera_params_t),
+                       num_cameras, f) != (size_t) num_cameras;
+    }
+
+    if (num_points > 0) {
+        error |= fread(&checkpoint.m_points[0], sizeof(v3_t),
+                       num_points, f) != (size_t) num_points;
+        error |= fread(&checkpoint.m_colors[0], sizeof(v3_t),
+                       num_points, f) != (size_t) num_points;
+        error |= fread(&num_views[0], sizeof(int),
+                       num_points, f) != (size_t) num_points;
+    }
+
+    if (!views.empty())
+        error |= fread(&views[0], sizeof(int), views.size(), f) !=
+            views.size();
+
+    if (header.num_tracks > 0)
+        error |= fread(&checkpoint.m_track_points[0], sizeof(int),
+                       header.num_tracks, f) != (size_t) header.num_tracks;
+
+    if (header.num_images > 0)
+        error |= fread(&checkpoint.m_image_flags[0], sizeof(char),
+                       header.num_images, f) != (size_t) header.num_images;
+
+    if (!checkpoint.m_key_extras.empty())
+        error |= fread(&checkpoint.m_key_extras[0], sizeof(int),
+                       checkpoint.m_key_extras.size(), f) !=
+            checkpoint.m_key_extras.size();
+
+    fclose(f);
+
+    if (error) {
+        printf("[ReadCheckpoint] Error: %s is truncated\n", filename);
+        return false;
+    }
+
+    /* Split the views back up by point */
+    checkpoint.m_pt_views.clear();
+    checkpoint.m_pt_views.resize(num_points);
+
+    size_t pos = 0;
+    for (int i = 0; i < num_points; i++) {
+        if (num_views[i] < 0 || pos + 2 * num_views[i] > views.size()) {
+            printf("[ReadCheckpoint] Error: bad views in %s\n", filename);
+            return false;
+        }
+
+        ImageKeyVector &pt_views = checkpoint.m_pt_views[i];
+        pt_views.reserve(num_views[i]);
+
+        for (int j = 0; j < num_views[i]; j++, pos += 2)
+            pt_views.push_back(ImageKey(views[pos], views[pos + 1]));
+    }
+
+    return true;
+}
+
+CheckpointWriter::CheckpointWriter() : m_checkpoint(NULL), m_success(true)
+{
+}
+
+CheckpointWriter::~CheckpointWriter()
+{
+    Wait();
+}
+
+void CheckpointWriter::Run(CheckpointWriter *writer)
+{
+    writer->m_success =
+        WriteCheckpoint(writer->m_filename.c_str(), *writer->m_checkpoint);
+}
+
+void CheckpointWriter::Write(const char *filename,
+                             BundleCheckpoint *checkpoint)
+{
+    /* A failed write has already reported its error */
+    Wait();
+
+    m_filename = filename;
+    m_checkpoint = checkpoint;
+    m_thread = std::thread(Run, this);
+}
+
+bool CheckpointWriter::Wait()
+{
+    if (m_thread.joinable())
+        m_thread.join();
+
+    delete m_checkpoint;
+    m_checkpoint = NULL;
+
+    bool success = m_success;
+    m_success = true;
+
+    return success;
+}
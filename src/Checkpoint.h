@@ -0,0 +1,95 @@
+/*
+ *  Copyright (c) 2008-2010  Noah Snavely (snavely (at) cs.cornell.edu)
+ *    and the University of Washington
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+/* Checkpoint.h */
+/* Checkpoints of the incremental bundle adjustment */
+
+#ifndef __checkpoint_h__
+#define __checkpoint_h__
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Geometry.h"
+#include "sfm.h"
+#include "vector.h"
+
+/* Per-image flags */
+#define CHECKPOINT_ADJUSTED 0x1   /* m_camera.m_adjusted */
+#define CHECKPOINT_IGNORED  0x2   /* m_ignore_in_bundle */
+
+/* The state of the incremental bundle adjustment at the end of a
+ * round: everything needed to carry on with the next round, including
+ * the point each track and each key of an added image refers to (which
+ * the bundle output files don't record) */
+class BundleCheckpoint
+{
+public:
+    BundleCheckpoint();
+
+    int m_num_images;
+    int m_num_tracks;
+    int m_round;                    /* Next round to run */
+    int m_num_cameras;
+    int m_num_points;
+
+    std::vector<int> m_added_order;            /* Image of each camera */
+    std::vector<camera_params_t> m_cameras;
+    std::vector<v3_t> m_points;
+    std::vector<v3_t> m_colors;
+    std::vector<ImageKeyVector> m_pt_views;    /* Views of each point */
+
+    std::vector<int> m_track_points;   /* m_extra of each track */
+    std::vector<char> m_image_flags;   /* CHECKPOINT_* of each image */
+
+    /* (image, key, m_extra) for each key of an added image whose
+     * m_extra is set */
+    std::vector<int> m_key_extras;
+};
+
+/* Write a checkpoint to a temporary file and move it over filename,
+ * so that a crash while writing leaves the previous checkpoint
+ * intact */
+bool WriteCheckpoint(const char *filename, const BundleCheckpoint &checkpoint);
+
+/* Read a checkpoint written by WriteCheckpoint */
+bool ReadCheckpoint(const char *filename, BundleCheckpoint &checkpoint);
+
+/* Writes checkpoints on a background thread, one at a time */
+class CheckpointWriter
+{
+public:
+    CheckpointWriter();
+    ~CheckpointWriter();
+
+    /* Wait for the previous write, then start writing checkpoint
+     * (which the writer takes ownership of) to filename */
+    void Write(const char *filename, BundleCheckpoint *checkpoint);
+
+    /* Wait for the write in progress.  Returns false if it failed */
+    bool Wait();
+
+private:
+    static void Run(CheckpointWriter *writer);
+
+    std::thread m_thread;
+    std::string m_filename;
+    BundleCheckpoint *m_checkpoint;
+    bool m_success;
+};
+
+#endif /* __checkpoint_h__ */
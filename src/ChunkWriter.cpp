@@ -0,0 +1,64 @@
+/*
+ *  Copyright (c) 2008-2010  Noah Snavely (snavely (at) cs.cornell.edu)
+ *    and the University of Washington
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+/* ChunkWriter.cpp */
+/* Encode the records of an output file in parallel chunks */
+
+#include <stdarg.h>
+#include <string.h>
+
+#include "ChunkWriter.h"
+
+void AppendFormat(std::string &buf, const char *fmt, ...)
+{
+    char tmp[256];
+
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(tmp, sizeof(tmp), fmt, args);
+    va_end(args);
+
+    if (len < 0)
+        return;
+
+    if (len < (int) sizeof(tmp)) {
+        buf.append(tmp, len);
+        return;
+    }
+
+    /* Too long for the stack buffer */
+    size_t pos = buf.size();
+    buf.resize(pos + len + 1);
+
+    va_start(args, fmt);
+    vsnprintf(&buf[pos], len + 1, fmt, args);
+    va_end(args);
+
+    buf.resize(pos + len);
+}
+
+void AppendLittleEndian(std::string &buf, const void *value, int size)
+{
+    const unsigned int one = 1;
+    const char *bytes = (const char *) value;
+
+    if (*((const char *) &one) == 1) {
+        buf.append(bytes, size);
+    } else {
+        for (int i = size - 1; i >= 0; i--)
+            buf.push_back(bytes[i]);
+    }
+}
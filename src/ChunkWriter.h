@@ -0,0 +1,90 @@
+/*
+ *  Copyright (c) 2008-2010  Noah Snavely (snavely (at) cs.cornell.edu)
+ *    and the University of Washington
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+/* ChunkWriter.h */
+/* Encode the records of an output file in parallel chunks */
+
+#ifndef __chunk_writer_h__
+#define __chunk_writer_h__
+
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/* Records encoded by one task */
+#define CHUNK_WRITER_RECORDS 4096
+
+/* Append printf-style formatted text to buf */
+void AppendFormat(std::string &buf, const char *fmt, ...);
+
+/* Append the size bytes of value to buf in little-endian order */
+void AppendLittleEndian(std::string &buf, const void *value, int size);
+
+/* Encode records [0, num_records) and write them to f in order.
+ * encode(i, buf) appends record i to buf (or nothing, to leave it
+ * out).  Chunks of records are encoded in parallel, a group of chunks
+ * at a time, so only one group is held in memory.  Returns false if a
+ * write fails */
+template <class Encoder>
+bool WriteChunks(FILE *f, int num_records, const Encoder &encode)
+{
+    int num_threads = 1;
+#ifdef _OPENMP
+    num_threads = omp_get_max_threads();
+#endif
+
+    int num_chunks =
+        (num_records + CHUNK_WRITER_RECORDS - 1) / CHUNK_WRITER_RECORDS;
+    int group_size = 4 * num_threads;
+
+    std::vector<std::string> chunks(group_size);
+
+    for (int group = 0; group < num_chunks; group += group_size) {
+        int n = num_chunks - group;
+        if (n > group_size)
+            n = group_size;
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+        for (int c = 0; c < n; c++) {
+            std::string &buf = chunks[c];
+            int start = (group + c) * CHUNK_WRITER_RECORDS;
+            int end = start + CHUNK_WRITER_RECORDS;
+            if (end > num_records)
+                end = num_records;
+
+            buf.clear();
+            for (int i = start; i < end; i++)
+                encode(i, buf);
+        }
+
+        for (int c = 0; c < n; c++) {
+            if (fwrite(chunks[c].data(), 1, chunks[c].size(), f) !=
+                chunks[c].size())
+                return false;
+        }
+    }
+
+    return true;
+}
+
+#endif /* __chunk_writer_h__ */
@@ -25,6 +25,7 @@
 #include "keys.h"
 
 #include "BundlerApp.h"
+#include "Profiler.h"
 #include "SifterUtil.h"
 
 bool CompareFirst(const KeypointMatch &k1, const KeypointMatch &k2) {
@@ -35,8 +36,13 @@ bool CompareFirst(const KeypointMatch &k1, const KeypointMatch &k2) {
 #define LARGE_NUMBER 99999999
 void BundlerApp::ComputeTracks(int new_image_start) 
 {
+    ProfileScope scope("ComputeTracks");
+
     unsigned int num_images = GetNumImages();
 
+    /* Marks on the keys visited so far, local to this call */
+    std::vector<std::vector<bool> > key_flags(num_images);
+
     /* Clear all marks for new images */
     for (unsigned int i = 0; i < num_images; i++) {
         /* If this image has no neighbors, don't worry about its keys */
@@ -50,7 +56,7 @@ void BundlerApp::ComputeTracks(int new_image_start)
         // m_image_data[i].LoadKeys(false);
 	// int num_features = GetNumKeys(i);
         int num_features = m_image_data[i].GetNumKeys();
-        m_image_data[i].m_key_flags.resize(num_features);
+        key_flags[i].resize(num_features);
 
 	// for (int j = 0; j < num_features; j++) {
 	//     GetKey(i,j).m_extra = -1;
@@ -116,7 +122,7 @@ void BundlerApp::ComputeTracks(int new_image_start)
 	    /* Check if this feature was visited */
 	    // if (GetKey(i,j).m_extra >= 0)
             //      continue;
-            if (m_image_data[i].m_key_flags[j])
+            if (key_flags[i][j])
                 continue; // already visited this feature
 
             // memset(img_marked, 0, num_images * sizeof(bool));
@@ -128,7 +134,7 @@ void BundlerApp::ComputeTracks(int new_image_start)
 
 	    /* Do a breadth first search given this feature */
 	    // GetKey(i,j).m_extra = pt_idx;
-            m_image_data[i].m_key_flags[j] = true;
+            key_flags[i][j] = true;
 
 	    features.push_back(ImageKey(i, j));
 	    features_queue.push(ImageKey(i, j));
@@ -198,12 +204,12 @@ void BundlerApp::ComputeTracks(int new_image_start)
                     //     continue;
                     assert(idx2 < m_image_data[k].GetNumKeys());
 
-                    if (m_image_data[k].m_key_flags[idx2])
+                    if (key_flags[k][idx2])
                         continue;
 
                     /* Mark and push the point */
                     // GetKey(k,idx2).m_extra = pt_idx;
-                    m_image_data[k].m_key_flags[idx2] = true;
+                    key_flags[k][idx2] = true;
                     features.push_back(ImageKey(k, idx2));
                     features_queue.push(ImageKey(k, idx2));
 
@@ -333,6 +339,8 @@ void BundlerApp::ComputeTracks(int new_image_start)
 
     /* Save the tracks */
     m_track_data = tracks;
+    scope.AddItems(m_track_data.size());
+    m_track_covisibility.Clear();
 
     // SetMatchesFromTracks();
 
@@ -24,6 +24,7 @@
 
 #include "matrix.h"
 #include "sfm.h"
+#include "sfm_project.h"
 #include "vector.h"
 
 void InvertDistortion(int n_in, int n_out, double r0, double r1, 
@@ -87,21 +88,8 @@ void InvertDistortion(int n_in, int n_out, double r0, double r1,
     delete [] b;
 }
 
-v2_t UndistortNormalizedPoint(v2_t p, camera_params_t c) 
+v2_t UndistortNormalizedPoint(v2_t p, const camera_params_t &c) 
 {
-    double r = sqrt(Vx(p) * Vx(p) + Vy(p) * Vy(p));
-    if (r == 0.0)
-        return p;
-    
-    double t = 1.0;
-    double a = 0.0;
-
-    for (int i = 0; i < POLY_INVERSE_DEGREE; i++) {
-        a += t * c.k_inv[i];
-        t = t * r;
-    }
-
-    double factor = a / r;
-    
-    return v2_scale(factor, p);
+    sfm_proj_undistort_normalized(c.k_inv, p.p);
+    return p;
 }
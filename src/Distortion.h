@@ -25,6 +25,6 @@
 void InvertDistortion(int n_in, int n_out, double r0, double r1, 
                       double *k_in, double *k_out);
 
-v2_t UndistortNormalizedPoint(v2_t p, camera_params_t c);
+v2_t UndistortNormalizedPoint(v2_t p, const camera_params_t &c);
 
 #endif /* __distortion_h__ */
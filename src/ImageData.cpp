@@ -43,6 +43,7 @@
 #include "util.h"
 
 #include "LoadJPEG.h"
+#include "Profiler.h"
 
 #define SUBSAMPLE_LEVEL 1
 
@@ -58,7 +59,6 @@
 #define DEFAULT_HEIGHT 1382
 #endif
 
-extern double global_scale;
 
 int CompareImageDates(ImageDate *date1, ImageDate *date2)
 {
@@ -312,6 +312,24 @@ void ImageData::LoadImage() {
     m_image_loaded = true;
 }
 
+img_t *ImageData::LoadImageReduced(int scale) {
+    /* Fisheye images are resampled by UndistortImage, which needs 
+     * full resolution */
+    if (m_fisheye)
+        return NULL;
+
+    char jpeg_buf[256];
+    strcpy(jpeg_buf, m_name);
+    jpeg_buf[strlen(m_name) - 3] = 'j';
+    jpeg_buf[strlen(m_name) - 2] = 'p';
+    jpeg_buf[strlen(m_name) - 1] = 'g';
+
+    if (!FileExists(jpeg_buf))
+        return NULL;
+
+    return LoadJPEG(jpeg_buf, scale);
+}
+
 void ImageData::UnloadImage() 
 {
     if (!m_image_loaded) {
@@ -518,12 +536,17 @@ void ImageData::LoadFloatingThumbnail() {
 
     m_thumb = NULL;    
 
-    if (FileExists(thumb_jpg_buf)) {
-	m_thumb = LoadJPEG(thumb_jpg_buf);
-    }
-
     if (FileExists(thumb_bmp_buf)) {
 	m_thumb = img_read_bmp_file(thumb_bmp_buf);
+    } else if (FileExists(thumb_jpg_buf)) {
+	/* Let the decoder do as much of the shrinking below as it can */
+	int w, h, scale = 1;
+	if (ReadJPEGDimensions(thumb_jpg_buf, w, h)) {
+	    while (scale < 8 && (w / scale >= 512 || h / scale >= 512))
+		scale *= 2;
+	}
+
+	m_thumb = LoadJPEG(thumb_jpg_buf, scale);
     }
 
     if (m_thumb != NULL) {
@@ -542,12 +565,13 @@ void ImageData::LoadFloatingThumbnail() {
 	return ;
     }
 
-    img_t *img = UndistortImage(0.0, 0.0);
-    img_t *thumb = img_scale_fast(img, 4);
-
-    m_thumb = thumb;
+    m_thumb = LoadImageReduced(4);
 
-    img_free(img);
+    if (m_thumb == NULL) {
+	img_t *img = UndistortImage(0.0, 0.0);
+	m_thumb = img_scale_fast(img, 4);
+	img_free(img);
+    }
 
     /* Cache the image */
     img_write_bmp_file(m_thumb, thumb_bmp_buf);
@@ -650,14 +674,25 @@ void ImageData::LoadFixedThumbnail(int w_max, int h_max, int rotation) {
 	ratio = h_ratio;
     }
 
-    img_t *img = UndistortImage(0.0, 0.0, rotation);
+    /* Decode at a reduced size that is still at least twice the size
+     * of the thumbnail */
+    int scale = GetJPEGScaleForSize(w, h, 2 * w_max, 2 * h_max);
+    img_t *img = LoadImageReduced(scale);
+
+    if (img != NULL) {
+	ratio /= scale;
+    } else {
+	img = UndistortImage(0.0, 0.0, rotation);
+    }
 
     printf("Blurring, sigma is %0.3f\n", 0.35 * ratio);
-    img_t *blur = img_smooth(img, 0.35 * ratio, 0);
+    pimg_t *src = img2pimg(img, 3, 0);
+    pimg_t *blur = pimg_smooth(src, 0.35 * ratio, 0);
     trans2D_t *T = new_scaling_transform(1.0 / ratio, 1.0 / ratio);
-    img_t *scaled = img_resample_bbox(blur, T);
+    img_t *scaled = pimg_resample_bbox(blur, T);
 
-    img_free(blur);
+    pimg_free(src);
+    pimg_free(blur);
     transform_free(T);
 
     img_t *thumb = img_new(w_max, h_max);
@@ -822,10 +857,13 @@ if (m_keys_loaded && !descriptor)
 if (m_keys_desc_loaded && descriptor)
   return;   /* Already loaded keys with descriptors */
 
+ProfileScope scope("LoadKeyFile");
+
 /* Try to find a keypoint file */
 if (!descriptor) 
  {
   std::vector<Keypoint> kps = ReadKeyFile(m_key_name);
+  scope.AddItems(kps.size());
 
   /* Flip y-axis to make things easier */
   for (int k = 0; k < (int) kps.size(); k++) 
@@ -844,6 +882,7 @@ if (!descriptor)
 else 
  {
   std::vector<KeypointWithDesc> kps = ReadKeyFileWithDesc(m_key_name, true);
+  scope.AddItems(kps.size());
 
   /* Flip y-axis to make things easier */
   for (int k = 0; k < (int) kps.size(); k++) 
@@ -880,10 +919,11 @@ void ImageData::UnloadKeys() {
             m_keys_desc[i].m_d = NULL;
         }
 
-        m_keys_desc.clear();
+        /* Swap rather than clear, so the storage is freed */
+        std::vector<KeypointWithDesc>().swap(m_keys_desc);
         m_keys_desc_loaded = false;
     } else if (m_keys_loaded) {
-        m_keys.clear();
+        std::vector<Keypoint>().swap(m_keys);
         m_keys_loaded = false;
     }
 }
@@ -995,25 +1035,25 @@ void ImageData::CacheDimensions()
 }
 
 int ImageData::GetWidth() { 
-    if (m_image_loaded) return iround(global_scale * m_img->w);
+    if (m_image_loaded) return m_img->w;
     else { 
 	if (m_cached_dimensions)
-	    return iround(global_scale * m_width);
+	    return m_width;
 
 	CacheDimensions();
-	return iround(global_scale * m_width);
+	return m_width;
     }
 
     // return DEFAULT_WIDTH; /* hack */
 }
 int ImageData::GetHeight() { 
-    if (m_image_loaded) return iround(global_scale * m_img->h); 
+    if (m_image_loaded) return m_img->h; 
     else { 
 	if (m_cached_dimensions)
-	    return iround(global_scale * m_height);
+	    return m_height;
 
 	CacheDimensions();
-	return iround(global_scale * m_height);
+	return m_height;
     }
     // return DEFAULT_HEIGHT; /* hack */
 }
@@ -1139,35 +1179,61 @@ void ImageData::DistortPoint(double x, double y,
 
 void ImageData::DistortPoint(double x, double y, double *R,
 			     double &x_out, double &y_out) const
+{
+    DistortPoints(1, &x, &y, R, &x_out, &y_out);
+}
+
+void ImageData::DistortPoints(int n, const double *x, const double *y, 
+                              double *x_out, double *y_out) const
+{
+    double I[9];
+    GetRotationFromSpherical(-0.5 * M_PI, 0.5 * M_PI, I);
+
+    DistortPoints(n, x, y, I, x_out, y_out);
+}
+
+void ImageData::DistortPoints(int n, const double *x, const double *y, 
+                              const double *R, 
+                              double *x_out, double *y_out) const
 {
     if (!m_fisheye) {
 	// DistortPointRD(x, y, x_out, y_out);
-	x_out = x;
-	y_out = y;
+        if (x_out != x)
+            memcpy(x_out, x, sizeof(double) * n);
+        if (y_out != y)
+            memcpy(y_out, y, sizeof(double) * n);
 	return;
     }
 
-    double xn = x; // - m_fCx;
-    double yn = y; // - m_fCy;
+    for (int i = 0; i < n; i++) {
+        double xn = x[i]; // - m_fCx;
+        double yn = y[i]; // - m_fCy;
 
-    double ray[3] = { xn, yn, -m_fFocal }, ray_rot[3];
-    matrix_product(3, 3, 3, 1, R, ray, ray_rot);
+        /* R * (xn, yn, -f), written out rather than through
+         * matrix_product, which costs more than the arithmetic */
+        double ray_rot[3];
+        for (int j = 0; j < 3; j++) {
+            ray_rot[j] = 
+                R[3 * j + 0] * xn + R[3 * j + 1] * yn - R[3 * j + 2] * m_fFocal;
+        }
 
-    if (ray_rot[2] <= 0.0) {
-	xn = -DBL_MAX;
-	yn = -DBL_MAX;
-	return;
-    } else {
-	xn = ray_rot[0] * m_fFocal / ray_rot[2];
-	yn = ray_rot[1] * m_fFocal / ray_rot[2];
-    }
+        if (ray_rot[2] <= 0.0) {
+            /* Behind the camera */
+            x_out[i] = -DBL_MAX;
+            y_out[i] = -DBL_MAX;
+            continue;
+        }
+
+        xn = ray_rot[0] * m_fFocal / ray_rot[2];
+        yn = ray_rot[1] * m_fFocal / ray_rot[2];
     
-    double r = sqrt(xn * xn + yn * yn);
-    double angle = RAD2DEG(atan(r / m_fFocal));
-    double rnew = m_fRad * angle / (0.5 * m_fAngle);
+        double r = sqrt(xn * xn + yn * yn);
+        double angle = RAD2DEG(atan(r / m_fFocal));
+        double rnew = m_fRad * angle / (0.5 * m_fAngle);
     
-    x_out = xn * (rnew / r) + m_fCx;
-    y_out = yn * (rnew / r) + m_fCy;
+        x_out[i] = xn * (rnew / r) + m_fCx;
+        y_out[i] = yn * (rnew / r) + m_fCy;
+    }
 }
 
 void ImageData::UndistortPoint(double x, double y, 
@@ -1300,21 +1366,30 @@ img_t *ImageData::UndistortImageResize(int w_new, int h_new)
 
     img_t *img_out = img_new(w_new, h_new);
 
+    std::vector<double> xn(w_new), yn(w_new), x_new(w_new), y_new(w_new);
+    std::vector<fcolor_t> row(w_new);
+
     for (int y = 0; y < h_new; y++) {
 	for (int x = 0; x < w_new; x++) {
-	    double xn = x - 0.5 * w_new;
-	    double yn = y - 0.5 * h_new;
-	    double x_new, y_new;
+	    xn[x] = x - 0.5 * w_new;
+	    yn[x] = y - 0.5 * h_new;
+	}
 	    
-	    DistortPoint(xn, yn, R, x_new, y_new);
+	DistortPoints(w_new, &xn[0], &yn[0], R, &x_new[0], &y_new[0]);
+
+	for (int x = 0; x < w_new; x++) {
+	    x_new[x] += 0.5 * width;
+	    y_new[x] += 0.5 * height;
+	}
 
-	    x_new += 0.5 * width;
-	    y_new += 0.5 * height;
+	img_lerp_batch(m_img, w_new, &x_new[0], &y_new[0], &row[0]);
 
-	    if (x_new < 0 || x_new >= width || y_new < 0 || y_new >= height)
+	for (int x = 0; x < w_new; x++) {
+	    if (x_new[x] < 0 || x_new[x] >= width || 
+                y_new[x] < 0 || y_new[x] >= height)
 		continue;
 
-	    fcolor_t c = pixel_lerp(m_img, x_new, y_new);
+	    fcolor_t c = row[x];
 
 	    img_set_pixel(img_out, x, y, 
 			  iround(c.r), iround(c.g), iround(c.b));
@@ -1367,24 +1442,34 @@ img_t *ImageData::UndistortImage(double theta, double phi, int num_rot) {
     int width = GetWidth();
     int height = GetHeight();
 
-    img_t *img_out = 
-	img_new(width / SUBSAMPLE_LEVEL, height / SUBSAMPLE_LEVEL);
+    int w_out = width / SUBSAMPLE_LEVEL;
+    int h_out = height / SUBSAMPLE_LEVEL;
+    img_t *img_out = img_new(w_out, h_out);
 
-    for (int y = 0; y < height / SUBSAMPLE_LEVEL; y++) {
-	for (int x = 0; x < width / SUBSAMPLE_LEVEL; x++) {
-	    double xn = x - 0.5 * width;
-	    double yn = y - 0.5 * height;
-	    double x_new, y_new;
+    std::vector<double> xn(w_out), yn(w_out), x_new(w_out), y_new(w_out);
+    std::vector<fcolor_t> row(w_out);
+
+    for (int y = 0; y < h_out; y++) {
+	for (int x = 0; x < w_out; x++) {
+	    xn[x] = x - 0.5 * width;
+	    yn[x] = y - 0.5 * height;
+	}
 	    
-	    DistortPoint(xn, yn, R, x_new, y_new);
+	DistortPoints(w_out, &xn[0], &yn[0], R, &x_new[0], &y_new[0]);
 
-	    x_new += 0.5 * width;
-	    y_new += 0.5 * height;
+	for (int x = 0; x < w_out; x++) {
+	    x_new[x] += 0.5 * width;
+	    y_new[x] += 0.5 * height;
+	}
 
-	    if (x_new < 0 || x_new >= width || y_new < 0 || y_new >= height)
+	img_lerp_batch(m_img, w_out, &x_new[0], &y_new[0], &row[0]);
+
+	for (int x = 0; x < w_out; x++) {
+	    if (x_new[x] < 0 || x_new[x] >= width || 
+                y_new[x] < 0 || y_new[x] >= height)
 		continue;
 
-	    fcolor_t c = pixel_lerp(m_img, x_new, y_new);
+	    fcolor_t c = row[x];
 
 	    img_set_pixel(img_out, x, y, 
 			  iround(c.r), iround(c.g), iround(c.b));
@@ -1843,26 +1928,24 @@ void ImageData::Gradient(double x, double y, double *grad)
 {
     double gx = 0.0, gy = 0.0;
 
-    int w = GetWidth();
-    int h = GetHeight();
-
-    double ident[9];
-    GetRotationFromSpherical(-0.5 * M_PI, 0.5 * M_PI, ident);
+    double xs[9], ys[9];
+    fcolor_t colors[9];
 
     int idx = 0;
     for (int dy = -1; dy <= 1; dy++) {
 	for (int dx = -1; dx <= 1; dx++, idx++) {
-	    double x_d, y_d;
-	    
-	    /* Distort */
-	    DistortPoint(x + dx, y + dy, ident, x_d, y_d);
+	    xs[idx] = x + dx;
+	    ys[idx] = y + dy;
+	}
+    }
+
+    SampleColors(9, xs, ys, colors);
 
-	    fcolor_t c = pixel_lerp(m_img, x_d + 0.5 * w, y_d + 0.5 * h);
-	    double v = fcolor_intensity(c);
+    for (idx = 0; idx < 9; idx++) {
+	double v = fcolor_intensity(colors[idx]);
 	    
-	    gx += sobel_x[idx] * v;
-	    gy += sobel_y[idx] * v;
-	}
+	gx += sobel_x[idx] * v;
+	gy += sobel_y[idx] * v;
     }
 
     // double mag = sqrt(gx * gx + gy * gy);
@@ -1873,35 +1956,52 @@ void ImageData::Gradient(double x, double y, double *grad)
     grad[1] = gy;
 }
 
-void ImageData::ReadKeyColors()
+void ImageData::SampleColors(int n, const double *x, const double *y,
+                             fcolor_t *colors) const
 {
     double ident[9];
     GetRotationFromSpherical(-0.5 * M_PI, 0.5 * M_PI, ident);
 
+    int w = m_img->w;
+    int h = m_img->h;
+
+    std::vector<double> x_d(n), y_d(n);
+    DistortPoints(n, x, y, ident, &x_d[0], &y_d[0]);
+
+    for (int i = 0; i < n; i++) {
+        x_d[i] += 0.5 * w;
+        y_d[i] += 0.5 * h;
+    }
+
+    img_lerp_batch(m_img, n, &x_d[0], &y_d[0], colors);
+}
+
+void ImageData::ReadKeyColors()
+{
     bool unload = false;
     if (!m_image_loaded) {
 	LoadImage();
 	unload = true;
     }
     
-    int w = GetWidth();
-    int h = GetHeight();
-
     int num_keys = (int) m_keys.size();
-	
-    for (int i = 0; i < num_keys; i++) {
-	double x = m_keys[i].m_x;
-	double y = m_keys[i].m_y;
 
-	double x_d, y_d;
-	DistortPoint(x, y, ident, x_d, y_d);
+    if (num_keys > 0) {
+        std::vector<double> x(num_keys), y(num_keys);
+        std::vector<fcolor_t> colors(num_keys);
 
-	fcolor_t col;
-	col = pixel_lerp(m_img, x_d + 0.5 * w, y_d + 0.5 * h);
+        for (int i = 0; i < num_keys; i++) {
+            x[i] = m_keys[i].m_x;
+            y[i] = m_keys[i].m_y;
+        }
+
+        SampleColors(num_keys, &x[0], &y[0], &colors[0]);
 
-	m_keys[i].m_r = iround(col.r);
-	m_keys[i].m_g = iround(col.g);
-	m_keys[i].m_b = iround(col.b);
+        for (int i = 0; i < num_keys; i++) {
+            m_keys[i].m_r = iround(colors[i].r);
+            m_keys[i].m_g = iround(colors[i].g);
+            m_keys[i].m_b = iround(colors[i].b);
+        }
     }
     
     if (unload)
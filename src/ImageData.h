@@ -168,6 +168,12 @@ public:
     void DistortPoint(double x, double y, double *R, 
         double &x_out, double &y_out) const;
     void DistortPoint(double x, double y, double &x_out, double &y_out) const;
+    /* Distort n points at once (as DistortPoint).  The outputs may
+     * be the inputs */
+    void DistortPoints(int n, const double *x, const double *y, 
+        const double *R, double *x_out, double *y_out) const;
+    void DistortPoints(int n, const double *x, const double *y, 
+        double *x_out, double *y_out) const;
     void UndistortPoint(double x, double y, 
         double &x_out, double &y_out) const;
 
@@ -232,6 +238,11 @@ public:
         const std::vector<PointData> &pt_data,
         const std::vector<int> &used_points);
 
+    /* Decode the image at 1 / scale resolution (scale is 1, 2, 4 or
+     * 8).  Returns NULL if the image isn't a jpeg or needs to be
+     * undistorted first */
+    img_t *LoadImageReduced(int scale);
+
     void CheckLoadFloatingThumb();
     void LoadFloatingThumbnail();
     void UnloadFloatingThumbnail();
@@ -270,6 +281,11 @@ public:
     /* Find the gradient direction at the given position */
     void Gradient(double x, double y, double *grad);
 
+    /* Sample the (loaded) image at n points given in the undistorted,
+     * centered coordinates of the keys */
+    void SampleColors(int n, const double *x, const double *y, 
+        fcolor_t *colors) const;
+
     vector<bool> m_visinfo;
     vector<int> m_visindex;
 
@@ -409,7 +425,6 @@ public:
     std::vector<Keypoint> m_keys;              /* Keypoints in this image */
     std::vector<KeypointWithDesc> m_keys_desc; /* Keypoints with descriptors */
     std::vector<KeypointWithScaleRot> m_keys_scale_rot;
-    std::vector<bool> m_key_flags;
 
     std::vector<int> m_visible_points;  /* Indices of points visible
                                          * in this image */
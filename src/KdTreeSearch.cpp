@@ -0,0 +1,265 @@
+/*
+ *  Copyright (c) 2008-2010  Noah Snavely (snavely (at) cs.cornell.edu)
+ *    and the University of Washington
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+/* KdTreeSearch.cpp */
+/* kd-tree for nearest-neighbor and radius search on 3D points */
+
+#include <algorithm>
+
+#include "KdTreeSearch.h"
+
+#include "defines.h"
+
+/* Most points a leaf holds */
+#define KD_LEAF_SIZE 8
+
+/* Orders point indices by one coordinate */
+class KdCoordLess
+{
+public:
+    KdCoordLess(const v3_t *pts, int axis) : m_pts(pts), m_axis(axis) { }
+
+    bool operator()(int a, int b) const {
+        return m_pts[a].p[m_axis] < m_pts[b].p[m_axis];
+    }
+
+private:
+    const v3_t *m_pts;
+    int m_axis;
+};
+
+KdTreeSearch::KdTreeSearch(int n, const v3_t *pts) : m_num_points(n)
+{
+    if (n <= 0) {
+        m_num_points = 0;
+        return;
+    }
+
+    std::vector<int> order(n);
+    for (int i = 0; i < n; i++)
+        order[i] = i;
+
+    m_nodes.reserve(2 * (n / KD_LEAF_SIZE + 1));
+    Build(order, pts, 0, n);
+
+    m_coords.resize(3 * n);
+    m_index.resize(n);
+
+    for (int i = 0; i < n; i++) {
+        const v3_t &p = pts[order[i]];
+        m_coords[3 * i + 0] = Vx(p);
+        m_coords[3 * i + 1] = Vy(p);
+        m_coords[3 * i + 2] = Vz(p);
+        m_index[i] = order[i];
+    }
+}
+
+int KdTreeSearch::Build(std::vector<int> &order, const v3_t *pts,
+                        int start, int end)
+{
+    int node = (int) m_nodes.size();
+
+    kd_node_t n;
+    n.axis = -1;
+    n.split = 0.0;
+    n.start = start;
+    n.end = end;
+    n.right = -1;
+    m_nodes.push_back(n);
+
+    if (end - start <= KD_LEAF_SIZE)
+        return node;
+
+    /* Split the widest dimension at the median */
+    double min[3], max[3];
+    for (int d = 0; d < 3; d++)
+        min[d] = max[d] = pts[order[start]].p[d];
+
+    for (int i = start + 1; i < end; i++) {
+        for (int d = 0; d < 3; d++) {
+            min[d] = MIN(min[d], pts[order[i]].p[d]);
+            max[d] = MAX(max[d], pts[order[i]].p[d]);
+        }
+    }
+
+    int axis = 0;
+    for (int d = 1; d < 3; d++) {
+        if (max[d] - min[d] > max[axis] - min[axis])
+            axis = d;
+    }
+
+    /* All points coincide */
+    if (max[axis] == min[axis])
+        return node;
+
+    int mid = (start + end) / 2;
+    std::nth_element(order.begin() + start, order.begin() + mid,
+                     order.begin() + end, KdCoordLess(pts, axis));
+
+    m_nodes[node].axis = axis;
+    m_nodes[node].split = pts[order[mid]].p[axis];
+
+    Build(order, pts, start, mid);
+    int right = Build(order, pts, mid, end);
+    m_nodes[node].right = right;
+
+    return node;
+}
+
+void KdTreeSearch::SearchClosest(int node, const double *q, int k,
+                                 Neighbor *heap, int &heap_size) const
+{
+    const kd_node_t &n = m_nodes[node];
+
+    if (n.axis == -1) {
+        for (int i = n.start; i < n.end; i++) {
+            const double *p = &m_coords[3 * i];
+            double dx = q[0] - p[0];
+            double dy = q[1] - p[1];
+            double dz = q[2] - p[2];
+
+            Neighbor nbr(dx * dx + dy * dy + dz * dz, m_index[i]);
+
+            if (heap_size < k) {
+                heap[heap_size++] = nbr;
+                std::push_heap(heap, heap + heap_size);
+            } else if (nbr < heap[0]) {
+                std::pop_heap(heap, heap + heap_size);
+                heap[heap_size - 1] = nbr;
+                std::push_heap(heap, heap + heap_size);
+            }
+        }
+
+        return;
+    }
+
+    double diff = q[n.axis] - n.split;
+    int near = (diff < 0.0) ? node + 1 : n.right;
+    int far = (diff < 0.0) ? n.right : node + 1;
+
+    SearchClosest(near, q, k, heap, heap_size);
+
+    /* Points on the split plane may tie with the worst neighbor, and
+     * could have a lower index */
+    if (heap_size < k || diff * diff <= heap[0].first)
+        SearchClosest(far, q, k, heap, heap_size);
+}
+
+void KdTreeSearch::SearchRadius(int node, const double *q, double radius_sq,
+                                std::vector<Neighbor> &found) const
+{
+    const kd_node_t &n = m_nodes[node];
+
+    if (n.axis == -1) {
+        for (int i = n.start; i < n.end; i++) {
+            const double *p = &m_coords[3 * i];
+            double dx = q[0] - p[0];
+            double dy = q[1] - p[1];
+            double dz = q[2] - p[2];
+            double dist = dx * dx + dy * dy + dz * dz;
+
+            if (dist <= radius_sq)
+                found.push_back(Neighbor(dist, m_index[i]));
+        }
+
+        return;
+    }
+
+    double diff = q[n.axis] - n.split;
+
+    if (diff <= 0.0 || diff * diff <= radius_sq)
+        SearchRadius(node + 1, q, radius_sq, found);
+    if (diff >= 0.0 || diff * diff <= radius_sq)
+        SearchRadius(n.right, q, radius_sq, found);
+}
+
+int KdTreeSearch::GetClosestPoints(const double *q, int num_points,
+                                   Neighbor *heap,
+                                   int *idxs, double *dists) const
+{
+    int k = MIN(num_points, m_num_points);
+    if (k <= 0)
+        return 0;
+
+    int heap_size = 0;
+    SearchClosest(0, q, k, heap, heap_size);
+    std::sort_heap(heap, heap + heap_size);
+
+    for (int i = 0; i < heap_size; i++) {
+        dists[i] = heap[i].first;
+        idxs[i] = heap[i].second;
+    }
+
+    return heap_size;
+}
+
+int KdTreeSearch::GetClosestPoints(v3_t query, int num_points,
+                                   int *idxs, double *dists) const
+{
+    std::vector<Neighbor> heap(MAX(MIN(num_points, m_num_points), 0));
+    return GetClosestPoints(query.p, num_points, heap.data(), idxs, dists);
+}
+
+int KdTreeSearch::GetClosestPoints(int num_queries, const v3_t *queries,
+                                   int num_points,
+                                   int *idxs, double *dists) const
+{
+    int k = MAX(MIN(num_points, m_num_points), 0);
+
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+    {
+        std::vector<Neighbor> heap(k);
+
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+        for (int i = 0; i < num_queries; i++) {
+            GetClosestPoints(queries[i].p, num_points, heap.data(),
+                             idxs + (size_t) i * num_points,
+                             dists + (size_t) i * num_points);
+        }
+    }
+
+    return k;
+}
+
+int KdTreeSearch::GetPointsInRadius(v3_t query, double radius,
+                                    std::vector<int> &idxs,
+                                    std::vector<double> &dists) const
+{
+    idxs.clear();
+    dists.clear();
+
+    if (m_num_points == 0 || radius < 0.0)
+        return 0;
+
+    std::vector<Neighbor> found;
+    SearchRadius(0, query.p, radius * radius, found);
+    std::sort(found.begin(), found.end());
+
+    int num_found = (int) found.size();
+    idxs.resize(num_found);
+    dists.resize(num_found);
+
+    for (int i = 0; i < num_found; i++) {
+        dists[i] = found[i].first;
+        idxs[i] = found[i].second;
+    }
+
+    return num_found;
+}
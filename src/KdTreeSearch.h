@@ -0,0 +1,86 @@
+/*
+ *  Copyright (c) 2008-2010  Noah Snavely (snavely (at) cs.cornell.edu)
+ *    and the University of Washington
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+/* KdTreeSearch.h */
+/* kd-tree for nearest-neighbor and radius search on 3D points */
+
+#ifndef __kd_tree_search_h__
+#define __kd_tree_search_h__
+
+#include <utility>
+#include <vector>
+
+#include "vector.h"
+
+/* A drop-in replacement for BruteForceSearch.  The points are copied
+ * into the order of the leaves of the tree, so that a leaf is a
+ * contiguous run of coordinates.  Distances are squared, and neighbors
+ * come back sorted by distance (ties broken by index), so the results
+ * don't depend on the shape of the tree.  Queries don't modify the tree
+ * and can run on several threads at once */
+class KdTreeSearch
+{
+public:
+    KdTreeSearch() : m_num_points(0) { }
+    KdTreeSearch(int n, const v3_t *pts);
+
+    /* Find the num_points closest points to query.  Returns the number
+     * found, which is less than num_points only if the tree holds fewer
+     * points */
+    int GetClosestPoints(v3_t query, int num_points,
+                         int *idxs, double *dists) const;
+
+    /* Find the num_points closest points to each of num_queries
+     * queries, in parallel.  The results for query i start at
+     * idxs[i * num_points] and dists[i * num_points].  Returns the
+     * number found for each query */
+    int GetClosestPoints(int num_queries, const v3_t *queries,
+                         int num_points, int *idxs, double *dists) const;
+
+    /* Find all points within radius of query, sorted by distance.
+     * Returns the number found */
+    int GetPointsInRadius(v3_t query, double radius,
+                          std::vector<int> &idxs,
+                          std::vector<double> &dists) const;
+
+    int m_num_points;
+
+private:
+    typedef std::pair<double, int> Neighbor;    /* (distance, index) */
+
+    typedef struct {
+        int axis;               /* -1 for a leaf */
+        double split;
+        int start, end;         /* Range of points below this node */
+        int right;              /* The left child follows its parent */
+    } kd_node_t;
+
+    int Build(std::vector<int> &order, const v3_t *pts, int start, int end);
+
+    void SearchClosest(int node, const double *q, int k,
+                       Neighbor *heap, int &heap_size) const;
+    void SearchRadius(int node, const double *q, double radius_sq,
+                      std::vector<Neighbor> &found) const;
+
+    int GetClosestPoints(const double *q, int num_points, Neighbor *heap,
+                         int *idxs, double *dists) const;
+
+    std::vector<kd_node_t> m_nodes;
+    std::vector<double> m_coords;       /* x, y, z in leaf order */
+    std::vector<int> m_index;           /* Input index in leaf order */
+};
+
+#endif /* __kd_tree_search_h__ */
@@ -0,0 +1,191 @@
+/*
+ *  Copyright (c) 2008-2010  Noah Snavely (snavely (at) cs.cornell.edu)
+ *    and the University of Washington
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+/* KeyCache.cpp */
+/* Memory-bounded cache of the keypoints of each image */
+
+#include <stdio.h>
+
+#include "KeyCache.h"
+
+KeyCache::KeyCache() : m_budget(0), m_num_bytes(0), m_num_loads(0)
+{
+}
+
+void KeyCache::SetBudget(size_t budget)
+{
+    m_budget = budget;
+}
+
+void KeyCache::Reserve(int img)
+{
+    if (img < (int) m_pins.size())
+        return;
+
+    m_pins.resize(img + 1, 0);
+    m_owned.resize(img + 1, false);
+    m_bytes.resize(img + 1, 0);
+    m_lru_pos.resize(img + 1, m_lru.end());
+}
+
+void KeyCache::AddLoaded(std::vector<ImageData> &images, int img)
+{
+    m_bytes[img] = images[img].m_keys.capacity() * sizeof(Keypoint);
+    m_num_bytes += m_bytes[img];
+    m_owned[img] = true;
+    m_num_loads++;
+}
+
+void KeyCache::Trim(std::vector<ImageData> &images, size_t slack)
+{
+    while (m_num_bytes + slack > m_budget && !m_lru.empty()) {
+        int img = m_lru.back();
+        m_lru.pop_back();
+        m_lru_pos[img] = m_lru.end();
+
+        /* Free the storage of the keys alone (UnloadKeys drops the
+         * descriptors instead, if those are loaded too) */
+        std::vector<Keypoint>().swap(images[img].m_keys);
+        images[img].m_keys_loaded = false;
+
+        m_num_bytes -= m_bytes[img];
+        m_bytes[img] = 0;
+        m_owned[img] = false;
+    }
+}
+
+void KeyCache::Pin(std::vector<ImageData> &images, int img, bool undistort)
+{
+    Reserve(img);
+
+    if (m_pins[img] == 0 && m_lru_pos[img] != m_lru.end()) {
+        m_lru.erase(m_lru_pos[img]);
+        m_lru_pos[img] = m_lru.end();
+    }
+
+    m_pins[img]++;
+
+    if (images[img].m_keys_loaded)
+        return;
+
+    /* Keys we loaded may have been unloaded behind our back */
+    if (m_owned[img]) {
+        m_num_bytes -= m_bytes[img];
+        m_bytes[img] = 0;
+        m_owned[img] = false;
+    }
+
+    images[img].LoadKeys(false, undistort);
+    AddLoaded(images, img);
+
+    Trim(images, 0);
+}
+
+void KeyCache::Unpin(std::vector<ImageData> &images, int img)
+{
+    if (img >= (int) m_pins.size() || m_pins[img] == 0) {
+        printf("[KeyCache::Unpin] Error: image %d is not pinned\n", img);
+        return;
+    }
+
+    m_pins[img]--;
+
+    if (m_pins[img] > 0 || !m_owned[img])
+        return;
+
+    if (m_budget == 0) {
+        images[img].UnloadKeys();
+
+        m_num_bytes -= m_bytes[img];
+        m_bytes[img] = 0;
+        m_owned[img] = false;
+        return;
+    }
+
+    m_lru.push_front(img);
+    m_lru_pos[img] = m_lru.begin();
+
+    Trim(images, 0);
+}
+
+void KeyCache::Prefetch(std::vector<ImageData> &images,
+                        const std::vector<int> &imgs, bool undistort)
+{
+    if (m_budget == 0)
+        return;
+
+    /* Take the images in order, as long as they fit in the budget
+     * together */
+    std::vector<int> fetch;
+    size_t fetch_bytes = 0;
+
+    int num_imgs = (int) imgs.size();
+    for (int i = 0; i < num_imgs; i++) {
+        int img = imgs[i];
+        Reserve(img);
+
+        if (images[img].m_keys_loaded)
+            continue;
+
+        bool seen = false;
+        for (int j = 0; j < (int) fetch.size(); j++) {
+            if (fetch[j] == img) {
+                seen = true;
+                break;
+            }
+        }
+
+        if (seen)
+            continue;
+
+        size_t bytes = images[img].GetNumKeys() * sizeof(Keypoint);
+        if (fetch_bytes + bytes > m_budget)
+            break;
+
+        fetch.push_back(img);
+        fetch_bytes += bytes;
+    }
+
+    if (fetch.empty())
+        return;
+
+    Trim(images, fetch_bytes);
+
+    /* Each load only touches its own image */
+    int num_fetch = (int) fetch.size();
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+    for (int i = 0; i < num_fetch; i++)
+        images[fetch[i]].LoadKeys(false, undistort);
+
+    /* Leave the first image to be used as the most recent */
+    for (int i = num_fetch - 1; i >= 0; i--) {
+        int img = fetch[i];
+
+        if (m_owned[img])
+            m_num_bytes -= m_bytes[img];
+
+        AddLoaded(images, img);
+
+        if (m_pins[img] == 0 && m_lru_pos[img] == m_lru.end()) {
+            m_lru.push_front(img);
+            m_lru_pos[img] = m_lru.begin();
+        }
+    }
+
+    Trim(images, 0);
+}
@@ -0,0 +1,86 @@
+/*
+ *  Copyright (c) 2008-2010  Noah Snavely (snavely (at) cs.cornell.edu)
+ *    and the University of Washington
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+/* KeyCache.h */
+/* Memory-bounded cache of the keypoints of each image */
+
+#ifndef __key_cache_h__
+#define __key_cache_h__
+
+#include <stddef.h>
+
+#include <list>
+#include <vector>
+
+#include "ImageData.h"
+
+/* Keeps track of the keys (without descriptors) loaded through it.
+ * An image is pinned while in use, and its keys are never dropped
+ * while pinned.  Once unpinned, the keys stay loaded (so the next pin
+ * doesn't re-read the key file) until the cache exceeds its budget,
+ * at which point the least recently used images are unloaded.  With a
+ * budget of zero the cache is disabled, and unpinned keys are
+ * unloaded right away.  Keys loaded elsewhere are used, but never
+ * unloaded, by the cache.  Not thread-safe: call it from serial
+ * code */
+class KeyCache
+{
+public:
+    KeyCache();
+
+    /* Set the budget in bytes (0 disables caching) */
+    void SetBudget(size_t budget);
+    size_t GetBudget() const { return m_budget; }
+
+    /* Load the keys of image img (if needed) and pin them */
+    void Pin(std::vector<ImageData> &images, int img, bool undistort);
+    /* Release a pin on image img */
+    void Unpin(std::vector<ImageData> &images, int img);
+
+    /* Load the keys of the given images ahead of their use, in
+     * parallel, as far as the budget allows.  The keys are cached
+     * but not pinned */
+    void Prefetch(std::vector<ImageData> &images,
+                  const std::vector<int> &imgs, bool undistort);
+
+    /* Bytes held by the keys loaded through the cache */
+    size_t GetNumBytes() const { return m_num_bytes; }
+
+    /* Number of key files read through the cache */
+    int GetNumLoads() const { return m_num_loads; }
+
+private:
+    void Reserve(int img);
+    /* Account for keys of image img that were just loaded */
+    void AddLoaded(std::vector<ImageData> &images, int img);
+    /* Unload unpinned images, least recently used first, until the
+     * cache fits in its budget (minus the given slack) */
+    void Trim(std::vector<ImageData> &images, size_t slack);
+
+    size_t m_budget;
+    size_t m_num_bytes;
+    int m_num_loads;
+
+    std::vector<int> m_pins;       /* Pin count of each image */
+    std::vector<bool> m_owned;     /* Were the keys loaded by the cache? */
+    std::vector<size_t> m_bytes;   /* Size of the keys of each image */
+
+    std::list<int> m_lru;          /* Unpinned cached images, most
+                                    * recently used first */
+    std::vector<std::list<int>::iterator> m_lru_pos;
+};
+
+#endif /* __key_cache_h__ */
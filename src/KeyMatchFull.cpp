@@ -24,6 +24,7 @@
 #include <string.h>
 
 #include "keys2a.h"
+#include "Profiler.h"
 
 #ifdef _OPENMP
 #include <omp.h>
@@ -64,8 +65,13 @@ int main(int argc, char **argv) {
     
     if (!(argc == 3 || argc == 4)) {
 	printf("Usage: %s <list.txt> <outfile> [tracklen]\n", argv[0]);
+	printf("  Set BUNDLER_PROFILE=<file> to time the stages and write\n"
+	       "  a Chrome trace to <file>\n");
 	return -1;
     }
+
+    if (getenv("BUNDLER_PROFILE") != NULL)
+        ProfilerStart(getenv("BUNDLER_PROFILE"));
     
     list_in = argv[1];
     ratio = 0.6;
@@ -103,7 +109,7 @@ int main(int argc, char **argv) {
 	printf("Loaded previous match matrix from %s, %d images\n", prev_matches_file, n_prev_matches);
     }
 
-    clock_t start = clock();
+    double start = GetWallTime();
 
     unsigned char **keys;
     int *num_keys;
@@ -137,17 +143,23 @@ int main(int argc, char **argv) {
     num_keys = new int[num_images];
 
     /* Read all keys */
+    {
+        ProfileScope scope("ReadKeys");
+
 #ifdef _OPENMP
-    #pragma omp parallel for
+        #pragma omp parallel for
 #endif
-    for (int i = 0; i < num_images; i++) {
-        keys[i] = NULL;
-        num_keys[i] = ReadKeyFile(key_files[i].c_str(), keys+i);
+        for (int i = 0; i < num_images; i++) {
+            keys[i] = NULL;
+            num_keys[i] = ReadKeyFile(key_files[i].c_str(), keys+i);
+        }
+
+        for (int i = 0; i < num_images; i++)
+            scope.AddItems(num_keys[i]);
     }
 
-    clock_t end = clock();    
-    printf("[KeyMatchFull] Reading keys took %0.3fs\n", 
-           (end - start) / ((double) CLOCKS_PER_SEC));
+    double end = GetWallTime();
+    printf("[KeyMatchFull] Reading keys took %0.3fs\n", end - start);
     
 
     KeyMapType all_matches;
@@ -161,7 +173,8 @@ int main(int argc, char **argv) {
         //printf("[KeyMatchFull] Matching to image %d:", i);
 	//fflush(stdout);
 
-        start = clock();
+        ProfileScope scope("MatchImage");
+        double match_start = GetWallTime();
 
         /* Create a tree from the keys */
         ANNkd_tree *tree = CreateSearchTree(num_keys[i], keys[i]);
@@ -180,6 +193,7 @@ int main(int argc, char **argv) {
 		
 		std::vector<KeypointMatch> matches = 
 		    MatchKeys(num_keys[j], keys[j], tree, ratio);
+                scope.AddItems(1);
             
 		int num_matches = (int) matches.size();
 		if (num_matches >= 16) {
@@ -203,6 +217,7 @@ int main(int argc, char **argv) {
                 /* Compute likely matches between two sets of keypoints */
                 std::vector<KeypointMatch> matches = 
                     MatchKeys(num_keys[j], keys[j], tree, ratio);
+                scope.AddItems(1);
                 
                 int num_matches = (int) matches.size();
                 if (num_matches >= 16) {
@@ -222,9 +237,8 @@ int main(int argc, char **argv) {
 	}
     	printf("\n");
 
-        end = clock();    
         printf("[KeyMatchFull] Matching image %d took %0.3fs\n", 
-               i, (end - start) / ((double) CLOCKS_PER_SEC));
+               i, GetWallTime() - match_start);
         fflush(stdout);
 
         // annDeallocPts(tree->pts);
@@ -237,6 +251,9 @@ int main(int argc, char **argv) {
 	    all_matches.find(PairIdx(j,i)
 */
 
+    ProfileScope write_scope("WriteMatches");
+    write_scope.AddItems(all_matches.size());
+
     for (KeyMapType::const_iterator it = all_matches.begin(); it != all_matches.end(); ++it) {
 	/* Write the pair */
 	int j = it->first.i1;
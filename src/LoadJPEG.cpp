@@ -20,26 +20,27 @@
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
 
 #include "jpeglib.h"
 
 #include "image.h"
 
-void GetJPEGDimensions(const char *filename, int &w, int &h)
+bool ReadJPEGDimensions(const char *filename, int &w, int &h)
 {
     struct jpeg_decompress_struct cinfo;
     struct jpeg_error_mgr jerr;
     
-    cinfo.err = jpeg_std_error(&jerr);
-    jpeg_create_decompress(&cinfo);
-    
     FILE *f;
     
-    if ((f = fopen(filename, "rb")) == NULL) {
-        printf("[GetJPEGDimensions] Error: can't open file %s for reading\n", 
-               filename);
-        return;
-    }
+    if ((f = fopen(filename, "rb")) == NULL)
+        return false;
+
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_decompress(&cinfo);
         
     jpeg_stdio_src(&cinfo, f);
     jpeg_read_header(&cinfo, TRUE);
@@ -47,36 +48,118 @@ void GetJPEGDimensions(const char *filename, int &w, int &h)
     w = cinfo.image_width;
     h = cinfo.image_height;
 
-    printf("[GetJPEGDimensions] File %s: ( %d , %d )\n", filename, w, h);
-    
     jpeg_destroy_decompress(&cinfo);
 
     fclose(f);
+
+    return true;
+}
+
+void GetJPEGDimensions(const char *filename, int &w, int &h)
+{
+    if (!ReadJPEGDimensions(filename, w, h)) {
+        printf("[GetJPEGDimensions] Error: can't open file %s for reading\n", 
+               filename);
+        return;
+    }
+
+    printf("[GetJPEGDimensions] File %s: ( %d , %d )\n", filename, w, h);
+}
+
+int GetJPEGDimensionsBatch(const std::vector<std::string> &filenames,
+                           std::vector<int> &w, std::vector<int> &h)
+{
+    int num_files = (int) filenames.size();
+    int num_read = 0;
+
+    w.resize(num_files);
+    h.resize(num_files);
+
+    /* Only the first few kilobytes of each file are touched, so this is
+     * bound by file open latency and benefits from many requests in
+     * flight */
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 8) reduction(+:num_read)
+#endif
+    for (int i = 0; i < num_files; i++) {
+        int w_curr = 0, h_curr = 0;
+        if (ReadJPEGDimensions(filenames[i].c_str(), w_curr, h_curr))
+            num_read++;
+
+        w[i] = w_curr;
+        h[i] = h_curr;
+    }
+
+    printf("[GetJPEGDimensionsBatch] Read dimensions of %d / %d files\n",
+           num_read, num_files);
+
+    return num_read;
+}
+
+int GetJPEGScaleForSize(int w, int h, int w_min, int h_min)
+{
+    int scale = 1;
+
+    /* libjpeg rounds scaled dimensions up */
+    while (scale < 8 && 
+           (w + 2 * scale - 1) / (2 * scale) >= w_min &&
+           (h + 2 * scale - 1) / (2 * scale) >= h_min) {
+        scale *= 2;
+    }
+
+    return scale;
 }
 
 /* Note: information on libjpeg can be found here: 
  * http://www.jpegcameras.com/libjpeg/libjpeg-2.html
  */
 
-img_t *LoadJPEG(const char *filename)
+/* Open a jpeg file and start decompressing it at 1 / scale of its
+ * full resolution.  libjpeg does the scaling inside the inverse DCT,
+ * so a reduced decode skips most of the work of a full one */
+static FILE *StartJPEGDecompress(const char *filename, int scale,
+                                 struct jpeg_decompress_struct &cinfo,
+                                 struct jpeg_error_mgr &jerr, 
+                                 const char *caller)
 {
-    struct jpeg_decompress_struct cinfo;
-    struct jpeg_error_mgr jerr;
-    
-    cinfo.err = jpeg_std_error(&jerr);
-    jpeg_create_decompress(&cinfo);
-    
     FILE *f;
     
     if ((f = fopen(filename, "rb")) == NULL) {
-        printf("[LoadJPEG] Error: can't open file %s for reading\n", filename);
+        printf("[%s] Error: can't open file %s for reading\n", 
+               caller, filename);
         return NULL;        
     }
+
+    assert(scale == 1 || scale == 2 || scale == 4 || scale == 8);
+
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_decompress(&cinfo);
         
     jpeg_stdio_src(&cinfo, f);
     jpeg_read_header(&cinfo, TRUE);
+
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = scale;
+
+    if (scale > 1) {
+        /* Fancy upsampling is wasted work on a thumbnail */
+        cinfo.do_fancy_upsampling = FALSE;
+    }
+
     jpeg_start_decompress(&cinfo);
 
+    return f;
+}
+
+img_t *LoadJPEG(const char *filename, int scale)
+{
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    
+    FILE *f = StartJPEGDecompress(filename, scale, cinfo, jerr, "LoadJPEG");
+    if (f == NULL)
+        return NULL;
+
     int w = cinfo.output_width;
     int h = cinfo.output_height;
     int n = cinfo.output_components;
@@ -89,15 +172,23 @@ img_t *LoadJPEG(const char *filename)
     for (int y = 0; y < h; y++) {
         jpeg_read_scanlines(&cinfo, &row, 1);
 
-        for (int x = 0; x < w; x++) {
-            if (n == 3) {
-                img_set_pixel(img, x, h - y - 1, 
-                              row[3 * x + 0], row[3 * x + 1], row[3 * x + 2]);
-            } else if (n == 1) {
-                img_set_pixel(img, x, h - y - 1, row[x], row[x], row[x]);
+        /* Image rows are stored bottom-up */
+        color_t *out = img->pixels + (h - y - 1) * w;
+
+        if (n == 3) {
+            for (int x = 0; x < w; x++) {
+                out[x].r = row[3 * x + 0];
+                out[x].g = row[3 * x + 1];
+                out[x].b = row[3 * x + 2];
             }
+        } else {
+            for (int x = 0; x < w; x++)
+                out[x].r = out[x].g = out[x].b = row[x];
         }
     }
+
+    /* Every pixel is valid */
+    memset(img->pixel_mask, 0xff, (w * h + 7) / 8);
     
     jpeg_finish_decompress(&cinfo);
     jpeg_destroy_decompress(&cinfo);
@@ -20,8 +20,29 @@
 #ifndef __load_jpeg_h__
 #define __load_jpeg_h__
 
-img_t *LoadJPEG(const char *filename);
+#include <string>
+#include <vector>
+
+/* Decode a jpeg file at 1 / scale of its full resolution (scale is 1,
+ * 2, 4 or 8) */
+img_t *LoadJPEG(const char *filename, int scale = 1);
+
 void GetJPEGDimensions(const char *filename, int &w, int &h);
+
+/* Quiet version of GetJPEGDimensions that only reads the header.
+ * Returns false if the file can't be opened */
+bool ReadJPEGDimensions(const char *filename, int &w, int &h);
+
+/* Read the dimensions of many jpeg files in parallel.  Files that
+ * can't be read get dimensions of zero.  Returns the number of files
+ * read */
+int GetJPEGDimensionsBatch(const std::vector<std::string> &filenames,
+                           std::vector<int> &w, std::vector<int> &h);
+
+/* Largest decode scale that keeps a w x h image at least 
+ * w_min x h_min */
+int GetJPEGScaleForSize(int w, int h, int w_min, int h_min);
+
 void WriteJPEG(const img_t *img, const char *filename);
 
 #endif /* __load_jpeg_h__ */
@@ -61,6 +61,7 @@ int BaseApp::SetTracksFromPoints(int image)
 void BaseApp::CreateTracksFromPoints()
 {
     m_track_data.clear();
+    m_track_covisibility.Clear();
     
     int num_images = GetNumImages();
     
@@ -145,34 +146,118 @@ void BaseApp::SetTracks(int image)
     fflush(stdout);
 }
 
-int BaseApp::GetNumTrackMatches(int img1, int img2) 
+int BaseApp::GetNumTrackMatches(int img1, int img2) const
 {
-    const std::vector<int> &tracks1 = m_image_data[img1].m_visible_points;
-    const std::vector<int> &tracks2 = m_image_data[img2].m_visible_points;
+    /* Intersect sorted copies of the track lists, rather than marking
+     * the shared track data, so that concurrent calls are safe */
+    std::vector<int> tracks1 = m_image_data[img1].m_visible_points;
+    std::vector<int> tracks2 = m_image_data[img2].m_visible_points;
 
-    // std::vector<int> isect = GetVectorIntersection(tracks1, tracks2);
-    // int num_isect = (int) isect.size();
+    std::sort(tracks1.begin(), tracks1.end());
+    std::sort(tracks2.begin(), tracks2.end());
 
-    std::vector<int>::const_iterator iter;
-    for (iter = tracks2.begin(); iter != tracks2.end(); iter++) {
-        int track_idx = *iter;
-        m_track_data[track_idx].m_extra = 0;
-    }
-
-    for (iter = tracks1.begin(); iter != tracks1.end(); iter++) {
-        int track_idx = *iter;
-        m_track_data[track_idx].m_extra = 1;
-    }
+    int num_tracks1 = (int) tracks1.size();
+    int num_tracks2 = (int) tracks2.size();
 
     int num_isect = 0;
-    for (iter = tracks2.begin(); iter != tracks2.end(); iter++) {
-        int track_idx = *iter;
-        num_isect += m_track_data[track_idx].m_extra;
+    int i = 0, j = 0;
+    while (i < num_tracks1 && j < num_tracks2) {
+        if (tracks1[i] < tracks2[j]) {
+            i++;
+        } else if (tracks2[j] < tracks1[i]) {
+            j++;
+        } else {
+            num_isect++;
+            i++;
+            j++;
+        }
     }
 
     return num_isect;
 }
 
+void BaseApp::ComputeTrackCovisibility()
+{
+    clock_t start = clock();
+
+    int num_images = GetNumImages();
+
+    m_track_covisibility.m_rows.clear();
+    m_track_covisibility.m_rows.resize(num_images);
+
+    /* Each image owns its row, so rows fill in parallel without
+     * touching the shared track data */
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+    {
+        std::vector<int> counts(num_images, 0);
+        std::vector<int> last_track(num_images, -1);
+        std::vector<int> touched;
+
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic, 16)
+#endif
+        for (int i = 0; i < num_images; i++) {
+            const std::vector<int> &tracks = m_image_data[i].m_visible_points;
+            int num_tracks = (int) tracks.size();
+
+            touched.clear();
+
+            for (int t = 0; t < num_tracks; t++) {
+                int tr = tracks[t];
+                const ImageKeyVector &views = m_track_data[tr].m_views;
+                int num_views = (int) views.size();
+
+                for (int v = 0; v < num_views; v++) {
+                    int j = views[v].first;
+
+                    /* Count each track once per image pair */
+                    if (j <= i || last_track[j] == tr)
+                        continue;
+
+                    last_track[j] = tr;
+
+                    if (counts[j] == 0)
+                        touched.push_back(j);
+
+                    counts[j]++;
+                }
+            }
+
+            std::sort(touched.begin(), touched.end());
+
+            std::vector<std::pair<int, int> > &row = 
+                m_track_covisibility.m_rows[i];
+            int num_touched = (int) touched.size();
+
+            row.resize(num_touched);
+            for (int k = 0; k < num_touched; k++) {
+                int j = touched[k];
+                row[k] = std::make_pair(j, counts[j]);
+                counts[j] = 0;
+                last_track[j] = -1;
+            }
+        }
+    }
+
+    m_track_covisibility.m_built = true;
+
+    clock_t end = clock();
+    
+    printf("[BaseApp::ComputeTrackCovisibility] Finished in %0.3fs\n", 
+           (double) (end - start) / CLOCKS_PER_SEC);
+    fflush(stdout);
+}
+
+const TrackCovisibility &BaseApp::GetTrackCovisibility()
+{
+    if (!m_track_covisibility.IsBuilt())
+        ComputeTrackCovisibility();
+
+    return m_track_covisibility;
+}
+
 void BaseApp::SetMatchesFromTracks(int img1, int img2)
 {
     std::vector<int> &tracks1 = m_image_data[img1].m_visible_points;
@@ -20,8 +20,12 @@
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "BundlerApp.h"
+#include "BundleReader.h"
+#include "ChunkWriter.h"
+#include "Profiler.h"
 
 #include "defines.h"
 #include "matrix.h"
@@ -332,8 +336,43 @@ void BundlerApp::ScaleFocalLengths(double focal)
     fclose(f);    
 }
 
+/* Encodes the points of a bundle file for WriteChunks */
+class BundlePointEncoder
+{
+public:
+    BundlePointEncoder(const BundleData &bundle) : m_bundle(bundle) { }
+
+    void operator()(int i, std::string &buf) const {
+        const double *pos = &m_bundle.m_pos[3 * i];
+        const float *color = &m_bundle.m_color[3 * i];
+
+	/* Position */
+        AppendFormat(buf, "%0.9e %0.9e %0.9e\n", pos[0], pos[1], pos[2]);
+
+	/* Color */
+        AppendFormat(buf, "%d %d %d\n", 
+                     iround(color[0]), iround(color[1]), iround(color[2]));
+
+        int num_visible = m_bundle.GetNumViews(i);
+        const bundle_view_t *views = m_bundle.GetViews(i);
+
+        AppendFormat(buf, "%d", num_visible);
+	for (int j = 0; j < num_visible; j++) {
+            AppendFormat(buf, " %d %d %0.4f %0.4f", views[j].image, 
+                         views[j].key, views[j].x, views[j].y);
+        }
+
+        buf.push_back('\n');
+    }
+
+private:
+    const BundleData &m_bundle;
+};
+
 void BundlerApp::OutputCompressed(const char *ext) 
 {
+    ProfileScope scope("OutputCompressed");
+
     // EstimatePointNormals();
 
     /* Output the new list of images */
@@ -354,6 +393,8 @@ void BundlerApp::OutputCompressed(const char *ext)
     int *map = new int[num_images];
 
     for (int i = 0; i < num_images; i++) {
+        map[i] = -1;
+
 	if (!m_image_data[i].m_camera.m_adjusted)
 	    continue;
 
@@ -373,112 +414,84 @@ void BundlerApp::OutputCompressed(const char *ext)
     }
 
     fclose(f);
-    
-    /* Output the new bundle.out file */
-    sprintf(buf, "bundle.%s.out", ext);
-    f = fopen(buf, "w");
-    if (f == NULL) {
-	printf("[SifterApp::OutputCompress] Error opening file %s "
-	       "for writing\n", buf);
-	return;
-    }
 
-#if 0
-    if (m_estimate_distortion && m_bundle_version > 0.1) {
-        fprintf(f, "v%lf\n", m_bundle_version);
+    /* Gather the cameras and the points seen by at least two cameras */
+    BundleData bundle;
+    bundle.m_version = 0.3;
+
+    for (int i = 0; i < num_images; i++) {
+	if (!m_image_data[i].m_camera.m_adjusted)
+	    continue;
+
+        const CameraInfo &camera = m_image_data[i].m_camera;
+
+        bundle_camera_t cam;
+        memset(&cam, 0, sizeof(bundle_camera_t));
+        cam.f = camera.m_focal;
+        cam.k[0] = camera.m_k[0];
+        cam.k[1] = camera.m_k[1];
+        memcpy(cam.R, camera.m_R, 9 * sizeof(double));
+        memcpy(cam.t, camera.m_t, 3 * sizeof(double));
+
+        bundle.m_cameras.push_back(cam);
     }
-#endif
 
-    fprintf(f, "# Bundle file v0.3\n");
-    
     int num_points = (int) m_point_data.size();
-    int num_good_points = 0;
+    std::vector<int> good_points;
     
     for (int i = 0; i < num_points; i++) {
         if (m_point_data[i].m_views.size() >= 2)
-            num_good_points++;
+            good_points.push_back(i);
     }
 
-    fprintf(f, "%d %d\n", num_adj_images, num_good_points);
+    int num_good_points = (int) good_points.size();
 
-    /* Dump cameras */
-    for (int i = 0; i < num_images; i++) {
-	if (!m_image_data[i].m_camera.m_adjusted)
-	    continue;
-
-        // if (m_estimate_distortion && m_bundle_version > 0.1) {
+    /* Keys are loaded (one image at a time) before the points are
+     * filled in parallel */
+    for (int i = 0; i < num_good_points; i++) {
+        const ImageKeyVector &views = m_point_data[good_points[i]].m_views;
 
-        fprintf(f, "%0.9e %0.9e %0.9e\n", 
-                m_image_data[i].m_camera.m_focal, 
-                m_image_data[i].m_camera.m_k[0],
-                m_image_data[i].m_camera.m_k[1]);
-        // } else {
-        //     fprintf(f, "%0.9e\n", m_image_data[i].m_camera.m_focal);
-        // }
-
-	fprintf(f, "%0.9e %0.9e %0.9e\n", 
-		m_image_data[i].m_camera.m_R[0], 
-		m_image_data[i].m_camera.m_R[1], 
-		m_image_data[i].m_camera.m_R[2]);
-	fprintf(f, "%0.9e %0.9e %0.9e\n", 
-		m_image_data[i].m_camera.m_R[3], 
-		m_image_data[i].m_camera.m_R[4], 
-		m_image_data[i].m_camera.m_R[5]);
-	fprintf(f, "%0.9e %0.9e %0.9e\n", 
-		m_image_data[i].m_camera.m_R[6], 
-		m_image_data[i].m_camera.m_R[7], 
-		m_image_data[i].m_camera.m_R[8]);
-
-	double *t = m_image_data[i].m_camera.m_t;
-	fprintf(f, "%0.9e %0.9e %0.9e\n", t[0], t[1], t[2]);
+        for (int j = 0; j < (int) views.size(); j++) {
+            if (!m_image_data[views[j].first].m_keys_loaded)
+                m_image_data[views[j].first].LoadKeys(false);
+        }
     }
-    
-    /* Dump points */
-    for (int i = 0; i < num_points; i++) {
-	PointData &p = m_point_data[i];
 
-	int num_visible = (int) p.m_views.size();
-        if (num_visible < 2)
-            continue;
+    bundle.m_view_start.resize(num_good_points + 1);
+    bundle.m_view_start[0] = 0;
+    for (int i = 0; i < num_good_points; i++) {
+        bundle.m_view_start[i+1] = bundle.m_view_start[i] + 
+            (int) m_point_data[good_points[i]].m_views.size();
+    }
 
-	/* Position */
-	fprintf(f, "%0.9e %0.9e %0.9e\n", 
-		p.m_pos[0], p.m_pos[1], p.m_pos[2]);
+    bundle.m_pos.resize(3 * num_good_points);
+    bundle.m_color.resize(3 * num_good_points);
+    bundle.m_views.resize(bundle.m_view_start[num_good_points]);
 
-	/* Color */
-	fprintf(f, "%d %d %d\n", 
-		iround(p.m_color[0]), 
-                iround(p.m_color[1]), 
-                iround(p.m_color[2]));
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+    for (int i = 0; i < num_good_points; i++) {
+	const PointData &p = m_point_data[good_points[i]];
 
-        /* Normal */
-        // fprintf(f, "%0.5e %0.5e %0.5e\n",
-        //         p.m_norm[0], p.m_norm[1], p.m_norm[2]);
+        memcpy(&bundle.m_pos[3 * i], p.m_pos, 3 * sizeof(double));
+        memcpy(&bundle.m_color[3 * i], p.m_color, 3 * sizeof(float));
 
-	fprintf(f, "%d", num_visible);
-	for (int j = 0; j < num_visible; j++) {
+        bundle_view_t *out = &bundle.m_views[0] + bundle.m_view_start[i];
+	for (int j = 0; j < (int) p.m_views.size(); j++) {
 	    int view = p.m_views[j].first;
-	    int view_new = map[view];
             int key = p.m_views[j].second;
+            const std::vector<Keypoint> &keys = m_image_data[view].m_keys;
 
-#if 1
-            if (!m_image_data[view].m_keys_loaded)
-                m_image_data[view].LoadKeys(false);
+            out[j].image = map[view];
+            out[j].key = key;
+            out[j].x = out[j].y = 0.0;
 
-            double x = 0.0, y = 0.0;
-
-            if (key < (int) m_image_data[view].m_keys.size()) {
-                x = m_image_data[view].m_keys[key].m_x;
-                y = m_image_data[view].m_keys[key].m_y;
+            if (key < (int) keys.size()) {
+                out[j].x = keys[key].m_x;
+                out[j].y = keys[key].m_y;
             }       
-
-	    fprintf(f, " %d %d %0.4f %0.4f", view_new, key, x, y);
-#else
-	    fprintf(f, " %d %d", view_new, key);
-#endif
 	}
-
-	fprintf(f, "\n");
     }
     
     for (int i = 0; i < num_images; i++) {
@@ -486,51 +499,125 @@ void BundlerApp::OutputCompressed(const char *ext)
             m_image_data[i].UnloadKeys();
     }
 
+    /* Output the new bundle.out file */
+    sprintf(buf, "bundle.%s.out", ext);
+
+    if (m_output_binary) {
+        WriteBundleBinary(buf, bundle);
+        delete [] map;
+        return;
+    }
+
+    f = fopen(buf, "w");
+    if (f == NULL) {
+	printf("[SifterApp::OutputCompress] Error opening file %s "
+	       "for writing\n", buf);
+        delete [] map;
+	return;
+    }
+
+#if 0
+    if (m_estimate_distortion && m_bundle_version > 0.1) {
+        fprintf(f, "v%lf\n", m_bundle_version);
+    }
+#endif
+
+    fprintf(f, "# Bundle file v0.3\n");
+    fprintf(f, "%d %d\n", num_adj_images, num_good_points);
+
+    /* Dump cameras */
+    for (int i = 0; i < bundle.GetNumCameras(); i++) {
+        const bundle_camera_t &cam = bundle.m_cameras[i];
+
+        fprintf(f, "%0.9e %0.9e %0.9e\n", cam.f, cam.k[0], cam.k[1]);
+	fprintf(f, "%0.9e %0.9e %0.9e\n", cam.R[0], cam.R[1], cam.R[2]);
+	fprintf(f, "%0.9e %0.9e %0.9e\n", cam.R[3], cam.R[4], cam.R[5]);
+	fprintf(f, "%0.9e %0.9e %0.9e\n", cam.R[6], cam.R[7], cam.R[8]);
+	fprintf(f, "%0.9e %0.9e %0.9e\n", cam.t[0], cam.t[1], cam.t[2]);
+    }
+    
+    /* Dump points */
+    if (!WriteChunks(f, num_good_points, BundlePointEncoder(bundle)))
+        printf("[OutputCompressed] Error writing to %s\n", buf);
+
     fclose(f);
 
     delete [] map;
 }
 
+/* Camera positions, for the passes over all points */
+static void GetCameraPositions(const std::vector<ImageData> &images,
+                               std::vector<double> &positions)
+{
+    int num_images = (int) images.size();
+    positions.resize(3 * num_images);
+
+    for (int i = 0; i < num_images; i++)
+        images[i].m_camera.GetPosition(&positions[3 * i]);
+}
+
 void BundlerApp::PruneBadPoints()
 {
+    ProfileScope scope("PruneBadPoints");
+
     int num_points = (int) m_point_data.size();
     const double MIN_ANGLE_THRESHOLD = 1.5;
     int num_pruned = 0;
 
-    for (int i = 0; i < num_points; i++) {
-        double *pos = m_point_data[i].m_pos;
-        int num_views = (int) m_point_data[i].m_views.size();
+    std::vector<double> cam_pos;
+    GetCameraPositions(m_image_data, cam_pos);
+
+    /* Find the widest angle between the rays to each point, in
+     * parallel */
+    std::vector<double> max_angles(num_points);
+
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+    {
+        std::vector<double> rays;
+
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic, 1024)
+#endif
+        for (int i = 0; i < num_points; i++) {
+            const double *pos = m_point_data[i].m_pos;
+            const ImageKeyVector &views = m_point_data[i].m_views;
+            int num_views = (int) views.size();
+
+            rays.resize(3 * num_views);
+            for (int j = 0; j < num_views; j++) {
+                double *r = &rays[3 * j];
+                matrix_diff(3, 1, 3, 1, (double *) pos, 
+                            &cam_pos[3 * views[j].first], r);
+                double norm = matrix_norm(3, 1, r);
+                matrix_scale(3, 1, r, 1.0 / norm, r);
+            }
 
-        double max_angle = 0.0;
-        for (int j = 0; j < num_views; j++) {
-            int v1 = m_point_data[i].m_views[j].first;
-
-            double p1[3], r1[3];
-            m_image_data[v1].m_camera.GetPosition(p1);
-            matrix_diff(3, 1, 3, 1, pos, p1, r1);
-            double norm = matrix_norm(3, 1, r1);
-            matrix_scale(3, 1, r1, 1.0 / norm, r1);
-
-            for (int k = j+1; k < num_views; k++) {
-                int v2 = m_point_data[i].m_views[k].first;
-
-                double p2[3], r2[3];
-                m_image_data[v2].m_camera.GetPosition(p2);
-                matrix_diff(3, 1, 3, 1, pos, p2, r2);
-                double norm = matrix_norm(3, 1, r2);
-                matrix_scale(3, 1, r2, 1.0 / norm, r2);
-                
-                double dot;
-                matrix_product(1, 3, 3, 1, r1, r2, &dot);
-
-                double angle = 
-                    acos(CLAMP(dot, -1.0 + 1.0e-8, 1.0 - 1.0e-8));
-
-                if (angle > max_angle) {
-                    max_angle = angle;
+            double max_angle = 0.0;
+            for (int j = 0; j < num_views; j++) {
+                const double *r1 = &rays[3 * j];
+
+                for (int k = j+1; k < num_views; k++) {
+                    const double *r2 = &rays[3 * k];
+                    double dot = r1[0] * r2[0] + r1[1] * r2[1] + r1[2] * r2[2];
+
+                    double angle = 
+                        acos(CLAMP(dot, -1.0 + 1.0e-8, 1.0 - 1.0e-8));
+
+                    if (angle > max_angle) {
+                        max_angle = angle;
+                    }
                 }
             }
+
+            max_angles[i] = max_angle;
         }
+    }
+
+    for (int i = 0; i < num_points; i++) {
+        int num_views = (int) m_point_data[i].m_views.size();
+        double max_angle = max_angles[i];
 
         if (num_views < 3 || RAD2DEG(max_angle) < MIN_ANGLE_THRESHOLD) {
             printf("[PruneBadPoints] Removing point %d with angle %0.3f\n",
@@ -0,0 +1,362 @@
+/*
+ *  Copyright (c) 2008-2010  Noah Snavely (snavely (at) cs.cornell.edu)
+ *    and the University of Washington
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+/* Profiler.cpp */
+/* Scoped timers for the stages of a run */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#include "Profiler.h"
+
+#include "defines.h"
+
+/* Stop adding events to the trace past this many (the summary keeps
+ * counting) */
+#define MAX_TRACE_EVENTS (1 << 22)
+
+/* A stage, as reached through a given chain of parent stages */
+typedef struct {
+    const char *name;
+    int parent;
+    int depth;
+
+    long long calls;
+    double wall;
+    double cpu;
+    long long items;
+    double peak_rss;            /* MB */
+} profile_node_t;
+
+typedef struct {
+    int node;
+    int thread;
+    double start;               /* Seconds since the profiler started */
+    double wall;
+    double cpu;
+    long long items;
+    double peak_rss;
+} profile_event_t;
+
+typedef struct {
+    bool enabled;
+    std::string trace_file;
+
+    std::chrono::steady_clock::time_point origin;
+    int main_thread;
+
+    std::mutex lock;
+    int num_threads;
+    std::vector<profile_node_t> nodes;
+    std::map<std::pair<int, std::string>, int> children;
+    std::vector<profile_event_t> events;
+    long long num_dropped;
+} profiler_t;
+
+static profiler_t *g_profiler = NULL;
+
+/* Stage running on this thread (-1 for none), and the number of the
+ * thread in the trace (0 until assigned) */
+static THREAD_LOCAL int t_current_node = -1;
+static THREAD_LOCAL int t_thread = 0;
+
+static int GetThread(profiler_t *p)
+{
+    if (t_thread == 0) {
+        std::lock_guard<std::mutex> guard(p->lock);
+        t_thread = ++p->num_threads;
+    }
+
+    return t_thread;
+}
+
+static double GetSeconds(profiler_t *p)
+{
+    return std::chrono::duration<double>
+        (std::chrono::steady_clock::now() - p->origin).count();
+}
+
+double GetWallTime()
+{
+    return std::chrono::duration<double>
+        (std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+#ifdef WIN32
+static double FileTimeToSeconds(const FILETIME &t)
+{
+    ULARGE_INTEGER v;
+    v.LowPart = t.dwLowDateTime;
+    v.HighPart = t.dwHighDateTime;
+    return 1.0e-7 * (double) v.QuadPart;
+}
+#endif
+
+static double GetCPUTime(bool process)
+{
+#ifdef WIN32
+    FILETIME create, exit_time, kernel, user;
+    BOOL ok = process ?
+        GetProcessTimes(GetCurrentProcess(), 
+                        &create, &exit_time, &kernel, &user) :
+        GetThreadTimes(GetCurrentThread(), 
+                       &create, &exit_time, &kernel, &user);
+
+    if (!ok)
+        return 0.0;
+
+    return FileTimeToSeconds(kernel) + FileTimeToSeconds(user);
+#else
+    struct timespec ts;
+    if (clock_gettime(process ? CLOCK_PROCESS_CPUTIME_ID :
+                      CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+        return 0.0;
+
+    return ts.tv_sec + 1.0e-9 * ts.tv_nsec;
+#endif
+}
+
+/* Peak resident memory of the process so far, in MB */
+static double GetPeakRSS()
+{
+#ifdef WIN32
+    return 0.0;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0.0;
+
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1048576.0;      /* Bytes */
+#else
+    return usage.ru_maxrss / 1024.0;         /* Kilobytes */
+#endif
+#endif
+}
+
+static void WriteTrace(profiler_t *p)
+{
+    FILE *f = fopen(p->trace_file.c_str(), "w");
+    if (f == NULL) {
+        printf("[Profiler] Error opening file %s for writing\n",
+               p->trace_file.c_str());
+        return;
+    }
+
+    fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+
+    int num_events = (int) p->events.size();
+    for (int i = 0; i < num_events; i++) {
+        const profile_event_t &e = p->events[i];
+
+        /* Names are string literals, so need no escaping */
+        fprintf(f, "{\"name\": \"%s\", \"cat\": \"bundler\", \"ph\": \"X\", "
+                "\"pid\": 1, \"tid\": %d, \"ts\": %0.1f, \"dur\": %0.1f, "
+                "\"args\": {\"cpu_ms\": %0.3f, \"items\": %lld, "
+                "\"peak_rss_mb\": %0.1f}}%s\n",
+                p->nodes[e.node].name, e.thread,
+                1.0e6 * e.start, 1.0e6 * e.wall, 1.0e3 * e.cpu, e.items,
+                e.peak_rss, (i + 1 < num_events) ? "," : "");
+    }
+
+    fprintf(f, "]}\n");
+    fclose(f);
+
+    printf("[Profiler] Wrote %d events to %s", num_events,
+           p->trace_file.c_str());
+
+    if (p->num_dropped > 0)
+        printf(" (%lld more dropped)", p->num_dropped);
+
+    printf("\n");
+}
+
+static void PrintNode(profiler_t *p, int node,
+                      const std::vector<std::vector<int> > &children)
+{
+    const profile_node_t &n = p->nodes[node];
+
+    char name[64];
+    sprintf(name, "%*s%.*s", 2 * n.depth, "",
+            (int) sizeof(name) - 2 * n.depth - 1, n.name);
+
+    printf("[Profiler] %-36s %8lld %10.3f %10.3f %12lld %10.1f\n",
+           name, n.calls, n.wall, n.cpu, n.items, n.peak_rss);
+
+    for (int i = 0; i < (int) children[node].size(); i++)
+        PrintNode(p, children[node][i], children);
+}
+
+static void PrintSummary(profiler_t *p)
+{
+    int num_nodes = (int) p->nodes.size();
+
+    std::vector<std::vector<int> > children(num_nodes);
+    std::vector<int> roots;
+
+    for (int i = 0; i < num_nodes; i++) {
+        if (p->nodes[i].parent == -1)
+            roots.push_back(i);
+        else
+            children[p->nodes[i].parent].push_back(i);
+    }
+
+    printf("[Profiler] %-36s %8s %10s %10s %12s %10s\n",
+           "Stage", "Calls", "Wall (s)", "CPU (s)", "Items", "Peak (MB)");
+
+    for (int i = 0; i < (int) roots.size(); i++)
+        PrintNode(p, roots[i], children);
+
+    printf("[Profiler] Total wall time %0.3fs, peak memory %0.1fMB\n",
+           GetSeconds(p), GetPeakRSS());
+}
+
+static void ProfilerExit()
+{
+    profiler_t *p = g_profiler;
+
+    std::lock_guard<std::mutex> guard(p->lock);
+    p->enabled = false;
+
+    fflush(stdout);
+    PrintSummary(p);
+
+    if (!p->trace_file.empty())
+        WriteTrace(p);
+
+    fflush(stdout);
+}
+
+void ProfilerStart(const char *trace_file)
+{
+    if (g_profiler != NULL)
+        return;
+
+    /* Never freed, so that it outlives the exit handler */
+    profiler_t *p = new profiler_t;
+
+    p->trace_file = (trace_file != NULL) ? trace_file : "";
+    p->origin = std::chrono::steady_clock::now();
+    p->num_threads = 0;
+    p->num_dropped = 0;
+
+    g_profiler = p;
+
+    p->main_thread = GetThread(p);
+    p->enabled = true;
+
+    atexit(ProfilerExit);
+}
+
+bool ProfilerEnabled()
+{
+    return g_profiler != NULL && g_profiler->enabled;
+}
+
+ProfileScope::ProfileScope(const char *name) : m_node(-1), m_items(0)
+{
+    profiler_t *p = g_profiler;
+    if (p == NULL || !p->enabled)
+        return;
+
+    m_process_cpu = (GetThread(p) == p->main_thread);
+    m_parent = t_current_node;
+
+    {
+        std::lock_guard<std::mutex> guard(p->lock);
+
+        /* Match names by value, as the same literal may have several
+         * copies */
+        std::pair<int, std::string> key(m_parent, name);
+        std::map<std::pair<int, std::string>, int>::iterator iter =
+            p->children.find(key);
+
+        if (iter != p->children.end()) {
+            m_node = iter->second;
+        } else {
+            profile_node_t n;
+            memset(&n, 0, sizeof(profile_node_t));
+            n.name = name;
+            n.parent = m_parent;
+            n.depth = (m_parent == -1) ? 0 : p->nodes[m_parent].depth + 1;
+
+            m_node = (int) p->nodes.size();
+            p->nodes.push_back(n);
+            p->children[key] = m_node;
+        }
+    }
+
+    t_current_node = m_node;
+
+    m_cpu_start = GetCPUTime(m_process_cpu);
+    m_wall_start = GetSeconds(p);
+}
+
+ProfileScope::~ProfileScope()
+{
+    if (m_node == -1)
+        return;
+
+    profiler_t *p = g_profiler;
+
+    double wall_end = GetSeconds(p);
+    double cpu = GetCPUTime(m_process_cpu) - m_cpu_start;
+    double peak_rss = GetPeakRSS();
+
+    t_current_node = m_parent;
+
+    std::lock_guard<std::mutex> guard(p->lock);
+
+    if (!p->enabled)
+        return;
+
+    profile_node_t &n = p->nodes[m_node];
+    n.calls++;
+    n.wall += wall_end - m_wall_start;
+    n.cpu += cpu;
+    n.items += m_items;
+    n.peak_rss = MAX(n.peak_rss, peak_rss);
+
+    if ((int) p->events.size() < MAX_TRACE_EVENTS) {
+        profile_event_t e;
+        e.node = m_node;
+        e.thread = t_thread;
+        e.start = m_wall_start;
+        e.wall = wall_end - m_wall_start;
+        e.cpu = cpu;
+        e.items = m_items;
+        e.peak_rss = peak_rss;
+
+        p->events.push_back(e);
+    } else {
+        p->num_dropped++;
+    }
+}
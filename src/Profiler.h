@@ -0,0 +1,63 @@
+/*
+ *  Copyright (c) 2008-2010  Noah Snavely (snavely (at) cs.cornell.edu)
+ *    and the University of Washington
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+/* Profiler.h */
+/* Scoped timers for the stages of a run */
+
+#ifndef __profiler_h__
+#define __profiler_h__
+
+/* Start profiling.  Stages are timed from here on, and when the
+ * program exits a summary table is printed and (if trace_file isn't
+ * NULL) the stages are written to trace_file in the Chrome trace
+ * format (viewable in chrome://tracing) */
+void ProfilerStart(const char *trace_file);
+
+/* Is the profiler running? */
+bool ProfilerEnabled();
+
+/* Wall-clock time in seconds, from an arbitrary origin.  Unlike
+ * clock(), which is the CPU time of the whole process, this measures
+ * elapsed time under OpenMP */
+double GetWallTime();
+
+/* Times a stage from construction to destruction.  A stage started
+ * while another one is running on the same thread is nested under it.
+ * Each stage records its wall time, its CPU time (that of the whole
+ * process on the thread that started the profiler, so that OpenMP
+ * workers count, and that of the thread elsewhere), the peak resident
+ * memory of the process at its end, and a count of the items it
+ * processed.  The name must be a string literal.  Stages are meant to
+ * be coarse (a pair, an image, a solve): each one takes a lock */
+class ProfileScope
+{
+public:
+    explicit ProfileScope(const char *name);
+    ~ProfileScope();
+
+    /* Count items processed in this stage */
+    void AddItems(long long count) { m_items += count; }
+
+private:
+    int m_node;                 /* -1 if the profiler is off */
+    int m_parent;
+    bool m_process_cpu;
+    double m_wall_start;
+    double m_cpu_start;
+    long long m_items;
+};
+
+#endif /* __profiler_h__ */
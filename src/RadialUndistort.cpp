@@ -2,8 +2,14 @@
 /* Undo radial distortion */
 
 #include <assert.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <thread>
 #include <vector>
 #include <string>
 #include <string.h>
@@ -17,6 +23,8 @@
 
 // #include "jpegcvt.h"
 #include "LoadJPEG.h"
+#include "BoundedQueue.h"
+#include "BundleReader.h"
 
 typedef struct
 {
@@ -38,155 +46,64 @@ void ReadBundleFile(char *bundle_file,
                     std::vector<camera_params_t> &cameras,
                     std::vector<point_t> &points)
 {
-    FILE *f = fopen(bundle_file, "r");
-    if (f == NULL) {
-	printf("Error opening file %s for reading\n", bundle_file);
-	return;
-    }
+    BundleData bundle;
+    if (!ReadBundle(bundle_file, bundle))
+        return;
 
-    int num_images, num_points;
-    double bundle_version;
-
-    char first_line[256];
-    bool coalesced = false;
-    fgets(first_line, 256, f);
-    if (first_line[0] == '#') {
-        double version;
-        sscanf(first_line, "# Bundle file v%lf", &version);
-
-        bundle_version = version;
-        printf("[ReadBundleFile] Bundle version: %0.3f\n", version);
-
-        if (bundle_version < 0.4) {
-            fscanf(f, "%d %d\n", &num_images, &num_points);
-        } else /* bundle_version >= 0.4 */ {
-            int coalesced_int = 0;
-            fscanf(f, "%d %d %d\n", &num_images, &num_points, &coalesced_int);
-            coalesced = (coalesced_int != 0);
-        }
-    } else if (first_line[0] == 'v') {
-        double version;
-        sscanf(first_line, "v%lf", &version);
-        bundle_version = version;
-        printf("[ReadBundleFile] Bundle version: %0.3f\n", version);
-
-        fscanf(f, "%d %d\n", &num_images, &num_points);
-    } else {
-        bundle_version = 0.1;
-        sscanf(first_line, "%d %d\n", &num_images, &num_points);
-    }
+    double bundle_version = bundle.m_version;
+    printf("[ReadBundleFile] Bundle version: %0.3f\n", bundle_version);
+
+    int num_images = bundle.GetNumCameras();
+    int num_points = bundle.GetNumPoints();
 
     printf("[ReadBundleFile] Reading %d images and %d points...\n",
 	   num_images, num_points);
 
+    filenames.insert(filenames.end(), 
+                     bundle.m_names.begin(), bundle.m_names.end());
+
     /* Read cameras */
     for (int i = 0; i < num_images; i++) {
-	double focal_length, k0, k1;
-	double R[9];
-	double t[3];
-        
-        if (bundle_version < 0.2) {
-            /* Focal length */
-            fscanf(f, "%lf\n", &focal_length);
-        } else if (bundle_version < 0.4) {
-            fscanf(f, "%lf %lf %lf\n", &focal_length, &k0, &k1);
-        } else { /* bundle_version >= 0.4 */
-            /* Get the name of the file and other info */
-            char name[512];
-            int w, h;
-            double focal_est;
-            int player_id;
-            fscanf(f, "%s %d %d %lf %d\n", 
-                   name, &w, &h, &focal_est, &player_id); // &w, &h);
-
-            fscanf(f, "%lf %lf %lf\n", &focal_length, &k0, &k1);
-
-            filenames.push_back(std::string(name));
-        }
-
-	/* Rotation */
-	fscanf(f, "%lf %lf %lf\n%lf %lf %lf\n%lf %lf %lf\n", 
-	       R+0, R+1, R+2, R+3, R+4, R+5, R+6, R+7, R+8);
-	/* Translation */
-	fscanf(f, "%lf %lf %lf\n", t+0, t+1, t+2);
+        const bundle_camera_t &c = bundle.m_cameras[i];
 
         camera_params_t cam;
 
-        cam.f = focal_length;
-        cam.k[0] = k0;
-        cam.k[1] = k1;
-        memcpy(cam.R, R, sizeof(double) * 9);
-        memcpy(cam.t, t, sizeof(double) * 3);
-
-        /* Flip the scene if needed */
-        if (bundle_version < 0.3) {
-            R[2] = -R[2];
-            R[5] = -R[5];
-            R[6] = -R[6];
-            R[7] = -R[7];
-            t[2] = -t[2];
-        }
+        cam.f = c.f;
+        cam.k[0] = c.k[0];
+        cam.k[1] = c.k[1];
+        memcpy(cam.R, c.R, sizeof(double) * 9);
+        memcpy(cam.t, c.t, sizeof(double) * 3);
 
         cameras.push_back(cam);
     }
 
     /* Read points */
+    points.reserve(num_points);
     for (int i = 0; i < num_points; i++) {
-	point_t pt;
-
-        if (bundle_version >= 0.4) {
-            int player_id;
-            fscanf(f, "%d\n", &player_id);
-        }
-
-	/* Position */
-	fscanf(f, "%lf %lf %lf\n", 
-	       pt.pos + 0, pt.pos + 1, pt.pos + 2);
+	int num_visible = bundle.GetNumViews(i);
+        if (num_visible == 0)
+            continue;
 
-	/* Color */
-	fscanf(f, "%lf %lf %lf\n", 
-	       pt.color + 0, pt.color + 1, pt.color + 2);
-
-        /* Descriptor */
-        if (bundle_version >= 0.4 && coalesced) {
-            float desc[128];
-            for (int j = 0; j < 16; j++) {
-                for (int k = 0; k < 8; k++) {
-                    fscanf(f, "%f", desc + j * 8 + k);
-                }
-                fscanf(f, "\n");
-            }
+	point_t pt;
+        for (int j = 0; j < 3; j++) {
+            pt.pos[j] = bundle.m_pos[3 * i + j];
+            pt.color[j] = bundle.m_color[3 * i + j];
         }
 
-	int num_visible;
-	fscanf(f, "%d", &num_visible);
-
+        const bundle_view_t *views = bundle.GetViews(i);
+        pt.views.resize(num_visible);
 	for (int j = 0; j < num_visible; j++) {
-	    int image, key;
-	    fscanf(f, "%d %d", &image, &key);
-
-            double x, y;
-            if (bundle_version >= 0.3)
-                fscanf(f, "%lf %lf", &x, &y);
-
-            view_t view;
-            view.image = image;
-            view.key = key;
-            view.x = x;
-            view.y = y;
-
-            pt.views.push_back(view);
+            pt.views[j].image = views[j].image;
+            pt.views[j].key = views[j].key;
+            pt.views[j].x = views[j].x;
+            pt.views[j].y = views[j].y;
 	}
 
         if (bundle_version < 0.3)
             pt.pos[2] = -pt.pos[2];
 
-        if (num_visible > 0) {
-            points.push_back(pt);
-        }
+        points.push_back(pt);
     }
-
-    fclose(f);
 }
 
 void ReadListFile(char *list_file, std::vector<std::string> &files)
@@ -288,85 +205,242 @@ void WriteBundleFile(const char *bundle_file,
     fclose(f);
 }
 
-void UndistortImage(const std::string &in, 
-                    const camera_params_t &camera,
-                    const std::string &out)
-{ 
-    printf("Undistorting image %s\n", in.c_str());
-    fflush(stdout);
+/* Intrinsics that determine an undistortion map */
+class RemapKey
+{
+public:
+    RemapKey(const camera_params_t &camera, int w, int h) 
+        : m_f(camera.f), m_k1(camera.k[0]), m_k2(camera.k[1]), m_w(w), m_h(h)
+    { }
+
+    bool operator<(const RemapKey &other) const {
+        if (m_f != other.m_f) return m_f < other.m_f;
+        if (m_k1 != other.m_k1) return m_k1 < other.m_k1;
+        if (m_k2 != other.m_k2) return m_k2 < other.m_k2;
+        if (m_w != other.m_w) return m_w < other.m_w;
+        return m_h < other.m_h;
+    }
 
-    img_t *img = LoadJPEG(in.c_str());
-    int w = img->w;
-    int h = img->h;
-    
-    img_t *img_out = img_new(w, h);
-   
-    double f2_inv = 1.0 / (camera.f * camera.f);
-
-    for (int y = 0; y < h; y++) {
-        for (int x = 0; x < w; x++) {
-            double x_c = x - 0.5 * w;
-            double y_c = y - 0.5 * h;
-            
-            double r2 = (x_c * x_c + y_c * y_c) * f2_inv;
-            double factor = 1.0 + camera.k[0] * r2 + camera.k[1] * r2 * r2;
-            
-            x_c *= factor;
-            y_c *= factor;
-
-            x_c += 0.5 * w;
-            y_c += 0.5 * h;
-            
-            fcolor_t c;
-            if (x_c >= 0 && x_c < w - 1 && y_c >= 0 && y_c < h - 1) {
-                c = pixel_lerp(img, x_c, y_c);
-            } else {
-                c = fcolor_new(0.0, 0.0, 0.0);
-            }
-            
-            img_set_pixel(img_out, x, y, 
-                          iround(c.r), iround(c.g), iround(c.b));
+    double m_f, m_k1, m_k2;
+    int m_w, m_h;
+};
+
+/* Undistortion maps shared between images with the same intrinsics.
+ * Images are counted per intrinsics, since their dimensions aren't
+ * known until they are decoded.  Once every image with some
+ * intrinsics has been processed, its maps (one per image size) are
+ * freed, so memory stays bounded when every image has its own
+ * intrinsics */
+class RemapCache
+{
+public:
+    RemapCache(const std::vector<camera_params_t> &cameras) {
+        for (int i = 0; i < (int) cameras.size(); i++) {
+            if (cameras[i].f != 0.0)
+                m_uses_left[Intrinsics(cameras[i])]++;
+        }
+    }
+
+    ~RemapCache() {
+        std::map<RemapKey, img_remap_t *>::iterator iter;
+        for (iter = m_maps.begin(); iter != m_maps.end(); iter++)
+            img_remap_free(iter->second);
+    }
+
+    /* Get the map for the given camera, creating it if needed */
+    const img_remap_t *Acquire(const camera_params_t &camera, int w, int h) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        RemapKey key(camera, w, h);
+        std::map<RemapKey, img_remap_t *>::iterator iter = m_maps.find(key);
+
+        if (iter == m_maps.end()) {
+            img_remap_t *map = 
+                img_remap_radial_distortion(w, h, camera.f,
+                                            camera.k[0], camera.k[1]);
+            iter = m_maps.insert(std::make_pair(key, map)).first;
+        }
+
+        return iter->second;
+    }
+
+    /* Signal that an image is done with its map.  The maps of the
+     * camera's intrinsics are freed with the last image that uses
+     * them */
+    void Release(const camera_params_t &camera) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        if (--m_uses_left[Intrinsics(camera)] > 0)
+            return;
+
+        /* Keys order by intrinsics first, so the maps of all image
+         * sizes are adjacent */
+        std::map<RemapKey, img_remap_t *>::iterator begin = 
+            m_maps.lower_bound(RemapKey(camera, INT_MIN, INT_MIN));
+        std::map<RemapKey, img_remap_t *>::iterator end = 
+            m_maps.upper_bound(RemapKey(camera, INT_MAX, INT_MAX));
+
+        for (std::map<RemapKey, img_remap_t *>::iterator iter = begin; 
+             iter != end; iter++) {
+            img_remap_free(iter->second);
+        }
+
+        m_maps.erase(begin, end);
+    }
+
+private:
+    static RemapKey Intrinsics(const camera_params_t &camera) {
+        return RemapKey(camera, 0, 0);
+    }
+
+    std::mutex m_mutex;
+    std::map<RemapKey, int> m_uses_left;
+    std::map<RemapKey, img_remap_t *> m_maps;
+};
+
+/* An image moving through the undistortion pipeline */
+typedef struct
+{
+    int index;      /* Index of the image in the file list */
+    img_t *img;     /* Decoded (or undistorted) image */
+} UndistortJob;
+
+/* State shared by the load, undistort and write stages */
+class UndistortPipeline
+{
+public:
+    UndistortPipeline(const char *output_path,
+                      const std::vector<std::string> &files, 
+                      const std::vector<camera_params_t> &cameras,
+                      int num_readers, int num_workers, int num_writers)
+        : m_output_path(output_path), m_files(files), m_cameras(cameras),
+          m_cache(cameras), m_next(0),
+          m_loaded(num_workers, num_readers),
+          m_undistorted(num_writers, num_workers)
+    { 
+        for (int i = 0; i < (int) files.size(); i++) {
+            if (cameras[i].f != 0.0)
+                m_todo.push_back(i);
         }
     }
 
-    // img_write_bmp_file(img_out, (char *) out.c_str());
-    WriteJPEG(img_out, (char *) out.c_str());
+    /* Stage 1: decode images */
+    void Load() {
+        while (true) {
+            int next = m_next.fetch_add(1);
+            if (next >= (int) m_todo.size())
+                break;
+
+            UndistortJob job;
+            job.index = m_todo[next];
+
+            printf("Undistorting image %s\n", m_files[job.index].c_str());
+            fflush(stdout);
+
+            job.img = LoadJPEG(m_files[job.index].c_str());
+            if (job.img != NULL)
+                m_loaded.Push(job);
+            else
+                m_cache.Release(m_cameras[job.index]);
+        }
+
+        m_loaded.ProducerDone();
+    }
+
+    /* Stage 2: resample through the undistortion map */
+    void Undistort() {
+        UndistortJob job;
+        while (m_loaded.Pop(job)) {
+            const camera_params_t &camera = m_cameras[job.index];
+            int w = job.img->w;
+            int h = job.img->h;
+
+            const img_remap_t *map = m_cache.Acquire(camera, w, h);
+            img_t *img_out = img_remap(job.img, map);
+            m_cache.Release(camera);
+
+            img_free(job.img);
+            job.img = img_out;
 
-    img_free(img);
-    img_free(img_out);
+            m_undistorted.Push(job);
+        }
+
+        m_undistorted.ProducerDone();
+    }
+
+    /* Stage 3: encode the results */
+    void Write() {
+        UndistortJob job;
+        while (m_undistorted.Pop(job)) {
+            const std::string &in = m_files[job.index];
+            int last_slash = in.rfind('/');
+            int last_dot = in.rfind('.');
+
+            assert(last_slash < last_dot);
+            std::string basename = 
+                in.substr(last_slash+1, last_dot - last_slash - 1);
+        
+            std::string out = 
+                std::string(m_output_path) + "/" + basename + ".rd.jpg";
+
+            // img_write_bmp_file(job.img, (char *) out.c_str());
+            WriteJPEG(job.img, (char *) out.c_str());
+            img_free(job.img);
+        }
+    }
+
+private:
+    const char *m_output_path;
+    const std::vector<std::string> &m_files;
+    const std::vector<camera_params_t> &m_cameras;
+
+    RemapCache m_cache;
+
+    std::vector<int> m_todo;      /* Images to undistort */
+    std::atomic<int> m_next;      /* Next entry of m_todo to load */
+
+    /* Queue capacities bound the number of images in memory */
+    BoundedQueue<UndistortJob> m_loaded, m_undistorted;
+};
+
+static void RunLoadStage(UndistortPipeline *pipeline) { pipeline->Load(); }
+static void RunUndistortStage(UndistortPipeline *pipeline) 
+{
+    pipeline->Undistort();
 }
+static void RunWriteStage(UndistortPipeline *pipeline) { pipeline->Write(); }
 
+/* Decoding, undistortion and encoding run as separate thread pools
+ * connected by bounded queues, so the stages overlap and throughput
+ * is limited by the slowest stage */
 void UndistortImages(const char *output_path,
                      const std::vector<std::string> &files, 
                      const std::vector<camera_params_t> &cameras)
 {
-    int num_files = (int) files.size();
     assert(files.size() == cameras.size());
 
-    for (int i = 0; i < num_files; i++) {
-        if (cameras[i].f == 0.0)
-            continue;
+    int num_threads = (int) std::thread::hardware_concurrency();
+    if (num_threads < 3)
+        num_threads = 3;
 
-        std::string in = files[i];
-        // std::string out = in;
-        // int len = out.length();
-        
-        // out[len-3] = 'b';
-        // out[len-2] = 'm';
-        // out[len-1] = 'p';
+    /* Encoding at high quality is the most expensive stage */
+    int num_readers = std::max(1, num_threads / 4);
+    int num_writers = std::max(1, num_threads / 3);
+    int num_workers = std::max(1, num_threads - num_readers - num_writers);
 
-        int last_slash = files[i].rfind('/');
-        int last_dot = files[i].rfind('.');
+    UndistortPipeline pipeline(output_path, files, cameras,
+                               num_readers, num_workers, num_writers);
 
-        assert(last_slash < last_dot);
-        std::string basename = 
-            files[i].substr(last_slash+1, last_dot - last_slash - 1);
-        
-        std::string out = 
-            std::string(output_path) + "/" + basename + ".rd.jpg";
+    std::vector<std::thread> threads;
+    for (int i = 0; i < num_readers; i++)
+        threads.push_back(std::thread(RunLoadStage, &pipeline));
+    for (int i = 0; i < num_workers; i++)
+        threads.push_back(std::thread(RunUndistortStage, &pipeline));
+    for (int i = 0; i < num_writers; i++)
+        threads.push_back(std::thread(RunWriteStage, &pipeline));
 
-        UndistortImage(in, cameras[i], out);
-    }
+    for (int i = 0; i < (int) threads.size(); i++)
+        threads[i].join();
 }
 
 void WriteNewFiles(const char *output_path,
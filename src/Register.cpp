@@ -32,6 +32,7 @@
 #include "homography.h"
 #include "horn.h"
 #include "matrix.h"
+#include "ransac.h"
 #include "tps.h"
 #include "vector.h"
 
@@ -45,6 +46,78 @@ static int LeastSquaresFit(const std::vector<Keypoint> &k1,
 			   std::vector<KeypointMatch> matches, MotionModel mm,
 			   const std::vector<int> &inliers, double *M);
 
+/* Matches handed to the RANSAC callbacks */
+class TransformRansacData
+{
+public:
+    TransformRansacData(const std::vector<Keypoint> &k1, 
+                        const std::vector<Keypoint> &k2, 
+                        const std::vector<KeypointMatch> &matches, 
+                        MotionModel mm)
+        : m_k1(k1), m_k2(k2), m_matches(matches), m_mm(mm) { }
+
+    const std::vector<Keypoint> &m_k1, &m_k2;
+    const std::vector<KeypointMatch> &m_matches;
+    MotionModel m_mm;
+};
+
+static int TransformRansacFit(const int *sample, double *M, void *data)
+{
+    TransformRansacData *d = (TransformRansacData *) data;
+    int min_matches = (d->m_mm == MotionRigid) ? 3 : 4;
+
+    v3_t r_pts[4], l_pts[4];
+    double weight[4];
+
+    for (int i = 0; i < min_matches; i++) {
+	int idx1 = d->m_matches[sample[i]].m_idx1;
+	int idx2 = d->m_matches[sample[i]].m_idx2;
+	    
+	Vx(l_pts[i]) = d->m_k1[idx1].m_x;
+	Vy(l_pts[i]) = d->m_k1[idx1].m_y;
+	Vz(l_pts[i]) = 1.0;
+		    
+	Vx(r_pts[i]) = d->m_k2[idx2].m_x;
+	Vy(r_pts[i]) = d->m_k2[idx2].m_y;
+	Vz(r_pts[i]) = 1.0;
+
+	weight[i] = 1.0;
+    }
+
+    switch (d->m_mm) {
+	case MotionRigid: {
+	    double R[9], T[9], Tout[9], scale;
+	    align_horn(min_matches, r_pts, l_pts, R, T, Tout, &scale, weight);
+	    memcpy(M, Tout, 9 * sizeof(double));
+	    break;
+	}
+		
+	case MotionHomography: {
+	    align_homography(min_matches, r_pts, l_pts, M, 0);
+	    break;
+	}
+    }
+
+    return 1;
+}
+
+/* Transfer error of a match, as in CountInliers */
+static double TransformRansacResidual(const double *M, int idx, void *data)
+{
+    TransformRansacData *d = (TransformRansacData *) data;
+    const KeypointMatch &match = d->m_matches[idx];
+
+    double p[3] = { d->m_k1[match.m_idx1].m_x, d->m_k1[match.m_idx1].m_y, 
+                    1.0 };
+    double q[3];
+    matrix_product331((double *) M, p, q);
+
+    double dx = q[0] / q[2] - d->m_k2[match.m_idx2].m_x;
+    double dy = q[1] / q[2] - d->m_k2[match.m_idx2].m_y;
+
+    return sqrt(dx * dx + dy * dy);
+}
+
 /* Estimate a transform between two sets of keypoints */
 std::vector<int> EstimateTransform(const std::vector<Keypoint> &k1, 
 				   const std::vector<Keypoint> &k2, 
@@ -63,10 +136,7 @@ std::vector<int> EstimateTransform(const std::vector<Keypoint> &k1,
 	    break;
     }
 
-    int *match_idxs = new int[min_matches];
-
     int num_matches = (int) matches.size();
-    int max_inliers = 0;
     double Mbest[9];
     
     if (num_matches < min_matches) {
@@ -75,73 +145,17 @@ std::vector<int> EstimateTransform(const std::vector<Keypoint> &k1,
 	return empty;
     }
 
-    v3_t *r_pts = new v3_t[min_matches];
-    v3_t *l_pts = new v3_t[min_matches];
-    double *weight = new double[min_matches];
-
-    for (int round = 0; round < nRANSAC; round++) {
-	for (int i = 0; i < min_matches; i++) {
-	    bool found;
-	    int idx;
-	    
-	    do {
-		found = true;
-		idx = rand() % num_matches;
-		
-		for (int j = 0; j < i; j++) {
-		    if (match_idxs[j] == idx) {
-			found = false;
-			break;
-		    }
-		}
-	    } while (!found);
-
-	    match_idxs[i] = idx;
-	}
-
-	/* Solve for the motion */
-		
-	for (int i = 0; i < min_matches; i++) {
-	    int idx1 = matches[match_idxs[i]].m_idx1;
-	    int idx2 = matches[match_idxs[i]].m_idx2;
-	    
-	    Vx(l_pts[i]) = k1[idx1].m_x;
-	    Vy(l_pts[i]) = k1[idx1].m_y;
-	    Vz(l_pts[i]) = 1.0;
-		    
-	    Vx(r_pts[i]) = k2[idx2].m_x;
-	    Vy(r_pts[i]) = k2[idx2].m_y;
-	    Vz(r_pts[i]) = 1.0;
-
-	    weight[i] = 1.0;
-	}
+    TransformRansacData data(k1, k2, matches, mm);
 
-	double Mcurr[9];
+    ransac_params_t params;
+    ransac_params_init(&params, num_matches, min_matches, 9, 1);
+    params.max_rounds = nRANSAC;
+    params.threshold = RANSACthresh;
+    params.fit = TransformRansacFit;
+    params.residual = TransformRansacResidual;
+    params.data = &data;
 
-	switch (mm) {
-	    case MotionRigid: {
-		double R[9], T[9], Tout[9], scale;
-		align_horn(min_matches, r_pts, l_pts, R, T, Tout, &scale, weight);
-		memcpy(Mcurr, Tout, 9 * sizeof(double));
-		break;
-	    }
-		
-	    case MotionHomography: {
-		align_homography(min_matches, r_pts, l_pts, Mcurr, 0);
-		break;
-	    }
-	}
-		
-
-	std::vector<int> inliers;
-	int num_inliers = CountInliers(k1, k2, matches, Mcurr, 
-				       RANSACthresh, inliers);
-
-	if (num_inliers > max_inliers) {
-	    max_inliers = num_inliers;
-	    memcpy(Mbest, Mcurr, 9 * sizeof(double));
-	}
-    }
+    ransac_estimate(&params, Mbest, NULL);
 
     std::vector<int> inliers;
     CountInliers(k1, k2, matches, Mbest, RANSACthresh, inliers);
@@ -150,11 +164,6 @@ std::vector<int> EstimateTransform(const std::vector<Keypoint> &k1,
 
     // memcpy(Mout, Mbest, 9 * sizeof(double));
 
-    delete [] match_idxs;
-    delete [] r_pts;
-    delete [] l_pts;
-    delete [] weight;
-
     return inliers;
 }
 
@@ -21,8 +21,11 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <algorithm>
+
 #include "BundlerApp.h"
 
+#include "BundleAdd.h"
 #include "Decompose.h"
 #include "Epipolar.h"
 #include "Register.h"
@@ -253,3 +256,111 @@ bool BundlerApp::EstimateRelativePose2(int i1, int i2,
 
     return true;
 }
+
+/* Score a candidate initial pair without modifying any shared state
+ * (so that several candidates can be scored at once).  The relative
+ * pose is estimated from the tracks the two images share, and
+ * num_good is set to the number of matches that triangulate in front
+ * of both cameras with a ray angle above m_ray_angle_threshold.  The
+ * keys of both images must already be loaded */
+bool BundlerApp::EvaluateInitialPair(int i1, int i2, int &num_good,
+                                     double &median_angle)
+{
+    num_good = 0;
+    median_angle = 0.0;
+
+    ImageData &data1 = m_image_data[i1];
+    ImageData &data2 = m_image_data[i2];
+
+    if (!data1.m_has_init_focal || !data2.m_has_init_focal)
+        return false;
+
+    /* Collect the keys of the shared tracks (the visible point lists
+     * are sorted by track) */
+    std::vector<KeypointMatch> matches;
+
+    const std::vector<int> &pts1 = data1.m_visible_points;
+    const std::vector<int> &pts2 = data2.m_visible_points;
+    int n1 = (int) pts1.size(), n2 = (int) pts2.size();
+
+    for (int a = 0, b = 0; a < n1 && b < n2; ) {
+        if (pts1[a] < pts2[b]) {
+            a++;
+        } else if (pts2[b] < pts1[a]) {
+            b++;
+        } else {
+            matches.push_back(KeypointMatch(data1.m_visible_keys[a], 
+                                            data2.m_visible_keys[b]));
+            a++;
+            b++;
+        }
+    }
+
+    int num_matches = (int) matches.size();
+    if (num_matches < 5)
+        return false;
+
+    camera_params_t cameras[2];
+    InitializeCameraParams(data1, cameras[0]);
+    InitializeCameraParams(data2, cameras[1]);
+    cameras[0].f = data1.m_init_focal;
+    cameras[1].f = data2.m_init_focal;
+
+    double K1[9], K2[9];
+    GetIntrinsics(cameras[0], K1);
+    GetIntrinsics(cameras[1], K2);
+
+    std::vector<Keypoint> k1, k2;
+    if (m_optimize_for_fisheye) {
+        k1 = data1.UndistortKeysCopy();
+        k2 = data2.UndistortKeysCopy();
+    }
+
+    const std::vector<Keypoint> &keys1 = 
+        m_optimize_for_fisheye ? k1 : data1.m_keys;
+    const std::vector<Keypoint> &keys2 = 
+        m_optimize_for_fisheye ? k2 : data2.m_keys;
+
+    double R0[9], t0[3];
+    int num_inliers = 
+        EstimatePose5Point(keys1, keys2, matches, 512, 
+                           0.25 * m_fmatrix_threshold, K1, K2, R0, t0);
+
+    if (num_inliers == 0)
+        return false;
+
+    /* Same camera setup as EstimateRelativePose2 */
+    memcpy(cameras[1].R, R0, sizeof(double) * 9);
+    matrix_transpose_product(3, 3, 3, 1, R0, t0, cameras[1].t);
+    matrix_scale(3, 1, cameras[1].t, -1.0, cameras[1].t);
+
+    std::vector<double> angles;
+    for (int i = 0; i < num_matches; i++) {
+        const Keypoint &key1 = keys1[matches[i].m_idx1];
+        const Keypoint &key2 = keys2[matches[i].m_idx2];
+
+        v2_t p = v2_new(key1.m_x, key1.m_y);
+        v2_t q = v2_new(key2.m_x, key2.m_y);
+
+        double error, angle;
+        bool in_front;
+        Triangulate(p, q, cameras[0], cameras[1], 
+                    error, in_front, angle, true);
+
+        if (!in_front || error > m_projection_estimation_threshold)
+            continue;
+
+        angles.push_back(RAD2DEG(angle));
+
+        if (RAD2DEG(angle) >= m_ray_angle_threshold)
+            num_good++;
+    }
+
+    if (!angles.empty()) {
+        int mid = (int) angles.size() / 2;
+        std::nth_element(angles.begin(), angles.begin() + mid, angles.end());
+        median_angle = angles[mid];
+    }
+
+    return true;
+}
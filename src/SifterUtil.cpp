@@ -43,11 +43,14 @@
 
 img_t *RescaleImage(img_t *img, double scale) 
 {
-    img_t *blur = img_smooth(img, 0.35 / scale, 0);
+    /* Stay planar from the blur to the resampling */
+    pimg_t *src = img2pimg(img, 3, 0);
+    pimg_t *blur = pimg_smooth(src, 0.35 / scale, 0);
     trans2D_t *T = new_scaling_transform(scale, scale);
-    img_t *scaled = img_resample_bbox(blur, T);
+    img_t *scaled = pimg_resample_bbox(blur, T);
 
-    img_free(blur);
+    pimg_free(src);
+    pimg_free(blur);
     transform_free(T);
 
     return scaled;
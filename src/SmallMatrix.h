@@ -0,0 +1,93 @@
+/*
+ *  Copyright (c) 2008-2010  Noah Snavely (snavely (at) cs.cornell.edu)
+ *    and the University of Washington
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+/* SmallMatrix.h */
+/* Fixed-size matrix routines for the 3x3 / 3x4 math on the geometry
+ * paths.  Dimensions are template parameters, so every loop has a
+ * constant trip count and is fully unrolled by the compiler, with
+ * none of the call and dispatch overhead of matrix_product.  Matrices
+ * are row-major double arrays, as in matrix.h, and outputs must not
+ * alias inputs. */
+
+#ifndef __small_matrix_h__
+#define __small_matrix_h__
+
+/* R = A * B, where A is M x N and B is N x P */
+template <int M, int N, int P>
+inline void SmallMatrixProduct(const double *A, const double *B, double *R)
+{
+    for (int i = 0; i < M; i++) {
+        for (int j = 0; j < P; j++) {
+            double sum = 0.0;
+            for (int k = 0; k < N; k++)
+                sum += A[i * N + k] * B[k * P + j];
+            R[i * P + j] = sum;
+        }
+    }
+}
+
+/* R = A^T * B, where A is M x N and B is M x P */
+template <int M, int N, int P>
+inline void SmallMatrixTransposeProduct(const double *A, const double *B,
+                                        double *R)
+{
+    for (int i = 0; i < N; i++) {
+        for (int j = 0; j < P; j++) {
+            double sum = 0.0;
+            for (int k = 0; k < M; k++)
+                sum += A[k * N + i] * B[k * P + j];
+            R[i * P + j] = sum;
+        }
+    }
+}
+
+/* R = s * A, where A is M x N (R may alias A) */
+template <int M, int N>
+inline void SmallMatrixScale(const double *A, double s, double *R)
+{
+    for (int i = 0; i < M * N; i++)
+        R[i] = s * A[i];
+}
+
+/* Invert a 3x3 matrix through its adjugate.  Returns false (and
+ * leaves Ainv untouched) if A is singular */
+inline bool SmallMatrixInvert3(const double *A, double *Ainv)
+{
+    double c0 = A[4] * A[8] - A[5] * A[7];
+    double c1 = A[5] * A[6] - A[3] * A[8];
+    double c2 = A[3] * A[7] - A[4] * A[6];
+
+    double det = A[0] * c0 + A[1] * c1 + A[2] * c2;
+
+    if (det == 0.0)
+        return false;
+
+    double inv = 1.0 / det;
+
+    Ainv[0] = c0 * inv;
+    Ainv[1] = (A[2] * A[7] - A[1] * A[8]) * inv;
+    Ainv[2] = (A[1] * A[5] - A[2] * A[4]) * inv;
+    Ainv[3] = c1 * inv;
+    Ainv[4] = (A[0] * A[8] - A[2] * A[6]) * inv;
+    Ainv[5] = (A[2] * A[3] - A[0] * A[5]) * inv;
+    Ainv[6] = c2 * inv;
+    Ainv[7] = (A[1] * A[6] - A[0] * A[7]) * inv;
+    Ainv[8] = (A[0] * A[4] - A[1] * A[3]) * inv;
+
+    return true;
+}
+
+#endif /* __small_matrix_h__ */
@@ -0,0 +1,198 @@
+/* SmallMatrixBench.cpp */
+/* Time the fixed-size kernels of SmallMatrix.h against the matrix
+ * library routines they replace on the geometry paths */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "defines.h"
+#include "matrix.h"
+
+#include "Profiler.h"
+#include "SmallMatrix.h"
+
+/* Inputs are drawn from a small pool, so that the compiler can't
+ * hoist the work out of the timing loops */
+#define NUM_INPUTS 64
+
+/* Every result is folded into this, so that none of the work is
+ * dropped */
+static volatile double bench_sink;
+
+static inline void Consume(int n, const double *R)
+{
+    double sum = 0.0;
+    for (int i = 0; i < n; i++)
+        sum += R[i];
+
+    bench_sink = sum;
+}
+
+static double RandomValue()
+{
+    return 2.0 * rand() / RAND_MAX - 1.0;
+}
+
+static void RandomMatrix(int n, double *A)
+{
+    for (int i = 0; i < n; i++)
+        A[i] = RandomValue();
+}
+
+/* Largest absolute difference between two n-vectors */
+static double MaxDiff(int n, const double *a, const double *b)
+{
+    double diff = 0.0;
+    for (int i = 0; i < n; i++)
+        diff = MAX(diff, fabs(a[i] - b[i]));
+
+    return diff;
+}
+
+static void Report(const char *name, double t_old, double t_new,
+                   int num_iters, double diff)
+{
+    printf("%-12s  matrix lib %8.1f ns  SmallMatrix %6.1f ns  "
+           "speedup %6.1fx  max diff %0.1e\n",
+           name, 1.0e9 * t_old / num_iters, 1.0e9 * t_new / num_iters,
+           t_old / t_new, diff);
+}
+
+/* Time R = A * B for an M x N matrix A and an N x P matrix B */
+template <int M, int N, int P>
+static void BenchProduct(const char *name, int num_iters)
+{
+    double A[NUM_INPUTS][M * N], B[NUM_INPUTS][N * P];
+    double R_old[M * P], R_new[M * P];
+    double diff = 0.0;
+
+    for (int i = 0; i < NUM_INPUTS; i++) {
+        RandomMatrix(M * N, A[i]);
+        RandomMatrix(N * P, B[i]);
+    }
+
+    double start = GetWallTime();
+    for (int i = 0; i < num_iters; i++) {
+        int j = i % NUM_INPUTS;
+        matrix_product(M, N, N, P, A[j], B[j], R_old);
+        Consume(M * P, R_old);
+    }
+    double t_old = GetWallTime() - start;
+
+    start = GetWallTime();
+    for (int i = 0; i < num_iters; i++) {
+        int j = i % NUM_INPUTS;
+        SmallMatrixProduct<M, N, P>(A[j], B[j], R_new);
+        Consume(M * P, R_new);
+    }
+    double t_new = GetWallTime() - start;
+
+    for (int i = 0; i < NUM_INPUTS; i++) {
+        matrix_product(M, N, N, P, A[i], B[i], R_old);
+        SmallMatrixProduct<M, N, P>(A[i], B[i], R_new);
+        diff = MAX(diff, MaxDiff(M * P, R_old, R_new));
+    }
+
+    Report(name, t_old, t_new, num_iters, diff);
+}
+
+/* Time R = A^T * B for M x N matrices A and M x P matrices B */
+template <int M, int N, int P>
+static void BenchTransposeProduct(const char *name, int num_iters)
+{
+    double A[NUM_INPUTS][M * N], B[NUM_INPUTS][M * P];
+    double R_old[N * P], R_new[N * P];
+    double diff = 0.0;
+
+    for (int i = 0; i < NUM_INPUTS; i++) {
+        RandomMatrix(M * N, A[i]);
+        RandomMatrix(M * P, B[i]);
+    }
+
+    double start = GetWallTime();
+    for (int i = 0; i < num_iters; i++) {
+        int j = i % NUM_INPUTS;
+        matrix_transpose_product(M, N, M, P, A[j], B[j], R_old);
+        Consume(N * P, R_old);
+    }
+    double t_old = GetWallTime() - start;
+
+    start = GetWallTime();
+    for (int i = 0; i < num_iters; i++) {
+        int j = i % NUM_INPUTS;
+        SmallMatrixTransposeProduct<M, N, P>(A[j], B[j], R_new);
+        Consume(N * P, R_new);
+    }
+    double t_new = GetWallTime() - start;
+
+    for (int i = 0; i < NUM_INPUTS; i++) {
+        matrix_transpose_product(M, N, M, P, A[i], B[i], R_old);
+        SmallMatrixTransposeProduct<M, N, P>(A[i], B[i], R_new);
+        diff = MAX(diff, MaxDiff(N * P, R_old, R_new));
+    }
+
+    Report(name, t_old, t_new, num_iters, diff);
+}
+
+/* Time the inverse of a 3x3 matrix */
+static void BenchInvert3(const char *name, int num_iters)
+{
+    double A[NUM_INPUTS][9];
+    double R_old[9], R_new[9];
+    double diff = 0.0;
+
+    for (int i = 0; i < NUM_INPUTS; i++) {
+        /* Keep the matrices well away from singular */
+        RandomMatrix(9, A[i]);
+        A[i][0] += 4.0;  A[i][4] += 4.0;  A[i][8] += 4.0;
+    }
+
+    double start = GetWallTime();
+    for (int i = 0; i < num_iters; i++) {
+        int j = i % NUM_INPUTS;
+        matrix_invert(3, A[j], R_old);
+        Consume(9, R_old);
+    }
+    double t_old = GetWallTime() - start;
+
+    start = GetWallTime();
+    for (int i = 0; i < num_iters; i++) {
+        int j = i % NUM_INPUTS;
+        SmallMatrixInvert3(A[j], R_new);
+        Consume(9, R_new);
+    }
+    double t_new = GetWallTime() - start;
+
+    for (int i = 0; i < NUM_INPUTS; i++) {
+        matrix_invert(3, A[i], R_old);
+        SmallMatrixInvert3(A[i], R_new);
+        diff = MAX(diff, MaxDiff(9, R_old, R_new));
+    }
+
+    Report(name, t_old, t_new, num_iters, diff);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 2) {
+        printf("Usage: %s [num_iterations]\n", argv[0]);
+        return 1;
+    }
+
+    int num_iters = 1000000;
+    if (argc == 2)
+        num_iters = MAX(NUM_INPUTS, atoi(argv[1]));
+
+    srand(0);
+
+    printf("[SmallMatrixBench] %d iterations per kernel\n", num_iters);
+
+    BenchProduct<3, 3, 1>("3x3 * 3x1", num_iters);
+    BenchProduct<3, 3, 3>("3x3 * 3x3", num_iters);
+    BenchProduct<3, 4, 1>("3x4 * 4x1", num_iters);
+    BenchTransposeProduct<3, 3, 3>("3x3^T * 3x3", num_iters);
+    BenchInvert3("3x3 inverse", num_iters / 10);
+
+    return 0;
+}
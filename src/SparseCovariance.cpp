@@ -0,0 +1,381 @@
+/*
+ *  Copyright (c) 2008-2010  Noah Snavely (snavely (at) cs.cornell.edu)
+ *    and the University of Washington
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+/* SparseCovariance.cpp */
+/* Marginal covariances from a block-sparse factorization of the
+ * reduced camera system */
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <set>
+#include <vector>
+
+#include "SparseCovariance.h"
+
+/* Column k of the block factor (in elimination order).  m_rows holds
+ * the rows below the diagonal that are structurally non-zero, sorted,
+ * and m_L / m_Z hold one block per row for the factor and for the
+ * inverse */
+class BlockColumn {
+public:
+    std::vector<int> m_rows;
+    std::vector<double> m_L;
+    std::vector<double> m_Z;
+    std::vector<double> m_Ldiag;
+    std::vector<double> m_Zdiag;
+};
+
+/* Find the block for row i in column c (the row must be present) */
+static double *FindBlock(BlockColumn &c, std::vector<double> &blocks,
+                         int i, int bsq)
+{
+    std::vector<int>::iterator p =
+        std::lower_bound(c.m_rows.begin(), c.m_rows.end(), i);
+    return &blocks[(p - c.m_rows.begin()) * bsq];
+}
+
+/* Copy block (i, j) of S, given by its blocks on and above the
+ * diagonal as for ComputeSparseInverseDiagonal, to B (zero if the
+ * block is not stored) */
+static void GetBlock(const int *rowptr, const int *colidx,
+                     const double *blocks, int bs, int i, int j, double *B)
+{
+    int bsq = bs * bs;
+    int r = (i <= j) ? i : j, c = (i <= j) ? j : i;
+
+    const int *p = std::lower_bound(colidx + rowptr[r],
+                                    colidx + rowptr[r + 1], c);
+    if (p == colidx + rowptr[r + 1] || *p != c) {
+        memset(B, 0, sizeof(double) * bsq);
+        return;
+    }
+
+    const double *S = blocks + (p - colidx) * bsq;
+    if (i <= j) {
+        memcpy(B, S, sizeof(double) * bsq);
+    } else {
+        for (int a = 0; a < bs; a++) {
+            for (int b = 0; b < bs; b++)
+                B[a * bs + b] = S[b * bs + a];
+        }
+    }
+}
+
+/* In-place Cholesky factorization A = L L^T of a block (the upper
+ * triangle is zeroed).  Returns false if A is not positive definite */
+static bool BlockCholesky(int bs, double *A)
+{
+    for (int j = 0; j < bs; j++) {
+        double d = A[j * bs + j];
+        for (int k = 0; k < j; k++)
+            d -= A[j * bs + k] * A[j * bs + k];
+
+        if (!(d > 0.0))
+            return false;
+
+        d = sqrt(d);
+        A[j * bs + j] = d;
+
+        for (int i = j + 1; i < bs; i++) {
+            double s = A[i * bs + j];
+            for (int k = 0; k < j; k++)
+                s -= A[i * bs + k] * A[j * bs + k];
+            A[i * bs + j] = s / d;
+        }
+
+        for (int i = 0; i < j; i++)
+            A[i * bs + j] = 0.0;
+    }
+
+    return true;
+}
+
+/* X = X L^-T for lower triangular L (solving Y L^T = X row by row) */
+static void BlockSolveLT(int bs, const double *L, double *X)
+{
+    for (int r = 0; r < bs; r++) {
+        double *x = X + r * bs;
+        for (int j = 0; j < bs; j++) {
+            double s = x[j];
+            for (int k = 0; k < j; k++)
+                s -= x[k] * L[j * bs + k];
+            x[j] = s / L[j * bs + j];
+        }
+    }
+}
+
+/* X = X L^-1 for lower triangular L */
+static void BlockSolveL(int bs, const double *L, double *X)
+{
+    for (int r = 0; r < bs; r++) {
+        double *x = X + r * bs;
+        for (int j = bs - 1; j >= 0; j--) {
+            double s = x[j];
+            for (int k = j + 1; k < bs; k++)
+                s -= x[k] * L[k * bs + j];
+            x[j] = s / L[j * bs + j];
+        }
+    }
+}
+
+/* C -= A * B^T, or C -= A^T * B^T when A is given transposed */
+static void BlockSubtractProductT(int bs, const double *A, bool transpose_A,
+                                  const double *B, double *C)
+{
+    for (int i = 0; i < bs; i++) {
+        for (int j = 0; j < bs; j++) {
+            double s = 0.0;
+            for (int k = 0; k < bs; k++) {
+                double a = transpose_A ? A[k * bs + i] : A[i * bs + k];
+                s += a * B[j * bs + k];
+            }
+            C[i * bs + j] -= s;
+        }
+    }
+}
+
+/* C -= A * B, or C -= A^T * B when A is given transposed */
+static void BlockSubtractProduct(int bs, const double *A, bool transpose_A,
+                                 const double *B, double *C)
+{
+    for (int i = 0; i < bs; i++) {
+        for (int j = 0; j < bs; j++) {
+            double s = 0.0;
+            for (int k = 0; k < bs; k++) {
+                double a = transpose_A ? A[k * bs + i] : A[i * bs + k];
+                s += a * B[k * bs + j];
+            }
+            C[i * bs + j] -= s;
+        }
+    }
+}
+
+/* Greedy minimum degree ordering of the block graph.  The neighbors
+ * of each node at the time it is eliminated are exactly the rows of
+ * its column in the factor, so this also gives the fill pattern */
+static void MinimumDegreeOrder(std::vector<std::set<int> > &adj,
+                               std::vector<int> &order,
+                               std::vector<std::vector<int> > &structure)
+{
+    int n = (int) adj.size();
+
+    std::set<std::pair<int, int> > queue;
+    for (int i = 0; i < n; i++)
+        queue.insert(std::make_pair((int) adj[i].size(), i));
+
+    order.clear();
+    structure.resize(n);
+
+    while (!queue.empty()) {
+        int v = queue.begin()->second;
+        queue.erase(queue.begin());
+
+        order.push_back(v);
+        structure[v].assign(adj[v].begin(), adj[v].end());
+
+        /* Eliminating v makes its neighbors a clique */
+        const std::vector<int> &nbrs = structure[v];
+        int num_nbrs = (int) nbrs.size();
+
+        for (int a = 0; a < num_nbrs; a++) {
+            int u = nbrs[a];
+            queue.erase(std::make_pair((int) adj[u].size(), u));
+
+            adj[u].erase(v);
+            for (int b = 0; b < num_nbrs; b++) {
+                if (b != a)
+                    adj[u].insert(nbrs[b]);
+            }
+
+            queue.insert(std::make_pair((int) adj[u].size(), u));
+        }
+
+        adj[v].clear();
+    }
+}
+
+bool ComputeSparseInverseDiagonal(int num_blocks, int block_size,
+                                  const int *rowptr, const int *colidx,
+                                  const double *blocks, double *Sinv_diag)
+{
+    int n = num_blocks;
+    int bs = block_size;
+    int bsq = bs * bs;
+
+    /* The off-diagonal blocks give the block graph */
+    std::vector<std::set<int> > adj(n);
+
+    for (int i = 0; i < n; i++) {
+        for (int l = rowptr[i]; l < rowptr[i + 1]; l++) {
+            int j = colidx[l];
+            if (j != i) {
+                adj[i].insert(j);
+                adj[j].insert(i);
+            }
+        }
+    }
+
+    /* Order the blocks and find the structure of the factor */
+    std::vector<int> order;
+    std::vector<std::vector<int> > structure;
+    MinimumDegreeOrder(adj, order, structure);
+
+    std::vector<int> order_inv(n);
+    for (int k = 0; k < n; k++)
+        order_inv[order[k]] = k;
+
+    std::vector<BlockColumn> cols(n);
+    long long num_fill = 0;
+
+    for (int k = 0; k < n; k++) {
+        BlockColumn &c = cols[k];
+        int v = order[k];
+        int num_rows = (int) structure[v].size();
+
+        c.m_rows.resize(num_rows);
+        for (int a = 0; a < num_rows; a++)
+            c.m_rows[a] = order_inv[structure[v][a]];
+
+        std::sort(c.m_rows.begin(), c.m_rows.end());
+
+        /* Copy in the blocks of S (fill-in starts at zero) */
+        c.m_Ldiag.resize(bsq);
+        GetBlock(rowptr, colidx, blocks, bs, v, v, &c.m_Ldiag[0]);
+
+        c.m_L.resize(num_rows * bsq);
+        for (int a = 0; a < num_rows; a++) {
+            int u = order[c.m_rows[a]];
+            GetBlock(rowptr, colidx, blocks, bs, u, v, &c.m_L[a * bsq]);
+        }
+
+        num_fill += num_rows;
+    }
+
+    printf("[ComputeSparseInverseDiagonal] %d blocks, %lld off-diagonal "
+           "blocks in the factor\n", n, num_fill);
+
+    /* Right-looking block Cholesky factorization */
+    for (int k = 0; k < n; k++) {
+        BlockColumn &c = cols[k];
+
+        if (!BlockCholesky(bs, &c.m_Ldiag[0])) {
+            printf("[ComputeSparseInverseDiagonal] Error: matrix is not "
+                   "positive definite\n");
+            return false;
+        }
+
+        int num_rows = (int) c.m_rows.size();
+
+        for (int a = 0; a < num_rows; a++)
+            BlockSolveLT(bs, &c.m_Ldiag[0], &c.m_L[a * bsq]);
+
+        /* Update the trailing blocks touched by this column */
+        for (int a = 0; a < num_rows; a++) {
+            int l = c.m_rows[a];
+            const double *L_lk = &c.m_L[a * bsq];
+
+            BlockSubtractProductT(bs, L_lk, false, L_lk, &cols[l].m_Ldiag[0]);
+
+            for (int b = a + 1; b < num_rows; b++) {
+                int i = c.m_rows[b];
+                const double *L_ik = &c.m_L[b * bsq];
+
+                double *A_il = FindBlock(cols[l], cols[l].m_L, i, bsq);
+                BlockSubtractProductT(bs, L_ik, false, L_lk, A_il);
+            }
+        }
+    }
+
+    /* Selected inversion, from the last column to the first.  With
+     * Lhat_jk = L_jk L_kk^-1 and D_k = L_kk L_kk^T:
+     *   Z_ik = -sum_j Z_ij Lhat_jk
+     *   Z_kk = D_k^-1 - sum_j Z_jk^T Lhat_jk
+     * where j runs over the rows of column k.  Those rows form a
+     * clique in the factor, so every Z_ij needed is already known */
+    std::vector<double> Lhat;
+    std::vector<double> ident(bsq, 0.0);
+    for (int r = 0; r < bs; r++)
+        ident[r * bs + r] = 1.0;
+
+    for (int k = n - 1; k >= 0; k--) {
+        BlockColumn &c = cols[k];
+        int num_rows = (int) c.m_rows.size();
+
+        Lhat.resize(num_rows * bsq);
+        for (int a = 0; a < num_rows; a++) {
+            memcpy(&Lhat[a * bsq], &c.m_L[a * bsq], sizeof(double) * bsq);
+            BlockSolveL(bs, &c.m_Ldiag[0], &Lhat[a * bsq]);
+        }
+
+        c.m_Z.assign(num_rows * bsq, 0.0);
+        for (int a = 0; a < num_rows; a++) {
+            int i = c.m_rows[a];
+            double *Z_ik = &c.m_Z[a * bsq];
+
+            for (int b = 0; b < num_rows; b++) {
+                int j = c.m_rows[b];
+                const double *Lhat_jk = &Lhat[b * bsq];
+
+                if (i == j) {
+                    BlockSubtractProduct(bs, &cols[i].m_Zdiag[0], false,
+                                         Lhat_jk, Z_ik);
+                } else if (i > j) {
+                    double *Z_ij = FindBlock(cols[j], cols[j].m_Z, i, bsq);
+                    BlockSubtractProduct(bs, Z_ij, false, Lhat_jk, Z_ik);
+                } else {
+                    double *Z_ji = FindBlock(cols[i], cols[i].m_Z, j, bsq);
+                    BlockSubtractProduct(bs, Z_ji, true, Lhat_jk, Z_ik);
+                }
+            }
+        }
+
+        /* D_k^-1 = L_kk^-T L_kk^-1 */
+        std::vector<double> Linv(ident);
+        BlockSolveL(bs, &c.m_Ldiag[0], &Linv[0]);
+
+        c.m_Zdiag.assign(bsq, 0.0);
+        BlockSubtractProduct(bs, &Linv[0], true, &Linv[0], &c.m_Zdiag[0]);
+        for (int r = 0; r < bsq; r++)
+            c.m_Zdiag[r] = -c.m_Zdiag[r];
+
+        for (int a = 0; a < num_rows; a++) {
+            BlockSubtractProduct(bs, &c.m_Z[a * bsq], true, &Lhat[a * bsq],
+                                 &c.m_Zdiag[0]);
+        }
+
+        /* Symmetrize against round-off */
+        for (int r = 0; r < bs; r++) {
+            for (int s = r + 1; s < bs; s++) {
+                double avg = 0.5 * (c.m_Zdiag[r * bs + s] +
+                                    c.m_Zdiag[s * bs + r]);
+                c.m_Zdiag[r * bs + s] = c.m_Zdiag[s * bs + r] = avg;
+            }
+        }
+
+        /* The factor blocks of this column are no longer needed */
+        std::vector<double>().swap(c.m_L);
+    }
+
+    for (int k = 0; k < n; k++) {
+        memcpy(Sinv_diag + order[k] * bsq, &cols[k].m_Zdiag[0],
+               sizeof(double) * bsq);
+    }
+
+    return true;
+}
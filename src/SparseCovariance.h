@@ -0,0 +1,40 @@
+/*
+ *  Copyright (c) 2008-2010  Noah Snavely (snavely (at) cs.cornell.edu)
+ *    and the University of Washington
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+/* SparseCovariance.h */
+/* Marginal covariances from a block-sparse factorization of the
+ * reduced camera system */
+
+#ifndef __sparse_covariance_h__
+#define __sparse_covariance_h__
+
+/* Compute the diagonal blocks of the inverse of the symmetric
+ * positive definite matrix S, which has num_blocks x num_blocks
+ * blocks of size block_size.  S is given by its non-zero blocks on
+ * and above the diagonal, in compressed row form: row i holds the
+ * blocks S_ij, j >= i, with j in colidx[rowptr[i]...rowptr[i+1]-1]
+ * (sorted, the diagonal included) and block l stored row-major at
+ * blocks + l * block_size^2, as sba returns them.  S is factored with
+ * a block Cholesky decomposition under a minimum degree ordering, and
+ * the inverse is recovered on the sparsity pattern of the factor with
+ * the Takahashi recurrences, so the full inverse is never formed.
+ * Sinv_diag receives num_blocks blocks of block_size x block_size.
+ * Returns false if S is not positive definite */
+bool ComputeSparseInverseDiagonal(int num_blocks, int block_size,
+                                  const int *rowptr, const int *colidx,
+                                  const double *blocks, double *Sinv_diag);
+
+#endif /* __sparse_covariance_h__ */
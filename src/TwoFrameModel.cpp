@@ -25,6 +25,14 @@
 */
 /*============================ TwoFrameModel ===========================*/
 #include <float.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef WIN32
+#include <unistd.h>
+#else
+#include <io.h>
+#endif
 
 #include "TwoFrameModel.h"
 #include "ImageData.h"
@@ -117,6 +125,7 @@ TwoFrameModel::TwoFrameModel()
 
 m_num_points = 0;           // No points.
 
+m_points = NULL;            // No 3D points.
 m_tracks = NULL;            // No frame tracks.
 m_keys1 = m_keys2 = NULL;   // No key points.
 
@@ -128,6 +137,24 @@ m_shortest_computed0 = m_shortest_computed1 = false;
 
 }
 
+/*=============================== Clear ==============================*/
+/*
+   Free the points, tracks, and keys.  Copies of a model share these
+   arrays, so only the last owner should clear them.
+*/
+void TwoFrameModel::Clear()
+{
+delete [] m_points;
+delete [] m_tracks;
+delete [] m_keys1;
+delete [] m_keys2;
+
+m_num_points = 0;
+m_points = NULL;
+m_tracks = NULL;
+m_keys1 = m_keys2 = NULL;
+}
+
 /*=============================== Read ===============================*/
 /*
    Read the two frame model from a file.
@@ -549,11 +576,445 @@ ModelTable::iterator ModelMap::End(unsigned int i)
  }
 
 
+//}-----
+/*======================================================================*/
+/*========================= TwoFrameModelStore =========================*/
+/*======================================================================*/
+//-----{
+
+/* Magic string at the start of a model store */
+#define MODEL_STORE_MAGIC "TFMODEL1"
+#define MODEL_STORE_MAGIC_LEN 8
+
+/* Record flags */
+#define MODEL_RECORD_VALID  0x1     /* Reconstruction succeeded */
+#define MODEL_RECORD_TRACKS 0x2     /* Points are indexed by track */
+#define MODEL_RECORD_KEYS   0x4     /* Points are indexed by key pairs */
+
+/* Doubles per camera: R, t, f, k */
+#define MODEL_CAMERA_DOUBLES 15
+
+/* Doubles before the points: angle, error, C0, C1, and the cameras */
+#define MODEL_FIXED_DOUBLES (2 + 9 + 9 + 2 * MODEL_CAMERA_DOUBLES)
+
+typedef struct {
+    int i1, i2;                 /* Image pair */
+    int flags;                  /* MODEL_RECORD_* */
+    int num_points;
+    int payload_size;           /* Bytes following the header */
+    int reserved;
+} model_record_t;
+
+static size_t GetPayloadSize(int flags, int num_points)
+{
+if (!(flags & MODEL_RECORD_VALID))
+  return 0;
+
+size_t size = sizeof(double) * (MODEL_FIXED_DOUBLES + 3 * num_points);
+
+if (flags & MODEL_RECORD_TRACKS)
+  size += sizeof(int) * num_points;
+if (flags & MODEL_RECORD_KEYS)
+  size += 2 * sizeof(int) * num_points;
+
+return size;
+}
+
+static double *PackCamera(const camera_params_t &camera, double *out)
+{
+memcpy(out + 0, camera.R, 9 * sizeof(double));
+memcpy(out + 9, camera.t, 3 * sizeof(double));
+out[12] = camera.f;
+out[13] = camera.k[0];
+out[14] = camera.k[1];
+
+return out + MODEL_CAMERA_DOUBLES;
+}
+
+static const double *UnpackCamera(const double *in, camera_params_t &camera)
+{
+memset(&camera, 0, sizeof(camera_params_t));
+memcpy(camera.R, in + 0, 9 * sizeof(double));
+memcpy(camera.t, in + 9, 3 * sizeof(double));
+camera.f = in[12];
+camera.k[0] = in[13];
+camera.k[1] = in[14];
+
+return in + MODEL_CAMERA_DOUBLES;
+}
+
+TwoFrameModelStore::TwoFrameModelStore() 
+ {
+  m_filename = NULL;
+  m_file = NULL;
+  m_size = 0;
+ }
+
+TwoFrameModelStore::~TwoFrameModelStore() 
+ {
+  Close();
+ }
+
+/*=============================== Open ===============================*/
+/*
+   Open (or create) the store and index the records it holds.  If the
+   last record is incomplete, the file is cut back to the end of the
+   last complete one before anything new is appended.
+*/
+bool TwoFrameModelStore::Open(const char *filename)
+{
+Close();
+
+FILE *f = fopen(filename, "ab");
+if (f == NULL) 
+ {
+  printf("[TwoFrameModelStore::Open] Error opening file %s for writing\n",
+         filename);
+  return false;
+ }
+fclose(f);
+
+m_filename = strdup(filename);
+
+if (!m_map.Open(filename)) 
+ {
+  printf("[TwoFrameModelStore::Open] Error opening file %s for reading\n",
+         filename);
+  Close();
+  return false;
+ }
+
+bool rewrite = false;
+
+if (m_map.m_size > 0 && 
+    (m_map.m_size < MODEL_STORE_MAGIC_LEN ||
+     memcmp(m_map.m_data, MODEL_STORE_MAGIC, MODEL_STORE_MAGIC_LEN) != 0)) 
+ {
+  if (m_map.m_size >= MODEL_STORE_MAGIC_LEN) 
+   {
+    printf("[TwoFrameModelStore::Open] Error: %s is not a model store\n",
+           filename);
+    Close();
+    return false;
+   }
+
+  /* Only part of the magic string made it to disk */
+  rewrite = true;
+ }
+
+size_t offset = MODEL_STORE_MAGIC_LEN;
+int num_failed = 0;
+
+if (!rewrite) 
+ {
+  while (offset + sizeof(model_record_t) <= m_map.m_size) 
+   {
+    model_record_t header;
+    memcpy(&header, m_map.m_data + offset, sizeof(model_record_t));
+
+    if (header.i1 < 0 || header.i2 <= header.i1 || header.num_points < 0 ||
+        (size_t) header.payload_size != 
+        GetPayloadSize(header.flags, header.num_points))
+      break;
+
+    size_t end = offset + sizeof(model_record_t) + header.payload_size;
+    if (end > m_map.m_size)
+      break;
+
+    /* A later record for the same pair replaces an earlier one */
+    m_records[GetMatchIndex(header.i1, header.i2)] = offset;
+
+    if (!(header.flags & MODEL_RECORD_VALID))
+      num_failed++;
+
+    offset = end;
+   }
+ }
+
+if (rewrite || m_map.m_size == 0) 
+ {
+  m_size = 0;
+ } 
+else 
+ {
+  m_size = offset;
+ }
+
+if (m_size != m_map.m_size) 
+ {
+  if (m_size > 0)
+    printf("[TwoFrameModelStore::Open] Dropping %lu trailing bytes of %s\n",
+           (unsigned long) (m_map.m_size - m_size), filename);
+
+  m_map.Close();
+
+  int result;
+#ifndef WIN32
+  result = truncate(filename, (off_t) m_size);
+#else
+  f = fopen(filename, "r+b");
+  result = (f == NULL) ? -1 : _chsize(_fileno(f), (long) m_size);
+  if (f != NULL)
+    fclose(f);
+#endif
+
+  if (result != 0 || !m_map.Open(filename)) 
+   {
+    printf("[TwoFrameModelStore::Open] Error truncating file %s\n", 
+           filename);
+    Close();
+    return false;
+   }
+ }
+
+m_file = fopen(filename, "ab");
+if (m_file == NULL) 
+ {
+  printf("[TwoFrameModelStore::Open] Error opening file %s for writing\n",
+         filename);
+  Close();
+  return false;
+ }
+
+if (m_size == 0) 
+ {
+  fwrite(MODEL_STORE_MAGIC, 1, MODEL_STORE_MAGIC_LEN, m_file);
+  fflush(m_file);
+  m_size = MODEL_STORE_MAGIC_LEN;
+ }
+
+printf("[TwoFrameModelStore::Open] %s holds %d pairs (%d failed)\n",
+       filename, (int) m_records.size(), num_failed);
+
+return true;
+}
+
+void TwoFrameModelStore::Close()
+{
+if (m_file != NULL)
+  fclose(m_file);
+
+m_map.Close();
+
+if (m_filename != NULL)
+  free(m_filename);
+
+m_file = NULL;
+m_filename = NULL;
+m_size = 0;
+m_records.clear();
+}
+
+/*============================== Remap ===============================*/
+/*
+   Map the file again, to pick up records appended since it was last
+   mapped.
+*/
+bool TwoFrameModelStore::Remap()
+{
+if (m_file != NULL)
+  fflush(m_file);
+
+m_map.Close();
+if (!m_map.Open(m_filename) || m_map.m_size < m_size) 
+ {
+  printf("[TwoFrameModelStore::Remap] Error mapping file %s\n", m_filename);
+  return false;
+ }
+
+return true;
+}
+
+bool TwoFrameModelStore::Contains(MatchIndex idx) const
+{
+return m_records.find(idx) != m_records.end();
+}
+
+/*=============================== Read ===============================*/
+/*
+   Read the model for a pair.  Returns false if the pair isn't in the
+   store, or if its reconstruction failed.
+*/
+bool TwoFrameModelStore::Read(MatchIndex idx, TwoFrameModel &model)
+{
+std::map<MatchIndex, size_t>::const_iterator iter = m_records.find(idx);
+if (iter == m_records.end())
+  return false;
+
+size_t offset = iter->second;
+model_record_t header;
+
+if (offset + sizeof(model_record_t) > m_map.m_size && !Remap())
+  return false;
+
+memcpy(&header, m_map.m_data + offset, sizeof(model_record_t));
+if (!(header.flags & MODEL_RECORD_VALID))
+  return false;
+
+if (offset + sizeof(model_record_t) + header.payload_size > m_map.m_size &&
+    !Remap())
+  return false;
+
+int n = header.num_points;
+const char *payload = m_map.m_data + offset + sizeof(model_record_t);
+
+double fixed[MODEL_FIXED_DOUBLES];
+memcpy(fixed, payload, sizeof(fixed));
+payload += sizeof(fixed);
+
+model.Clear();
+
+model.m_angle = fixed[0];
+model.m_error = fixed[1];
+memcpy(model.m_C0, fixed + 2, 9 * sizeof(double));
+memcpy(model.m_C1, fixed + 11, 9 * sizeof(double));
+
+const double *cam = fixed + 20;
+cam = UnpackCamera(cam, model.m_camera0);
+UnpackCamera(cam, model.m_camera1);
+
+model.m_num_points = n;
+model.m_points = new v3_t[n];
+memcpy(model.m_points, payload, 3 * sizeof(double) * n);
+payload += 3 * sizeof(double) * n;
+
+if (header.flags & MODEL_RECORD_TRACKS) 
+ {
+  model.m_tracks = new int[n];
+  memcpy(model.m_tracks, payload, sizeof(int) * n);
+  payload += sizeof(int) * n;
+ }
+
+if (header.flags & MODEL_RECORD_KEYS) 
+ {
+  model.m_keys1 = new int[n];
+  model.m_keys2 = new int[n];
+  memcpy(model.m_keys1, payload, sizeof(int) * n);
+  memcpy(model.m_keys2, payload + sizeof(int) * n, sizeof(int) * n);
+ }
+
+return true;
+}
+
+/*============================== Append ==============================*/
+/*
+   Append the model for a pair (or, if model is NULL, a record that
+   the pair failed to reconstruct) and flush it to disk.
+*/
+bool TwoFrameModelStore::Append(MatchIndex idx, const TwoFrameModel *model)
+{
+if (m_file == NULL) 
+ {
+  printf("[TwoFrameModelStore::Append] Error: store is not open\n");
+  return false;
+ }
+
+assert(idx.first < idx.second);
+
+model_record_t header;
+memset(&header, 0, sizeof(model_record_t));
+header.i1 = (int) idx.first;
+header.i2 = (int) idx.second;
+
+if (model != NULL) 
+ {
+  header.flags = MODEL_RECORD_VALID;
+  header.num_points = model->m_num_points;
+
+  if (model->m_tracks != NULL)
+    header.flags |= MODEL_RECORD_TRACKS;
+  if (model->m_keys1 != NULL && model->m_keys2 != NULL)
+    header.flags |= MODEL_RECORD_KEYS;
+ }
+
+header.payload_size = (int) GetPayloadSize(header.flags, header.num_points);
+
+size_t written = fwrite(&header, sizeof(model_record_t), 1, m_file);
+
+if (model != NULL) 
+ {
+  int n = model->m_num_points;
+  double fixed[MODEL_FIXED_DOUBLES];
+
+  fixed[0] = model->m_angle;
+  fixed[1] = model->m_error;
+  memcpy(fixed + 2, model->m_C0, 9 * sizeof(double));
+  memcpy(fixed + 11, model->m_C1, 9 * sizeof(double));
+
+  double *cam = fixed + 20;
+  cam = PackCamera(model->m_camera0, cam);
+  PackCamera(model->m_camera1, cam);
+
+  fwrite(fixed, sizeof(double), MODEL_FIXED_DOUBLES, m_file);
+  fwrite(model->m_points, sizeof(v3_t), n, m_file);
+
+  if (header.flags & MODEL_RECORD_TRACKS)
+    fwrite(model->m_tracks, sizeof(int), n, m_file);
+
+  if (header.flags & MODEL_RECORD_KEYS) 
+   {
+    fwrite(model->m_keys1, sizeof(int), n, m_file);
+    fwrite(model->m_keys2, sizeof(int), n, m_file);
+   }
+ }
+
+if (written != 1 || fflush(m_file) != 0 || ferror(m_file)) 
+ {
+  printf("[TwoFrameModelStore::Append] Error writing to %s\n", m_filename);
+  return false;
+ }
+
+m_records[idx] = m_size;
+m_size += sizeof(model_record_t) + header.payload_size;
+
+return true;
+}
+
+int TwoFrameModelStore::GetNumRecords() const
+{
+return (int) m_records.size();
+}
+
+void TwoFrameModelStore::GetPairs(std::vector<MatchIndex> &pairs) const
+{
+pairs.clear();
+pairs.reserve(m_records.size());
+
+std::map<MatchIndex, size_t>::const_iterator iter;
+for (iter = m_records.begin(); iter != m_records.end(); iter++)
+  pairs.push_back(iter->first);
+}
+
+
 //}-----
 /*======================================================================*/
 /*===================== ModelMap Utility Functions =====================*/
 /*======================================================================*/
 
+/* Reject degenerate models */
+static bool IsModelUsable(const TwoFrameModel &m, int i1, int i2, 
+                          const char *caller)
+{
+    if (m.ComputeTrace(true) < 0.0 || m.ComputeTrace(false) < 0.0) {
+        printf("[%s] Error! Trace(%d,%d) < 0!\n", caller, i1, i2);
+        return false;
+    }
+
+    if (m.m_num_points < 28 /*33*/) {
+        // printf("[%s] Error! Too few points [%d] for (%d,%d)\n",
+        //        caller, m.m_num_points, i1, i2);
+
+        return false;
+    }
+
+    if (isnan(m.m_angle) || isnan(m.m_error)) {
+        printf("[%s] Error! NaNs in pair %d,%d!\n", caller, i1, i2);
+        return false;
+    }
+
+    return true;
+}
+
 /*===== ReadModels =====*/
 ModelMap ReadModels(FILE *f, int *num_images_out) 
 {
@@ -573,22 +1034,8 @@ ModelMap ReadModels(FILE *f, int *num_images_out)
         TwoFrameModel m;
         m.Read(f);
         
-        if (m.ComputeTrace(true) < 0.0 || m.ComputeTrace(false) < 0.0) {
-            printf("[ReadModels] Error! Trace(%d,%d) < 0!\n", i1, i2);
+        if (!IsModelUsable(m, i1, i2, "ReadModels"))
             continue;
-        }
-
-        if (m.m_num_points < 28 /*33*/) {
-            // printf("[ReadModels] Error! Too few points [%d] for (%d,%d)\n",
-            //        m.m_num_points, i1, i2);
-
-            continue;
-        }
-
-        if (isnan(m.m_angle) || isnan(m.m_error)) {
-            printf("[ReadModels] Error! NaNs in pair %d,%d!\n", i1, i2);
-            continue;
-        }
 
         assert(i1 < i2);
         models.AddModel(GetMatchIndex(i1, i2), m);
@@ -601,6 +1048,40 @@ ModelMap ReadModels(FILE *f, int *num_images_out)
 }
 
 
+/*===== ReadModelsBinary =====*/
+/* Add the usable models in a model store to a model map.  Returns
+ * the number of models added */
+int ReadModelsBinary(TwoFrameModelStore &store, ModelMap &models)
+{
+    std::vector<MatchIndex> pairs;
+    store.GetPairs(pairs);
+
+    int num_added = 0;
+    int num_pairs = (int) pairs.size();
+    for (int i = 0; i < num_pairs; i++) {
+        MatchIndex idx = pairs[i];
+
+        if (models.Contains(idx))
+            continue;
+
+        TwoFrameModel m;
+        if (!store.Read(idx, m))
+            continue;
+
+        if (!IsModelUsable(m, (int) idx.first, (int) idx.second, 
+                           "ReadModelsBinary")) {
+            m.Clear();
+            continue;
+        }
+
+        models.AddModel(idx, m);
+        num_added++;
+    }
+
+    return num_added;
+}
+
+
 /*===== ReadPEdges =====*/
 
 PEdgeMap ReadPEdges(FILE *f, int num_images) 
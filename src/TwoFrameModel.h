@@ -42,6 +42,9 @@
 
 #include <stdio.h>
 
+#include <map>
+
+#include "BundleReader.h"
 #include "Geometry.h"
 #include "ImageData.h"
 #include "BaseApp.h"
@@ -63,6 +66,8 @@ class TwoFrameModel
 public:
   /*========= Member Functions ==========*/
   TwoFrameModel(); 
+
+  void Clear();
     
   void Read(FILE *f);
   void Write(FILE *f) const;
@@ -143,6 +148,47 @@ private:
 };
 
 
+/*========================= TwoFrameModelStore =========================*/
+/*
+   Binary store of two-frame models, indexed by image pair, so that the
+   pairwise reconstructions are computed once and reused across runs.
+   Records are only ever appended, and each one is flushed as soon as
+   its model is computed: an interrupted run loses at most the record
+   being written (a truncated tail is dropped when the store is opened)
+   and a rerun only computes the pairs that are missing.  Pairs whose
+   reconstruction failed are recorded as well, so they aren't retried.
+   Records are read back through a memory map of the file.
+*/
+
+class TwoFrameModelStore
+{
+public:
+
+  TwoFrameModelStore();
+  ~TwoFrameModelStore();
+
+  bool Open(const char *filename);
+  void Close();
+
+  bool Contains(MatchIndex idx) const;
+  bool Read(MatchIndex idx, TwoFrameModel &model);
+  bool Append(MatchIndex idx, const TwoFrameModel *model);
+
+  int GetNumRecords() const;
+  void GetPairs(std::vector<MatchIndex> &pairs) const;
+
+private:
+  bool Remap();
+
+  char *m_filename;
+  FILE *m_file;                     /* Open for appending */
+  MappedFile m_map;                 /* Records written before the map */
+  size_t m_size;                    /* Bytes of complete records */
+
+  std::map<MatchIndex, size_t> m_records;   /* Offset of each record */
+};
+
+
 /*========================== Utility Functions =========================*/
 
 #ifndef WIN32
@@ -155,6 +201,7 @@ void WriteModels(ModelMap &models, int num_images, char *out_file);
 void WriteModelsSparse(ModelMap &models, int num_images, char *out_file);
 void WritePEdges(PEdgeMap &p_edges, int num_images, char *out_file);
 ModelMap ReadModels(FILE *f, int *num_images_out = NULL);
+int ReadModelsBinary(TwoFrameModelStore &store, ModelMap &models);
 PEdgeMap ReadPEdges(FILE *f, int num_images);
 
 void ThresholdTwists(int num_images, ModelMap &models, 